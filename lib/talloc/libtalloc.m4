@@ -21,6 +21,14 @@ AC_SUBST(TALLOC_CFLAGS)
 TALLOC_LIBS=""
 AC_SUBST(TALLOC_LIBS)
 
+AC_ARG_ENABLE(talloc-compact-header,
+	[AS_HELP_STRING([--enable-talloc-compact-header],
+		[Use a smaller talloc chunk header (default=no)])])
+if test x"$enable_talloc_compact_header" = x"yes"; then
+	AC_DEFINE(TALLOC_COMPACT_HEADER, 1,
+		[Whether talloc keeps rarely used chunk fields out of line])
+fi
+
 AC_CHECK_SIZEOF(size_t,cross)
 AC_CHECK_SIZEOF(void *,cross)
 
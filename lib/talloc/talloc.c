@@ -51,17 +51,25 @@
 
 
 #define MAX_TALLOC_SIZE 0x10000000
-#define TALLOC_MAGIC_BASE 0xe814ec70
+#ifndef TALLOC_COMPACT_HEADER
+#define TALLOC_MAGIC_BASE 0xe814ec00
+#else
+/* so that chunks of the compact and the normal layout are not mixed */
+#define TALLOC_MAGIC_BASE 0xe824ec00
+#endif
 #define TALLOC_MAGIC ( \
 	TALLOC_MAGIC_BASE + \
 	(TALLOC_VERSION_MAJOR << 12) + \
-	(TALLOC_VERSION_MINOR << 4) \
+	(TALLOC_VERSION_MINOR << 7) \
 )
 
 #define TALLOC_FLAG_FREE 0x01
 #define TALLOC_FLAG_LOOP 0x02
 #define TALLOC_FLAG_POOL 0x04		/* This is a talloc pool */
 #define TALLOC_FLAG_POOLMEM 0x08	/* This is allocated in a pool */
+#define TALLOC_FLAG_PROFILE 0x70	/* The profile generation counting it */
+#define TALLOC_FLAG_PROFILE_SHIFT 4
+#define TALLOC_FLAG_MASK 0x7F
 #define TALLOC_MAGIC_REFERENCE ((const char *)1)
 
 /* by default we abort when given a bad pointer (such as when talloc_free() is called 
@@ -112,6 +120,8 @@ struct talloc_reference_handle {
 
 typedef int (*talloc_destructor_t)(void *);
 
+#ifndef TALLOC_COMPACT_HEADER
+
 struct talloc_chunk {
 	struct talloc_chunk *next, *prev;
 	struct talloc_chunk *parent, *child;
@@ -135,6 +145,204 @@ struct talloc_chunk {
 	void *pool;
 };
 
+/*
+  Only the first child of a parent points to it, the others find it by
+  walking back along their siblings. A chunk has either a "prev" or a
+  "parent", these macros keep the other one NULL.
+*/
+#define TC_PREV(tc) ((tc)->prev)
+#define TC_PARENT(tc) ((tc)->parent)
+#define TC_SET_PREV(tc, p) do { (tc)->prev = (p); (tc)->parent = NULL; } while (0)
+#define TC_SET_FIRST(tc, p) do { (tc)->prev = NULL; (tc)->parent = (p); } while (0)
+
+static inline void talloc_chunk_init_extra(struct talloc_chunk *tc, void *pool)
+{
+	tc->refs = NULL;
+	tc->destructor = NULL;
+	tc->pool = pool;
+}
+
+static inline void talloc_chunk_free_extra(struct talloc_chunk *tc)
+{
+}
+
+static inline struct talloc_reference_handle *talloc_chunk_refs(struct talloc_chunk *tc)
+{
+	return tc->refs;
+}
+
+static inline struct talloc_reference_handle **talloc_chunk_refs_ptr(struct talloc_chunk *tc)
+{
+	return &tc->refs;
+}
+
+static inline talloc_destructor_t talloc_chunk_destructor(struct talloc_chunk *tc)
+{
+	return tc->destructor;
+}
+
+static inline int talloc_chunk_set_destructor(struct talloc_chunk *tc,
+					      talloc_destructor_t destructor)
+{
+	tc->destructor = destructor;
+	return 0;
+}
+
+static inline void *talloc_chunk_pool(struct talloc_chunk *tc)
+{
+	return tc->pool;
+}
+
+static inline void talloc_chunk_set_pool(struct talloc_chunk *tc, void *pool)
+{
+	tc->pool = pool;
+}
+
+#else /* TALLOC_COMPACT_HEADER */
+
+/*
+  The compact header is 48 instead of 80 bytes on 64 bit systems. The
+  references, the destructor and (once one of them is set) the pool
+  pointer live in a separately allocated struct talloc_chunk_extra, the
+  size is 32 bits wide, which MAX_TALLOC_SIZE allows, and "up" holds
+  either the previous sibling or, for the first child, the parent.
+
+  Setting a destructor can then run out of memory, talloc_set_destructor()
+  aborts in that case.
+*/
+
+struct talloc_chunk_extra {
+	struct talloc_reference_handle *refs;
+	talloc_destructor_t destructor;
+	void *pool;
+};
+
+struct talloc_chunk {
+	struct talloc_chunk *next;
+	uintptr_t up;
+	struct talloc_chunk *child;
+	const char *name;
+	uint32_t size;
+	unsigned flags;
+
+	/*
+	 * The "pool" of the normal header (see there), or a struct
+	 * talloc_chunk_extra holding it, marked by TALLOC_AUX_EXTRA.
+	 */
+	uintptr_t aux;
+};
+
+#define TALLOC_UP_PARENT 1
+#define TALLOC_AUX_EXTRA 1
+
+#define TC_PREV(tc) \
+	(((tc)->up & TALLOC_UP_PARENT) ? NULL : (struct talloc_chunk *)(tc)->up)
+#define TC_PARENT(tc) \
+	(((tc)->up & TALLOC_UP_PARENT) \
+	 ? (struct talloc_chunk *)((tc)->up & ~(uintptr_t)TALLOC_UP_PARENT) : NULL)
+#define TC_SET_PREV(tc, p) do { (tc)->up = (uintptr_t)(p); } while (0)
+#define TC_SET_FIRST(tc, p) do { \
+	(tc)->up = (p) ? ((uintptr_t)(p) | TALLOC_UP_PARENT) : 0; \
+} while (0)
+
+static inline struct talloc_chunk_extra *talloc_chunk_extra(struct talloc_chunk *tc)
+{
+	if (likely(!(tc->aux & TALLOC_AUX_EXTRA))) {
+		return NULL;
+	}
+	return (struct talloc_chunk_extra *)(tc->aux & ~(uintptr_t)TALLOC_AUX_EXTRA);
+}
+
+static struct talloc_chunk_extra *talloc_chunk_add_extra(struct talloc_chunk *tc)
+{
+	struct talloc_chunk_extra *extra = talloc_chunk_extra(tc);
+
+	if (extra != NULL) {
+		return extra;
+	}
+
+	extra = (struct talloc_chunk_extra *)malloc(sizeof(*extra));
+	if (unlikely(extra == NULL)) {
+		return NULL;
+	}
+	extra->refs = NULL;
+	extra->destructor = NULL;
+	extra->pool = (void *)tc->aux;
+	tc->aux = (uintptr_t)extra | TALLOC_AUX_EXTRA;
+	return extra;
+}
+
+static inline void talloc_chunk_init_extra(struct talloc_chunk *tc, void *pool)
+{
+	tc->aux = (uintptr_t)pool;
+}
+
+static inline void talloc_chunk_free_extra(struct talloc_chunk *tc)
+{
+	struct talloc_chunk_extra *extra = talloc_chunk_extra(tc);
+
+	if (unlikely(extra != NULL)) {
+		tc->aux = (uintptr_t)extra->pool;
+		free(extra);
+	}
+}
+
+static inline struct talloc_reference_handle *talloc_chunk_refs(struct talloc_chunk *tc)
+{
+	struct talloc_chunk_extra *extra = talloc_chunk_extra(tc);
+	return extra ? extra->refs : NULL;
+}
+
+static inline struct talloc_reference_handle **talloc_chunk_refs_ptr(struct talloc_chunk *tc)
+{
+	struct talloc_chunk_extra *extra = talloc_chunk_add_extra(tc);
+	return extra ? &extra->refs : NULL;
+}
+
+static inline talloc_destructor_t talloc_chunk_destructor(struct talloc_chunk *tc)
+{
+	struct talloc_chunk_extra *extra = talloc_chunk_extra(tc);
+	return extra ? extra->destructor : NULL;
+}
+
+static inline int talloc_chunk_set_destructor(struct talloc_chunk *tc,
+					      talloc_destructor_t destructor)
+{
+	struct talloc_chunk_extra *extra;
+
+	if (destructor == NULL) {
+		extra = talloc_chunk_extra(tc);
+	} else {
+		extra = talloc_chunk_add_extra(tc);
+		if (unlikely(extra == NULL)) {
+			return -1;
+		}
+	}
+	if (extra != NULL) {
+		extra->destructor = destructor;
+	}
+	return 0;
+}
+
+static inline void *talloc_chunk_pool(struct talloc_chunk *tc)
+{
+	struct talloc_chunk_extra *extra = talloc_chunk_extra(tc);
+	return extra ? extra->pool : (void *)tc->aux;
+}
+
+static inline void talloc_chunk_set_pool(struct talloc_chunk *tc, void *pool)
+{
+	struct talloc_chunk_extra *extra = talloc_chunk_extra(tc);
+
+	if (unlikely(extra != NULL)) {
+		extra->pool = pool;
+	} else {
+		tc->aux = (uintptr_t)pool;
+	}
+}
+
+#endif /* TALLOC_COMPACT_HEADER */
+
 /* 16 byte alignment seems to keep everyone happy */
 #define TC_HDR_SIZE ((sizeof(struct talloc_chunk)+15)&~15)
 #define TC_PTR_FROM_CHUNK(tc) ((void *)(TC_HDR_SIZE + (char*)tc))
@@ -228,9 +436,9 @@ static inline struct talloc_chunk *talloc_chunk_from_ptr(const void *ptr)
 {
 	const char *pp = (const char *)ptr;
 	struct talloc_chunk *tc = discard_const_p(struct talloc_chunk, pp - TC_HDR_SIZE);
-	if (unlikely((tc->flags & (TALLOC_FLAG_FREE | ~0xF)) != TALLOC_MAGIC)) { 
+	if (unlikely((tc->flags & (TALLOC_FLAG_FREE | ~TALLOC_FLAG_MASK)) != TALLOC_MAGIC)) { 
 		if ((tc->flags & (~0xFFF)) == TALLOC_MAGIC_BASE) {
-			talloc_abort_magic(tc->flags & (~0xF));
+			talloc_abort_magic(tc->flags & (~TALLOC_FLAG_MASK));
 			return NULL;
 		}
 
@@ -273,6 +481,42 @@ do { \
 	if ((p) && ((p) != (list))) (p)->next = (p)->prev = NULL; \
 } while (0)
 
+/*
+  make tc the first child of parent
+*/
+static inline void talloc_chunk_link(struct talloc_chunk *parent,
+				     struct talloc_chunk *tc)
+{
+	tc->next = parent->child;
+	if (tc->next) {
+		TC_SET_PREV(tc->next, tc);
+	}
+	TC_SET_FIRST(tc, parent);
+	parent->child = tc;
+}
+
+/*
+  take tc out of its list of siblings. A first child keeps pointing to
+  its old parent and any other one to its old previous sibling, so
+  talloc_parent_chunk() still finds the old parent afterwards.
+*/
+static inline void talloc_chunk_unlink(struct talloc_chunk *tc)
+{
+	struct talloc_chunk *parent = TC_PARENT(tc);
+
+	if (parent) {
+		parent->child = tc->next;
+		if (tc->next) {
+			TC_SET_FIRST(tc->next, parent);
+		}
+		tc->next = NULL;
+	} else {
+		struct talloc_chunk *prev = TC_PREV(tc);
+
+		if (prev) prev->next = tc->next;
+		if (tc->next) TC_SET_PREV(tc->next, prev);
+	}
+}
 
 /*
   return the parent chunk of a pointer
@@ -286,9 +530,9 @@ static inline struct talloc_chunk *talloc_parent_chunk(const void *ptr)
 	}
 
 	tc = talloc_chunk_from_ptr(ptr);
-	while (tc->prev) tc=tc->prev;
+	while (TC_PREV(tc)) tc = TC_PREV(tc);
 
-	return tc->parent;
+	return TC_PARENT(tc);
 }
 
 void *talloc_parent(const void *ptr)
@@ -317,13 +561,95 @@ const char *talloc_parent_name(const void *ptr)
   The object count is not put into "struct talloc_chunk" because it is only
   relevant for talloc pools and the alignment to 16 bytes would increase the
   memory footprint of each talloc chunk by those 16 bytes.
+
+  A recycling pool (see talloc_recycling_pool()) has a larger header: after
+  the count come statistics and free lists of members freed while others
+  are still alive, one per 16 byte size class, which are handed out again
+  before the unused part of the pool is touched.
 */
 
 #define TALLOC_POOL_HDR_SIZE 16
 
+/* chunks of up to TALLOC_POOL_NUM_CLASSES*16 bytes are recycled */
+#define TALLOC_POOL_NUM_CLASSES 64
+
+struct talloc_pool_hdr {
+	unsigned int object_count;
+	unsigned int recycling;
+
+	/* from here on only in recycling pools */
+	struct talloc_pool_stats stats;
+	struct talloc_chunk *free_list[TALLOC_POOL_NUM_CLASSES];
+};
+
+#define TALLOC_RECYCLING_POOL_HDR_SIZE \
+	((sizeof(struct talloc_chunk) + sizeof(struct talloc_pool_hdr) \
+	  - TC_HDR_SIZE + 15) & ~15)
+
+static struct talloc_pool_hdr *talloc_pool_hdr(struct talloc_chunk *tc)
+{
+	return (struct talloc_pool_hdr *)((char *)tc + sizeof(struct talloc_chunk));
+}
+
 static unsigned int *talloc_pool_objectcount(struct talloc_chunk *tc)
 {
-	return (unsigned int *)((char *)tc + sizeof(struct talloc_chunk));
+	return &talloc_pool_hdr(tc)->object_count;
+}
+
+static size_t talloc_pool_hdr_size(struct talloc_chunk *tc)
+{
+	return talloc_pool_hdr(tc)->recycling
+		? TALLOC_RECYCLING_POOL_HDR_SIZE : TALLOC_POOL_HDR_SIZE;
+}
+
+/*
+  Hand a freed member back to a recycling pool
+*/
+
+static void talloc_pool_recycle(struct talloc_chunk *pool_ctx,
+				struct talloc_chunk *tc)
+{
+	struct talloc_pool_hdr *hdr = talloc_pool_hdr(pool_ctx);
+	/* tc->size may have shrunk in place, so this can be less than the
+	 * chunk really has, which only wastes the difference */
+	size_t chunk_size = (TC_HDR_SIZE + tc->size + 15) & ~15;
+	size_t idx = chunk_size / 16 - 1;
+
+	/* the most recent allocation just gives its space back */
+	if ((char *)tc + chunk_size == (char *)talloc_chunk_pool(pool_ctx)) {
+		talloc_chunk_set_pool(pool_ctx, tc);
+		return;
+	}
+
+	if (idx >= TALLOC_POOL_NUM_CLASSES) {
+		hdr->stats.lost_bytes += chunk_size;
+		return;
+	}
+
+	tc->next = hdr->free_list[idx];
+	hdr->free_list[idx] = tc;
+	hdr->stats.free_bytes += chunk_size;
+}
+
+/*
+  Make all of a recycling pool available again once only the pool is left
+*/
+
+static void talloc_pool_reset(struct talloc_chunk *pool_ctx)
+{
+	struct talloc_pool_hdr *hdr = talloc_pool_hdr(pool_ctx);
+	size_t hdr_size = talloc_pool_hdr_size(pool_ctx);
+
+	talloc_chunk_set_pool(pool_ctx, (char *)pool_ctx + TC_HDR_SIZE + hdr_size);
+	if (hdr->recycling) {
+		memset(hdr->free_list, 0, sizeof(hdr->free_list));
+		hdr->stats.free_bytes = 0;
+		hdr->stats.lost_bytes = 0;
+	}
+#if defined(DEVELOPER) && defined(VALGRIND_MAKE_MEM_NOACCESS)
+	VALGRIND_MAKE_MEM_NOACCESS(talloc_chunk_pool(pool_ctx),
+				   pool_ctx->size - hdr_size);
+#endif
 }
 
 /*
@@ -334,6 +660,7 @@ static struct talloc_chunk *talloc_alloc_pool(struct talloc_chunk *parent,
 					      size_t size)
 {
 	struct talloc_chunk *pool_ctx = NULL;
+	struct talloc_pool_hdr *hdr;
 	size_t space_left;
 	struct talloc_chunk *result;
 	size_t chunk_size;
@@ -346,41 +673,244 @@ static struct talloc_chunk *talloc_alloc_pool(struct talloc_chunk *parent,
 		pool_ctx = parent;
 	}
 	else if (parent->flags & TALLOC_FLAG_POOLMEM) {
-		pool_ctx = (struct talloc_chunk *)parent->pool;
+		pool_ctx = (struct talloc_chunk *)talloc_chunk_pool(parent);
 	}
 
 	if (pool_ctx == NULL) {
 		return NULL;
 	}
 
+	hdr = talloc_pool_hdr(pool_ctx);
+
 	space_left = ((char *)pool_ctx + TC_HDR_SIZE + pool_ctx->size)
-		- ((char *)pool_ctx->pool);
+		- ((char *)talloc_chunk_pool(pool_ctx));
 
 	/*
 	 * Align size to 16 bytes
 	 */
 	chunk_size = ((size + 15) & ~15);
 
+	if (hdr->recycling) {
+		size_t idx = chunk_size / 16 - 1;
+
+		/* an exact fit first, then the unused part, then a
+		 * bigger free chunk, wasting the difference */
+		if (idx < TALLOC_POOL_NUM_CLASSES && hdr->free_list[idx]) {
+			goto recycle;
+		}
+		if (space_left >= chunk_size) {
+			hdr->stats.allocs += 1;
+			goto carve;
+		}
+		for (idx++; idx < TALLOC_POOL_NUM_CLASSES; idx++) {
+			if (hdr->free_list[idx]) {
+				goto recycle;
+			}
+		}
+		hdr->stats.fallbacks += 1;
+		return NULL;
+
+	recycle:
+		result = hdr->free_list[idx];
+		hdr->free_list[idx] = result->next;
+		hdr->stats.free_bytes -= (idx + 1) * 16;
+		hdr->stats.hits += 1;
+		goto found;
+	}
+
 	if (space_left < chunk_size) {
 		return NULL;
 	}
 
-	result = (struct talloc_chunk *)pool_ctx->pool;
+carve:
+	result = (struct talloc_chunk *)talloc_chunk_pool(pool_ctx);
+	talloc_chunk_set_pool(pool_ctx, (char *)result + chunk_size);
 
+found:
 #if defined(DEVELOPER) && defined(VALGRIND_MAKE_MEM_UNDEFINED)
 	VALGRIND_MAKE_MEM_UNDEFINED(result, size);
 #endif
 
-	pool_ctx->pool = (void *)((char *)result + chunk_size);
-
 	result->flags = TALLOC_MAGIC | TALLOC_FLAG_POOLMEM;
-	result->pool = pool_ctx;
+	talloc_chunk_init_extra(result, pool_ctx);
 
 	*talloc_pool_objectcount(pool_ctx) += 1;
 
 	return result;
 }
 
+/*
+  The profile keeps the number of live blocks and their bytes per name.
+  Names are compared by pointer, which is what makes it cheap enough to
+  be switched on in a running process: all objects of a type share the
+  type name string and untyped ones are named by their __location__, so
+  the entries are per type or per allocation site. Strings, which
+  talloc_strdup() and friends name after their contents, are counted
+  together as ".string". Entries are dropped when their last block goes
+  away, so dynamic names from talloc_set_name() only live as long as
+  their objects.
+
+  A counted block carries the generation of the profile in its flags,
+  and only those are taken off the counters when they go away: a block
+  which existed before the profile was enabled, or was counted by an
+  earlier one, was never added. The generation wraps after 7 profiles.
+*/
+
+struct talloc_profile_entry {
+	struct talloc_profile_entry *next;
+	const char *name;
+	size_t count;
+	size_t bytes;
+};
+
+struct talloc_profile {
+	struct talloc_profile_entry **buckets;
+	size_t num_buckets;
+	size_t num_entries;
+	struct talloc_profile_entry *unused;
+	/* TALLOC_FLAG_PROFILE of the blocks we counted */
+	unsigned flag;
+};
+
+static struct talloc_profile *talloc_profile;
+static unsigned talloc_profile_generation;
+
+static const char talloc_profile_strings[] = ".string";
+
+static inline const char *talloc_profile_name(struct talloc_chunk *tc)
+{
+	if (tc->name == TC_PTR_FROM_CHUNK(tc)) {
+		return talloc_profile_strings;
+	}
+	return tc->name;
+}
+
+static inline size_t talloc_profile_hash(struct talloc_profile *prof,
+					 const char *name)
+{
+	uintptr_t h = (uintptr_t)name;
+
+	h ^= h >> 17;
+	h *= 0x9E3779B1;
+	return (h ^ (h >> 15)) & (prof->num_buckets - 1);
+}
+
+static void talloc_profile_grow(struct talloc_profile *prof)
+{
+	size_t num_buckets = prof->num_buckets * 2;
+	struct talloc_profile_entry **old = prof->buckets;
+	size_t old_num = prof->num_buckets;
+	size_t i;
+
+	prof->buckets = (struct talloc_profile_entry **)calloc(
+		num_buckets, sizeof(*prof->buckets));
+	if (prof->buckets == NULL) {
+		/* keep the longer chains */
+		prof->buckets = old;
+		return;
+	}
+	prof->num_buckets = num_buckets;
+
+	for (i = 0; i < old_num; i++) {
+		struct talloc_profile_entry *e, *next;
+		for (e = old[i]; e; e = next) {
+			size_t h = talloc_profile_hash(prof, e->name);
+			next = e->next;
+			e->next = prof->buckets[h];
+			prof->buckets[h] = e;
+		}
+	}
+	free(old);
+}
+
+static void talloc_profile_add(struct talloc_chunk *tc)
+{
+	struct talloc_profile *prof = talloc_profile;
+	const char *name = talloc_profile_name(tc);
+	size_t size = tc->size;
+	size_t h = talloc_profile_hash(prof, name);
+	struct talloc_profile_entry *e;
+
+	for (e = prof->buckets[h]; e; e = e->next) {
+		if (e->name == name) {
+			e->count += 1;
+			e->bytes += size;
+			tc->flags = (tc->flags & ~TALLOC_FLAG_PROFILE) | prof->flag;
+			return;
+		}
+	}
+
+	if (prof->unused != NULL) {
+		e = prof->unused;
+		prof->unused = e->next;
+	} else {
+		e = (struct talloc_profile_entry *)malloc(sizeof(*e));
+		if (e == NULL) {
+			return;
+		}
+	}
+	e->name = name;
+	e->count = 1;
+	e->bytes = size;
+	e->next = prof->buckets[h];
+	prof->buckets[h] = e;
+	tc->flags = (tc->flags & ~TALLOC_FLAG_PROFILE) | prof->flag;
+
+	prof->num_entries += 1;
+	if (prof->num_entries > prof->num_buckets * 2) {
+		talloc_profile_grow(prof);
+	}
+}
+
+static void talloc_profile_sub(struct talloc_chunk *tc)
+{
+	struct talloc_profile *prof = talloc_profile;
+	const char *name = talloc_profile_name(tc);
+	size_t size = tc->size;
+	struct talloc_profile_entry **pe, *e;
+
+	if ((tc->flags & TALLOC_FLAG_PROFILE) != prof->flag) {
+		/* not counted by this profile */
+		return;
+	}
+	tc->flags &= ~TALLOC_FLAG_PROFILE;
+
+	pe = &prof->buckets[talloc_profile_hash(prof, name)];
+	for (e = *pe; e; pe = &e->next, e = e->next) {
+		if (e->name == name) {
+			break;
+		}
+	}
+	if (e == NULL) {
+		return;
+	}
+
+	e->bytes -= MIN(size, e->bytes);
+	e->count -= 1;
+	if (e->count > 0) {
+		return;
+	}
+
+	*pe = e->next;
+	e->next = prof->unused;
+	prof->unused = e;
+	prof->num_entries -= 1;
+}
+
+/*
+  count everything that exists below the null context when the profile
+  is enabled
+*/
+static void talloc_profile_add_tree(struct talloc_chunk *tc)
+{
+	struct talloc_chunk *c;
+
+	talloc_profile_add(tc);
+	for (c = tc->child; c; c = c->next) {
+		talloc_profile_add_tree(c);
+	}
+}
+
 /* 
    Allocate a bit of memory as a child of an existing pointer
 */
@@ -405,30 +935,22 @@ static inline void *__talloc(const void *context, size_t size)
 		tc = (struct talloc_chunk *)malloc(TC_HDR_SIZE+size);
 		if (unlikely(tc == NULL)) return NULL;
 		tc->flags = TALLOC_MAGIC;
-		tc->pool  = NULL;
+		talloc_chunk_init_extra(tc, NULL);
 	}
 
 	tc->size = size;
-	tc->destructor = NULL;
 	tc->child = NULL;
 	tc->name = NULL;
-	tc->refs = NULL;
 
 	if (likely(context)) {
-		struct talloc_chunk *parent = talloc_chunk_from_ptr(context);
-
-		if (parent->child) {
-			parent->child->parent = NULL;
-			tc->next = parent->child;
-			tc->next->prev = tc;
-		} else {
-			tc->next = NULL;
-		}
-		tc->parent = parent;
-		tc->prev = NULL;
-		parent->child = tc;
+		talloc_chunk_link(talloc_chunk_from_ptr(context), tc);
 	} else {
-		tc->next = tc->prev = tc->parent = NULL;
+		tc->next = NULL;
+		TC_SET_FIRST(tc, NULL);
+	}
+
+	if (unlikely(talloc_profile != NULL)) {
+		talloc_profile_add(tc);
 	}
 
 	return TC_PTR_FROM_CHUNK(tc);
@@ -450,17 +972,82 @@ void *talloc_pool(const void *context, size_t size)
 	tc = talloc_chunk_from_ptr(result);
 
 	tc->flags |= TALLOC_FLAG_POOL;
-	tc->pool = (char *)result + TALLOC_POOL_HDR_SIZE;
+	talloc_chunk_set_pool(tc, (char *)result + TALLOC_POOL_HDR_SIZE);
 
 	*talloc_pool_objectcount(tc) = 1;
+	talloc_pool_hdr(tc)->recycling = 0;
 
 #if defined(DEVELOPER) && defined(VALGRIND_MAKE_MEM_NOACCESS)
-	VALGRIND_MAKE_MEM_NOACCESS(tc->pool, size);
+	VALGRIND_MAKE_MEM_NOACCESS(talloc_chunk_pool(tc), size);
 #endif
 
 	return result;
 }
 
+/*
+ * Create a talloc pool which reuses the memory of freed members
+ */
+
+void *talloc_recycling_pool(const void *context, size_t size)
+{
+	void *result = __talloc(context, size + TALLOC_RECYCLING_POOL_HDR_SIZE);
+	struct talloc_chunk *tc;
+	struct talloc_pool_hdr *hdr;
+
+	if (unlikely(result == NULL)) {
+		return NULL;
+	}
+
+	tc = talloc_chunk_from_ptr(result);
+	hdr = talloc_pool_hdr(tc);
+
+	tc->flags |= TALLOC_FLAG_POOL;
+	talloc_chunk_set_pool(tc, (char *)result + TALLOC_RECYCLING_POOL_HDR_SIZE);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->object_count = 1;
+	hdr->recycling = 1;
+
+#if defined(DEVELOPER) && defined(VALGRIND_MAKE_MEM_NOACCESS)
+	VALGRIND_MAKE_MEM_NOACCESS(talloc_chunk_pool(tc), size);
+#endif
+
+	return result;
+}
+
+/*
+ * Return how a pool is used. The counters are only kept by recycling pools.
+ */
+
+int talloc_pool_get_stats(const void *ptr, struct talloc_pool_stats *stats)
+{
+	struct talloc_chunk *tc;
+	struct talloc_pool_hdr *hdr;
+	size_t hdr_size;
+
+	if (unlikely(ptr == NULL)) {
+		return -1;
+	}
+
+	tc = talloc_chunk_from_ptr(ptr);
+	if (!(tc->flags & TALLOC_FLAG_POOL)) {
+		return -1;
+	}
+
+	hdr = talloc_pool_hdr(tc);
+	hdr_size = talloc_pool_hdr_size(tc);
+
+	if (hdr->recycling) {
+		*stats = hdr->stats;
+	} else {
+		memset(stats, 0, sizeof(*stats));
+	}
+	stats->size = tc->size - hdr_size;
+	stats->used = (char *)talloc_chunk_pool(tc) - ((char *)ptr + hdr_size);
+	stats->objects = hdr->object_count - 1;
+	return 0;
+}
+
 /*
   setup a destructor to be called on free of a pointer
   the destructor should return 0 on success, or -1 on failure.
@@ -470,7 +1057,9 @@ void *talloc_pool(const void *context, size_t size)
 void _talloc_set_destructor(const void *ptr, int (*destructor)(void *))
 {
 	struct talloc_chunk *tc = talloc_chunk_from_ptr(ptr);
-	tc->destructor = destructor;
+	if (unlikely(talloc_chunk_set_destructor(tc, destructor) != 0)) {
+		talloc_abort("talloc_set_destructor: out of memory");
+	}
 }
 
 /*
@@ -492,7 +1081,7 @@ int talloc_increase_ref_count(const void *ptr)
 static int talloc_reference_destructor(struct talloc_reference_handle *handle)
 {
 	struct talloc_chunk *ptr_tc = talloc_chunk_from_ptr(handle->ptr);
-	_TLIST_REMOVE(ptr_tc->refs, handle);
+	_TLIST_REMOVE(*talloc_chunk_refs_ptr(ptr_tc), handle);
 	return 0;
 }
 
@@ -503,6 +1092,12 @@ static int talloc_reference_destructor(struct talloc_reference_handle *handle)
 static inline void _talloc_set_name_const(const void *ptr, const char *name)
 {
 	struct talloc_chunk *tc = talloc_chunk_from_ptr(ptr);
+	if (unlikely(talloc_profile != NULL)) {
+		talloc_profile_sub(tc);
+		tc->name = name;
+		talloc_profile_add(tc);
+		return;
+	}
 	tc->name = name;
 }
 
@@ -535,10 +1130,13 @@ static inline void *_talloc_named_const(const void *context, size_t size, const
 void *_talloc_reference_loc(const void *context, const void *ptr, const char *location)
 {
 	struct talloc_chunk *tc;
+	struct talloc_reference_handle **refs;
 	struct talloc_reference_handle *handle;
 	if (unlikely(ptr == NULL)) return NULL;
 
 	tc = talloc_chunk_from_ptr(ptr);
+	refs = talloc_chunk_refs_ptr(tc);
+	if (unlikely(refs == NULL)) return NULL;
 	handle = (struct talloc_reference_handle *)_talloc_named_const(context,
 						   sizeof(struct talloc_reference_handle),
 						   TALLOC_MAGIC_REFERENCE);
@@ -550,7 +1148,7 @@ void *_talloc_reference_loc(const void *context, const void *ptr, const char *lo
 	talloc_set_destructor(handle, talloc_reference_destructor);
 	handle->ptr = discard_const_p(void, ptr);
 	handle->location = location;
-	_TLIST_ADD(tc->refs, handle);
+	_TLIST_ADD(*refs, handle);
 	return handle->ptr;
 }
 
@@ -562,6 +1160,8 @@ static void *_talloc_steal_internal(const void *new_ctx, const void *ptr);
 static inline int _talloc_free_internal(void *ptr, const char *location)
 {
 	struct talloc_chunk *tc;
+	struct talloc_reference_handle *refs;
+	talloc_destructor_t d;
 
 	if (unlikely(ptr == NULL)) {
 		return -1;
@@ -569,7 +1169,8 @@ static inline int _talloc_free_internal(void *ptr, const char *location)
 
 	tc = talloc_chunk_from_ptr(ptr);
 
-	if (unlikely(tc->refs)) {
+	refs = talloc_chunk_refs(tc);
+	if (unlikely(refs)) {
 		int is_child;
 		/* check this is a reference from a child or grantchild
 		 * back to it's parent or grantparent
@@ -578,8 +1179,8 @@ static inline int _talloc_free_internal(void *ptr, const char *location)
 		 * call another instance of talloc_free() on the current
 		 * pointer.
 		 */
-		is_child = talloc_is_parent(tc->refs, ptr);
-		_talloc_free_internal(tc->refs, location);
+		is_child = talloc_is_parent(refs, ptr);
+		_talloc_free_internal(refs, location);
 		if (is_child) {
 			return _talloc_free_internal(ptr, location);
 		}
@@ -591,29 +1192,25 @@ static inline int _talloc_free_internal(void *ptr, const char *location)
 		return 0;
 	}
 
-	if (unlikely(tc->destructor)) {
-		talloc_destructor_t d = tc->destructor;
+	d = talloc_chunk_destructor(tc);
+	if (unlikely(d)) {
 		if (d == (talloc_destructor_t)-1) {
 			return -1;
 		}
-		tc->destructor = (talloc_destructor_t)-1;
+		talloc_chunk_set_destructor(tc, (talloc_destructor_t)-1);
 		if (d(ptr) == -1) {
-			tc->destructor = d;
+			talloc_chunk_set_destructor(tc, d);
 			return -1;
 		}
-		tc->destructor = NULL;
+		talloc_chunk_set_destructor(tc, NULL);
 	}
 
-	if (tc->parent) {
-		_TLIST_REMOVE(tc->parent->child, tc);
-		if (tc->parent->child) {
-			tc->parent->child->parent = tc->parent;
-		}
-	} else {
-		if (tc->prev) tc->prev->next = tc->next;
-		if (tc->next) tc->next->prev = tc->prev;
+	if (unlikely(talloc_profile != NULL)) {
+		talloc_profile_sub(tc);
 	}
 
+	talloc_chunk_unlink(tc);
+
 	tc->flags |= TALLOC_FLAG_LOOP;
 
 	while (tc->child) {
@@ -623,9 +1220,11 @@ static inline int _talloc_free_internal(void *ptr, const char *location)
 		   pointer, the second choice is our parent, and the
 		   final choice is the null context. */
 		void *child = TC_PTR_FROM_CHUNK(tc->child);
+		struct talloc_reference_handle *child_refs;
 		const void *new_parent = null_context;
-		if (unlikely(tc->child->refs)) {
-			struct talloc_chunk *p = talloc_parent_chunk(tc->child->refs);
+		child_refs = talloc_chunk_refs(tc->child);
+		if (unlikely(child_refs)) {
+			struct talloc_chunk *p = talloc_parent_chunk(child_refs);
 			if (p) new_parent = TC_PTR_FROM_CHUNK(p);
 		}
 		if (unlikely(_talloc_free_internal(child, location) == -1)) {
@@ -645,12 +1244,14 @@ static inline int _talloc_free_internal(void *ptr, const char *location)
 	 */	 
 	tc->name = location;
 
+	talloc_chunk_free_extra(tc);
+
 	if (tc->flags & (TALLOC_FLAG_POOL|TALLOC_FLAG_POOLMEM)) {
 		struct talloc_chunk *pool;
 		unsigned int *pool_object_count;
 
 		pool = (tc->flags & TALLOC_FLAG_POOL)
-			? tc : (struct talloc_chunk *)tc->pool;
+			? tc : (struct talloc_chunk *)talloc_chunk_pool(tc);
 
 		pool_object_count = talloc_pool_objectcount(pool);
 
@@ -663,6 +1264,13 @@ static inline int _talloc_free_internal(void *ptr, const char *location)
 
 		if (*pool_object_count == 0) {
 			free(pool);
+		} else if (talloc_pool_hdr(pool)->recycling &&
+			   !(pool->flags & TALLOC_FLAG_FREE)) {
+			if (*pool_object_count == 1) {
+				talloc_pool_reset(pool);
+			} else {
+				talloc_pool_recycle(pool, tc);
+			}
 		}
 	}
 	else {
@@ -691,39 +1299,21 @@ static void *_talloc_steal_internal(const void *new_ctx, const void *ptr)
 	tc = talloc_chunk_from_ptr(ptr);
 
 	if (unlikely(new_ctx == NULL)) {
-		if (tc->parent) {
-			_TLIST_REMOVE(tc->parent->child, tc);
-			if (tc->parent->child) {
-				tc->parent->child->parent = tc->parent;
-			}
-		} else {
-			if (tc->prev) tc->prev->next = tc->next;
-			if (tc->next) tc->next->prev = tc->prev;
-		}
-		
-		tc->parent = tc->next = tc->prev = NULL;
+		talloc_chunk_unlink(tc);
+
+		tc->next = NULL;
+		TC_SET_FIRST(tc, NULL);
 		return discard_const_p(void, ptr);
 	}
 
 	new_tc = talloc_chunk_from_ptr(new_ctx);
 
-	if (unlikely(tc == new_tc || tc->parent == new_tc)) {
+	if (unlikely(tc == new_tc || TC_PARENT(tc) == new_tc)) {
 		return discard_const_p(void, ptr);
 	}
 
-	if (tc->parent) {
-		_TLIST_REMOVE(tc->parent->child, tc);
-		if (tc->parent->child) {
-			tc->parent->child->parent = tc->parent;
-		}
-	} else {
-		if (tc->prev) tc->prev->next = tc->next;
-		if (tc->next) tc->next->prev = tc->prev;
-	}
-
-	tc->parent = new_tc;
-	if (new_tc->child) new_tc->child->parent = NULL;
-	_TLIST_ADD(new_tc->child, tc);
+	talloc_chunk_unlink(tc);
+	talloc_chunk_link(new_tc, tc);
 
 	return discard_const_p(void, ptr);
 }
@@ -743,13 +1333,13 @@ void *_talloc_steal_loc(const void *new_ctx, const void *ptr, const char *locati
 	
 	tc = talloc_chunk_from_ptr(ptr);
 	
-	if (unlikely(tc->refs != NULL) && talloc_parent(ptr) != new_ctx) {
+	if (unlikely(talloc_chunk_refs(tc) != NULL) && talloc_parent(ptr) != new_ctx) {
 		struct talloc_reference_handle *h;
 
 		talloc_log("WARNING: talloc_steal with references at %s\n",
 			   location);
 
-		for (h=tc->refs; h; h=h->next) {
+		for (h=talloc_chunk_refs(tc); h; h=h->next) {
 			talloc_log("\treference at %s\n",
 				   h->location);
 		}
@@ -779,7 +1369,7 @@ void *talloc_reparent(const void *old_parent, const void *new_parent, const void
 	}
 
 	tc = talloc_chunk_from_ptr(ptr);
-	for (h=tc->refs;h;h=h->next) {
+	for (h=talloc_chunk_refs(tc);h;h=h->next) {
 		if (talloc_parent(h) == old_parent) {
 			if (_talloc_steal_internal(new_parent, h) != h) {
 				return NULL;
@@ -806,7 +1396,7 @@ static inline int talloc_unreference(const void *context, const void *ptr)
 		context = null_context;
 	}
 
-	for (h=tc->refs;h;h=h->next) {
+	for (h=talloc_chunk_refs(tc);h;h=h->next) {
 		struct talloc_chunk *p = talloc_parent_chunk(h);
 		if (p == NULL) {
 			if (context == NULL) break;
@@ -854,11 +1444,11 @@ int talloc_unlink(const void *context, void *ptr)
 	
 	tc_p = talloc_chunk_from_ptr(ptr);
 
-	if (tc_p->refs == NULL) {
+	if (talloc_chunk_refs(tc_p) == NULL) {
 		return _talloc_free_internal(ptr, __location__);
 	}
 
-	new_p = talloc_parent_chunk(tc_p->refs);
+	new_p = talloc_parent_chunk(talloc_chunk_refs(tc_p));
 	if (new_p) {
 		new_parent = TC_PTR_FROM_CHUNK(new_p);
 	} else {
@@ -882,7 +1472,14 @@ static inline const char *talloc_set_name_v(const void *ptr, const char *fmt, va
 static inline const char *talloc_set_name_v(const void *ptr, const char *fmt, va_list ap)
 {
 	struct talloc_chunk *tc = talloc_chunk_from_ptr(ptr);
-	tc->name = talloc_vasprintf(ptr, fmt, ap);
+	const char *name = talloc_vasprintf(ptr, fmt, ap);
+	if (unlikely(talloc_profile != NULL)) {
+		talloc_profile_sub(tc);
+	}
+	tc->name = name;
+	if (unlikely(talloc_profile != NULL)) {
+		talloc_profile_add(tc);
+	}
 	if (likely(tc->name)) {
 		_talloc_set_name_const(tc->name, ".name");
 	}
@@ -1049,9 +1646,11 @@ void talloc_free_children(void *ptr)
 		   pointer, the second choice is our parent, and the
 		   final choice is the null context. */
 		void *child = TC_PTR_FROM_CHUNK(tc->child);
+		struct talloc_reference_handle *child_refs;
 		const void *new_parent = null_context;
-		if (unlikely(tc->child->refs)) {
-			struct talloc_chunk *p = talloc_parent_chunk(tc->child->refs);
+		child_refs = talloc_chunk_refs(tc->child);
+		if (unlikely(child_refs)) {
+			struct talloc_chunk *p = talloc_parent_chunk(child_refs);
 			if (p) new_parent = TC_PTR_FROM_CHUNK(p);
 		}
 		if (unlikely(talloc_free(child) == -1)) {
@@ -1065,11 +1664,7 @@ void talloc_free_children(void *ptr)
 
 	if ((tc->flags & TALLOC_FLAG_POOL)
 	    && (*talloc_pool_objectcount(tc) == 1)) {
-		tc->pool = ((char *)tc + TC_HDR_SIZE + TALLOC_POOL_HDR_SIZE);
-#if defined(DEVELOPER) && defined(VALGRIND_MAKE_MEM_NOACCESS)
-		VALGRIND_MAKE_MEM_NOACCESS(
-			tc->pool, tc->size - TALLOC_POOL_HDR_SIZE);
-#endif
+		talloc_pool_reset(tc);
 	}
 }
 
@@ -1117,13 +1712,13 @@ int _talloc_free(void *ptr, const char *location)
 	
 	tc = talloc_chunk_from_ptr(ptr);
 	
-	if (unlikely(tc->refs != NULL)) {
+	if (unlikely(talloc_chunk_refs(tc) != NULL)) {
 		struct talloc_reference_handle *h;
 
 		talloc_log("ERROR: talloc_free with references at %s\n",
 			   location);
 
-		for (h=tc->refs; h; h=h->next) {
+		for (h=talloc_chunk_refs(tc); h; h=h->next) {
 			talloc_log("\treference at %s\n",
 				   h->location);
 		}
@@ -1163,7 +1758,7 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 	tc = talloc_chunk_from_ptr(ptr);
 
 	/* don't allow realloc on referenced pointers */
-	if (unlikely(tc->refs)) {
+	if (unlikely(talloc_chunk_refs(tc))) {
 		return NULL;
 	}
 
@@ -1174,10 +1769,20 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 
 	/* don't shrink if we have less than 1k to gain */
 	if ((size < tc->size) && ((tc->size - size) < 1024)) {
+		if (unlikely(talloc_profile != NULL)) {
+			talloc_profile_sub(tc);
+		}
 		tc->size = size;
+		if (unlikely(talloc_profile != NULL)) {
+			talloc_profile_add(tc);
+		}
 		return ptr;
 	}
 
+	if (unlikely(talloc_profile != NULL)) {
+		talloc_profile_sub(tc);
+	}
+
 	/* by resetting magic we catch users of the old memory */
 	tc->flags |= TALLOC_FLAG_FREE;
 
@@ -1189,10 +1794,11 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 	}
 #else
 	if (tc->flags & TALLOC_FLAG_POOLMEM) {
+		struct talloc_chunk *pool_ctx =
+			(struct talloc_chunk *)talloc_chunk_pool(tc);
 
 		new_ptr = talloc_alloc_pool(tc, size + TC_HDR_SIZE);
-		*talloc_pool_objectcount((struct talloc_chunk *)
-					 (tc->pool)) -= 1;
+		*talloc_pool_objectcount(pool_ctx) -= 1;
 
 		if (new_ptr == NULL) {
 			new_ptr = malloc(TC_HDR_SIZE+size);
@@ -1201,6 +1807,10 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 
 		if (new_ptr) {
 			memcpy(new_ptr, tc, MIN(tc->size,size) + TC_HDR_SIZE);
+			if (talloc_pool_hdr(pool_ctx)->recycling &&
+			    !(pool_ctx->flags & TALLOC_FLAG_FREE)) {
+				talloc_pool_recycle(pool_ctx, tc);
+			}
 		}
 	}
 	else {
@@ -1209,6 +1819,9 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 #endif
 	if (unlikely(!new_ptr)) {	
 		tc->flags &= ~TALLOC_FLAG_FREE; 
+		if (unlikely(talloc_profile != NULL)) {
+			talloc_profile_add(tc);
+		}
 		return NULL; 
 	}
 
@@ -1217,21 +1830,24 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 	if (malloced) {
 		tc->flags &= ~TALLOC_FLAG_POOLMEM;
 	}
-	if (tc->parent) {
-		tc->parent->child = tc;
+	if (TC_PARENT(tc)) {
+		TC_PARENT(tc)->child = tc;
 	}
 	if (tc->child) {
-		tc->child->parent = tc;
+		TC_SET_FIRST(tc->child, tc);
 	}
 
-	if (tc->prev) {
-		tc->prev->next = tc;
+	if (TC_PREV(tc)) {
+		TC_PREV(tc)->next = tc;
 	}
 	if (tc->next) {
-		tc->next->prev = tc;
+		TC_SET_PREV(tc->next, tc);
 	}
 
 	tc->size = size;
+	if (unlikely(talloc_profile != NULL)) {
+		talloc_profile_add(tc);
+	}
 	_talloc_set_name_const(TC_PTR_FROM_CHUNK(tc), name);
 
 	return TC_PTR_FROM_CHUNK(tc);
@@ -1326,7 +1942,7 @@ size_t talloc_reference_count(const void *ptr)
 	struct talloc_reference_handle *h;
 	size_t ret = 0;
 
-	for (h=tc->refs;h;h=h->next) {
+	for (h=talloc_chunk_refs(tc);h;h=h->next) {
 		ret++;
 	}
 	return ret;
@@ -1443,6 +2059,115 @@ void talloc_report(const void *ptr, FILE *f)
 	talloc_report_depth_file(ptr, 0, 1, f);
 }
 
+/*
+  start counting live blocks and bytes per name, see talloc_profile_report()
+*/
+int talloc_enable_profile(void)
+{
+	struct talloc_profile *prof;
+
+	if (talloc_profile != NULL) {
+		return 0;
+	}
+
+	prof = (struct talloc_profile *)malloc(sizeof(*prof));
+	if (prof == NULL) {
+		return -1;
+	}
+	prof->num_buckets = 256;
+	prof->num_entries = 0;
+	prof->unused = NULL;
+	talloc_profile_generation = talloc_profile_generation % 7 + 1;
+	prof->flag = talloc_profile_generation << TALLOC_FLAG_PROFILE_SHIFT;
+	prof->buckets = (struct talloc_profile_entry **)calloc(
+		prof->num_buckets, sizeof(*prof->buckets));
+	if (prof->buckets == NULL) {
+		free(prof);
+		return -1;
+	}
+
+	talloc_profile = prof;
+
+	if (null_context != NULL) {
+		talloc_profile_add_tree(talloc_chunk_from_ptr(null_context));
+	}
+	return 0;
+}
+
+/*
+  stop profiling and forget the counters
+*/
+void talloc_disable_profile(void)
+{
+	struct talloc_profile *prof = talloc_profile;
+	struct talloc_profile_entry *e, *next;
+	size_t i;
+
+	if (prof == NULL) {
+		return;
+	}
+	talloc_profile = NULL;
+
+	for (i = 0; i < prof->num_buckets; i++) {
+		for (e = prof->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	for (e = prof->unused; e; e = next) {
+		next = e->next;
+		free(e);
+	}
+	free(prof->buckets);
+	free(prof);
+}
+
+/*
+  call the callback for every name with live blocks. The counters are
+  copied first, so the callback may allocate and free memory, but it must
+  not free the objects whose names it is given.
+
+  returns the number of names, or -1 if profiling is not enabled
+*/
+int talloc_profile_report(void (*callback)(const char *name,
+					   size_t count, size_t bytes,
+					   void *private_data),
+			  void *private_data)
+{
+	struct talloc_profile *prof = talloc_profile;
+	struct talloc_profile_entry *copy, *e;
+	size_t i, num = 0;
+
+	if (prof == NULL) {
+		return -1;
+	}
+
+	copy = (struct talloc_profile_entry *)malloc(
+		(prof->num_entries + 1) * sizeof(*copy));
+	if (copy == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < prof->num_buckets; i++) {
+		for (e = prof->buckets[i]; e; e = e->next) {
+			copy[num++] = *e;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		const char *name = copy[i].name;
+		if (name == TALLOC_MAGIC_REFERENCE) {
+			name = ".reference";
+		} else if (name == NULL) {
+			name = "UNNAMED";
+		}
+		callback(name, copy[i].count, copy[i].bytes, private_data);
+	}
+
+	free(copy);
+	return num;
+}
+
 /*
   report on any memory hanging off the null context
 */
@@ -1498,12 +2223,12 @@ void talloc_disable_null_tracking(void)
 		struct talloc_chunk *tc, *tc2;
 		tc = talloc_chunk_from_ptr(null_context);
 		for (tc2 = tc->child; tc2; tc2=tc2->next) {
-			if (tc2->parent == tc) tc2->parent = NULL;
-			if (tc2->prev == tc) tc2->prev = NULL;
+			if (TC_PARENT(tc2) == tc) TC_SET_FIRST(tc2, NULL);
+			if (TC_PREV(tc2) == tc) TC_SET_PREV(tc2, NULL);
 		}
 		for (tc2 = tc->next; tc2; tc2=tc2->next) {
-			if (tc2->parent == tc) tc2->parent = NULL;
-			if (tc2->prev == tc) tc2->prev = NULL;
+			if (TC_PARENT(tc2) == tc) TC_SET_FIRST(tc2, NULL);
+			if (TC_PREV(tc2) == tc) TC_SET_PREV(tc2, NULL);
 		}
 		tc->child = NULL;
 		tc->next = NULL;
@@ -1939,9 +2664,9 @@ void *talloc_find_parent_byname(const void *context, const char *name)
 		if (tc->name && strcmp(tc->name, name) == 0) {
 			return TC_PTR_FROM_CHUNK(tc);
 		}
-		while (tc && tc->prev) tc = tc->prev;
+		while (tc && TC_PREV(tc)) tc = TC_PREV(tc);
 		if (tc) {
-			tc = tc->parent;
+			tc = TC_PARENT(tc);
 		}
 	}
 	return NULL;
@@ -1963,9 +2688,9 @@ void talloc_show_parents(const void *context, FILE *file)
 	fprintf(file, "talloc parents of '%s'\n", talloc_get_name(context));
 	while (tc) {
 		fprintf(file, "\t'%s'\n", talloc_get_name(TC_PTR_FROM_CHUNK(tc)));
-		while (tc && tc->prev) tc = tc->prev;
+		while (tc && TC_PREV(tc)) tc = TC_PREV(tc);
 		if (tc) {
-			tc = tc->parent;
+			tc = TC_PARENT(tc);
 		}
 	}
 	fflush(file);
@@ -1985,9 +2710,9 @@ int talloc_is_parent(const void *context, const void *ptr)
 	tc = talloc_chunk_from_ptr(context);
 	while (tc) {
 		if (TC_PTR_FROM_CHUNK(tc) == ptr) return 1;
-		while (tc && tc->prev) tc = tc->prev;
+		while (tc && TC_PREV(tc)) tc = TC_PREV(tc);
 		if (tc) {
-			tc = tc->parent;
+			tc = TC_PARENT(tc);
 		}
 	}
 	return 0;
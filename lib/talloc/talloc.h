@@ -126,9 +126,23 @@ typedef void TALLOC_CTX;
 
 #define TALLOC_FREE(ctx) do { talloc_free(ctx); ctx=NULL; } while(0)
 
+/* how a talloc pool is used, see talloc_pool_get_stats() */
+struct talloc_pool_stats {
+	size_t size;		/* bytes in the pool */
+	size_t used;		/* bytes of it handed out so far */
+	size_t objects;		/* members still allocated in it */
+	size_t allocs;		/* members taken from the unused part */
+	size_t hits;		/* members taken from the free lists */
+	size_t fallbacks;	/* members that did not fit and were malloc()ed */
+	size_t free_bytes;	/* bytes of freed members waiting to be reused */
+	size_t lost_bytes;	/* bytes of freed members too big to be reused */
+};
+
 /* The following definitions come from talloc.c  */
 void *_talloc(const void *context, size_t size);
 void *talloc_pool(const void *context, size_t size);
+void *talloc_recycling_pool(const void *context, size_t size);
+int talloc_pool_get_stats(const void *ptr, struct talloc_pool_stats *stats);
 void _talloc_set_destructor(const void *ptr, int (*_destructor)(void *));
 int talloc_increase_ref_count(const void *ptr);
 size_t talloc_reference_count(const void *ptr);
@@ -162,6 +176,12 @@ void talloc_report_depth_cb(const void *ptr, int depth, int max_depth,
 void talloc_report_depth_file(const void *ptr, int depth, int max_depth, FILE *f);
 void talloc_report_full(const void *ptr, FILE *f);
 void talloc_report(const void *ptr, FILE *f);
+int talloc_enable_profile(void);
+void talloc_disable_profile(void);
+int talloc_profile_report(void (*callback)(const char *name,
+					   size_t count, size_t bytes,
+					   void *private_data),
+			  void *private_data);
 void talloc_enable_null_tracking(void);
 void talloc_enable_null_tracking_no_autofree(void);
 void talloc_disable_null_tracking(void);
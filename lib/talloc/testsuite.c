@@ -816,51 +816,56 @@ static bool test_unref_reparent(void)
 /*
   measure the speed of talloc versus malloc
 */
-static bool test_speed(void)
+/*
+  Allocations per second of talloc under ctx, cleaning up each round
+  with talloc_free_children(ctx) or else talloc_free() of its top chunk
+*/
+static double test_speed_loop(void *ctx, bool free_children)
 {
-	void *ctx = talloc_new(NULL);
-	unsigned count;
+	unsigned count = 0;
 	const int loop = 1000;
 	int i;
 	struct timeval tv;
 
-	printf("test: speed\n# TALLOC VS MALLOC SPEED\n");
-
 	tv = timeval_current();
-	count = 0;
 	do {
-		void *p1, *p2, *p3;
+		void *p1;
 		for (i=0;i<loop;i++) {
 			p1 = talloc_size(ctx, loop % 100);
-			p2 = talloc_strdup(p1, "foo bar");
-			p3 = talloc_size(p1, 300);
-			talloc_free(p1);
+			talloc_strdup(p1, "foo bar");
+			talloc_size(p1, 300);
+			if (free_children)
+				talloc_free_children(ctx);
+			else
+				talloc_free(p1);
 		}
 		count += 3 * loop;
 	} while (timeval_elapsed(&tv) < 5.0);
 
-	fprintf(stderr, "talloc: %.0f ops/sec\n", count/timeval_elapsed(&tv));
+	return count/timeval_elapsed(&tv);
+}
 
-	talloc_free(ctx);
+static bool test_speed(void)
+{
+	void *ctx;
+	unsigned count;
+	const int loop = 1000;
+	int i;
+	struct timeval tv;
 
-	ctx = talloc_pool(NULL, 1024);
+	printf("test: speed\n# TALLOC VS MALLOC SPEED\n");
 
-	tv = timeval_current();
-	count = 0;
-	do {
-		void *p1, *p2, *p3;
-		for (i=0;i<loop;i++) {
-			p1 = talloc_size(ctx, loop % 100);
-			p2 = talloc_strdup(p1, "foo bar");
-			p3 = talloc_size(p1, 300);
-			talloc_free_children(ctx);
-		}
-		count += 3 * loop;
-	} while (timeval_elapsed(&tv) < 5.0);
+	ctx = talloc_new(NULL);
+	fprintf(stderr, "talloc: %.0f ops/sec\n", test_speed_loop(ctx, false));
+	talloc_free(ctx);
 
+	ctx = talloc_pool(NULL, 1024);
+	fprintf(stderr, "talloc_pool: %.0f ops/sec\n", test_speed_loop(ctx, true));
 	talloc_free(ctx);
 
-	fprintf(stderr, "talloc_pool: %.0f ops/sec\n", count/timeval_elapsed(&tv));
+	ctx = talloc_recycling_pool(NULL, 1024);
+	fprintf(stderr, "talloc_recycling_pool: %.0f ops/sec\n", test_speed_loop(ctx, false));
+	talloc_free(ctx);
 
 	tv = timeval_current();
 	count = 0;
@@ -1132,6 +1137,344 @@ static bool test_pool(void)
 	return true;
 }
 
+static bool test_recycling_pool(void)
+{
+	void *pool;
+	void *p[16];
+	void *p1, *p2;
+	struct talloc_pool_stats st;
+	size_t j;
+	int i;
+
+	printf("test: recycling_pool\n# RECYCLING POOL\n");
+
+	pool = talloc_recycling_pool(NULL, 4096);
+	torture_assert("recycling_pool", pool != NULL, "no pool");
+
+	/* the live members would not fit if freed ones were not reused */
+	for (i = 0; i < 16; i++) {
+		p[i] = talloc_size(pool, 100);
+	}
+	for (j = 0; j < 1000; j++) {
+		i = j % 16;
+		talloc_free(p[i]);
+		p[i] = talloc_size(pool, 90 + (j % 3));
+		CHECK_PARENT("recycling_pool", p[i], pool);
+	}
+
+	torture_assert("recycling_pool", talloc_pool_get_stats(pool, &st) == 0,
+		       "no stats");
+	printf("# allocs %u hits %u fallbacks %u free_bytes %u used %u of %u\n",
+	       (unsigned)st.allocs, (unsigned)st.hits, (unsigned)st.fallbacks,
+	       (unsigned)st.free_bytes, (unsigned)st.used, (unsigned)st.size);
+	torture_assert("recycling_pool", st.fallbacks == 0,
+		       "freed members not reused");
+	torture_assert("recycling_pool", st.hits + st.allocs == 1016,
+		       "allocations not counted");
+	torture_assert("recycling_pool", st.objects == 16,
+		       "wrong object count");
+
+	/* a realloc that moves gives the old chunk back */
+	p1 = talloc_realloc_size(pool, p[0], 500);
+	torture_assert("recycling_pool", p1 != NULL, "realloc failed");
+	talloc_pool_get_stats(pool, &st);
+	torture_assert("recycling_pool", st.free_bytes >= 100,
+		       "realloc did not recycle");
+	p[0] = p1;
+
+	/* too big for the pool, comes from malloc() */
+	j = st.fallbacks;
+	p2 = talloc_size(pool, 8192);
+	talloc_pool_get_stats(pool, &st);
+	torture_assert("recycling_pool", st.fallbacks == j + 1,
+		       "fallback not counted");
+	talloc_free(p2);
+
+	/* once all members are gone the whole pool is available again */
+	for (i = 0; i < 16; i++) {
+		talloc_free(p[i]);
+	}
+	talloc_pool_get_stats(pool, &st);
+	torture_assert("recycling_pool", st.used == 0 && st.free_bytes == 0,
+		       "empty pool not reset");
+
+	p1 = talloc_new(NULL);
+	torture_assert("recycling_pool", talloc_pool_get_stats(p1, &st) == -1,
+		       "stats of a non-pool");
+	talloc_free(p1);
+
+	talloc_free(pool);
+
+	printf("success: recycling_pool\n");
+	return true;
+}
+
+static unsigned int small_destructor_count;
+
+static int test_small_destructor(void *ptr)
+{
+	small_destructor_count++;
+	return 0;
+}
+
+static bool test_small_objects(void)
+{
+	void *pool, *ctx;
+	void *p[8];
+	void *p1, *ref;
+	int i;
+
+	printf("test: small_objects\n# SMALL OBJECTS IN A POOL\n");
+
+	pool = talloc_pool(NULL, 4096);
+	ctx = talloc_new(NULL);
+
+	/* destructors and references on pool members, siblings and a realloc
+	 * that leaves the pool must keep the hierarchy intact */
+	small_destructor_count = 0;
+	for (i = 0; i < 8; i++) {
+		p[i] = talloc_size(pool, 16);
+		talloc_set_destructor(p[i], test_small_destructor);
+	}
+	for (i = 0; i < 8; i++) {
+		CHECK_PARENT("small_objects", p[i], pool);
+	}
+
+	ref = talloc_reference(ctx, p[3]);
+	torture_assert("small_objects", ref == p[3], "reference failed");
+	torture_assert("small_objects", talloc_reference_count(p[3]) == 1,
+		       "wrong reference count");
+
+	p1 = talloc_realloc_size(pool, p[5], 8192);
+	torture_assert("small_objects", p1 != NULL, "realloc failed");
+	p[5] = p1;
+	CHECK_PARENT("small_objects", p[5], pool);
+	CHECK_PARENT("small_objects", p[4], pool);
+	CHECK_PARENT("small_objects", p[6], pool);
+
+	talloc_set_destructor(p[7], NULL);
+	talloc_free(p[0]);
+	torture_assert("small_objects", small_destructor_count == 1,
+		       "destructor not called");
+	CHECK_BLOCKS("small_objects", pool, 8);
+
+	talloc_free(pool);
+	torture_assert("small_objects", small_destructor_count == 6,
+		       "destructors not called");
+	CHECK_PARENT("small_objects", p[3], ctx);
+
+	talloc_free(ctx);
+	torture_assert("small_objects", small_destructor_count == 7,
+		       "referenced destructor not called");
+
+	printf("success: small_objects\n");
+	return true;
+}
+
+static bool test_small_speed(void)
+{
+	const unsigned int num = 10000;
+	struct talloc_pool_stats st;
+	void *ctx, *pool;
+	void **p;
+	unsigned int count, i;
+	struct timeval tv;
+
+	printf("test: small_speed\n# SMALL OBJECT MEMORY AND SPEED\n");
+
+	/* a pool shows what an object really takes, its header included */
+	pool = talloc_pool(NULL, num * 128);
+	for (i = 0; i < num; i++) {
+		talloc_size(pool, 16);
+	}
+	talloc_pool_get_stats(pool, &st);
+	torture_assert("small_speed", st.objects == num, "not all in the pool");
+	fprintf(stderr, "talloc: %u bytes per 16 byte object\n",
+		(unsigned)(st.used / num));
+	talloc_free(pool);
+
+	ctx = talloc_new(NULL);
+	p = talloc_array(ctx, void *, num);
+
+	tv = timeval_current();
+	count = 0;
+	do {
+		for (i = 0; i < num; i++) {
+			p[i] = talloc_size(ctx, 16);
+		}
+		for (i = 0; i < num; i++) {
+			talloc_free(p[i]);
+		}
+		count += 2 * num;
+	} while (timeval_elapsed(&tv) < 5.0);
+
+	fprintf(stderr, "talloc small: %.0f ops/sec\n",
+		count/timeval_elapsed(&tv));
+
+	tv = timeval_current();
+	count = 0;
+	do {
+		for (i = 0; i < num; i++) {
+			p[i] = malloc(16);
+		}
+		for (i = 0; i < num; i++) {
+			free(p[i]);
+		}
+		count += 2 * num;
+	} while (timeval_elapsed(&tv) < 5.0);
+
+	fprintf(stderr, "malloc small: %.0f ops/sec\n",
+		count/timeval_elapsed(&tv));
+
+	talloc_free(ctx);
+
+	printf("success: small_speed\n");
+	return true;
+}
+
+struct profile_result {
+	const char *name;
+	size_t count;
+	size_t bytes;
+};
+
+static void test_profile_cb(const char *name, size_t count, size_t bytes,
+			    void *private_data)
+{
+	struct profile_result *res = (struct profile_result *)private_data;
+
+	if (strcmp(name, res->name) == 0) {
+		res->count += count;
+		res->bytes += bytes;
+	}
+}
+
+#define CHECK_PROFILE(test, pname, pcount, pbytes) do { \
+	struct profile_result res = { pname, 0, 0 }; \
+	talloc_profile_report(test_profile_cb, &res); \
+	if (res.count != (pcount) || res.bytes != (pbytes)) { \
+		printf("failed: %s [\n%s: '%s' profile: got %u/%u expected %u/%u\n]\n", \
+		       test, __location__, pname, \
+		       (unsigned)res.count, (unsigned)res.bytes, \
+		       (unsigned)(pcount), (unsigned)(pbytes)); \
+		return false; \
+	} \
+} while (0)
+
+struct profile_obj {
+	int x[4];
+};
+
+static bool test_profile(void)
+{
+	void *root, *old;
+	struct profile_obj *o[10];
+	char *s;
+	int i;
+
+	printf("test: profile\n# TALLOC PROFILE\n");
+
+	torture_assert("profile",
+		       talloc_profile_report(test_profile_cb, NULL) == -1,
+		       "profile not disabled");
+
+	/* allocated before, found through the null context */
+	old = talloc_named_const(NULL, 100, "profile_old");
+
+	torture_assert("profile", talloc_enable_profile() == 0,
+		       "enable failed");
+	CHECK_PROFILE("profile", "profile_old", 1, 100);
+
+	root = talloc_named_const(NULL, 0, "profile_root");
+	for (i = 0; i < 10; i++) {
+		o[i] = talloc(root, struct profile_obj);
+	}
+	CHECK_PROFILE("profile", "struct profile_obj", 10, 10 * sizeof(struct profile_obj));
+
+	for (i = 0; i < 5; i++) {
+		talloc_free(o[i]);
+	}
+	CHECK_PROFILE("profile", "struct profile_obj", 5, 5 * sizeof(struct profile_obj));
+
+	/* strings are named after their contents, they are counted together */
+	s = talloc_strdup(root, "abc");
+	talloc_strdup(root, "xy");
+	CHECK_PROFILE("profile", ".string", 2, 7);
+	s = talloc_strdup_append(s, "def");
+	CHECK_PROFILE("profile", ".string", 2, 10);
+	CHECK_PROFILE("profile", "abcdef", 0, 0);
+
+	talloc_set_name(o[5], "renamed %d", 5);
+	CHECK_PROFILE("profile", "struct profile_obj", 4, 4 * sizeof(struct profile_obj));
+	CHECK_PROFILE("profile", "renamed 5", 1, sizeof(struct profile_obj));
+
+	talloc_free(old);
+	talloc_free(root);
+	CHECK_PROFILE("profile", "profile_old", 0, 0);
+	CHECK_PROFILE("profile", "struct profile_obj", 0, 0);
+	CHECK_PROFILE("profile", "renamed 5", 0, 0);
+	CHECK_PROFILE("profile", ".name", 0, 0);
+	CHECK_PROFILE("profile", ".string", 0, 0);
+	CHECK_PROFILE("profile", "profile_root", 0, 0);
+
+	talloc_disable_profile();
+
+	printf("success: profile\n");
+	return true;
+}
+
+static bool test_profile_uncounted(void)
+{
+	struct profile_obj *before[3], *during[3], *after[3];
+	int i;
+
+	printf("test: profile_uncounted\n# TALLOC PROFILE OF UNCOUNTED OBJECTS\n");
+
+	/* without null tracking the profile can't find these */
+	talloc_disable_null_tracking();
+	for (i = 0; i < 3; i++) {
+		before[i] = talloc(NULL, struct profile_obj);
+	}
+
+	torture_assert("profile_uncounted", talloc_enable_profile() == 0,
+		       "enable failed");
+	CHECK_PROFILE("profile_uncounted", "struct profile_obj", 0, 0);
+
+	for (i = 0; i < 3; i++) {
+		during[i] = talloc(NULL, struct profile_obj);
+	}
+	CHECK_PROFILE("profile_uncounted", "struct profile_obj", 3, 3 * sizeof(struct profile_obj));
+
+	/* freeing what was never counted leaves the counters alone */
+	before[0] = talloc_realloc_size(NULL, before[0], 100);
+	for (i = 0; i < 3; i++) {
+		talloc_free(before[i]);
+	}
+	CHECK_PROFILE("profile_uncounted", "struct profile_obj", 3, 3 * sizeof(struct profile_obj));
+
+	/* and so does freeing what an earlier profile counted */
+	talloc_disable_profile();
+	torture_assert("profile_uncounted", talloc_enable_profile() == 0,
+		       "enable failed");
+	for (i = 0; i < 3; i++) {
+		after[i] = talloc(NULL, struct profile_obj);
+	}
+	for (i = 0; i < 3; i++) {
+		talloc_free(during[i]);
+	}
+	CHECK_PROFILE("profile_uncounted", "struct profile_obj", 3, 3 * sizeof(struct profile_obj));
+
+	for (i = 0; i < 3; i++) {
+		talloc_free(after[i]);
+	}
+	CHECK_PROFILE("profile_uncounted", "struct profile_obj", 0, 0);
+
+	talloc_disable_profile();
+
+	printf("success: profile_uncounted\n");
+	return true;
+}
+
 static void test_reset(void)
 {
 	talloc_set_log_fn(test_log_stdout);
@@ -1185,10 +1528,20 @@ bool torture_local_talloc(struct torture_context *tctx)
 	ret &= test_talloc_free_in_destructor();
 	test_reset();
 	ret &= test_pool();
+	test_reset();
+	ret &= test_recycling_pool();
+	test_reset();
+	ret &= test_small_objects();
+	test_reset();
+	ret &= test_profile();
+	test_reset();
+	ret &= test_profile_uncounted();
 
 	if (ret) {
 		test_reset();
 		ret &= test_speed();
+		test_reset();
+		ret &= test_small_speed();
 	}
 	test_reset();
 	ret &= test_autofree();
@@ -38,9 +38,19 @@ static bool tdb_check_header(struct tdb_context *tdb, tdb_off_t *recovery)
 	if (hdr.version != TDB_VERSION)
 		goto corrupt;
 
-	if (hdr.rwlocks != 0)
+	if (hdr.rwlocks != 0 && hdr.rwlocks != TDB_HASH_RWLOCK_MAGIC &&
+	    hdr.rwlocks != TDB_FEATURE_RWLOCK_MAGIC)
 		goto corrupt;
 
+	/* the free list layout can't change while we're open */
+	if (hdr.rwlocks == TDB_FEATURE_RWLOCK_MAGIC) {
+		if (hdr.free_groups != tdb->header.free_groups ||
+		    hdr.free_classes != tdb->header.free_classes)
+			goto corrupt;
+	} else if (tdb->header.free_classes != 0) {
+		goto corrupt;
+	}
+
 	if (hdr.hash_size == 0)
 		goto corrupt;
 
@@ -48,7 +58,7 @@ static bool tdb_check_header(struct tdb_context *tdb, tdb_off_t *recovery)
 		goto corrupt;
 
 	if (hdr.recovery_start != 0 &&
-	    hdr.recovery_start < TDB_DATA_START(tdb->header.hash_size))
+	    hdr.recovery_start < TDB_DATA_START(tdb))
 		goto corrupt;
 
 	*recovery = hdr.recovery_start;
@@ -68,7 +78,7 @@ static bool tdb_check_record(struct tdb_context *tdb,
 	tdb_off_t tailer;
 
 	/* Check rec->next: 0 or points to record offset, aligned. */
-	if (rec->next > 0 && rec->next < TDB_DATA_START(tdb->header.hash_size)){
+	if (rec->next > 0 && rec->next < TDB_DATA_START(tdb)){
 		TDB_LOG((tdb, TDB_DEBUG_ERROR,
 			 "Record offset %d too small next %d\n",
 			 off, rec->next));
@@ -293,6 +303,14 @@ static bool tdb_check_free_record(struct tdb_context *tdb,
 	if (!tdb_check_record(tdb, off, rec))
 		return false;
 
+	/* In a free list table, key_len holds the list it is on. */
+	if (tdb->header.free_classes && rec->key_len >= TDB_FREE_LISTS(tdb)) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR,
+			 "Free record offset %d on invalid list %d\n",
+			 off, rec->key_len));
+		return false;
+	}
+
 	/* Mark this offset as a known value for the free list. */
 	record_offset(hashes[0], off);
 	/* And similarly if the next pointer is valid. */
@@ -322,7 +340,7 @@ int tdb_check(struct tdb_context *tdb,
 		goto unlock;
 
 	/* We should have the whole header, too. */
-	if (tdb->map_size < TDB_DATA_START(tdb->header.hash_size)) {
+	if (tdb->map_size < TDB_DATA_START(tdb)) {
 		tdb->ecode = TDB_ERR_CORRUPT;
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "File too short for hashes\n"));
 		goto unlock;
@@ -351,8 +369,20 @@ int tdb_check(struct tdb_context *tdb,
 			record_offset(hashes[h], off);
 	}
 
+	/* So is the free list table, if any: all the lists share the
+	   free list's bitmap. */
+	if (tdb->header.free_classes) {
+		for (h = 0; h < TDB_FREE_LISTS(tdb); h++) {
+			if (tdb_ofs_read(tdb, TDB_FREE_LIST_TOP(tdb, h),
+					 &off) == -1)
+				goto free;
+			if (off)
+				record_offset(hashes[0], off);
+		}
+	}
+
 	/* For each record, read it in and check it's ok. */
-	for (off = TDB_DATA_START(tdb->header.hash_size);
+	for (off = TDB_DATA_START(tdb);
 	     off < tdb->map_size;
 	     off += sizeof(rec) + rec.rec_len) {
 		if (tdb->methods->tdb_read(tdb, off, &rec, sizeof(rec),
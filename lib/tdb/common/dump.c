@@ -90,48 +90,110 @@ void tdb_dump_all(struct tdb_context *tdb)
 	tdb_dump_chain(tdb, -1);
 }
 
-int tdb_printfreelist(struct tdb_context *tdb)
+static int tdb_print_freelist(struct tdb_context *tdb, uint32_t list,
+			      long *total_free)
 {
-	int ret;
-	long total_free = 0;
+	int ret, lock = TDB_FREE_LIST_LOCK(tdb, list);
 	tdb_off_t offset, rec_ptr;
 	struct tdb_record rec;
 
-	if ((ret = tdb_lock(tdb, -1, F_WRLCK)) != 0)
+	if ((ret = tdb_lock(tdb, lock, F_WRLCK)) != 0)
 		return ret;
 
-	offset = FREELIST_TOP;
+	offset = TDB_FREE_LIST_TOP(tdb, list);
 
 	/* read in the freelist top */
 	if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
-		tdb_unlock(tdb, -1, F_WRLCK);
+		tdb_unlock(tdb, lock, F_WRLCK);
 		return 0;
 	}
 
-	printf("freelist top=[0x%08x]\n", rec_ptr );
+	if (tdb->header.free_classes) {
+		if (rec_ptr == 0) {
+			/* don't print hundreds of empty lists */
+			return tdb_unlock(tdb, lock, F_WRLCK);
+		}
+		printf("freelist %u (group %u class %u) top=[0x%08x]\n",
+		       list, list / tdb->header.free_classes,
+		       list % tdb->header.free_classes, rec_ptr);
+	} else {
+		printf("freelist top=[0x%08x]\n", rec_ptr );
+	}
 	while (rec_ptr) {
 		if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec, 
 					   sizeof(rec), DOCONV()) == -1) {
-			tdb_unlock(tdb, -1, F_WRLCK);
+			tdb_unlock(tdb, lock, F_WRLCK);
 			return -1;
 		}
 
 		if (rec.magic != TDB_FREE_MAGIC) {
 			printf("bad magic 0x%08x in free list\n", rec.magic);
-			tdb_unlock(tdb, -1, F_WRLCK);
+			tdb_unlock(tdb, lock, F_WRLCK);
 			return -1;
 		}
 
 		printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%d)] (end = 0x%08x)\n", 
 		       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
-		total_free += rec.rec_len;
+		*total_free += rec.rec_len;
 
 		/* move to the next record */
 		rec_ptr = rec.next;
 	}
+
+	return tdb_unlock(tdb, lock, F_WRLCK);
+}
+
+int tdb_printfreelist(struct tdb_context *tdb)
+{
+	int ret;
+	long total_free = 0;
+	uint32_t i;
+
+	for (i = 0; i < TDB_FREE_LISTS(tdb); i++) {
+		if ((ret = tdb_print_freelist(tdb, i, &total_free)) != 0)
+			return ret;
+	}
 	printf("total rec_len = [0x%08x (%d)]\n", (int)total_free, 
                (int)total_free);
 
-	return tdb_unlock(tdb, -1, F_WRLCK);
+	return 0;
 }
 
+
+/*
+  fill in lengths[0..tdb_hash_size()-1] with the number of records on
+  each hash chain (dead records included, as tdb_find() walks them too)
+ */
+int tdb_hash_chain_lengths(struct tdb_context *tdb, uint32_t *lengths)
+{
+	uint32_t i;
+	tdb_off_t rec_ptr;
+	struct tdb_record rec;
+
+	for (i = 0; i < tdb->header.hash_size; i++) {
+		lengths[i] = 0;
+
+		if (tdb_lock(tdb, i, F_RDLCK) != 0)
+			return -1;
+
+		if (tdb_ofs_read(tdb, TDB_HASH_TOP(i), &rec_ptr) == -1) {
+			tdb_unlock(tdb, i, F_RDLCK);
+			return -1;
+		}
+
+		while (rec_ptr) {
+			if (tdb_rec_read(tdb, rec_ptr, &rec) == -1 ||
+			    lengths[i] > tdb->map_size / sizeof(rec)) {
+				tdb->ecode = TDB_ERR_CORRUPT;
+				tdb_unlock(tdb, i, F_RDLCK);
+				return -1;
+			}
+			lengths[i]++;
+			rec_ptr = rec.next;
+		}
+
+		tdb_unlock(tdb, i, F_RDLCK);
+	}
+
+	return 0;
+}
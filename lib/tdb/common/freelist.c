@@ -61,6 +61,56 @@ int tdb_rec_free_read(struct tdb_context *tdb, tdb_off_t off, struct tdb_record
 	return 0;
 }
 
+/*
+  the size class of a free record of length len: class 0 is everything
+  below 64 bytes, then two classes per power of two, the last class
+  taking everything bigger. Every record on the list for a class is at
+  least as long as the class minimum - records only ever grow while on
+  a list (by merging), and move when they shrink.
+ */
+static uint32_t tdb_free_class(struct tdb_context *tdb, tdb_len_t len)
+{
+	uint32_t bits, c;
+
+	if (len < 64) {
+		return 0;
+	}
+	for (bits = 6; (len >> (bits+1)) != 0; bits++)
+		;
+	c = 1 + 2*(bits-6) + ((len >> (bits-1)) & 1);
+	return MIN(c, tdb->header.free_classes - 1);
+}
+
+/* the free list a record of length len freed from chain hash goes on */
+static uint32_t tdb_free_list(struct tdb_context *tdb, uint32_t hash,
+			      tdb_len_t len)
+{
+	uint32_t group = BUCKET(hash) % tdb->header.free_groups;
+
+	return group * tdb->header.free_classes + tdb_free_class(tdb, len);
+}
+
+/*
+  lock the central freelist for an allocation. With a free list table
+  each free list operation takes only the lock of the group it works
+  on, so there is nothing to do
+ */
+int tdb_lock_freelist(struct tdb_context *tdb)
+{
+	if (tdb->header.free_classes) {
+		return 0;
+	}
+	return tdb_lock(tdb, -1, F_WRLCK);
+}
+
+int tdb_unlock_freelist(struct tdb_context *tdb)
+{
+	if (tdb->header.free_classes) {
+		return 0;
+	}
+	return tdb_unlock(tdb, -1, F_WRLCK);
+}
+
 
 #if USE_RIGHT_MERGES
 /* Remove an element from the freelist.  Must have alloc lock. */
@@ -97,10 +147,194 @@ static int update_tailer(struct tdb_context *tdb, tdb_off_t offset,
 			 &totalsize);
 }
 
+/* read the record to the left of the one at offset, if there is one */
+static bool tdb_read_left(struct tdb_context *tdb, tdb_off_t offset,
+			  tdb_off_t *left, struct tdb_record *l)
+{
+	tdb_off_t leftsize;
+
+	if (offset - sizeof(tdb_off_t) <= TDB_DATA_START(tdb)) {
+		return false;
+	}
+
+	/* Read in tailer and jump back to header */
+	if (tdb_ofs_read(tdb, offset - sizeof(tdb_off_t), &leftsize) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left offset read failed at %u\n",
+			 (unsigned int)(offset - sizeof(tdb_off_t))));
+		return false;
+	}
+
+	/* it could be uninitialised data */
+	if (leftsize == 0 || leftsize == TDB_PAD_U32) {
+		return false;
+	}
+
+	*left = offset - leftsize;
+
+	if (leftsize > offset ||
+	    *left < TDB_DATA_START(tdb)) {
+		return false;
+	}
+
+	/* Now read in the left record */
+	if (tdb->methods->tdb_read(tdb, *left, l, sizeof(*l), DOCONV()) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left read failed at %u (%u)\n", *left, leftsize));
+		return false;
+	}
+	return true;
+}
+
+/*
+  a free record in a free list table has changed size: move it to the
+  list for its new size, in the same group. last_ptr is the offset of
+  the pointer to it. Must hold the group lock.
+ */
+static int tdb_free_refile(struct tdb_context *tdb, tdb_off_t rec_ptr,
+			   struct tdb_record *rec, tdb_off_t last_ptr)
+{
+	uint32_t list;
+
+	list = rec->key_len - rec->key_len % tdb->header.free_classes
+		+ tdb_free_class(tdb, rec->rec_len);
+	if (list == rec->key_len) {
+		return tdb_rec_write(tdb, rec_ptr, rec);
+	}
+
+	/* unlink it from the previous record */
+	if (tdb_ofs_write(tdb, last_ptr, &rec->next) == -1) {
+		return -1;
+	}
+
+	rec->key_len = list;
+	if (tdb_ofs_read(tdb, TDB_FREE_LIST_TOP(tdb, list), &rec->next) == -1 ||
+	    tdb_rec_write(tdb, rec_ptr, rec) == -1 ||
+	    tdb_ofs_write(tdb, TDB_FREE_LIST_TOP(tdb, list), &rec_ptr) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  a free record in a free list table has grown by merging: find what
+  points to it so that it can move to the list for its new size.
+ */
+static int tdb_free_promote(struct tdb_context *tdb, tdb_off_t rec_ptr,
+			    struct tdb_record *rec)
+{
+	tdb_off_t last_ptr, ptr;
+
+	last_ptr = TDB_FREE_LIST_TOP(tdb, rec->key_len);
+	while (tdb_ofs_read(tdb, last_ptr, &ptr) == 0 && ptr != 0) {
+		if (ptr == rec_ptr) {
+			return tdb_free_refile(tdb, rec_ptr, rec, last_ptr);
+		}
+		last_ptr = ptr;
+	}
+
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: record %u not on free list %u\n",
+		 rec_ptr, rec->key_len));
+	tdb->ecode = TDB_ERR_CORRUPT;
+	return -1;
+}
+
+/*
+  tdb_free() for a tdb with a free list table. The record goes on the
+  list for its size in the group of the chain it was freed from
+  (rec->full_hash); free space which was never on a chain uses
+  rec->full_hash to pick the group as well.
+
+  The merge with a free record to the left is done under the lock of
+  the group that record is on, which we only learn by reading it: so
+  read it again once locked, as it may have been allocated meanwhile.
+ */
+static int tdb_free_table(struct tdb_context *tdb, tdb_off_t offset,
+			  struct tdb_record *rec)
+{
+	tdb_off_t left, left2;
+	struct tdb_record l;
+	uint32_t list;
+	int lock;
+
+	/* set an initial tailer, so if we fail we don't leave a bogus
+	   record. The record is ours until it is on a list */
+	if (update_tailer(tdb, offset, rec) != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed!\n"));
+		return -1;
+	}
+
+	/* Look left */
+	if (tdb_read_left(tdb, offset, &left, &l) &&
+	    l.magic == TDB_FREE_MAGIC &&
+	    l.key_len < TDB_FREE_LISTS(tdb)) {
+		list = l.key_len;
+		lock = TDB_FREE_LIST_LOCK(tdb, list);
+
+		if (tdb_lock(tdb, lock, F_WRLCK) != 0) {
+			return -1;
+		}
+		if (tdb_read_left(tdb, offset, &left2, &l) &&
+		    left2 == left &&
+		    l.magic == TDB_FREE_MAGIC &&
+		    l.key_len == list) {
+			l.rec_len += sizeof(*rec) + rec->rec_len;
+			/* don't hide a big record on the list of a
+			   smaller size, where allocation won't look */
+			if (tdb_free_class(tdb, l.rec_len) !=
+			    list % tdb->header.free_classes) {
+				if (tdb_free_promote(tdb, left, &l) == -1) {
+					goto fail;
+				}
+			} else if (tdb_rec_write(tdb, left, &l) == -1) {
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_left failed at %u\n", left));
+				goto fail;
+			}
+			if (update_tailer(tdb, left, &l) == -1) {
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %u\n", offset));
+				goto fail;
+			}
+			tdb_unlock(tdb, lock, F_WRLCK);
+			return 0;
+		}
+		tdb_unlock(tdb, lock, F_WRLCK);
+	}
+
+	/* Now, prepend to its free list */
+	list = tdb_free_list(tdb, rec->full_hash, rec->rec_len);
+	lock = TDB_FREE_LIST_LOCK(tdb, list);
+
+	if (tdb_lock(tdb, lock, F_WRLCK) != 0) {
+		return -1;
+	}
+
+	rec->magic = TDB_FREE_MAGIC;
+	rec->key_len = list;
+
+	if (tdb_ofs_read(tdb, TDB_FREE_LIST_TOP(tdb, list), &rec->next) == -1 ||
+	    tdb_rec_write(tdb, offset, rec) == -1 ||
+	    tdb_ofs_write(tdb, TDB_FREE_LIST_TOP(tdb, list), &offset) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%d\n", offset));
+		goto fail;
+	}
+
+	tdb_unlock(tdb, lock, F_WRLCK);
+	return 0;
+
+ fail:
+	tdb_unlock(tdb, lock, F_WRLCK);
+	return -1;
+}
+
 /* Add an element into the freelist. Merge adjacent records if
    neccessary. */
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec)
 {
+	tdb_off_t left;
+	struct tdb_record l;
+
+	if (tdb->header.free_classes) {
+		return tdb_free_table(tdb, offset, rec);
+	}
+
 	/* Allocation and tailer lock */
 	if (tdb_lock(tdb, -1, F_WRLCK) != 0)
 		return -1;
@@ -139,56 +373,24 @@ left:
 #endif
 
 	/* Look left */
-	if (offset - sizeof(tdb_off_t) > TDB_DATA_START(tdb->header.hash_size)) {
-		tdb_off_t left = offset - sizeof(tdb_off_t);
-		struct tdb_record l;
-		tdb_off_t leftsize;
-		
-		/* Read in tailer and jump back to header */
-		if (tdb_ofs_read(tdb, left, &leftsize) == -1) {
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left offset read failed at %u\n", left));
-			goto update;
-		}
-
-		/* it could be uninitialised data */
-		if (leftsize == 0 || leftsize == TDB_PAD_U32) {
-			goto update;
-		}
-
-		left = offset - leftsize;
-
-		if (leftsize > offset ||
-		    left < TDB_DATA_START(tdb->header.hash_size)) {
-			goto update;
-		}
-
-		/* Now read in the left record */
-		if (tdb->methods->tdb_read(tdb, left, &l, sizeof(l), DOCONV()) == -1) {
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left read failed at %u (%u)\n", left, leftsize));
-			goto update;
+	if (tdb_read_left(tdb, offset, &left, &l) &&
+	    l.magic == TDB_FREE_MAGIC) {
+		/* we now merge the new record into the left record, rather than the other 
+		   way around. This makes the operation O(1) instead of O(n). This change
+		   prevents traverse from being O(n^2) after a lot of deletes */
+		l.rec_len += sizeof(*rec) + rec->rec_len;
+		if (tdb_rec_write(tdb, left, &l) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_left failed at %u\n", left));
+			goto fail;
 		}
-
-		/* If it's free, expand to include it. */
-		if (l.magic == TDB_FREE_MAGIC) {
-			/* we now merge the new record into the left record, rather than the other 
-			   way around. This makes the operation O(1) instead of O(n). This change
-			   prevents traverse from being O(n^2) after a lot of deletes */
-			l.rec_len += sizeof(*rec) + rec->rec_len;
-			if (tdb_rec_write(tdb, left, &l) == -1) {
-				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_left failed at %u\n", left));
-				goto fail;
-			}
-			if (update_tailer(tdb, left, &l) == -1) {
-				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %u\n", offset));
-				goto fail;
-			}
-			tdb_unlock(tdb, -1, F_WRLCK);
-			return 0;
+		if (update_tailer(tdb, left, &l) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %u\n", offset));
+			goto fail;
 		}
+		tdb_unlock(tdb, -1, F_WRLCK);
+		return 0;
 	}
 
-update:
-
 	/* Now, prepend to free list */
 	rec->magic = TDB_FREE_MAGIC;
 
@@ -242,7 +444,11 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 
 	/* we're going to just shorten the existing record */
 	rec->rec_len -= (length + sizeof(*rec));
-	if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
+	if (tdb->header.free_classes) {
+		if (tdb_free_refile(tdb, rec_ptr, rec, last_ptr) == -1) {
+			return 0;
+		}
+	} else if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
 		return 0;
 	}
 	if (update_tailer(tdb, rec_ptr, rec) == -1) {
@@ -267,41 +473,26 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 	return rec_ptr;
 }
 
-/* allocate some space from the free list. The offset returned points
-   to a unconnected tdb_record within the database with room for at
-   least length bytes of total data
-
-   0 is returned if the space could not be allocated
+/*
+  best fit search of the free list at list_top for a record of at least
+  length bytes. Sets *bestfit_ptr to 0 if there is none.
  */
-tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec)
+static int tdb_free_bestfit(struct tdb_context *tdb, tdb_off_t list_top,
+			    tdb_len_t length, struct tdb_record *rec,
+			    tdb_off_t *bestfit_ptr, tdb_off_t *bestfit_last)
 {
-	tdb_off_t rec_ptr, last_ptr, newrec_ptr;
-	struct {
-		tdb_off_t rec_ptr, last_ptr;
-		tdb_len_t rec_len;
-	} bestfit;
+	tdb_off_t rec_ptr, last_ptr;
+	tdb_len_t bestfit_len = 0;
 	float multiplier = 1.0;
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1)
-		return 0;
+	*bestfit_ptr = 0;
+	*bestfit_last = 0;
 
-	/* over-allocate to reduce fragmentation */
-	length *= 1.25;
-
-	/* Extra bytes required for tailer */
-	length += sizeof(tdb_off_t);
-	length = TDB_ALIGN(length, TDB_ALIGNMENT);
-
- again:
-	last_ptr = FREELIST_TOP;
+	last_ptr = list_top;
 
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1)
-		goto fail;
-
-	bestfit.rec_ptr = 0;
-	bestfit.last_ptr = 0;
-	bestfit.rec_len = 0;
+	if (tdb_ofs_read(tdb, list_top, &rec_ptr) == -1)
+		return -1;
 
 	/* 
 	   this is a best fit allocation strategy. Originally we used
@@ -310,15 +501,15 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 	 */
 	while (rec_ptr) {
 		if (tdb_rec_free_read(tdb, rec_ptr, rec) == -1) {
-			goto fail;
+			return -1;
 		}
 
 		if (rec->rec_len >= length) {
-			if (bestfit.rec_ptr == 0 ||
-			    rec->rec_len < bestfit.rec_len) {
-				bestfit.rec_len = rec->rec_len;
-				bestfit.rec_ptr = rec_ptr;
-				bestfit.last_ptr = last_ptr;
+			if (*bestfit_ptr == 0 ||
+			    rec->rec_len < bestfit_len) {
+				bestfit_len = rec->rec_len;
+				*bestfit_ptr = rec_ptr;
+				*bestfit_last = last_ptr;
 			}
 		}
 
@@ -330,8 +521,8 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 		   stop searching if its also not too big. The
 		   definition of 'too big' changes as we scan
 		   through */
-		if (bestfit.rec_len > 0 &&
-		    bestfit.rec_len < length * multiplier) {
+		if (bestfit_len > 0 &&
+		    bestfit_len < length * multiplier) {
 			break;
 		}
 		
@@ -342,13 +533,167 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 		multiplier *= 1.05;
 	}
 
-	if (bestfit.rec_ptr != 0) {
-		if (tdb_rec_free_read(tdb, bestfit.rec_ptr, rec) == -1) {
-			goto fail;
+	if (*bestfit_ptr != 0) {
+		if (tdb_rec_free_read(tdb, *bestfit_ptr, rec) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  allocate from one group of a free list table, under its lock. With
+  bestfit we search the list of class 'from', whose records may or may
+  not be big enough, otherwise we take the head of the first non-empty
+  list from class 'from' up, whose records all are.
+
+  Returns -1 on error, 0 with *rec_ptr 0 if there was nothing suitable
+ */
+static int tdb_allocate_group(struct tdb_context *tdb, uint32_t group,
+			      uint32_t from, bool bestfit, tdb_len_t length,
+			      struct tdb_record *rec, tdb_off_t *rec_ptr)
+{
+	uint32_t first = group * tdb->header.free_classes;
+	uint32_t list, last = bestfit ? from : tdb->header.free_classes - 1;
+	tdb_off_t last_ptr;
+	int lock = TDB_FREE_LIST_LOCK(tdb, first);
+
+	*rec_ptr = 0;
+
+	/* skip groups with nothing for us before taking the lock */
+	for (list = first + from; list <= first + last; list++) {
+		if (tdb_ofs_read(tdb, TDB_FREE_LIST_TOP(tdb, list), rec_ptr) == -1) {
+			return -1;
+		}
+		if (*rec_ptr != 0) {
+			break;
+		}
+	}
+	if (*rec_ptr == 0) {
+		return 0;
+	}
+
+	if (tdb_lock(tdb, lock, F_WRLCK) == -1) {
+		return -1;
+	}
+
+	for (*rec_ptr = 0; list <= first + last; list++) {
+		last_ptr = TDB_FREE_LIST_TOP(tdb, list);
+		if (bestfit) {
+			if (tdb_free_bestfit(tdb, last_ptr, length, rec,
+					     rec_ptr, &last_ptr) == -1) {
+				goto fail;
+			}
+		} else {
+			if (tdb_ofs_read(tdb, last_ptr, rec_ptr) == -1) {
+				goto fail;
+			}
+			if (*rec_ptr != 0 &&
+			    tdb_rec_free_read(tdb, *rec_ptr, rec) == -1) {
+				goto fail;
+			}
+		}
+		if (*rec_ptr != 0) {
+			*rec_ptr = tdb_allocate_ofs(tdb, length, *rec_ptr,
+						    rec, last_ptr);
+			if (*rec_ptr == 0) {
+				goto fail;
+			}
+			break;
 		}
+	}
+
+	tdb_unlock(tdb, lock, F_WRLCK);
+	return 0;
+
+ fail:
+	tdb_unlock(tdb, lock, F_WRLCK);
+	return -1;
+}
+
+/*
+  tdb_allocate() for a tdb with a free list table: O(1) from the head of
+  a list of records all big enough for us, preferring the group of our
+  hash chain so that writers to other chains don't contend with us
+ */
+static tdb_off_t tdb_allocate_table(struct tdb_context *tdb, uint32_t hash,
+				    tdb_len_t length, struct tdb_record *rec)
+{
+	uint32_t group = BUCKET(hash) % tdb->header.free_groups;
+	uint32_t fit, i;
+	tdb_off_t rec_ptr;
+
+	/* the first class whose records are all at least length long */
+	fit = tdb_free_class(tdb, length - 1) + 1;
+
+ again:
+	if (fit < tdb->header.free_classes) {
+		for (i = 0; i < tdb->header.free_groups; i++) {
+			if (tdb_allocate_group(
+				    tdb, (group + i) % tdb->header.free_groups,
+				    fit, false, length, rec, &rec_ptr) == -1) {
+				return 0;
+			}
+			if (rec_ptr != 0) {
+				return rec_ptr;
+			}
+		}
+	}
+
+	/* the class below holds records which might be big enough */
+	for (i = 0; i < tdb->header.free_groups; i++) {
+		if (tdb_allocate_group(
+			    tdb, (group + i) % tdb->header.free_groups,
+			    fit - 1, true, length, rec, &rec_ptr) == -1) {
+			return 0;
+		}
+		if (rec_ptr != 0) {
+			return rec_ptr;
+		}
+	}
+
+	/* we didn't find enough space. See if we can expand the
+	   database and if we can then try again */
+	if (tdb_expand(tdb, length + sizeof(*rec)) == 0)
+		goto again;
+
+	return 0;
+}
 
-		newrec_ptr = tdb_allocate_ofs(tdb, length, bestfit.rec_ptr, 
-					      rec, bestfit.last_ptr);
+/* allocate some space from the free list. The offset returned points
+   to a unconnected tdb_record within the database with room for at
+   least length bytes of total data, to be linked into chain hash
+
+   0 is returned if the space could not be allocated
+ */
+tdb_off_t tdb_allocate(struct tdb_context *tdb, uint32_t hash, tdb_len_t length,
+		       struct tdb_record *rec)
+{
+	tdb_off_t newrec_ptr, bestfit_ptr, bestfit_last;
+
+	/* over-allocate to reduce fragmentation */
+	length *= 1.25;
+
+	/* Extra bytes required for tailer */
+	length += sizeof(tdb_off_t);
+	length = TDB_ALIGN(length, TDB_ALIGNMENT);
+
+	if (tdb->header.free_classes) {
+		return tdb_allocate_table(tdb, hash, length, rec);
+	}
+
+	if (tdb_lock(tdb, -1, F_WRLCK) == -1)
+		return 0;
+
+ again:
+	if (tdb_free_bestfit(tdb, FREELIST_TOP, length, rec,
+			     &bestfit_ptr, &bestfit_last) == -1) {
+		goto fail;
+	}
+
+	if (bestfit_ptr != 0) {
+		newrec_ptr = tdb_allocate_ofs(tdb, length, bestfit_ptr, 
+					      rec, bestfit_last);
 		tdb_unlock(tdb, -1, F_WRLCK);
 		return newrec_ptr;
 	}
@@ -370,17 +715,20 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 int tdb_freelist_size(struct tdb_context *tdb)
 {
 	tdb_off_t ptr;
+	uint32_t i;
 	int count=0;
 
-	if (tdb_lock(tdb, -1, F_RDLCK) == -1) {
-		return -1;
-	}
+	for (i = 0; i < TDB_FREE_LISTS(tdb); i++) {
+		if (tdb_lock(tdb, TDB_FREE_LIST_LOCK(tdb, i), F_RDLCK) == -1) {
+			return -1;
+		}
 
-	ptr = FREELIST_TOP;
-	while (tdb_ofs_read(tdb, ptr, &ptr) == 0 && ptr != 0) {
-		count++;
-	}
+		ptr = TDB_FREE_LIST_TOP(tdb, i);
+		while (tdb_ofs_read(tdb, ptr, &ptr) == 0 && ptr != 0) {
+			count++;
+		}
 
-	tdb_unlock(tdb, -1, F_RDLCK);
+		tdb_unlock(tdb, TDB_FREE_LIST_LOCK(tdb, i), F_RDLCK);
+	}
 	return count;
 }
@@ -43,29 +43,23 @@ static int seen_insert(struct tdb_context *mem_tdb, tdb_off_t rec_ptr)
 	return tdb_store(mem_tdb, key, data, TDB_INSERT);
 }
 
-int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
+/* walk one free list, recording each record in mem_tdb */
+static int tdb_validate_list(struct tdb_context *tdb,
+			     struct tdb_context *mem_tdb, uint32_t list,
+			     int *pnum_entries)
 {
-	struct tdb_context *mem_tdb = NULL;
 	struct tdb_record rec;
 	tdb_off_t rec_ptr, last_ptr;
+	int lock = TDB_FREE_LIST_LOCK(tdb, list);
 	int ret = -1;
 
-	*pnum_entries = 0;
-
-	mem_tdb = tdb_open("flval", tdb->header.hash_size,
-				TDB_INTERNAL, O_RDWR, 0600);
-	if (!mem_tdb) {
-		return -1;
-	}
-
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
-		tdb_close(mem_tdb);
+	if (tdb_lock(tdb, lock, F_WRLCK) == -1) {
 		return 0;
 	}
 
-	last_ptr = FREELIST_TOP;
+	last_ptr = TDB_FREE_LIST_TOP(tdb, list);
 
-	/* Store the FREELIST_TOP record. */
+	/* Store the list top record. */
 	if (seen_insert(mem_tdb, last_ptr) == -1) {
 		tdb->ecode = TDB_ERR_CORRUPT;
 		ret = -1;
@@ -73,7 +67,7 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 	}
 
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1) {
+	if (tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1) {
 		goto fail;
 	}
 
@@ -93,6 +87,13 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 			goto fail;
 		}
 
+		/* a record in a free list table knows its list */
+		if (tdb->header.free_classes && rec.key_len != list) {
+			tdb->ecode = TDB_ERR_CORRUPT;
+			ret = -1;
+			goto fail;
+		}
+
 		/* move to the next record */
 		last_ptr = rec_ptr;
 		rec_ptr = rec.next;
@@ -103,7 +104,28 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 
   fail:
 
+	tdb_unlock(tdb, lock, F_WRLCK);
+	return ret;
+}
+
+int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
+{
+	struct tdb_context *mem_tdb = NULL;
+	uint32_t i;
+	int ret = 0;
+
+	*pnum_entries = 0;
+
+	mem_tdb = tdb_open("flval", tdb->header.hash_size,
+				TDB_INTERNAL, O_RDWR, 0600);
+	if (!mem_tdb) {
+		return -1;
+	}
+
+	for (i = 0; ret == 0 && i < TDB_FREE_LISTS(tdb); i++) {
+		ret = tdb_validate_list(tdb, mem_tdb, i, pnum_entries);
+	}
+
 	tdb_close(mem_tdb);
-	tdb_unlock(tdb, -1, F_WRLCK);
 	return ret;
 }
@@ -351,12 +351,32 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 		tdb_mmap(tdb);
 	}
 
+	offset = tdb->map_size - size;
+
+	/* with a free list table, give each group a share of the new
+	   space. Free them from the end, so that each piece finds
+	   padding on its left rather than a free record to merge with */
+	if (tdb->header.free_classes) {
+		tdb_off_t piece = (size / tdb->header.free_groups)
+			& ~(TDB_ALIGNMENT-1);
+		uint32_t g;
+
+		for (g = tdb->header.free_groups - 1;
+		     g > 0 && piece > 2 * sizeof(rec); g--) {
+			memset(&rec,'\0',sizeof(rec));
+			rec.rec_len = piece - sizeof(rec);
+			rec.full_hash = g;
+			size -= piece;
+			if (tdb_free(tdb, offset + size, &rec) == -1)
+				goto fail;
+		}
+	}
+
 	/* form a new freelist record */
 	memset(&rec,'\0',sizeof(rec));
 	rec.rec_len = size - sizeof(rec);
 
 	/* link it into the free list */
-	offset = tdb->map_size - size;
 	if (tdb_free(tdb, offset, &rec) == -1)
 		goto fail;
 
@@ -136,7 +136,8 @@ static int _tdb_lock(struct tdb_context *tdb, int list, int ltype, int op)
 		return -1;
 	}
 
-	if (list < -1 || list >= (int)tdb->header.hash_size) {
+	if (list < -1 - (int)tdb->header.free_groups ||
+	    list >= (int)tdb->header.hash_size) {
 		tdb->ecode = TDB_ERR_LOCK;
 		TDB_LOG((tdb, TDB_DEBUG_ERROR,"tdb_lock: invalid list %d for ltype=%d\n", 
 			   list, ltype));
@@ -237,7 +238,8 @@ int tdb_unlock(struct tdb_context *tdb, int list, int ltype)
 		return 0;
 
 	/* Sanity checks */
-	if (list < -1 || list >= (int)tdb->header.hash_size) {
+	if (list < -1 - (int)tdb->header.free_groups ||
+	    list >= (int)tdb->header.hash_size) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_unlock: list %d invalid (%d)\n", list, tdb->header.hash_size));
 		return ret;
 	}
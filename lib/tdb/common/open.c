@@ -31,30 +31,84 @@
 static struct tdb_context *tdbs = NULL;
 
 
-/* This is based on the hash algorithm from gdbm */
-static unsigned int default_tdb_hash(TDB_DATA *key)
+/* the values stored in the header identify the hash function, so that
+   a database is never opened with a hash other than the one that
+   created it */
+static void tdb_header_hash(struct tdb_context *tdb,
+			    uint32_t *magic1_hash, uint32_t *magic2_hash)
 {
-	uint32_t value;	/* Used to compute the hash value.  */
-	uint32_t   i;	/* Used to cycle through random values. */
+	TDB_DATA hash_key;
 
-	/* Set the initial value from the key size. */
-	for (value = 0x238F13AF * key->dsize, i=0; i < key->dsize; i++)
-		value = (value + (key->dptr[i] << (i*5 % 24)));
+	hash_key.dptr = discard_const_p(unsigned char, TDB_MAGIC_FOOD);
+	hash_key.dsize = sizeof(TDB_MAGIC_FOOD);
+	*magic1_hash = tdb->hash_fn(&hash_key);
 
-	return (1103515243 * value + 12345);  
+	hash_key.dptr = discard_const_p(unsigned char, TDB_HASH_MAGIC_KEY);
+	hash_key.dsize = sizeof(TDB_HASH_MAGIC_KEY);
+	*magic2_hash = tdb->hash_fn(&hash_key);
+
+	/* both zero means "written before hashes were recorded" */
+	if (*magic1_hash == 0 && *magic2_hash == 0) {
+		*magic1_hash = 1;
+	}
+}
+
+/* check the header against our hash function. If the caller didn't
+   ask for a particular hash, try the other builtin one as well */
+static bool tdb_check_header_hash(struct tdb_context *tdb, bool default_hash)
+{
+	uint32_t magic1, magic2;
+
+	tdb_header_hash(tdb, &magic1, &magic2);
+	if (tdb->header.magic1_hash == magic1 &&
+	    tdb->header.magic2_hash == magic2) {
+		return true;
+	}
+	if (!default_hash) {
+		return false;
+	}
+	if (tdb->hash_fn == tdb_old_hash) {
+		tdb->hash_fn = tdb_jenkins_hash;
+	} else {
+		tdb->hash_fn = tdb_old_hash;
+	}
+	return tdb_check_header_hash(tdb, false);
 }
 
+/* check the feature flags and the free list table layout they imply */
+static bool tdb_check_header_features(struct tdb_context *tdb)
+{
+	if (tdb->header.feature_flags & ~TDB_FEATURE_ALL) {
+		return false;
+	}
+	if (!(tdb->header.feature_flags & TDB_FEATURE_FREE_CLASSES)) {
+		return tdb->header.free_groups == 0 &&
+			tdb->header.free_classes == 0;
+	}
+	return tdb->header.free_groups >= 1 &&
+		tdb->header.free_groups <= TDB_FREE_GROUPS_MAX &&
+		tdb->header.free_groups <= tdb->header.hash_size &&
+		tdb->header.free_classes >= 1 &&
+		tdb->header.free_classes <= TDB_FREE_CLASSES_MAX;
+}
 
 /* initialise a new database with a specified hash size */
 static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 {
 	struct tdb_header *newdb;
 	size_t size;
+	uint32_t free_groups = 0, free_classes = 0;
 	int ret = -1;
 	ssize_t written;
 
+	if (tdb->flags & TDB_SEGREGATED_FREELIST) {
+		free_groups = MIN(TDB_FREE_GROUPS, hash_size);
+		free_classes = TDB_FREE_CLASSES;
+	}
+
 	/* We make it up in memory, then write it out if not internal */
-	size = sizeof(struct tdb_header) + (hash_size+1)*sizeof(tdb_off_t);
+	size = sizeof(struct tdb_header) + (hash_size+1)*sizeof(tdb_off_t)
+		+ free_groups*free_classes*sizeof(tdb_off_t);
 	if (!(newdb = (struct tdb_header *)calloc(size, 1))) {
 		tdb->ecode = TDB_ERR_OOM;
 		return -1;
@@ -63,6 +117,20 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	/* Fill in the header */
 	newdb->version = TDB_VERSION;
 	newdb->hash_size = hash_size;
+	tdb_header_hash(tdb, &newdb->magic1_hash, &newdb->magic2_hash);
+	/* stop versions of tdb which don't check the header hashes
+	   from opening a database they would hash wrongly */
+	if (tdb->hash_fn != tdb_old_hash) {
+		newdb->rwlocks = TDB_HASH_RWLOCK_MAGIC;
+	}
+	/* and versions which don't know the feature flags from opening
+	   one whose layout they don't understand */
+	if (free_classes) {
+		newdb->feature_flags = TDB_FEATURE_FREE_CLASSES;
+		newdb->free_groups = free_groups;
+		newdb->free_classes = free_classes;
+		newdb->rwlocks = TDB_FEATURE_RWLOCK_MAGIC;
+	}
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->map_size = size;
 		tdb->map_ptr = (char *)newdb;
@@ -176,7 +244,13 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		tdb->log.log_fn = null_log_fn;
 		tdb->log.log_private = NULL;
 	}
-	tdb->hash_fn = hash_fn ? hash_fn : default_tdb_hash;
+	if (hash_fn) {
+		tdb->hash_fn = hash_fn;
+	} else if (tdb_flags & TDB_INCOMPATIBLE_HASH) {
+		tdb->hash_fn = tdb_jenkins_hash;
+	} else {
+		tdb->hash_fn = tdb_old_hash;
+	}
 
 	/* cache the page size */
 	tdb->page_size = getpagesize();
@@ -289,11 +363,55 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 	if (fstat(tdb->fd, &st) == -1)
 		goto fail;
 
-	if (tdb->header.rwlocks != 0) {
+	if (tdb->header.rwlocks != 0 &&
+	    tdb->header.rwlocks != TDB_HASH_RWLOCK_MAGIC &&
+	    tdb->header.rwlocks != TDB_FEATURE_RWLOCK_MAGIC) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: spinlocks no longer supported\n"));
 		goto fail;
 	}
 
+	if (tdb->header.rwlocks != TDB_FEATURE_RWLOCK_MAGIC) {
+		/* written by a version which left these reserved */
+		tdb->header.feature_flags = 0;
+		tdb->header.free_groups = 0;
+		tdb->header.free_classes = 0;
+	}
+
+	if (!tdb_check_header_features(tdb)) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			 "%s uses features (0x%x) we don't support\n",
+			 name, tdb->header.feature_flags));
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if (tdb->header.magic1_hash == 0 && tdb->header.magic2_hash == 0) {
+		/* older tdb without the hash recorded: it can only
+		 * have been created with the old default, or with a
+		 * hash the caller supplies again */
+		if (!hash_fn) {
+			tdb->hash_fn = tdb_old_hash;
+		}
+	} else if (!tdb_check_header_hash(tdb, !hash_fn)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_open_ex: "
+			 "%s was not created with the hash function we are "
+			 "using\n", name));
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if (tdb->hash_fn == tdb_jenkins_hash) {
+		tdb->flags |= TDB_INCOMPATIBLE_HASH;
+	} else {
+		tdb->flags &= ~TDB_INCOMPATIBLE_HASH;
+	}
+
+	if (tdb->header.free_classes) {
+		tdb->flags |= TDB_SEGREGATED_FREELIST;
+	} else {
+		tdb->flags &= ~TDB_SEGREGATED_FREELIST;
+	}
+
 	/* Is it already in the open list?  If so, fail. */
 	if (tdb_already_open(st.st_dev, st.st_ino)) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
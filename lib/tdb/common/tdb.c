@@ -344,7 +344,7 @@ static int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash)
 	struct tdb_record rec;
 	tdb_off_t rec_ptr;
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+	if (tdb_lock_freelist(tdb) == -1) {
 		return -1;
 	}
 	
@@ -369,7 +369,7 @@ static int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash)
 	}
 	res = 0;
  fail:
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_freelist(tdb);
 	return res;
 }
 
@@ -544,20 +544,20 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 	 * the hash chain under the freelist lock.
 	 */
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+	if (tdb_lock_freelist(tdb) == -1) {
 		goto fail;
 	}
 
 	if ((tdb->max_dead_records != 0)
 	    && (tdb_purge_dead(tdb, hash) == -1)) {
-		tdb_unlock(tdb, -1, F_WRLCK);
+		tdb_unlock_freelist(tdb);
 		goto fail;
 	}
 
 	/* we have to allocate some space */
-	rec_ptr = tdb_allocate(tdb, key.dsize + dbuf.dsize, &rec);
+	rec_ptr = tdb_allocate(tdb, hash, key.dsize + dbuf.dsize, &rec);
 
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_freelist(tdb);
 
 	if (rec_ptr == 0) {
 		goto fail;
@@ -849,18 +849,20 @@ int tdb_wipe_all(struct tdb_context *tdb)
 		}
 	}
 
-	/* wipe the freelist */
-	if (tdb_ofs_write(tdb, FREELIST_TOP, &offset) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write freelist\n"));
-		goto failed;
+	/* wipe the freelists */
+	for (i=0;i<TDB_FREE_LISTS(tdb);i++) {
+		if (tdb_ofs_write(tdb, TDB_FREE_LIST_TOP(tdb, i), &offset) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write freelist %d\n", i));
+			goto failed;
+		}
 	}
 
 	/* add all the rest of the file to the freelist, possibly leaving a gap 
 	   for the recovery area */
 	if (recovery_size == 0) {
 		/* the simple case - the whole file can be used as a freelist */
-		data_len = (tdb->map_size - TDB_DATA_START(tdb->header.hash_size));
-		if (tdb_free_region(tdb, TDB_DATA_START(tdb->header.hash_size), data_len) != 0) {
+		data_len = (tdb->map_size - TDB_DATA_START(tdb));
+		if (tdb_free_region(tdb, TDB_DATA_START(tdb), data_len) != 0) {
 			goto failed;
 		}
 	} else {
@@ -872,8 +874,8 @@ int tdb_wipe_all(struct tdb_context *tdb)
 		   move the recovery area or we risk subtle data
 		   corruption
 		*/
-		data_len = (recovery_head - TDB_DATA_START(tdb->header.hash_size));
-		if (tdb_free_region(tdb, TDB_DATA_START(tdb->header.hash_size), data_len) != 0) {
+		data_len = (recovery_head - TDB_DATA_START(tdb));
+		if (tdb_free_region(tdb, TDB_DATA_START(tdb), data_len) != 0) {
 			goto failed;
 		}
 		/* and the 2nd free list entry after the recovery area - if any */
@@ -44,11 +44,20 @@ typedef uint32_t tdb_off_t;
 #endif
 
 #define TDB_MAGIC_FOOD "TDB file\n"
+#define TDB_HASH_MAGIC_KEY "TDB hash\n"
 #define TDB_VERSION (0x26011967 + 6)
 #define TDB_MAGIC (0x26011999U)
 #define TDB_FREE_MAGIC (~TDB_MAGIC)
 #define TDB_DEAD_MAGIC (0xFEE1DEAD)
 #define TDB_RECOVERY_MAGIC (0xf53bc0e7U)
+#define TDB_HASH_RWLOCK_MAGIC (0xbad1a51U)
+#define TDB_FEATURE_RWLOCK_MAGIC (0xbad1a52U)
+#define TDB_FEATURE_FREE_CLASSES 0x1
+#define TDB_FEATURE_ALL (TDB_FEATURE_FREE_CLASSES)
+#define TDB_FREE_GROUPS 8
+#define TDB_FREE_GROUPS_MAX 32 /* their locks must fit below FREELIST_TOP */
+#define TDB_FREE_CLASSES 16
+#define TDB_FREE_CLASSES_MAX 32
 #define TDB_ALIGNMENT 4
 #define DEFAULT_HASH_SIZE 131
 #define FREELIST_TOP (sizeof(struct tdb_header))
@@ -58,7 +67,15 @@ typedef uint32_t tdb_off_t;
 #define TDB_BAD_MAGIC(r) ((r)->magic != TDB_MAGIC && !TDB_DEAD(r))
 #define TDB_HASH_TOP(hash) (FREELIST_TOP + (BUCKET(hash)+1)*sizeof(tdb_off_t))
 #define TDB_HASHTABLE_SIZE(tdb) ((tdb->header.hash_size+1)*sizeof(tdb_off_t))
-#define TDB_DATA_START(hash_size) (TDB_HASH_TOP(hash_size-1) + sizeof(tdb_off_t))
+#define TDB_FREETABLE_TOP(tdb) (TDB_HASH_TOP(tdb->header.hash_size-1) + sizeof(tdb_off_t))
+#define TDB_FREETABLE_SIZE(tdb) (tdb->header.free_groups*tdb->header.free_classes*sizeof(tdb_off_t))
+#define TDB_DATA_START(tdb) (TDB_FREETABLE_TOP(tdb) + TDB_FREETABLE_SIZE(tdb))
+/* a tdb has either the single freelist at FREELIST_TOP, locked by list
+   -1, or a table of free lists after the hash table: one per size
+   class in each group, each group locked by list -2-group */
+#define TDB_FREE_LISTS(tdb) (tdb->header.free_classes ? tdb->header.free_groups*tdb->header.free_classes : 1)
+#define TDB_FREE_LIST_TOP(tdb, list) (tdb->header.free_classes ? TDB_FREETABLE_TOP(tdb) + (list)*sizeof(tdb_off_t) : FREELIST_TOP)
+#define TDB_FREE_LIST_LOCK(tdb, list) (tdb->header.free_classes ? -2 - (int)((list) / tdb->header.free_classes) : -1)
 #define TDB_RECOVERY_HEAD offsetof(struct tdb_header, recovery_start)
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
 #define TDB_PAD_BYTE 0x42
@@ -121,7 +138,8 @@ void tdb_trace_2rec_retrec(struct tdb_context *tdb, const char *op,
 struct tdb_record {
 	tdb_off_t next; /* offset of the next record in the list */
 	tdb_len_t rec_len; /* total byte length of record */
-	tdb_len_t key_len; /* byte length of key */
+	tdb_len_t key_len; /* byte length of key (or, for a free record
+			      in a free list table, the list it is on) */
 	tdb_len_t data_len; /* byte length of data */
 	uint32_t full_hash; /* the full 32 bit hash of the key */
 	uint32_t magic;   /* try to catch errors */
@@ -143,10 +161,17 @@ struct tdb_header {
 	char magic_food[32]; /* for /etc/magic */
 	uint32_t version; /* version of the code */
 	uint32_t hash_size; /* number of hash entries */
-	tdb_off_t rwlocks; /* obsolete - kept to detect old formats */
+	tdb_off_t rwlocks; /* obsolete - kept to detect old formats, and
+			      TDB_HASH_RWLOCK_MAGIC for a non-default hash or
+			      TDB_FEATURE_RWLOCK_MAGIC if feature_flags is set */
 	tdb_off_t recovery_start; /* offset of transaction recovery region */
 	tdb_off_t sequence_number; /* used when TDB_SEQNUM is set */
-	tdb_off_t reserved[29];
+	uint32_t magic1_hash; /* hash of TDB_MAGIC_FOOD */
+	uint32_t magic2_hash; /* hash of TDB_HASH_MAGIC_KEY */
+	uint32_t feature_flags; /* TDB_FEATURE_* */
+	uint32_t free_groups; /* free list table layout, with */
+	uint32_t free_classes; /*   TDB_FEATURE_FREE_CLASSES */
+	tdb_off_t reserved[24];
 };
 
 struct tdb_lock_type {
@@ -224,7 +249,10 @@ int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 void *tdb_convert(void *buf, uint32_t size);
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec);
-tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec);
+tdb_off_t tdb_allocate(struct tdb_context *tdb, uint32_t hash, tdb_len_t length,
+		       struct tdb_record *rec);
+int tdb_lock_freelist(struct tdb_context *tdb);
+int tdb_unlock_freelist(struct tdb_context *tdb);
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_lock_record(struct tdb_context *tdb, tdb_off_t off);
@@ -50,6 +50,8 @@ extern "C" {
 #define TDB_VOLATILE   256 /* Activate the per-hashchain freelist, default 5 */
 #define TDB_ALLOW_NESTING 512 /* Allow transactions to nest */
 #define TDB_DISALLOW_NESTING 1024 /* Disallow transactions to nest */
+#define TDB_INCOMPATIBLE_HASH 2048 /* Create with the Jenkins hash; older tdb versions can't open it */
+#define TDB_SEGREGATED_FREELIST 4096 /* Create with a free list per size class and lock group; older tdb versions can't open it */
 
 /* error codes */
 enum TDB_ERROR {TDB_SUCCESS=0, TDB_ERR_CORRUPT, TDB_ERR_IO, TDB_ERR_LOCK, 
@@ -145,6 +147,8 @@ void tdb_increment_seqnum_nonblock(struct tdb_context *tdb);
 int tdb_check(struct tdb_context *tdb,
 	      int (*check)(TDB_DATA key, TDB_DATA data, void *private_data),
 	      void *private_data);
+unsigned int tdb_jenkins_hash(TDB_DATA *key);
+unsigned int tdb_old_hash(TDB_DATA *key);
 
 /* Low level locking functions: use with care */
 int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key);
@@ -166,6 +170,7 @@ void tdb_dump_all(struct tdb_context *tdb);
 int tdb_printfreelist(struct tdb_context *tdb);
 int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries);
 int tdb_freelist_size(struct tdb_context *tdb);
+int tdb_hash_chain_lengths(struct tdb_context *tdb, uint32_t *lengths);
 
 extern TDB_DATA tdb_null;
 
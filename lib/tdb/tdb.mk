@@ -2,7 +2,7 @@ dirs::
 	@mkdir -p bin common tools
 
 PROGS = bin/tdbtool$(EXEEXT) bin/tdbdump$(EXEEXT) bin/tdbbackup$(EXEEXT)
-PROGS_NOINSTALL = bin/tdbtest$(EXEEXT) bin/tdbtorture$(EXEEXT)
+PROGS_NOINSTALL = bin/tdbtest$(EXEEXT) bin/tdbtorture$(EXEEXT) bin/tdbhashbench$(EXEEXT)
 ALL_PROGS = $(PROGS) $(PROGS_NOINSTALL)
 
 TDB_SONAME = libtdb.$(SHLIBEXT).1
@@ -20,6 +20,9 @@ bin/tdbtool$(EXEEXT): tools/tdbtool.o $(TDB_LIB)
 bin/tdbtorture$(EXEEXT): tools/tdbtorture.o $(TDB_LIB)
 	$(CC) $(CFLAGS) $(LDFLAGS) -o bin/tdbtorture tools/tdbtorture.o -L. -ltdb
 
+bin/tdbhashbench$(EXEEXT): tools/tdbhashbench.o $(TDB_LIB)
+	$(CC) $(CFLAGS) $(LDFLAGS) -o bin/tdbhashbench tools/tdbhashbench.o -L. -ltdb
+
 bin/tdbdump$(EXEEXT): tools/tdbdump.o $(TDB_LIB)
 	$(CC) $(CFLAGS) $(LDFLAGS) -o bin/tdbdump tools/tdbdump.o -L. -ltdb
 
@@ -30,13 +33,14 @@ test:: abi_checks
 
 test:: bin/tdbtorture$(EXEEXT) $(TDB_SONAME)
 	$(LIB_PATH_VAR)=. bin/tdbtorture$(EXEEXT)
+	$(LIB_PATH_VAR)=. bin/tdbtorture$(EXEEXT) -S -H 131
 
 abi_checks::
 	@echo ABI checks:
 	@./script/abi_checks.sh tdb include/tdb.h
 
 clean:: 
-	rm -f test.db test.tdb torture.tdb test.gdbm
+	rm -f test.db test.tdb torture.tdb hashbench.tdb test.gdbm
 	rm -f $(TDB_SONAME) $(TDB_SOLIB) $(TDB_STLIB) libtdb.$(SHLIBEXT)
 	rm -f $(ALL_PROGS) tdb.pc
 	rm -f tdb.exports.sort tdb.exports.check tdb.exports.check.sort
@@ -38,6 +38,12 @@
   don't need to be backed up, so you can optimise the above a little
   by only running the backup on the critical databases.
 
+  The backup keeps the hash function of the original unless -H is
+  given, so an existing database can be converted to the jenkins hash
+  (while it is not in use) with:
+     tdbbackup -H jenkins -s .new foo.tdb && mv foo.tdb.new foo.tdb
+  and likewise to the segregated free lists with -S.
+
  */
 
 #include "replace.h"
@@ -103,8 +109,14 @@ static int test_fn(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA dbuf, void *state)
   carefully backup a tdb, validating the contents and
   only doing the backup if its OK
   this function is also used for restore
+
+  hash_flags is TDB_INCOMPATIBLE_HASH or TDB_DEFAULT to choose the hash
+  of the new tdb, or -1 to keep the hash of the old one. extra_flags
+  are added to the flags of the new tdb, which keeps the free list
+  layout of the old one.
 */
-static int backup_tdb(const char *old_name, const char *new_name, int hash_size)
+static int backup_tdb(const char *old_name, const char *new_name,
+		      int hash_size, int hash_flags, int extra_flags)
 {
 	TDB_CONTEXT *tdb;
 	TDB_CONTEXT *tdb_new;
@@ -130,11 +142,17 @@ static int backup_tdb(const char *old_name, const char *new_name, int hash_size)
 		return 1;
 	}
 
+	if (hash_flags == -1) {
+		hash_flags = tdb_get_flags(tdb) & TDB_INCOMPATIBLE_HASH;
+	}
+	hash_flags |= extra_flags |
+		(tdb_get_flags(tdb) & TDB_SEGREGATED_FREELIST);
+
 	/* create the new tdb */
 	unlink(tmp_name);
 	tdb_new = tdb_open_ex(tmp_name, 
 			      hash_size ? hash_size : tdb_hash_size(tdb), 
-			      TDB_DEFAULT, 
+			      hash_flags, 
 			      O_RDWR|O_CREAT|O_EXCL, st.st_mode & 0777, 
 			      &log_ctx, NULL);
 	if (!tdb_new) {
@@ -244,7 +262,7 @@ static int verify_tdb(const char *fname, const char *bak_name)
 	/* count is < 0 means an error */
 	if (count < 0) {
 		printf("restoring %s\n", fname);
-		return backup_tdb(bak_name, fname, 0);
+		return backup_tdb(bak_name, fname, 0, -1, 0);
 	}
 
 	printf("%s : %d records\n", fname, count);
@@ -274,6 +292,9 @@ static void usage(void)
 	printf("   -s suffix     set the backup suffix\n");
 	printf("   -v            verify mode (restore if corrupt)\n");
 	printf("   -n hashsize   set the new hash size for the backup\n");
+	printf("   -H hash       set the hash function for the backup\n");
+	printf("                 (\"jenkins\" or \"old\", default: keep)\n");
+	printf("   -S            use segregated free lists for the backup\n");
 }
 		
 
@@ -284,11 +305,13 @@ static void usage(void)
 	int c;
 	int verify = 0;
 	int hashsize = 0;
+	int hashflags = -1;
+	int extraflags = 0;
 	const char *suffix = ".bak";
 
 	log_ctx.log_fn = tdb_log;
 
-	while ((c = getopt(argc, argv, "vhs:n:")) != -1) {
+	while ((c = getopt(argc, argv, "vhs:n:H:S")) != -1) {
 		switch (c) {
 		case 'h':
 			usage();
@@ -302,6 +325,19 @@ static void usage(void)
 		case 'n':
 			hashsize = atoi(optarg);
 			break;
+		case 'H':
+			if (strcmp(optarg, "jenkins") == 0) {
+				hashflags = TDB_INCOMPATIBLE_HASH;
+			} else if (strcmp(optarg, "old") == 0) {
+				hashflags = TDB_DEFAULT;
+			} else {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'S':
+			extraflags |= TDB_SEGREGATED_FREELIST;
+			break;
 		}
 	}
 
@@ -325,7 +361,8 @@ static void usage(void)
 			}
 		} else {
 			if (file_newer(fname, bak_name) &&
-			    backup_tdb(fname, bak_name, hashsize) != 0) {
+			    backup_tdb(fname, bak_name, hashsize, hashflags,
+				       extraflags) != 0) {
 				ret = 1;
 			}
 		}
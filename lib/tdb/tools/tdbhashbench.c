@@ -0,0 +1,280 @@
+/* compare the old (gdbm) tdb hash with the jenkins hash: load a key set
+   into a tdb with each hash, then report the hash chain length
+   distribution and the fetch throughput.
+
+   The keys come from the tdbs named on the command line (a real key
+   set, e.g. idmap.tdb or a sam.ldb partition), or, with no arguments,
+   from synthetic SID, DN and idmap shaped keys.
+*/
+
+#include "replace.h"
+#include "system/time.h"
+#include "system/filesys.h"
+#include "tdb.h"
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#define BENCH_NAME "hashbench.tdb"
+
+struct keyset {
+	const char *name;
+	TDB_DATA *keys;
+	unsigned int num, alloc;
+};
+
+static int hash_size = 10000;
+static double timelimit = 1.0;
+
+static struct timeval tp1,tp2;
+
+static void _start_timer(void)
+{
+	gettimeofday(&tp1,NULL);
+}
+
+static double _end_timer(void)
+{
+	gettimeofday(&tp2,NULL);
+	return((tp2.tv_sec - tp1.tv_sec) +
+	       (tp2.tv_usec - tp1.tv_usec)*1.0e-6);
+}
+
+static void fatal(const char *why)
+{
+	perror(why);
+	exit(1);
+}
+
+static void add_key(struct keyset *ks, const void *p, size_t len)
+{
+	if (ks->num == ks->alloc) {
+		ks->alloc = ks->alloc ? ks->alloc * 2 : 1024;
+		ks->keys = (TDB_DATA *)realloc(ks->keys,
+					       ks->alloc * sizeof(TDB_DATA));
+		if (ks->keys == NULL) {
+			fatal("realloc");
+		}
+	}
+	ks->keys[ks->num].dptr = (unsigned char *)malloc(len);
+	if (ks->keys[ks->num].dptr == NULL) {
+		fatal("malloc");
+	}
+	memcpy(ks->keys[ks->num].dptr, p, len);
+	ks->keys[ks->num].dsize = len;
+	ks->num++;
+}
+
+static int load_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
+		   void *state)
+{
+	add_key((struct keyset *)state, key.dptr, key.dsize);
+	return 0;
+}
+
+static void load_tdb(struct keyset *ks, const char *fname)
+{
+	struct tdb_context *tdb;
+
+	tdb = tdb_open(fname, 0, 0, O_RDONLY, 0);
+	if (tdb == NULL) {
+		fatal(fname);
+	}
+	ks->name = fname;
+	if (tdb_traverse_read(tdb, load_fn, ks) == -1) {
+		fprintf(stderr, "failed to traverse %s\n", fname);
+		exit(1);
+	}
+	tdb_close(tdb);
+}
+
+/* the key shapes samba stores most: SIDs of one domain, LDAP DNs
+   differing in one component and idmap entries */
+static void make_keys(struct keyset *ks, const char *shape, unsigned int num)
+{
+	char buf[128];
+	unsigned int i;
+	int len;
+
+	ks->name = shape;
+	for (i = 0; i < num; i++) {
+		if (strcmp(shape, "sid") == 0) {
+			len = snprintf(buf, sizeof(buf),
+				       "S-1-5-21-3623811015-3361044348-30300820-%u",
+				       1000 + i);
+		} else if (strcmp(shape, "dn") == 0) {
+			len = snprintf(buf, sizeof(buf),
+				       "DN=CN=USER%u,CN=USERS,DC=SAMBA,DC=EXAMPLE,DC=COM",
+				       i);
+		} else {
+			len = snprintf(buf, sizeof(buf), "UID %u", 10000 + i);
+		}
+		/* samba stores these with the terminating nul */
+		add_key(ks, buf, len + 1);
+	}
+}
+
+static void bench_hash(struct keyset *ks, const char *hash_name,
+		       int hash_flags, tdb_hash_func hash_fn)
+{
+	struct tdb_context *tdb;
+	TDB_DATA data;
+	uint32_t *lengths;
+	unsigned int i, used = 0, longest = 0, acc = 0;
+	unsigned int hist[6];
+	double probes = 0, t;
+	unsigned long ops;
+
+	unlink(BENCH_NAME);
+	tdb = tdb_open(BENCH_NAME, hash_size,
+		       TDB_NOLOCK | TDB_NOSYNC | hash_flags,
+		       O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (tdb == NULL) {
+		fatal(BENCH_NAME);
+	}
+
+	data.dptr = (unsigned char *)"x";
+	data.dsize = 1;
+	for (i = 0; i < ks->num; i++) {
+		if (tdb_store(tdb, ks->keys[i], data, TDB_REPLACE) != 0) {
+			fprintf(stderr, "store failed: %s\n",
+				tdb_errorstr(tdb));
+			exit(1);
+		}
+	}
+
+	lengths = (uint32_t *)malloc(hash_size * sizeof(uint32_t));
+	if (lengths == NULL) {
+		fatal("malloc");
+	}
+	if (tdb_hash_chain_lengths(tdb, lengths) != 0) {
+		fprintf(stderr, "chain walk failed: %s\n", tdb_errorstr(tdb));
+		exit(1);
+	}
+
+	/* chains of 0, 1, 2, 3-4, 5-8 and more than 8 records */
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < (unsigned int)hash_size; i++) {
+		uint32_t len = lengths[i];
+
+		if (len > 0) {
+			used++;
+		}
+		if (len > longest) {
+			longest = len;
+		}
+		/* finding the k'th record of a chain reads k records */
+		probes += (double)len * (len + 1) / 2;
+		hist[len <= 2 ? len : len <= 4 ? 3 : len <= 8 ? 4 : 5]++;
+	}
+	free(lengths);
+
+	printf("  %-8s chains used %u/%d, longest %u, "
+	       "records read per fetch %.2f\n",
+	       hash_name, used, hash_size, longest,
+	       ks->num ? probes / ks->num : 0.0);
+	printf("           chain length 0:%u 1:%u 2:%u 3-4:%u 5-8:%u >8:%u\n",
+	       hist[0], hist[1], hist[2], hist[3], hist[4], hist[5]);
+
+	ops = 0;
+	_start_timer();
+	do {
+		for (i = 0; i < ks->num; i++) {
+			data = tdb_fetch(tdb, ks->keys[i]);
+			if (data.dptr == NULL) {
+				fprintf(stderr, "fetch failed: %s\n",
+					tdb_errorstr(tdb));
+				exit(1);
+			}
+			free(data.dptr);
+		}
+		ops += ks->num;
+		t = _end_timer();
+	} while (t < timelimit);
+	printf("           fetch %10.0f ops/sec", ops / t);
+
+	ops = 0;
+	_start_timer();
+	do {
+		for (i = 0; i < ks->num; i++) {
+			acc += hash_fn(&ks->keys[i]);
+		}
+		ops += ks->num;
+		t = _end_timer();
+	} while (t < timelimit);
+	/* printing the hashes keeps the loop from being optimised away */
+	printf(", hash %10.0f ops/sec (sum %08x)\n", ops / t, acc);
+
+	tdb_close(tdb);
+	unlink(BENCH_NAME);
+}
+
+static void bench(struct keyset *ks)
+{
+	unsigned int i;
+
+	printf("%s: %u keys, hash size %d\n", ks->name, ks->num, hash_size);
+	bench_hash(ks, "old", TDB_DEFAULT, tdb_old_hash);
+	bench_hash(ks, "jenkins", TDB_INCOMPATIBLE_HASH, tdb_jenkins_hash);
+
+	for (i = 0; i < ks->num; i++) {
+		free(ks->keys[i].dptr);
+	}
+	free(ks->keys);
+	memset(ks, 0, sizeof(*ks));
+}
+
+static void usage(void)
+{
+	printf("Usage: tdbhashbench [-H HASH_SIZE] [-n NUM_KEYS] [-t SECONDS] [tdb...]\n");
+	exit(0);
+}
+
+ int main(int argc, char * const *argv)
+{
+	struct keyset ks;
+	unsigned int num_keys = 100000;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "H:n:t:h")) != -1) {
+		switch (c) {
+		case 'H':
+			hash_size = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_keys = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			timelimit = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (hash_size <= 0) {
+		usage();
+	}
+
+	memset(&ks, 0, sizeof(ks));
+
+	if (argc == 0) {
+		make_keys(&ks, "sid", num_keys);
+		bench(&ks);
+		make_keys(&ks, "dn", num_keys);
+		bench(&ks);
+		make_keys(&ks, "idmap", num_keys);
+		bench(&ks);
+		return 0;
+	}
+
+	for (i = 0; i < argc; i++) {
+		load_tdb(&ks, argv[i]);
+		bench(&ks);
+	}
+
+	return 0;
+}
@@ -185,7 +185,7 @@ static void help(void)
 {
 	printf("\n"
 "tdbtool: \n"
-"  create    dbname     : create a database\n"
+"  create    dbname [jenkins] : create a database [with the jenkins hash]\n"
 "  open      dbname     : open an existing database\n"
 "  transaction_start    : start a transaction\n"
 "  transaction_commit   : commit a transaction\n"
@@ -217,13 +217,25 @@ static void terror(const char *why)
 	printf("%s\n", why);
 }
 
-static void create_tdb(const char *tdbname)
+static void create_tdb(const char *tdbname, const char *hashname)
 {
 	struct tdb_logging_context log_ctx;
+	int hash_flags = 0;
 	log_ctx.log_fn = tdb_log;
 
+	if (hashname && *hashname == '\0') {
+		hashname = NULL;
+	}
+
+	if (hashname && strcmp(hashname, "jenkins") == 0) {
+		hash_flags = TDB_INCOMPATIBLE_HASH;
+	} else if (hashname) {
+		terror("unknown hash function");
+		return;
+	}
+
 	if (tdb) tdb_close(tdb);
-	tdb = tdb_open_ex(tdbname, 0, TDB_CLEAR_IF_FIRST | (disable_mmap?TDB_NOMMAP:0),
+	tdb = tdb_open_ex(tdbname, 0, TDB_CLEAR_IF_FIRST | hash_flags | (disable_mmap?TDB_NOMMAP:0),
 			  O_RDWR | O_CREAT | O_TRUNC, 0600, &log_ctx, NULL);
 	if (!tdb) {
 		printf("Could not create %s: %s\n", tdbname, strerror(errno));
@@ -410,11 +422,44 @@ static int traverse_fn(TDB_CONTEXT *the_tdb, TDB_DATA key, TDB_DATA dbuf, void *
 static void info_tdb(void)
 {
 	int count;
+	int i, hash_size, used = 0;
+	uint32_t *lengths, longest = 0, chained = 0;
+
 	total_bytes = 0;
-	if ((count = tdb_traverse(tdb, traverse_fn, NULL)) == -1)
+	if ((count = tdb_traverse(tdb, traverse_fn, NULL)) == -1) {
 		printf("Error = %s\n", tdb_errorstr(tdb));
-	else
-		printf("%d records totalling %d bytes\n", count, total_bytes);
+		return;
+	}
+	printf("%d records totalling %d bytes\n", count, total_bytes);
+
+	hash_size = tdb_hash_size(tdb);
+	lengths = (uint32_t *)malloc(hash_size * sizeof(uint32_t));
+	if (lengths == NULL) {
+		return;
+	}
+	if (tdb_hash_chain_lengths(tdb, lengths) == -1) {
+		printf("Error = %s\n", tdb_errorstr(tdb));
+		free(lengths);
+		return;
+	}
+	for (i = 0; i < hash_size; i++) {
+		if (lengths[i] > 0) {
+			used++;
+		}
+		chained += lengths[i];
+		if (lengths[i] > longest) {
+			longest = lengths[i];
+		}
+	}
+	printf("%s hash, %d of %d chains used, longest chain %u, "
+	       "average used chain %.2f\n",
+	       (tdb_get_flags(tdb) & TDB_INCOMPATIBLE_HASH) ? "jenkins" : "old",
+	       used, hash_size, (unsigned int)longest,
+	       used ? (double)chained / used : 0.0);
+	printf("%s freelist, %d free records\n",
+	       (tdb_get_flags(tdb) & TDB_SEGREGATED_FREELIST) ?
+	       "segregated" : "single", tdb_freelist_size(tdb));
+	free(lengths);
 }
 
 static void speed_tdb(const char *tlimit)
@@ -578,7 +623,7 @@ static int do_command(void)
 	switch (mycmd) {
 	case CMD_CREATE_TDB:
 		bIterate = 0;
-		create_tdb(arg1);
+		create_tdb(arg1, arg2);
 		return 0;
 	case CMD_OPEN_TDB:
 		bIterate = 0;
@@ -211,7 +211,7 @@ static int traverse_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 
 static void usage(void)
 {
-	printf("Usage: tdbtorture [-t] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
+	printf("Usage: tdbtorture [-t] [-S] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
 	exit(0);
 }
 
@@ -221,6 +221,7 @@ static void usage(void)
 	int num_procs = 3;
 	int num_loops = 5000;
 	int hash_size = 2;
+	int tdb_flags = TDB_CLEAR_IF_FIRST;
 	int c;
 	extern char *optarg;
 	pid_t *pids;
@@ -228,7 +229,7 @@ static void usage(void)
 	struct tdb_logging_context log_ctx;
 	log_ctx.log_fn = tdb_log;
 
-	while ((c = getopt(argc, argv, "n:l:s:H:th")) != -1) {
+	while ((c = getopt(argc, argv, "n:l:s:H:tSh")) != -1) {
 		switch (c) {
 		case 'n':
 			num_procs = strtol(optarg, NULL, 0);
@@ -245,6 +246,9 @@ static void usage(void)
 		case 't':
 			always_transaction = 1;
 			break;
+		case 'S':
+			tdb_flags |= TDB_SEGREGATED_FREELIST;
+			break;
 		default:
 			usage();
 		}
@@ -259,7 +263,7 @@ static void usage(void)
 		if ((pids[i+1]=fork()) == 0) break;
 	}
 
-	db = tdb_open_ex("torture.tdb", hash_size, TDB_CLEAR_IF_FIRST, 
+	db = tdb_open_ex("torture.tdb", hash_size, tdb_flags, 
 			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
 	if (!db) {
 		fatal("db open failed");
@@ -270,8 +274,9 @@ static void usage(void)
 	}
 
 	if (i == 0) {
-		printf("testing with %d processes, %d loops, %d hash_size, seed=%d%s\n",
-		       num_procs, num_loops, hash_size, seed, always_transaction ? " (all within transactions)" : "");
+		printf("testing with %d processes, %d loops, %d hash_size, seed=%d%s%s\n",
+		       num_procs, num_loops, hash_size, seed, always_transaction ? " (all within transactions)" : "",
+		       (tdb_flags & TDB_SEGREGATED_FREELIST) ? " (segregated freelist)" : "");
 	}
 
 	srand(seed + i);
@@ -30,6 +30,7 @@ TEVENT_OBJ="tevent.o tevent_debug.o tevent_util.o"
 TEVENT_OBJ="$TEVENT_OBJ tevent_fd.o tevent_timed.o tevent_immediate.o tevent_signal.o"
 TEVENT_OBJ="$TEVENT_OBJ tevent_req.o tevent_wakeup.o tevent_queue.o"
 TEVENT_OBJ="$TEVENT_OBJ tevent_standard.o tevent_select.o"
+TEVENT_OBJ="$TEVENT_OBJ tevent_threadpool.o"
 
 AC_CHECK_HEADERS(sys/epoll.h)
 AC_CHECK_FUNCS(epoll_create)
@@ -38,6 +39,24 @@ if test x"$ac_cv_header_sys_epoll_h" = x"yes" -a x"$ac_cv_func_epoll_create" = x
    AC_DEFINE(HAVE_EPOLL, 1, [Whether epoll available])
 fi
 
+dnl tevent_threadpool runs its jobs in threads unless pthreads are
+dnl missing or --disable-pthreadpool was given, then they run inline
+if test x"$enable_pthreadpool" != x"no"; then
+   AC_CHECK_HEADERS(pthread.h sys/eventfd.h)
+   AC_CHECK_FUNCS(eventfd)
+   AC_CACHE_CHECK([for __sync_val_compare_and_swap],
+	tevent_cv_HAVE___SYNC_VAL_COMPARE_AND_SWAP,[
+	AC_TRY_LINK([], [int i = 0; __sync_val_compare_and_swap(&i, 0, 1);],
+		tevent_cv_HAVE___SYNC_VAL_COMPARE_AND_SWAP=yes,
+		tevent_cv_HAVE___SYNC_VAL_COMPARE_AND_SWAP=no)])
+   if test x"$ac_cv_header_pthread_h" = x"yes" -a x"$tevent_cv_HAVE___SYNC_VAL_COMPARE_AND_SWAP" = x"yes"; then
+      AC_CHECK_LIB(pthread, pthread_create, [
+	 TEVENT_LIBS="$TEVENT_LIBS -lpthread"
+	 AC_DEFINE(HAVE_TEVENT_THREADPOOL, 1, [Whether tevent_threadpool uses threads])
+      ])
+   fi
+fi
+
 if test x"$VERSIONSCRIPT" != "x"; then
     EXPORTSFILE=tevent.exports
     AC_SUBST(EXPORTSFILE)
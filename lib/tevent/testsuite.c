@@ -144,6 +144,331 @@ static bool test_event_context(struct torture_context *test,
 	return true;
 }
 
+#define EPOLL_BATCH_FDS 16
+
+struct epoll_batch_test {
+	struct tevent_fd *fde[EPOLL_BATCH_FDS];
+	int fd[EPOLL_BATCH_FDS];
+	int fired[EPOLL_BATCH_FDS];
+	int count;
+};
+
+static void epoll_batch_handler(struct tevent_context *ev_ctx, struct tevent_fd *fde,
+				uint16_t flags, void *private_data)
+{
+	struct epoll_batch_test *t = (struct epoll_batch_test *)private_data;
+	int victim;
+	int i;
+	char c;
+
+	for (i = 0; i < EPOLL_BATCH_FDS; i++) {
+		if (t->fde[i] == fde) break;
+	}
+	read(t->fd[i], &c, 1);
+	t->fired[i]++;
+
+	/* the first one frees another fd that is ready in the same batch */
+	if (t->count++ == 0) {
+		victim = (i == 0) ? EPOLL_BATCH_FDS - 1 : 0;
+		talloc_free(t->fde[victim]);
+		t->fde[victim] = NULL;
+	}
+
+	/* a change undone before the next epoll_wait() costs no epoll_ctl() */
+	TEVENT_FD_WRITEABLE(fde);
+	TEVENT_FD_NOT_WRITEABLE(fde);
+
+	TEVENT_FD_NOT_READABLE(fde);
+}
+
+/*
+  dispatches many ready fds from one epoll_wait(), one of them freed
+  by an earlier handler
+*/
+static bool test_event_epoll_batch(struct torture_context *test,
+				   const void *test_data)
+{
+	struct tevent_context *ev_ctx;
+	struct tevent_epoll_stats stats;
+	struct epoll_batch_test t;
+	struct tevent_timer *te;
+	int fd[EPOLL_BATCH_FDS][2];
+	int finished = 0;
+	int i;
+
+	ev_ctx = tevent_context_init_byname(test, "epoll_batch");
+	if (ev_ctx == NULL) {
+		torture_skip(test, "no epoll_batch backend");
+	}
+
+	ZERO_STRUCT(t);
+	for (i = 0; i < EPOLL_BATCH_FDS; i++) {
+		torture_assert(test, pipe(fd[i]) == 0, "pipe failed");
+		write(fd[i][1], "x", 1);
+		t.fd[i] = fd[i][0];
+		t.fde[i] = event_add_fd(ev_ctx, ev_ctx, fd[i][0], EVENT_FD_READ,
+					epoll_batch_handler, &t);
+		tevent_fd_set_auto_close(t.fde[i]);
+	}
+
+	te = event_add_timed(ev_ctx, ev_ctx, timeval_current_ofs(2,0),
+			     finished_handler, &finished);
+
+	while (t.count < EPOLL_BATCH_FDS - 1 && !finished) {
+		if (event_loop_once(ev_ctx) == -1) {
+			break;
+		}
+	}
+
+	torture_assert(test, tevent_epoll_get_stats(ev_ctx, &stats),
+		       "no epoll stats");
+	torture_comment(test, "%llu wakeups, %llu events, %llu epoll_ctl calls, "
+			"%llu of %llu changes skipped\n",
+			(unsigned long long)stats.wakeups,
+			(unsigned long long)stats.events,
+			(unsigned long long)stats.ctl_calls,
+			(unsigned long long)stats.mods_skipped,
+			(unsigned long long)stats.mods_deferred);
+
+	torture_assert_int_equal(test, t.count, EPOLL_BATCH_FDS - 1, "fired count mismatch");
+	for (i = 0; i < EPOLL_BATCH_FDS; i++) {
+		torture_assert(test, t.fired[i] <= 1, "fd fired twice");
+		close(fd[i][1]);
+	}
+	torture_assert(test, stats.max_events > 1, "fds not batched");
+
+	/* let the last changes reach the kernel */
+	talloc_free(te);
+	event_add_timed(ev_ctx, ev_ctx, timeval_current_ofs(0,1000),
+			finished_handler, &finished);
+	event_loop_once(ev_ctx);
+	tevent_epoll_get_stats(ev_ctx, &stats);
+	torture_assert(test, stats.mods_skipped == stats.mods_deferred,
+		       "undone changes reached the kernel");
+
+	talloc_free(ev_ctx);
+
+	return true;
+}
+
+#define THREADPOOL_JOBS 100
+
+struct threadpool_job {
+	int n;
+	int result;
+	int usecs;
+};
+
+static void threadpool_job_fn(void *private_data)
+{
+	struct threadpool_job *j = (struct threadpool_job *)private_data;
+	int i;
+
+	if (j->usecs) {
+		usleep(j->usecs);
+	}
+	j->result = 0;
+	for (i = 1; i <= j->n; i++) {
+		j->result += i;
+	}
+}
+
+struct threadpool_test {
+	int done;
+	int failed;
+	int cancelled;
+};
+
+static void threadpool_job_done(struct tevent_req *req)
+{
+	struct threadpool_test *t = (struct threadpool_test *)tevent_req_callback_data_void(req);
+	int ret, err;
+
+	ret = tevent_threadpool_recv(req, &err);
+	if (ret == 0) {
+		t->done++;
+	} else if (err == ECANCELED) {
+		t->cancelled++;
+	} else {
+		t->failed++;
+	}
+	talloc_free(req);
+}
+
+/*
+  runs jobs in a tevent_threadpool, cancels one before it starts and
+  drops one while it runs
+*/
+static bool test_event_threadpool(struct torture_context *test,
+				  const void *test_data)
+{
+	struct tevent_context *ev_ctx;
+	struct tevent_threadpool *pool;
+	struct threadpool_job *j[THREADPOOL_JOBS];
+	struct tevent_req *req[THREADPOOL_JOBS];
+	struct threadpool_test t;
+	int i;
+
+	ev_ctx = event_context_init(test);
+	torture_assert(test, ev_ctx != NULL, "event_context_init failed");
+	pool = tevent_threadpool_create(ev_ctx, ev_ctx, 4);
+	torture_assert(test, pool != NULL, "tevent_threadpool_create failed");
+
+	ZERO_STRUCT(t);
+	for (i = 0; i < THREADPOOL_JOBS; i++) {
+		j[i] = talloc_zero(test, struct threadpool_job);
+		torture_assert(test, j[i] != NULL, "out of memory");
+		j[i]->n = i;
+		req[i] = tevent_threadpool_send(ev_ctx, ev_ctx, pool,
+						threadpool_job_fn, j[i]);
+		torture_assert(test, req[i] != NULL, "tevent_threadpool_send failed");
+		tevent_req_set_callback(req[i], threadpool_job_done, &t);
+	}
+
+	while (t.done + t.failed < THREADPOOL_JOBS) {
+		if (event_loop_once(ev_ctx) == -1) {
+			break;
+		}
+	}
+	torture_assert_int_equal(test, t.done, THREADPOOL_JOBS, "done count mismatch");
+	for (i = 0; i < THREADPOOL_JOBS; i++) {
+		torture_assert(test, talloc_parent(j[i]) == test, "private data not given back");
+		torture_assert_int_equal(test, j[i]->result, i * (i + 1) / 2, "wrong result");
+		talloc_free(j[i]);
+	}
+
+#ifdef HAVE_TEVENT_THREADPOOL
+	/* with one thread busy, the next job waits and can be cancelled */
+	talloc_free(pool);
+	pool = tevent_threadpool_create(ev_ctx, ev_ctx, 1);
+	torture_assert(test, pool != NULL, "tevent_threadpool_create failed");
+
+	ZERO_STRUCT(t);
+	for (i = 0; i < 3; i++) {
+		j[i] = talloc_zero(test, struct threadpool_job);
+		torture_assert(test, j[i] != NULL, "out of memory");
+		j[i]->n = 10;
+		j[i]->usecs = 100000;
+		req[i] = tevent_threadpool_send(ev_ctx, ev_ctx, pool,
+						threadpool_job_fn, j[i]);
+		torture_assert(test, req[i] != NULL, "tevent_threadpool_send failed");
+		tevent_req_set_callback(req[i], threadpool_job_done, &t);
+	}
+
+	/* the first one runs, its data stays with the pool until it is done */
+	talloc_free(req[0]);
+	torture_assert(test, tevent_req_cancel(req[2]), "queued job not cancelled");
+
+	while (t.done + t.failed + t.cancelled < 2) {
+		if (event_loop_once(ev_ctx) == -1) {
+			break;
+		}
+	}
+	torture_assert_int_equal(test, t.done, 1, "done count mismatch");
+	torture_assert_int_equal(test, t.cancelled, 1, "cancelled count mismatch");
+	torture_assert_int_equal(test, j[1]->result, 55, "wrong result");
+	torture_assert_int_equal(test, j[2]->result, 0, "cancelled job ran");
+
+	talloc_free(j[1]);
+	talloc_free(j[2]);
+#endif
+
+	talloc_free(ev_ctx);
+
+	return true;
+}
+
+#define TIMER_ORDER_COUNT 10000
+
+struct timer_order {
+	int fired;
+	bool in_order;
+	struct timeval last;
+	int last_index;
+};
+
+struct timer_order_entry {
+	struct timer_order *o;
+	struct tevent_timer *te;
+	struct timeval when;
+	int index;
+};
+
+static void timer_order_handler(struct tevent_context *ev_ctx, struct tevent_timer *te,
+				struct timeval tval, void *private_data)
+{
+	struct timer_order_entry *e = (struct timer_order_entry *)private_data;
+	struct timer_order *o = e->o;
+	int cmp = timeval_compare(&e->when, &o->last);
+
+	/* due times never go back, equal ones fire in the order added */
+	if (cmp < 0 || (cmp == 0 && e->index < o->last_index)) {
+		o->in_order = false;
+	}
+	/* cancelled timers must not fire */
+	if (e->index % 2) {
+		o->in_order = false;
+	}
+	o->last = e->when;
+	o->last_index = e->index;
+	e->te = NULL;
+	o->fired++;
+}
+
+/*
+  adds timers due in random order, many at the same time, cancels every
+  other one and checks the rest fire in order; timing with far more
+  timers is left to tools/teventtimerbench
+*/
+static bool test_event_timer_order(struct torture_context *test,
+				   const void *test_data)
+{
+	struct tevent_context *ev_ctx;
+	struct timer_order o;
+	struct timer_order_entry *e;
+	uint32_t r = 1;
+	int i;
+
+	ev_ctx = event_context_init(test);
+	torture_assert(test, ev_ctx != NULL, "event_context_init failed");
+	e = talloc_array(test, struct timer_order_entry, TIMER_ORDER_COUNT);
+	torture_assert(test, e != NULL, "out of memory");
+
+	ZERO_STRUCT(o);
+	o.in_order = true;
+	o.last_index = -1;
+
+	for (i = 0; i < TIMER_ORDER_COUNT; i++) {
+		r = r * 1103515245 + 12345;
+		e[i].o = &o;
+		e[i].index = i;
+		/* all in the past, so they are due at once */
+		e[i].when = timeval_set(1, (r >> 8) % 1000);
+		e[i].te = event_add_timed(ev_ctx, ev_ctx, e[i].when,
+					  timer_order_handler, &e[i]);
+		torture_assert(test, e[i].te != NULL, "event_add_timed failed");
+	}
+
+	for (i = 1; i < TIMER_ORDER_COUNT; i += 2) {
+		talloc_free(e[i].te);
+		e[i].te = NULL;
+	}
+
+	while (o.fired < TIMER_ORDER_COUNT / 2) {
+		if (event_loop_once(ev_ctx) == -1) {
+			break;
+		}
+	}
+
+	torture_assert_int_equal(test, o.fired, TIMER_ORDER_COUNT / 2, "fired count mismatch");
+	torture_assert(test, o.in_order, "timers fired out of order");
+
+	talloc_free(ev_ctx);
+	talloc_free(e);
+
+	return true;
+}
+
 struct torture_suite *torture_local_event(TALLOC_CTX *mem_ctx)
 {
 	struct torture_suite *suite = torture_suite_create(mem_ctx, "EVENT");
@@ -156,5 +481,12 @@ struct torture_suite *torture_local_event(TALLOC_CTX *mem_ctx)
 					       (const void *)list[i]);
 	}
 
+	torture_suite_add_simple_tcase_const(suite, "epoll_batch",
+					     test_event_epoll_batch, NULL);
+	torture_suite_add_simple_tcase_const(suite, "threadpool",
+					     test_event_threadpool, NULL);
+	torture_suite_add_simple_tcase_const(suite, "timer_order",
+					     test_event_timer_order, NULL);
+
 	return suite;
 }
@@ -120,6 +120,14 @@ static void tevent_backend_init(void)
 #endif
 }
 
+#ifndef HAVE_EPOLL
+bool tevent_epoll_get_stats(struct tevent_context *ev,
+			    struct tevent_epoll_stats *stats)
+{
+	return false;
+}
+#endif
+
 /*
   list available backends
 */
@@ -142,9 +150,9 @@ const char **tevent_backend_list(TALLOC_CTX *mem_ctx)
 int tevent_common_context_destructor(struct tevent_context *ev)
 {
 	struct tevent_fd *fd, *fn;
-	struct tevent_timer *te, *tn;
 	struct tevent_immediate *ie, *in;
 	struct tevent_signal *se, *sn;
+	size_t i;
 
 	if (ev->pipe_fde) {
 		talloc_free(ev->pipe_fde);
@@ -159,11 +167,11 @@ int tevent_common_context_destructor(struct tevent_context *ev)
 		DLIST_REMOVE(ev->fd_events, fd);
 	}
 
-	for (te = ev->timer_events; te; te = tn) {
-		tn = te->next;
-		te->event_ctx = NULL;
-		DLIST_REMOVE(ev->timer_events, te);
+	for (i = 0; i < ev->num_timers; i++) {
+		ev->timer_heap[i]->event_ctx = NULL;
 	}
+	ev->num_timers = 0;
+	ev->timer_events = NULL;
 
 	for (ie = ev->immediate_events; ie; ie = in) {
 		in = ie->next;
@@ -166,6 +166,21 @@ int tevent_set_debug(struct tevent_context *ev,
 		     void *context);
 int tevent_set_debug_stderr(struct tevent_context *ev);
 
+/* counters of the "epoll" and "epoll_batch" backends */
+struct tevent_epoll_stats {
+	uint64_t waits;		/* epoll_wait() calls */
+	uint64_t wakeups;	/* epoll_wait() calls which returned fds */
+	uint64_t events;	/* fds returned, events/wakeups per wakeup */
+	uint64_t max_events;	/* most fds returned by one epoll_wait() */
+	uint64_t ctl_calls;	/* epoll_ctl() calls */
+	uint64_t mods_deferred;	/* EPOLL_CTL_MODs put off to the next epoll_wait() */
+	uint64_t mods_skipped;	/* of those, the ones found unnecessary */
+};
+
+/* returns false if ev doesn't use one of the epoll backends */
+bool tevent_epoll_get_stats(struct tevent_context *ev,
+			    struct tevent_epoll_stats *stats);
+
 /**
  * An async request moves between the following 4 states:
  */
@@ -300,6 +315,18 @@ struct tevent_req *tevent_wakeup_send(TALLOC_CTX *mem_ctx,
 				      struct timeval wakeup_time);
 bool tevent_wakeup_recv(struct tevent_req *req);
 
+struct tevent_threadpool;
+
+struct tevent_threadpool *tevent_threadpool_create(TALLOC_CTX *mem_ctx,
+						   struct tevent_context *ev,
+						   unsigned max_threads);
+struct tevent_req *tevent_threadpool_send(TALLOC_CTX *mem_ctx,
+					  struct tevent_context *ev,
+					  struct tevent_threadpool *pool,
+					  void (*fn)(void *private_data),
+					  void *private_data);
+int tevent_threadpool_recv(struct tevent_req *req, int *perrno);
+
 int tevent_timeval_compare(const struct timeval *tv1,
 			   const struct timeval *tv2);
 
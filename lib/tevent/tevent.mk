@@ -3,6 +3,11 @@ TEVENT_SONAME = $(TEVENT_SOBASE).0
 TEVENT_SOLIB = $(TEVENT_SOBASE).$(PACKAGE_VERSION)
 TEVENT_STLIB = libtevent.a
 
+PROGS_NOINSTALL = bin/teventtimerbench$(EXEEXT)
+
+bin/teventtimerbench$(EXEEXT): tools/teventtimerbench.o $(TEVENT_STLIB)
+	$(CC) $(CFLAGS) $(LDFLAGS) -o bin/teventtimerbench tools/teventtimerbench.o -L. -ltevent $(LIBS)
+
 $(TEVENT_STLIB): $(TEVENT_OBJ)
 	ar -rv $(TEVENT_STLIB) $(TEVENT_OBJ)
 
@@ -13,7 +18,7 @@ $(TEVENT_SONAME): $(TEVENT_SOLIB)
 	ln -fs $< $@
 
 dirs::
-	@mkdir -p lib
+	@mkdir -p lib bin tools
 
 installdirs::
 	mkdir -p $(DESTDIR)$(includedir)
@@ -37,6 +42,7 @@ test:: abi_checks
 
 clean::
 	rm -f $(TEVENT_SOBASE) $(TEVENT_SONAME) $(TEVENT_SOLIB) $(TEVENT_STLIB)
+	rm -f $(PROGS_NOINSTALL)
 	rm -f tevent.pc
 	rm -f tevent.exports.sort tevent.exports.check tevent.exports.check.sort
 	rm -f tevent.signatures.sort tevent.signatures.check tevent.signatures.check.sort
@@ -31,6 +31,21 @@
 #include "tevent_internal.h"
 #include "tevent_util.h"
 
+/* how many ready fds one epoll_wait() may return in batch mode */
+#define EPOLL_BATCH_MAXEVENTS 64
+
+/*
+  the events of an epoll_wait() being dispatched, on the stack of
+  epoll_event_loop(); handlers may run nested loops, so these form a chain
+*/
+struct epoll_batch {
+	struct epoll_batch *prev;
+	struct epoll_event *events;
+	int num_events;
+	/* set if a handler freed the event context */
+	bool ctx_freed;
+};
+
 struct epoll_event_context {
 	/* a pointer back to the generic event_context */
 	struct tevent_context *ev;
@@ -39,6 +54,19 @@ struct epoll_event_context {
 	int epoll_fd;
 
 	pid_t pid;
+
+	/*
+	  in batch mode all fds returned by epoll_wait() are dispatched
+	  in one go and EPOLL_CTL_MOD calls are put off until the next
+	  epoll_wait(), so a flag set and reset in between costs nothing
+	*/
+	bool batch;
+	struct epoll_batch *batches;
+	struct tevent_fd **pending;
+	size_t num_pending;
+	size_t pending_size;
+
+	struct tevent_epoll_stats stats;
 };
 
 /*
@@ -68,6 +96,11 @@ static uint32_t epoll_map_flags(uint16_t flags)
 */
 static int epoll_ctx_destructor(struct epoll_event_context *epoll_ev)
 {
+	struct epoll_batch *b;
+
+	for (b = epoll_ev->batches; b; b = b->prev) {
+		b->ctx_freed = true;
+	}
 	close(epoll_ev->epoll_fd);
 	epoll_ev->epoll_fd = -1;
 	return 0;
@@ -118,6 +151,23 @@ static void epoll_check_reopen(struct epoll_event_context *epoll_ev)
 #define EPOLL_ADDITIONAL_FD_FLAG_HAS_EVENT	(1<<0)
 #define EPOLL_ADDITIONAL_FD_FLAG_REPORT_ERROR	(1<<1)
 #define EPOLL_ADDITIONAL_FD_FLAG_GOT_ERROR	(1<<2)
+#define EPOLL_ADDITIONAL_FD_FLAG_MOD_PENDING	(1<<3)
+/* the TEVENT_FD_* flags last given to the kernel, shifted */
+#define EPOLL_ADDITIONAL_FD_FLAG_KERNEL_SHIFT	4
+#define EPOLL_ADDITIONAL_FD_FLAG_KERNEL_MASK	(3<<EPOLL_ADDITIONAL_FD_FLAG_KERNEL_SHIFT)
+
+static void epoll_set_kernel_flags(struct tevent_fd *fde)
+{
+	fde->additional_flags &= ~EPOLL_ADDITIONAL_FD_FLAG_KERNEL_MASK;
+	fde->additional_flags |= (fde->flags & (TEVENT_FD_READ|TEVENT_FD_WRITE))
+		<< EPOLL_ADDITIONAL_FD_FLAG_KERNEL_SHIFT;
+}
+
+static uint16_t epoll_get_kernel_flags(struct tevent_fd *fde)
+{
+	return (fde->additional_flags & EPOLL_ADDITIONAL_FD_FLAG_KERNEL_MASK)
+		>> EPOLL_ADDITIONAL_FD_FLAG_KERNEL_SHIFT;
+}
 
 /*
  add the epoll event to the given fd_event
@@ -136,10 +186,12 @@ static void epoll_add_event(struct epoll_event_context *epoll_ev, struct tevent_
 	ZERO_STRUCT(event);
 	event.events = epoll_map_flags(fde->flags);
 	event.data.ptr = fde;
+	epoll_ev->stats.ctl_calls++;
 	if (epoll_ctl(epoll_ev->epoll_fd, EPOLL_CTL_ADD, fde->fd, &event) != 0) {
 		epoll_panic(epoll_ev, "EPOLL_CTL_ADD failed");
 	}
 	fde->additional_flags |= EPOLL_ADDITIONAL_FD_FLAG_HAS_EVENT;
+	epoll_set_kernel_flags(fde);
 
 	/* only if we want to read we want to tell the event handler about errors */
 	if (fde->flags & TEVENT_FD_READ) {
@@ -164,6 +216,7 @@ static void epoll_del_event(struct epoll_event_context *epoll_ev, struct tevent_
 	ZERO_STRUCT(event);
 	event.events = epoll_map_flags(fde->flags);
 	event.data.ptr = fde;
+	epoll_ev->stats.ctl_calls++;
 	if (epoll_ctl(epoll_ev->epoll_fd, EPOLL_CTL_DEL, fde->fd, &event) != 0) {
 		tevent_debug(epoll_ev->ev, TEVENT_DEBUG_FATAL,
 			     "epoll_del_event failed! probable early close bug (%s)\n",
@@ -185,9 +238,11 @@ static void epoll_mod_event(struct epoll_event_context *epoll_ev, struct tevent_
 	ZERO_STRUCT(event);
 	event.events = epoll_map_flags(fde->flags);
 	event.data.ptr = fde;
+	epoll_ev->stats.ctl_calls++;
 	if (epoll_ctl(epoll_ev->epoll_fd, EPOLL_CTL_MOD, fde->fd, &event) != 0) {
 		epoll_panic(epoll_ev, "EPOLL_CTL_MOD failed");
 	}
+	epoll_set_kernel_flags(fde);
 
 	/* only if we want to read we want to tell the event handler about errors */
 	if (fde->flags & TEVENT_FD_READ) {
@@ -195,6 +250,95 @@ static void epoll_mod_event(struct epoll_event_context *epoll_ev, struct tevent_
 	}
 }
 
+/*
+  put off the EPOLL_CTL_MOD for the given fd_event until the next
+  epoll_wait(), see epoll_flush_pending()
+*/
+static void epoll_defer_mod_event(struct epoll_event_context *epoll_ev, struct tevent_fd *fde)
+{
+	/* the handler sees errors depending on what it wants now */
+	if (fde->flags & TEVENT_FD_READ) {
+		fde->additional_flags |= EPOLL_ADDITIONAL_FD_FLAG_REPORT_ERROR;
+	}
+
+	if (fde->additional_flags & EPOLL_ADDITIONAL_FD_FLAG_MOD_PENDING) {
+		return;
+	}
+
+	if (epoll_ev->num_pending == epoll_ev->pending_size) {
+		size_t size = epoll_ev->pending_size ? epoll_ev->pending_size * 2 : 16;
+		struct tevent_fd **pending;
+
+		pending = talloc_realloc(epoll_ev, epoll_ev->pending,
+					 struct tevent_fd *, size);
+		if (pending == NULL) {
+			epoll_mod_event(epoll_ev, fde);
+			return;
+		}
+		epoll_ev->pending = pending;
+		epoll_ev->pending_size = size;
+	}
+
+	epoll_ev->pending[epoll_ev->num_pending++] = fde;
+	fde->additional_flags |= EPOLL_ADDITIONAL_FD_FLAG_MOD_PENDING;
+	epoll_ev->stats.mods_deferred++;
+}
+
+/*
+  tell the kernel about the fd_events changed since the last epoll_wait()
+*/
+static void epoll_flush_pending(struct epoll_event_context *epoll_ev)
+{
+	size_t i;
+
+	for (i = 0; i < epoll_ev->num_pending; i++) {
+		struct tevent_fd *fde = epoll_ev->pending[i];
+
+		/* freed in the meantime */
+		if (fde == NULL) continue;
+
+		fde->additional_flags &= ~EPOLL_ADDITIONAL_FD_FLAG_MOD_PENDING;
+
+		/* deleted or re-added in the meantime, or back where it was */
+		if (!(fde->additional_flags & EPOLL_ADDITIONAL_FD_FLAG_HAS_EVENT) ||
+		    epoll_get_kernel_flags(fde) == fde->flags) {
+			epoll_ev->stats.mods_skipped++;
+			continue;
+		}
+
+		epoll_mod_event(epoll_ev, fde);
+	}
+	epoll_ev->num_pending = 0;
+}
+
+/*
+  an fd_event is going away, make sure neither a pending change nor
+  the rest of a batch being dispatched refers to it
+*/
+static void epoll_forget_event(struct epoll_event_context *epoll_ev, struct tevent_fd *fde)
+{
+	struct epoll_batch *b;
+	size_t i;
+	int j;
+
+	if (fde->additional_flags & EPOLL_ADDITIONAL_FD_FLAG_MOD_PENDING) {
+		for (i = 0; i < epoll_ev->num_pending; i++) {
+			if (epoll_ev->pending[i] == fde) {
+				epoll_ev->pending[i] = NULL;
+			}
+		}
+		fde->additional_flags &= ~EPOLL_ADDITIONAL_FD_FLAG_MOD_PENDING;
+	}
+
+	for (b = epoll_ev->batches; b; b = b->prev) {
+		for (j = 0; j < b->num_events; j++) {
+			if (b->events[j].data.ptr == fde) {
+				b->events[j].data.ptr = NULL;
+			}
+		}
+	}
+}
+
 static void epoll_change_event(struct epoll_event_context *epoll_ev, struct tevent_fd *fde)
 {
 	bool got_error = (fde->additional_flags & EPOLL_ADDITIONAL_FD_FLAG_GOT_ERROR);
@@ -208,6 +352,10 @@ static void epoll_change_event(struct epoll_event_context *epoll_ev, struct teve
 	/* there's already an event */
 	if (fde->additional_flags & EPOLL_ADDITIONAL_FD_FLAG_HAS_EVENT) {
 		if (want_read || (want_write && !got_error)) {
+			if (epoll_ev->batch) {
+				epoll_defer_mod_event(epoll_ev, fde);
+				return;
+			}
 			epoll_mod_event(epoll_ev, fde);
 			return;
 		}
@@ -234,8 +382,9 @@ static void epoll_change_event(struct epoll_event_context *epoll_ev, struct teve
 static int epoll_event_loop(struct epoll_event_context *epoll_ev, struct timeval *tvalp)
 {
 	int ret, i;
-#define MAXEVENTS 1
-	struct epoll_event events[MAXEVENTS];
+	struct epoll_event events[EPOLL_BATCH_MAXEVENTS];
+	int maxevents = epoll_ev->batch ? EPOLL_BATCH_MAXEVENTS : 1;
+	struct epoll_batch batch;
 	int timeout = -1;
 
 	if (epoll_ev->epoll_fd == -1) return -1;
@@ -250,7 +399,12 @@ static int epoll_event_loop(struct epoll_event_context *epoll_ev, struct timeval
 		return 0;
 	}
 
-	ret = epoll_wait(epoll_ev->epoll_fd, events, MAXEVENTS, timeout);
+	if (epoll_ev->num_pending) {
+		epoll_flush_pending(epoll_ev);
+	}
+
+	epoll_ev->stats.waits++;
+	ret = epoll_wait(epoll_ev->epoll_fd, events, maxevents, timeout);
 
 	if (ret == -1 && errno == EINTR && epoll_ev->ev->signal_events) {
 		if (tevent_common_check_signal(epoll_ev->ev)) {
@@ -269,12 +423,36 @@ static int epoll_event_loop(struct epoll_event_context *epoll_ev, struct timeval
 		return 0;
 	}
 
+	if (ret <= 0) {
+		return 0;
+	}
+
+	epoll_ev->stats.wakeups++;
+	epoll_ev->stats.events += ret;
+	if (ret > epoll_ev->stats.max_events) {
+		epoll_ev->stats.max_events = ret;
+	}
+
+	/*
+	  handlers may free any fd_event, epoll_forget_event() then
+	  clears its entries in the batch
+	*/
+	batch.prev = epoll_ev->batches;
+	batch.events = events;
+	batch.num_events = ret;
+	batch.ctx_freed = false;
+	epoll_ev->batches = &batch;
+
 	for (i=0;i<ret;i++) {
-		struct tevent_fd *fde = talloc_get_type(events[i].data.ptr, 
-						       struct tevent_fd);
+		struct tevent_fd *fde;
 		uint16_t flags = 0;
 
+		if (events[i].data.ptr == NULL) {
+			continue;
+		}
+		fde = talloc_get_type(events[i].data.ptr, struct tevent_fd);
 		if (fde == NULL) {
+			epoll_ev->batches = batch.prev;
 			epoll_panic(epoll_ev, "epoll_wait() gave bad data");
 			return -1;
 		}
@@ -294,12 +472,21 @@ static int epoll_event_loop(struct epoll_event_context *epoll_ev, struct timeval
 		}
 		if (events[i].events & EPOLLIN) flags |= TEVENT_FD_READ;
 		if (events[i].events & EPOLLOUT) flags |= TEVENT_FD_WRITE;
+		/* an earlier handler may have changed what it waits for */
+		flags &= fde->flags;
 		if (flags) {
 			fde->handler(epoll_ev->ev, fde, flags, fde->private_data);
-			break;
+			if (batch.ctx_freed) {
+				return 0;
+			}
+			if (!epoll_ev->batch) {
+				break;
+			}
 		}
 	}
 
+	epoll_ev->batches = batch.prev;
+
 	return 0;
 }
 
@@ -340,6 +527,7 @@ static int epoll_event_fd_destructor(struct tevent_fd *fde)
 
 		epoll_check_reopen(epoll_ev);
 
+		epoll_forget_event(epoll_ev, fde);
 		epoll_del_event(epoll_ev, fde);
 	}
 
@@ -424,6 +612,42 @@ static int epoll_event_loop_once(struct tevent_context *ev, const char *location
 	return epoll_event_loop(epoll_ev, &tval);
 }
 
+/*
+  create a epoll_event_context structure for batch mode.
+*/
+static int epoll_batch_event_context_init(struct tevent_context *ev)
+{
+	struct epoll_event_context *epoll_ev;
+	int ret;
+
+	ret = epoll_event_context_init(ev);
+	if (ret != 0) {
+		return ret;
+	}
+
+	epoll_ev = talloc_get_type(ev->additional_data, struct epoll_event_context);
+	epoll_ev->batch = true;
+	return 0;
+}
+
+/*
+  return the counters of an epoll or epoll_batch event context
+*/
+bool tevent_epoll_get_stats(struct tevent_context *ev,
+			    struct tevent_epoll_stats *stats)
+{
+	struct epoll_event_context *epoll_ev;
+
+	if (ev->ops->context_init != epoll_event_context_init &&
+	    ev->ops->context_init != epoll_batch_event_context_init) {
+		return false;
+	}
+
+	epoll_ev = talloc_get_type(ev->additional_data, struct epoll_event_context);
+	*stats = epoll_ev->stats;
+	return true;
+}
+
 static const struct tevent_ops epoll_event_ops = {
 	.context_init		= epoll_event_context_init,
 	.add_fd			= epoll_event_add_fd,
@@ -437,7 +661,23 @@ static const struct tevent_ops epoll_event_ops = {
 	.loop_wait		= tevent_common_loop_wait,
 };
 
+static const struct tevent_ops epoll_batch_event_ops = {
+	.context_init		= epoll_batch_event_context_init,
+	.add_fd			= epoll_event_add_fd,
+	.set_fd_close_fn	= tevent_common_fd_set_close_fn,
+	.get_fd_flags		= tevent_common_fd_get_flags,
+	.set_fd_flags		= epoll_event_set_fd_flags,
+	.add_timer		= tevent_common_add_timer,
+	.schedule_immediate	= tevent_common_schedule_immediate,
+	.add_signal		= tevent_common_add_signal,
+	.loop_once		= epoll_event_loop_once,
+	.loop_wait		= tevent_common_loop_wait,
+};
+
 bool tevent_epoll_init(void)
 {
-	return tevent_register_backend("epoll", &epoll_event_ops);
+	if (!tevent_register_backend("epoll", &epoll_event_ops)) {
+		return false;
+	}
+	return tevent_register_backend("epoll_batch", &epoll_batch_event_ops);
 }
@@ -167,7 +167,10 @@ struct tevent_fd {
 };
 
 struct tevent_timer {
-	struct tevent_timer *prev, *next;
+	/* position in event_ctx->timer_heap */
+	size_t heap_index;
+	/* orders timers due at the same time by when they were added */
+	uint64_t seq;
 	struct tevent_context *event_ctx;
 	struct timeval next_event;
 	tevent_timer_handler_t handler;
@@ -226,9 +229,15 @@ struct tevent_context {
 	/* list of fd events - used by common code */
 	struct tevent_fd *fd_events;
 
-	/* list of timed events - used by common code */
+	/* the first timed event due, NULL if there is none - used by common code */
 	struct tevent_timer *timer_events;
 
+	/* min-heap of all timed events, see tevent_timed.c */
+	struct tevent_timer **timer_heap;
+	size_t num_timers;
+	size_t timer_heap_size;
+	uint64_t timer_seq;
+
 	/* list of immediate events - used by common code */
 	struct tevent_immediate *immediate_events;
 
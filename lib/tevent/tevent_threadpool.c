@@ -0,0 +1,682 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   run blocking functions in helper threads, completing on the event loop
+
+   Copyright (C) The Samba Team 2026
+
+     ** NOTE! The following LGPL license applies to the tevent
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The jobs are handed to the workers on a mutex protected queue. A
+  finished job is pushed onto a lock-free stack by its worker and only
+  the push that finds the stack empty wakes the event loop, so a burst
+  of completions costs a single eventfd (or pipe) write and a single
+  fd event, which takes the whole stack at once.
+
+  Only the event loop thread touches talloc memory: the workers see the
+  job, which is malloc()ed, and the private data of the function.
+*/
+
+#include "replace.h"
+#include "system/filesys.h"
+#include "tevent.h"
+#include "tevent_internal.h"
+#include "tevent_util.h"
+
+#ifdef HAVE_TEVENT_THREADPOOL
+
+#include <pthread.h>
+#include <signal.h>
+#if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#define TEVENT_THREADPOOL_EVENTFD 1
+#endif
+
+struct tevent_threadpool_job {
+	/* the queue of jobs not yet started, under pool->mutex */
+	struct tevent_threadpool_job *next;
+	/* the stack of finished jobs, see tevent_threadpool_push_done() */
+	struct tevent_threadpool_job *done_next;
+
+	void (*fn)(void *private_data);
+	void *private_data;
+
+	/* NULL once the request is gone, only used by the event loop thread */
+	struct tevent_req *req;
+};
+
+struct tevent_threadpool {
+	struct tevent_context *ev;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t condvar;
+
+	/* the queue of jobs not yet started */
+	struct tevent_threadpool_job *jobs, *last_job;
+	bool shutdown;
+
+	unsigned max_threads;
+	unsigned num_threads;
+	unsigned num_idle;
+	pthread_t *threads;
+
+	/* finished jobs, newest first, pushed without holding the mutex */
+	struct tevent_threadpool_job *done;
+
+	/* signal_fd[1] wakes the event loop, both are the eventfd if we have one */
+	int signal_fd[2];
+	struct tevent_fd *fde;
+
+	/* finished jobs taken off the stack, oldest first */
+	struct tevent_threadpool_job *reaping;
+	/* set by the destructor if a request callback freed the pool */
+	bool *destroyed;
+
+	/* the data of orphaned jobs, freed when they finish */
+	TALLOC_CTX *orphans;
+};
+
+struct tevent_threadpool_state {
+	struct tevent_threadpool *pool;
+	struct tevent_threadpool_job *job;
+	/* where the private data of the job goes back to */
+	void *private_parent;
+	/* finishes the request if the pool goes away first */
+	struct tevent_immediate *im;
+	bool ran;
+};
+
+static void tevent_threadpool_push_done(struct tevent_threadpool *pool,
+					struct tevent_threadpool_job *job)
+{
+	struct tevent_threadpool_job *old = NULL, *cur;
+
+	while (true) {
+		job->done_next = old;
+		cur = __sync_val_compare_and_swap(&pool->done, old, job);
+		if (cur == old) {
+			break;
+		}
+		old = cur;
+	}
+
+	/*
+	 * The event loop takes the whole stack, so only the job which
+	 * found it empty has to wake it up.
+	 */
+	if (old == NULL) {
+#ifdef TEVENT_THREADPOOL_EVENTFD
+		uint64_t one = 1;
+#else
+		char one = 0;
+#endif
+		ssize_t res;
+
+		/* a full pipe already has a wakeup in it */
+		do {
+			res = write(pool->signal_fd[1], &one, sizeof(one));
+		} while (res == -1 && errno == EINTR);
+	}
+}
+
+static struct tevent_threadpool_job *tevent_threadpool_take_done(struct tevent_threadpool *pool)
+{
+	struct tevent_threadpool_job *list = NULL, *job, *next;
+
+	while (true) {
+		job = __sync_val_compare_and_swap(&pool->done, list, NULL);
+		if (job == list) {
+			break;
+		}
+		list = job;
+	}
+
+	/* the stack is newest first, complete them in order */
+	job = list;
+	list = NULL;
+	while (job) {
+		next = job->done_next;
+		job->done_next = list;
+		list = job;
+		job = next;
+	}
+	return list;
+}
+
+static void *tevent_threadpool_worker(void *arg)
+{
+	struct tevent_threadpool *pool = (struct tevent_threadpool *)arg;
+	struct tevent_threadpool_job *job;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (true) {
+		while (pool->jobs == NULL && !pool->shutdown) {
+			pool->num_idle++;
+			pthread_cond_wait(&pool->condvar, &pool->mutex);
+			pool->num_idle--;
+		}
+
+		job = pool->jobs;
+		if (job == NULL) {
+			/* shutting down and nothing left to do */
+			break;
+		}
+		pool->jobs = job->next;
+		if (pool->last_job == job) {
+			pool->last_job = NULL;
+		}
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		job->fn(job->private_data);
+		tevent_threadpool_push_done(pool, job);
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+/*
+  report a finished job to its request, if it still has one
+*/
+static void tevent_threadpool_job_done(struct tevent_threadpool *pool,
+				       struct tevent_threadpool_job *job)
+{
+	struct tevent_req *req = job->req;
+	struct tevent_threadpool_state *state;
+
+	if (req == NULL) {
+		talloc_free(job->private_data);
+		free(job);
+		return;
+	}
+
+	state = tevent_req_data(req, struct tevent_threadpool_state);
+	state->job = NULL;
+	talloc_steal(state->private_parent, job->private_data);
+	free(job);
+
+	tevent_req_done(req);
+}
+
+static void tevent_threadpool_handler(struct tevent_context *ev,
+				      struct tevent_fd *fde,
+				      uint16_t flags, void *private_data)
+{
+	struct tevent_threadpool *pool = talloc_get_type_abort(
+		private_data, struct tevent_threadpool);
+	struct tevent_threadpool_job *job, *last;
+	bool destroyed = false;
+	bool *outer_destroyed;
+#ifdef TEVENT_THREADPOOL_EVENTFD
+	uint64_t count;
+	ssize_t res;
+
+	/* this resets the counter, EAGAIN means someone else did */
+	do {
+		res = read(pool->signal_fd[0], &count, sizeof(count));
+	} while (res == -1 && errno == EINTR);
+#else
+	char buf[64];
+
+	/* the pipe is non-blocking, empty it */
+	while (read(pool->signal_fd[0], buf, sizeof(buf)) == sizeof(buf)) ;
+#endif
+
+	/*
+	 * Read the wakeup before taking the stack: a job pushed after
+	 * this will either be taken now or wake us again.
+	 */
+	job = tevent_threadpool_take_done(pool);
+	if (job == NULL) {
+		return;
+	}
+
+	/* a previous run may have been left by a nested event loop */
+	if (pool->reaping) {
+		for (last = pool->reaping; last->done_next; last = last->done_next) ;
+		last->done_next = job;
+	} else {
+		pool->reaping = job;
+	}
+
+	outer_destroyed = pool->destroyed;
+	pool->destroyed = &destroyed;
+
+	while (pool->reaping) {
+		job = pool->reaping;
+		pool->reaping = job->done_next;
+
+		tevent_threadpool_job_done(pool, job);
+		if (destroyed) {
+			if (outer_destroyed) {
+				*outer_destroyed = true;
+			}
+			return;
+		}
+	}
+
+	pool->destroyed = outer_destroyed;
+}
+
+/*
+  the request went away before its job finished, the data of the job
+  is kept until it has
+*/
+static int tevent_threadpool_state_destructor(struct tevent_threadpool_state *state)
+{
+	struct tevent_threadpool_job *job = state->job;
+
+	if (job == NULL) {
+		return 0;
+	}
+
+	job->req = NULL;
+	talloc_steal(state->pool->orphans, job->private_data);
+	state->job = NULL;
+	return 0;
+}
+
+/*
+  a job which has not started yet can be taken off the queue
+*/
+static bool tevent_threadpool_cancel(struct tevent_req *req)
+{
+	struct tevent_threadpool_state *state = tevent_req_data(
+		req, struct tevent_threadpool_state);
+	struct tevent_threadpool *pool = state->pool;
+	struct tevent_threadpool_job *job = state->job;
+	struct tevent_threadpool_job *prev = NULL, *j;
+
+	if (job == NULL) {
+		return false;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	for (j = pool->jobs; j; prev = j, j = j->next) {
+		if (j == job) break;
+	}
+	if (j == NULL) {
+		/* running or finished already */
+		pthread_mutex_unlock(&pool->mutex);
+		return false;
+	}
+	if (prev) {
+		prev->next = job->next;
+	} else {
+		pool->jobs = job->next;
+	}
+	if (pool->last_job == job) {
+		pool->last_job = prev;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	state->job = NULL;
+	talloc_steal(state->private_parent, job->private_data);
+	free(job);
+
+	tevent_req_error(req, ECANCELED);
+	return true;
+}
+
+static void tevent_threadpool_finish(struct tevent_context *ev,
+				     struct tevent_immediate *im,
+				     void *private_data)
+{
+	struct tevent_req *req = talloc_get_type_abort(
+		private_data, struct tevent_req);
+	struct tevent_threadpool_state *state = tevent_req_data(
+		req, struct tevent_threadpool_state);
+
+	if (state->ran) {
+		tevent_req_done(req);
+	} else {
+		tevent_req_error(req, ECANCELED);
+	}
+}
+
+/*
+  finish a request from the pool destructor, the callback runs from the
+  event loop later
+*/
+static void tevent_threadpool_post(struct tevent_threadpool *pool,
+				   struct tevent_threadpool_job *job,
+				   bool ran)
+{
+	struct tevent_req *req = job->req;
+	struct tevent_threadpool_state *state;
+
+	if (req == NULL) {
+		free(job);
+		return;
+	}
+
+	state = tevent_req_data(req, struct tevent_threadpool_state);
+	state->job = NULL;
+	talloc_steal(state->private_parent, job->private_data);
+	free(job);
+
+	state->ran = ran;
+	tevent_schedule_immediate(state->im, pool->ev,
+				  tevent_threadpool_finish, req);
+}
+
+static int tevent_threadpool_destructor(struct tevent_threadpool *pool)
+{
+	struct tevent_threadpool_job *job, *next;
+	unsigned i;
+
+	if (pool->destroyed) {
+		*pool->destroyed = true;
+	}
+
+	/* jobs that have not started are cancelled */
+	pthread_mutex_lock(&pool->mutex);
+	job = pool->jobs;
+	pool->jobs = pool->last_job = NULL;
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->condvar);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (; job; job = next) {
+		next = job->next;
+		tevent_threadpool_post(pool, job, false);
+	}
+
+	/* the running ones are waited for */
+	for (i = 0; i < pool->num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	for (job = pool->reaping; job; job = next) {
+		next = job->done_next;
+		tevent_threadpool_post(pool, job, true);
+	}
+	for (job = tevent_threadpool_take_done(pool); job; job = next) {
+		next = job->done_next;
+		tevent_threadpool_post(pool, job, true);
+	}
+
+	TALLOC_FREE(pool->fde);
+	close(pool->signal_fd[0]);
+	if (pool->signal_fd[1] != pool->signal_fd[0]) {
+		close(pool->signal_fd[1]);
+	}
+	pthread_cond_destroy(&pool->condvar);
+	pthread_mutex_destroy(&pool->mutex);
+	return 0;
+}
+
+/*
+  create a pool of at most max_threads threads, started as jobs come
+  in. Its requests complete on ev, which must be run by the thread
+  creating the pool. The threads don't survive a fork(), a child
+  process needs a pool of its own.
+*/
+struct tevent_threadpool *tevent_threadpool_create(TALLOC_CTX *mem_ctx,
+						   struct tevent_context *ev,
+						   unsigned max_threads)
+{
+	struct tevent_threadpool *pool;
+
+	if (max_threads == 0) {
+		max_threads = 1;
+	}
+
+	pool = talloc_zero(mem_ctx, struct tevent_threadpool);
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->ev = ev;
+	pool->max_threads = max_threads;
+
+	pool->threads = talloc_array(pool, pthread_t, max_threads);
+	pool->orphans = talloc_new(pool);
+	if (pool->threads == NULL || pool->orphans == NULL) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+#ifdef TEVENT_THREADPOOL_EVENTFD
+	pool->signal_fd[0] = eventfd(0, 0);
+	if (pool->signal_fd[0] == -1) {
+		talloc_free(pool);
+		return NULL;
+	}
+	pool->signal_fd[1] = pool->signal_fd[0];
+	ev_set_blocking(pool->signal_fd[0], false);
+#else
+	if (pipe(pool->signal_fd) != 0) {
+		talloc_free(pool);
+		return NULL;
+	}
+	ev_set_blocking(pool->signal_fd[0], false);
+	ev_set_blocking(pool->signal_fd[1], false);
+#endif
+
+	if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+		close(pool->signal_fd[0]);
+		if (pool->signal_fd[1] != pool->signal_fd[0]) {
+			close(pool->signal_fd[1]);
+		}
+		talloc_free(pool);
+		return NULL;
+	}
+	if (pthread_cond_init(&pool->condvar, NULL) != 0) {
+		pthread_mutex_destroy(&pool->mutex);
+		close(pool->signal_fd[0]);
+		if (pool->signal_fd[1] != pool->signal_fd[0]) {
+			close(pool->signal_fd[1]);
+		}
+		talloc_free(pool);
+		return NULL;
+	}
+	talloc_set_destructor(pool, tevent_threadpool_destructor);
+
+	pool->fde = tevent_add_fd(ev, pool, pool->signal_fd[0], TEVENT_FD_READ,
+				  tevent_threadpool_handler, pool);
+	if (pool->fde == NULL) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*
+  queue a job, starting another thread if none is idle
+*/
+static int tevent_threadpool_add_job(struct tevent_threadpool *pool,
+				     struct tevent_threadpool_job *job)
+{
+	sigset_t mask, omask;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->jobs == NULL) {
+		pool->jobs = job;
+	} else {
+		pool->last_job->next = job;
+	}
+	pool->last_job = job;
+
+	if (pool->num_idle > 0) {
+		pthread_cond_signal(&pool->condvar);
+		pthread_mutex_unlock(&pool->mutex);
+		return 0;
+	}
+
+	if (pool->num_threads == pool->max_threads) {
+		pthread_mutex_unlock(&pool->mutex);
+		return 0;
+	}
+
+	/* the workers should not receive any signals */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	ret = pthread_create(&pool->threads[pool->num_threads], NULL,
+			     tevent_threadpool_worker, pool);
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	if (ret == 0) {
+		pool->num_threads++;
+	} else if (pool->num_threads > 0) {
+		/* the running threads will get to it */
+		ret = 0;
+	} else {
+		pool->jobs = pool->last_job = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	return ret;
+}
+
+/*
+  run fn(private_data) in a thread of pool.
+
+  private_data must be a talloc pointer or NULL, it is moved to the
+  request while the job runs and moved back when it completes, or
+  freed when the job finishes after the request was freed. fn must
+  not use talloc memory shared with the event loop thread.
+*/
+struct tevent_req *tevent_threadpool_send(TALLOC_CTX *mem_ctx,
+					  struct tevent_context *ev,
+					  struct tevent_threadpool *pool,
+					  void (*fn)(void *private_data),
+					  void *private_data)
+{
+	struct tevent_req *req;
+	struct tevent_threadpool_state *state;
+	struct tevent_threadpool_job *job;
+	int ret;
+
+	req = tevent_req_create(mem_ctx, &state, struct tevent_threadpool_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->pool = pool;
+
+	state->im = tevent_create_immediate(state);
+	job = (struct tevent_threadpool_job *)malloc(sizeof(*job));
+	if (state->im == NULL || job == NULL) {
+		free(job);
+		tevent_req_nomem(NULL, req);
+		return tevent_req_post(req, ev);
+	}
+	job->next = NULL;
+	job->done_next = NULL;
+	job->fn = fn;
+	job->private_data = private_data;
+	job->req = req;
+
+	state->private_parent = talloc_parent(private_data);
+	talloc_steal(state, private_data);
+	state->job = job;
+	talloc_set_destructor(state, tevent_threadpool_state_destructor);
+
+	ret = tevent_threadpool_add_job(pool, job);
+	if (ret != 0) {
+		state->job = NULL;
+		talloc_steal(state->private_parent, private_data);
+		free(job);
+		tevent_req_error(req, ret);
+		return tevent_req_post(req, ev);
+	}
+
+	tevent_req_set_cancel_fn(req, tevent_threadpool_cancel);
+	return req;
+}
+
+#else /* HAVE_TEVENT_THREADPOOL */
+
+/*
+  without threads the jobs run right away, blocking the event loop
+*/
+
+struct tevent_threadpool {
+	uint8_t dummy;
+};
+
+struct tevent_threadpool_state {
+	uint8_t dummy;
+};
+
+struct tevent_threadpool *tevent_threadpool_create(TALLOC_CTX *mem_ctx,
+						   struct tevent_context *ev,
+						   unsigned max_threads)
+{
+	return talloc(mem_ctx, struct tevent_threadpool);
+}
+
+struct tevent_req *tevent_threadpool_send(TALLOC_CTX *mem_ctx,
+					  struct tevent_context *ev,
+					  struct tevent_threadpool *pool,
+					  void (*fn)(void *private_data),
+					  void *private_data)
+{
+	struct tevent_req *req;
+	struct tevent_threadpool_state *state;
+
+	req = tevent_req_create(mem_ctx, &state, struct tevent_threadpool_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	fn(private_data);
+	tevent_req_done(req);
+	return tevent_req_post(req, ev);
+}
+
+#endif /* HAVE_TEVENT_THREADPOOL */
+
+/*
+  returns 0 once the function has run, -1 with *perrno set otherwise,
+  ECANCELED if the request was cancelled before it started
+*/
+int tevent_threadpool_recv(struct tevent_req *req, int *perrno)
+{
+	enum tevent_req_state state;
+	uint64_t error;
+
+	if (!tevent_req_is_error(req, &state, &error)) {
+		tevent_req_received(req);
+		return 0;
+	}
+
+	switch (state) {
+	case TEVENT_REQ_USER_ERROR:
+		*perrno = error;
+		break;
+	case TEVENT_REQ_TIMED_OUT:
+		*perrno = ETIMEDOUT;
+		break;
+	case TEVENT_REQ_NO_MEMORY:
+		*perrno = ENOMEM;
+		break;
+	default:
+		*perrno = EINVAL;
+		break;
+	}
+	tevent_req_received(req);
+	return -1;
+}
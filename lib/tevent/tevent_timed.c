@@ -128,6 +128,126 @@ struct timeval tevent_timeval_current_ofs(uint32_t secs, uint32_t usecs)
 	return tevent_timeval_add(&tv, secs, usecs);
 }
 
+/*
+  The timed events are kept in a binary min-heap, ordered by next_event
+  and for equal times by the order they were added in, so adding and
+  removing one is O(log n) however many are pending.
+  ev->timer_events always points to the root, the first one due.
+*/
+
+/* The heap array never shrinks below this many slots */
+#define TEVENT_TIMER_HEAP_MIN 16
+
+static bool tevent_timer_before(const struct tevent_timer *a,
+				const struct tevent_timer *b)
+{
+	int ret = tevent_timeval_compare(&a->next_event, &b->next_event);
+	if (ret != 0) {
+		return ret < 0;
+	}
+	return a->seq < b->seq;
+}
+
+static void tevent_timer_heap_set(struct tevent_context *ev, size_t i,
+				  struct tevent_timer *te)
+{
+	ev->timer_heap[i] = te;
+	te->heap_index = i;
+}
+
+static void tevent_timer_heap_up(struct tevent_context *ev, size_t i)
+{
+	struct tevent_timer *te = ev->timer_heap[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!tevent_timer_before(te, ev->timer_heap[parent])) {
+			break;
+		}
+		tevent_timer_heap_set(ev, i, ev->timer_heap[parent]);
+		i = parent;
+	}
+	tevent_timer_heap_set(ev, i, te);
+}
+
+static void tevent_timer_heap_down(struct tevent_context *ev, size_t i)
+{
+	struct tevent_timer *te = ev->timer_heap[i];
+
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= ev->num_timers) {
+			break;
+		}
+		if (child + 1 < ev->num_timers &&
+		    tevent_timer_before(ev->timer_heap[child + 1],
+					ev->timer_heap[child])) {
+			child++;
+		}
+		if (!tevent_timer_before(ev->timer_heap[child], te)) {
+			break;
+		}
+		tevent_timer_heap_set(ev, i, ev->timer_heap[child]);
+		i = child;
+	}
+	tevent_timer_heap_set(ev, i, te);
+}
+
+static bool tevent_timer_heap_insert(struct tevent_context *ev,
+				     struct tevent_timer *te)
+{
+	if (ev->num_timers == ev->timer_heap_size) {
+		size_t size = ev->timer_heap_size * 2;
+		struct tevent_timer **heap;
+
+		if (size < TEVENT_TIMER_HEAP_MIN) {
+			size = TEVENT_TIMER_HEAP_MIN;
+		}
+		heap = talloc_realloc(ev, ev->timer_heap,
+				      struct tevent_timer *, size);
+		if (heap == NULL) {
+			return false;
+		}
+		ev->timer_heap = heap;
+		ev->timer_heap_size = size;
+	}
+
+	te->seq = ev->timer_seq++;
+	tevent_timer_heap_set(ev, ev->num_timers++, te);
+	tevent_timer_heap_up(ev, te->heap_index);
+	ev->timer_events = ev->timer_heap[0];
+	return true;
+}
+
+static void tevent_timer_heap_remove(struct tevent_context *ev,
+				     struct tevent_timer *te)
+{
+	size_t i = te->heap_index;
+	struct tevent_timer *last = ev->timer_heap[--ev->num_timers];
+
+	if (i != ev->num_timers) {
+		tevent_timer_heap_set(ev, i, last);
+		if (i > 0 && tevent_timer_before(last, ev->timer_heap[(i - 1) / 2])) {
+			tevent_timer_heap_up(ev, i);
+		} else {
+			tevent_timer_heap_down(ev, i);
+		}
+	}
+	ev->timer_events = ev->num_timers ? ev->timer_heap[0] : NULL;
+
+	/* give memory back after a burst of timers */
+	if (ev->timer_heap_size > TEVENT_TIMER_HEAP_MIN &&
+	    ev->num_timers < ev->timer_heap_size / 4) {
+		struct tevent_timer **heap;
+		heap = talloc_realloc(ev, ev->timer_heap, struct tevent_timer *,
+				      ev->timer_heap_size / 2);
+		if (heap != NULL) {
+			ev->timer_heap = heap;
+			ev->timer_heap_size /= 2;
+		}
+	}
+}
+
 /*
   destroy a timed event
 */
@@ -138,7 +258,7 @@ static int tevent_common_timed_destructor(struct tevent_timer *te)
 		     te, te->handler_name);
 
 	if (te->event_ctx) {
-		DLIST_REMOVE(te->event_ctx->timer_events, te);
+		tevent_timer_heap_remove(te->event_ctx, te);
 	}
 
 	return 0;
@@ -160,7 +280,7 @@ struct tevent_timer *tevent_common_add_timer(struct tevent_context *ev, TALLOC_C
 					     const char *handler_name,
 					     const char *location)
 {
-	struct tevent_timer *te, *last_te, *cur_te;
+	struct tevent_timer *te;
 
 	te = talloc(mem_ctx?mem_ctx:ev, struct tevent_timer);
 	if (te == NULL) return NULL;
@@ -173,19 +293,11 @@ struct tevent_timer *tevent_common_add_timer(struct tevent_context *ev, TALLOC_C
 	te->location		= location;
 	te->additional_data	= NULL;
 
-	/* keep the list ordered */
-	last_te = NULL;
-	for (cur_te = ev->timer_events; cur_te; cur_te = cur_te->next) {
-		/* if the new event comes before the current one break */
-		if (tevent_timeval_compare(&te->next_event, &cur_te->next_event) < 0) {
-			break;
-		}
-
-		last_te = cur_te;
+	if (!tevent_timer_heap_insert(ev, te)) {
+		talloc_free(te);
+		return NULL;
 	}
 
-	DLIST_ADD_AFTER(ev->timer_events, te, last_te);
-
 	talloc_set_destructor(te, tevent_common_timed_destructor);
 
 	tevent_debug(ev, TEVENT_DEBUG_TRACE,
@@ -239,10 +351,10 @@ struct timeval tevent_common_loop_timer_delay(struct tevent_context *ev)
 	/* deny the handler to free the event */
 	talloc_set_destructor(te, tevent_common_timed_deny_destructor);
 
-	/* We need to remove the timer from the list before calling the
+	/* We need to remove the timer from the heap before calling the
 	 * handler because in a semi-async inner event loop called from the
 	 * handler we don't want to come across this event again -- vl */
-	DLIST_REMOVE(ev->timer_events, te);
+	tevent_timer_heap_remove(ev, te);
 
 	/*
 	 * If the timed event was registered for a zero current_time,
@@ -254,7 +366,7 @@ struct timeval tevent_common_loop_timer_delay(struct tevent_context *ev)
 	te->handler(ev, te, current_time, te->private_data);
 
 	/* The destructor isn't necessary anymore, we've already removed the
-	 * event from the list. */
+	 * event from the heap. */
 	talloc_set_destructor(te, NULL);
 
 	tevent_debug(te->event_ctx, TEVENT_DEBUG_TRACE,
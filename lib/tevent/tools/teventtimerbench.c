@@ -0,0 +1,143 @@
+/* time the tevent timer queue: add timers due in random order, many at
+   the same time, cancel every other one and run the rest, reporting
+   the time taken by each step.
+
+   Not part of the test suite, the LOCAL-EVENT timer_order test checks
+   the same steps for correctness on a small count.
+*/
+
+#include "replace.h"
+#include "system/time.h"
+#include "system/filesys.h"
+#include "talloc.h"
+#include "tevent.h"
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+struct bench {
+	int fired;
+	bool in_order;
+	struct timeval last;
+	int last_index;
+};
+
+struct bench_entry {
+	struct bench *b;
+	struct tevent_timer *te;
+	struct timeval when;
+	int index;
+};
+
+static struct timeval tp1,tp2;
+
+static void _start_timer(void)
+{
+	gettimeofday(&tp1,NULL);
+}
+
+static double _end_timer(void)
+{
+	gettimeofday(&tp2,NULL);
+	return((tp2.tv_sec - tp1.tv_sec) +
+	       (tp2.tv_usec - tp1.tv_usec)*1.0e-6);
+}
+
+static void bench_handler(struct tevent_context *ev, struct tevent_timer *te,
+			  struct timeval tval, void *private_data)
+{
+	struct bench_entry *e = (struct bench_entry *)private_data;
+	struct bench *b = e->b;
+	int cmp = tevent_timeval_compare(&e->when, &b->last);
+
+	if (cmp < 0 || (cmp == 0 && e->index < b->last_index)) {
+		b->in_order = false;
+	}
+	b->last = e->when;
+	b->last_index = e->index;
+	e->te = NULL;
+	b->fired++;
+}
+
+static void usage(void)
+{
+	printf("Usage: teventtimerbench [-n NUM_TIMERS]\n");
+	exit(0);
+}
+
+ int main(int argc, char * const *argv)
+{
+	struct tevent_context *ev;
+	struct bench b;
+	struct bench_entry *e;
+	int num = 1000000;
+	uint32_t r = 1;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "n:h")) != -1) {
+		switch (c) {
+		case 'n':
+			num = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (num <= 0) {
+		usage();
+	}
+
+	ev = tevent_context_init(NULL);
+	e = talloc_array(ev, struct bench_entry, num);
+	if (ev == NULL || e == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.in_order = true;
+	b.last_index = -1;
+
+	_start_timer();
+	for (i = 0; i < num; i++) {
+		r = r * 1103515245 + 12345;
+		e[i].b = &b;
+		e[i].index = i;
+		/* all in the past, so they are due at once */
+		e[i].when = tevent_timeval_set(1, (r >> 8) % 100000);
+		e[i].te = tevent_add_timer(ev, ev, e[i].when,
+					   bench_handler, &e[i]);
+		if (e[i].te == NULL) {
+			fprintf(stderr, "tevent_add_timer failed\n");
+			exit(1);
+		}
+	}
+	printf("added     %8d timers in %.3f sec\n", num, _end_timer());
+
+	_start_timer();
+	for (i = 1; i < num; i += 2) {
+		talloc_free(e[i].te);
+		e[i].te = NULL;
+	}
+	printf("cancelled %8d timers in %.3f sec\n", num / 2, _end_timer());
+
+	_start_timer();
+	while (b.fired < num - num / 2) {
+		if (tevent_loop_once(ev) == -1) {
+			break;
+		}
+	}
+	printf("ran       %8d timers in %.3f sec\n", b.fired, _end_timer());
+
+	if (b.fired != num - num / 2 || !b.in_order) {
+		fprintf(stderr, "timers fired %s\n",
+			b.in_order ? "short" : "out of order");
+		exit(1);
+	}
+
+	talloc_free(ev);
+
+	return 0;
+}
@@ -727,6 +727,7 @@ sub provision($$$$$$$)
 
 	max xmit = 32K
 	server max protocol = SMB2
+	server services = smb rpc nbt wrepl ldap cldap kdc drepl winbind ntp_signd kcc ahexec
 
 [tmp]
 	path = $ctx->{tmpdir}
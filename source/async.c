@@ -14,94 +14,215 @@
 #include <util/time.h>
 #include <smb_cliraw.h>
 #include <util/debug.h>
+#ifdef HAVE_SMB2
+#include <libcli/smb2/smb2.h>
+#include <libcli/smb2/smb2_calls.h>
+#endif
 
 #include "async.h"
 
+#ifndef MIN_SMB_SIZE
+#define MIN_SMB_SIZE 35
+#endif
+
 static int async_read(struct async_context *c);
 
-static void list_enqueue(struct data_list *l, const void *data, int size)
+static int ring_put(struct async_context *c, const char *data, int len)
 {
-	struct list_item *li = talloc_size(0, sizeof(struct list_item) + size);
-	memcpy(li->data, data, size);
-	li->size = size;
-	li->next = 0;
-	if (l->end)
-		l->end->next = li;
-	else
-		l->begin = li;
-	l->end = li;
+	struct async_ring *r = &c->wq;
+	int end, n;
+
+	if (!len)
+		return 1;
+	if (r->len + len > r->size) {
+		int size = r->size ? r->size : ASYNC_WQ_MIN;
+		char *buf;
+
+		while (size < r->len + len)
+			size *= 2;
+		buf = talloc_size(c, size);
+		if (!buf)
+			return 0;
+		/* Unwrap the queued bytes to the start of the new buffer */
+		n = r->size - r->start;
+		if (n > r->len)
+			n = r->len;
+		if (r->len) {
+			memcpy(buf, r->data + r->start, n);
+			memcpy(buf + n, r->data, r->len - n);
+		}
+		talloc_free(r->data);
+		r->data = buf;
+		r->size = size;
+		r->start = 0;
+	}
+	end = (r->start + r->len) % r->size;
+	n = r->size - end;
+	if (n > len)
+		n = len;
+	memcpy(r->data + end, data, n);
+	memcpy(r->data, data + n, len - n);
+	r->len += len;
+	return 1;
 }
 
-static void list_dequeue(struct data_list *l)
+/* Returns len contiguous bytes from the head of the ring */
+static const char *ring_peek(struct async_context *c, int len)
 {
-	struct list_item *li = l->begin;
-	if (!li)
-		return;
-	l->begin = li->next;
-	if (!l->begin)
-		l->end = 0;
-	talloc_free(li);
+	struct async_ring *r = &c->wq;
+	int n = r->size - r->start;
+
+	if (len <= n)
+		return r->data + r->start;
+	if (!c->wbuf) {
+		c->wbuf = talloc_size(c, ASYNC_WRITE_MAX);
+		if (!c->wbuf)
+			return NULL;
+	}
+	memcpy(c->wbuf, r->data + r->start, n);
+	memcpy(c->wbuf + n, r->data, len - n);
+	return c->wbuf;
 }
 
-static void async_read_recv(struct smbcli_request *req)
+static void ring_consume(struct async_ring *r, int len)
 {
-	struct async_context *c = req->async.private_data;
-	NTSTATUS status;
+	r->len -= len;
+	r->start = r->len ? (r->start + len) % r->size : 0;
+}
 
-	status = smb_raw_read_recv(req, c->io_read);
-	c->rreq = NULL;
-	if (!NT_STATUS_IS_OK(status)) {
-		DEBUG(1, ("ERROR: smb_raw_read_recv - %s\n", nt_errstr(status)));
-		if (c->cb_error)
-			c->cb_error(c->cb_ctx, ASYNC_READ_RECV, status);
-		return;
-	}
+static int async_window(int window)
+{
+	if (window < 1)
+		return 1;
+	if (window > ASYNC_WINDOW_MAX)
+		return ASYNC_WINDOW_MAX;
+	return window;
+}
+
+/* Deliver in issue order, a reply waits for the ones sent before it */
+static void async_read_done(struct async_read_slot *s)
+{
+	struct async_context *c = s->c;
 
-	if (c->cb_read)
-		c->cb_read(c->cb_ctx, c->buffer, c->io_read->readx.out.nread);
+	s->done = 1;
+	while (c->read_head != c->read_tail && !c->closing) {
+		s = c->reads[c->read_head % ASYNC_WINDOW_MAX];
+		if (!s->done)
+			break;
+		s->done = 0;
+		c->read_head++;
+		if (c->read_failed)
+			continue;
+		if (!NT_STATUS_IS_OK(s->status)) {
+			DEBUG(1, ("ERROR: async_read_recv - %s\n", nt_errstr(s->status)));
+			c->read_failed = 1;
+			if (c->cb_error)
+				c->cb_error(c->cb_ctx, ASYNC_READ_RECV, s->status);
+			continue;
+		}
+
+		if (c->stats) {
+			c->stats->reads++;
+			c->stats->bytes_read += s->nread;
+		}
+		if (c->cb_read)
+			c->cb_read(c->cb_ctx, s->data, s->nread);
+
+		/* A full read means more data is waiting, ask for more next time */
+		if (s->nread == s->size && c->read_size == s->size)
+			c->read_size *= 2;
+	}
 
 	async_read(c);
 }
 
-static void async_write_recv(struct smbcli_request *req)
+static void async_read_recv(struct smbcli_request *req)
 {
-	struct async_context *c = req->async.private_data;
-	NTSTATUS status;
+	struct async_read_slot *s = req->async.private_data;
+
+	s->status = smb_raw_read_recv(req, &s->io);
+	s->req = NULL;
+	s->data = s->buffer;
+	s->nread = s->io.readx.out.nread;
+	async_read_done(s);
+}
+
+static int async_write_send(struct async_context *c, const void *buf, int len);
+
+/* Largest write the transport allows, see smbcli_smbwrite() */
+static int async_write_limit(struct async_context *c)
+{
+	int limit;
+
+	if (c->tree2)
+		return ASYNC_WRITE_MAX;
+	limit = c->tree->session->transport->negotiate.max_xmit - 48;
+	if (limit > ASYNC_WRITE_MAX)
+		limit = ASYNC_WRITE_MAX;
+	if (limit < ASYNC_READ_MIN)
+		limit = ASYNC_READ_MIN;
+	return limit;
+}
+
+static void async_write_flush(struct async_context *c)
+{
+	int window = async_window(c->write_window);
+	int limit = async_write_limit(c);
+	const char *data;
+	int len;
+
+	while (c->wq.len && !c->closing && c->writes_pending < window) {
+		len = c->wq.len < limit ? c->wq.len : limit;
+		data = ring_peek(c, len);
+		if (!data || !async_write_send(c, data, len)) {
+			DEBUG(1, ("ERROR: async_write_flush\n"));
+			return;
+		}
+		ring_consume(&c->wq, len);
+	}
+}
+
+static void async_write_done(struct async_write_slot *w, NTSTATUS status)
+{
+	struct async_write_slot **pw;
+	struct async_context *c = w->c;
 
-	status = smb_raw_write_recv(req, c->io_write);
-	c->wreq = NULL;
+	for (pw = &c->writes; *pw != w; pw = &(*pw)->next)
+		;
+	*pw = w->next;
+	if (NT_STATUS_IS_OK(status) && c->stats) {
+		c->stats->writes++;
+		c->stats->bytes_written += w->len;
+	}
+	talloc_free(w);
+	c->writes_pending--;
 	if (!NT_STATUS_IS_OK(status)) {
-		DEBUG(1, ("ERROR: smb_raw_write_recv - %s\n", nt_errstr(status)));
-		talloc_free(c->io_write);
-		c->io_write = 0;
+		DEBUG(1, ("ERROR: async_write_recv - %s\n", nt_errstr(status)));
 		if (c->cb_error)
 			c->cb_error(c->cb_ctx, ASYNC_WRITE_RECV, status);
 		return;
 	}
 
+	/* Refill the window first so cb_write sees what is still queued */
+	async_write_flush(c);
+
 	if (c->cb_write)
 		c->cb_write(c->cb_ctx);
-
-	if (c->wq.begin) {
-		async_write(c, c->wq.begin->data, c->wq.begin->size);
-		list_dequeue(&c->wq);
-	}
 }
 
-static void async_open_recv(struct smbcli_request *req)
+static void async_write_recv(struct smbcli_request *req)
 {
-	struct async_context *c = req->async.private_data;
-	NTSTATUS status;
+	struct async_write_slot *w = req->async.private_data;
 
-	DEBUG(1, ("IN: async_open_recv\n"));
-	status = smb_raw_open_recv(req, c, c->io_open);
-	c->rreq = NULL;
-	if (NT_STATUS_IS_OK(status))
-		c->fd = c->io_open->ntcreatex.out.file.fnum;
+	async_write_done(w, smb_raw_write_recv(req, &w->io));
+}
+
+static void async_open_done(struct async_context *c, NTSTATUS status)
+{
 	talloc_free(c->io_open);
 	c->io_open = 0;
 	if (!NT_STATUS_IS_OK(status)) {
-		DEBUG(1, ("ERROR: smb_raw_open_recv - %s\n", nt_errstr(status)));
+		DEBUG(1, ("ERROR: async_open_recv - %s\n", nt_errstr(status)));
 		if (c->cb_error)
 			c->cb_error(c->cb_ctx, ASYNC_OPEN_RECV, status);
 		return;
@@ -111,60 +232,292 @@ static void async_open_recv(struct smbcli_request *req)
 	async_read(c);
 }
 
-static void async_close_recv(struct smbcli_request *req)
+static void async_open_recv(struct smbcli_request *req)
 {
 	struct async_context *c = req->async.private_data;
+	NTSTATUS status;
 
-	smbcli_request_simple_recv(req);
+	DEBUG(1, ("IN: async_open_recv\n"));
+	status = smb_raw_open_recv(req, c, c->io_open);
+	c->rreq = NULL;
+	if (NT_STATUS_IS_OK(status))
+		c->fd = c->io_open->ntcreatex.out.file.fnum;
+	async_open_done(c, status);
+}
+
+static void async_close_done(struct async_context *c)
+{
 	talloc_free(c->io_close);
 	c->io_close = 0;
 	if (c->io_open) {
 		talloc_free(c->io_open);
 		c->io_open = 0;
 	}
-	if (c->io_read) {
-		talloc_free(c->io_read);
-		c->io_read = 0;
-	}
-	if (c->io_write) {
-		talloc_free(c->io_write);
-		c->io_write = 0;
-	}
 	if (c->cb_close)
 		c->cb_close(c->cb_ctx);
 }
 
+static void async_close_recv(struct smbcli_request *req)
+{
+	struct async_context *c = req->async.private_data;
+
+	smbcli_request_simple_recv(req);
+	async_close_done(c);
+}
+
+/* Largest read the transport allows, see smbcli_read() */
+static int async_read_limit(struct async_context *c)
+{
+	int limit = ASYNC_READ_MAX;
+
+	if (!c->tree2)
+		limit = c->tree->session->transport->negotiate.max_xmit - (MIN_SMB_SIZE + 32);
+	if (limit > ASYNC_READ_MAX)
+		limit = ASYNC_READ_MAX;
+	if (c->read_max && limit > c->read_max)
+		limit = c->read_max;
+	if (limit < ASYNC_READ_MIN)
+		limit = ASYNC_READ_MIN;
+	return limit;
+}
+
+static int async_read_send(struct async_context *c, struct async_read_slot *s)
+{
+	if (s->buffer_size < s->size) {
+		char *buffer = talloc_realloc(s, s->buffer, char, s->size);
+		if (!buffer)
+			return 0;
+		s->buffer = buffer;
+		s->buffer_size = s->size;
+	}
+	s->io.readx.level = RAW_READ_READX;
+	s->io.readx.in.file.fnum = c->fd;
+	s->io.readx.in.offset = 0;
+	s->io.readx.in.remaining = 0;
+	s->io.readx.in.read_for_execute = false;
+	s->io.readx.in.mincnt = s->size;
+	s->io.readx.in.maxcnt = s->size;
+	s->io.readx.out.data = (uint8_t *)s->buffer;
+	s->req = smb_raw_read_send(c->tree, &s->io);
+	if (!s->req)
+		return 0;
+	s->req->transport->options.request_timeout = 0;
+	s->req->async.fn = async_read_recv;
+	s->req->async.private_data = s;
+	return 1;
+}
+
+#ifdef HAVE_SMB2
+static int async_read_send2(struct async_context *c, struct async_read_slot *s);
+#endif
+
+/* Sends one more read at the tail of the window */
+static int async_read_issue(struct async_context *c)
+{
+	int limit = async_read_limit(c);
+	struct async_read_slot *s;
+	int ok;
+
+	if (c->read_size < ASYNC_READ_MIN)
+		c->read_size = ASYNC_READ_MIN;
+	if (c->read_size > limit)
+		c->read_size = limit;
+	s = c->reads[c->read_tail % ASYNC_WINDOW_MAX];
+	if (!s) {
+		s = talloc_zero(c, struct async_read_slot);
+		if (!s)
+			return 0;
+		s->c = c;
+		c->reads[c->read_tail % ASYNC_WINDOW_MAX] = s;
+	}
+	s->size = c->read_size;
+	s->done = 0;
+#ifdef HAVE_SMB2
+	if (c->tree2)
+		ok = async_read_send2(c, s);
+	else
+#endif
+	ok = async_read_send(c, s);
+	if (!ok)
+		return 0;
+	c->read_tail++;
+	return 1;
+}
+
 static int async_read(struct async_context *c)
 {
-	if (!c->io_read) {
-		c->io_read = talloc(c->tree, union smb_read);
-		c->io_read->readx.level = RAW_READ_READX;
-		c->io_read->readx.in.file.fnum = c->fd;
-		c->io_read->readx.in.offset = 0;
-		c->io_read->readx.in.mincnt = sizeof(c->buffer);
-		c->io_read->readx.in.maxcnt = sizeof(c->buffer);
-		c->io_read->readx.in.remaining = 0;
-		c->io_read->readx.in.read_for_execute = false;
-		c->io_read->readx.out.data = (uint8_t *)c->buffer;
-	}
-	c->rreq = smb_raw_read_send(c->tree, c->io_read);
-	if (!c->rreq) {
-		if (c->cb_error)
-			c->cb_error(c->cb_ctx, ASYNC_READ, NT_STATUS_NO_MEMORY);
+	unsigned int window = async_window(c->read_window);
+
+	while (!c->closing && !c->read_failed && !c->read_paused && c->read_tail - c->read_head < window) {
+		if (!async_read_issue(c))
+			goto failed;
+	}
+	return 1;
+
+  failed:
+	/* Reads already in flight keep the pipe going, try again after them */
+	if (c->read_tail != c->read_head)
+		return 1;
+	if (c->cb_error)
+		c->cb_error(c->cb_ctx, ASYNC_READ, NT_STATUS_NO_MEMORY);
+	return 0;
+}
+
+#ifdef HAVE_SMB2
+static void async_read_recv2(struct smb2_request *req)
+{
+	struct async_read_slot *s = req->async.private_data;
+
+	s->status = smb2_read_recv(req, s, &s->io.smb2);
+	s->req2 = NULL;
+	s->data = (const char *)s->io.smb2.out.data.data;
+	s->nread = s->io.smb2.out.data.length;
+	async_read_done(s);
+}
+
+static int async_read_send2(struct async_context *c, struct async_read_slot *s)
+{
+	/* The previous reply of this slot has been delivered by now */
+	data_blob_free(&s->io.smb2.out.data);
+	ZERO_STRUCT(s->io.smb2);
+	s->io.smb2.level = RAW_READ_SMB2;
+	s->io.smb2.in.file.handle = c->handle;
+	s->io.smb2.in.length = s->size;
+	s->io.smb2.in.offset = 0;
+	s->io.smb2.in.min_count = 0;
+	c->tree2->session->transport->options.request_timeout = 0;
+	s->req2 = smb2_read_send(c->tree2, &s->io.smb2);
+	if (!s->req2)
 		return 0;
+	s->req2->async.fn = async_read_recv2;
+	s->req2->async.private_data = s;
+	return 1;
+}
+
+static void async_write_recv2(struct smb2_request *req)
+{
+	struct async_write_slot *w = req->async.private_data;
+
+	async_write_done(w, smb2_write_recv(req, &w->io.smb2));
+}
+
+static int async_write_send2(struct async_context *c, struct async_write_slot *w, const void *buf, int len)
+{
+	w->io.smb2.level = RAW_WRITE_SMB2;
+	w->io.smb2.in.file.handle = c->handle;
+	w->io.smb2.in.offset = 0;
+	w->io.smb2.in.data = data_blob_const(buf, len);
+	w->req2 = smb2_write_send(c->tree2, &w->io.smb2);
+	if (!w->req2)
+		return 0;
+	w->req2->async.fn = async_write_recv2;
+	w->req2->async.private_data = w;
+	return 1;
+}
+
+static void async_open_recv2(struct smb2_request *req)
+{
+	struct async_context *c = req->async.private_data;
+	struct async_read_slot *s = c->reads[0];
+	NTSTATUS status;
+
+	DEBUG(1, ("IN: async_open_recv2\n"));
+	status = smb2_create_recv(req, c, &c->io_open->smb2);
+	c->rreq2 = NULL;
+	if (NT_STATUS_IS_OK(status)) {
+		c->handle = c->io_open->smb2.out.file.handle;
+	} else if (s && s->req2) {
+		/* The compounded read fails along, nobody wants to hear about it */
+		TALLOC_FREE(s->req2);
+		c->read_head = c->read_tail;
+	}
+	async_open_done(c, status);
+}
+
+static int async_open2(struct async_context *c, const char *fn)
+{
+	struct smb2_transport *transport = c->tree2->session->transport;
+	struct smb2_create *io = &c->io_open->smb2;
+
+	io->level = RAW_OPEN_SMB2;
+	io->in.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	io->in.desired_access =
+		SEC_STD_READ_CONTROL |
+		SEC_FILE_WRITE_ATTRIBUTE |
+		SEC_FILE_WRITE_EA |
+		SEC_FILE_READ_DATA |
+		SEC_FILE_WRITE_DATA;
+	io->in.share_access = NTCREATEX_SHARE_ACCESS_READ | NTCREATEX_SHARE_ACCESS_WRITE;
+	io->in.create_disposition = NTCREATEX_DISP_OPEN;
+	io->in.create_options = NTCREATEX_OPTIONS_NON_DIRECTORY_FILE | NTCREATEX_OPTIONS_WRITE_THROUGH;
+	/* SMB2 names are relative to the share */
+	while (*fn == '\\')
+		++fn;
+	io->in.fname = fn;
+
+	if (transport->credits.ask_num < ASYNC_SMB2_CREDITS)
+		smb2_transport_credits_ask_num(transport, ASYNC_SMB2_CREDITS);
+
+	/* The first read goes out in the same packet, on the handle being created */
+	smb2_transport_compound_start(transport, 2);
+	smb2_transport_compound_set_related(transport, true);
+	c->rreq2 = smb2_create_send(c->tree2, io);
+	if (!c->rreq2)
+		goto failed;
+	c->rreq2->async.fn = async_open_recv2;
+	c->rreq2->async.private_data = c;
+	c->handle.data[0] = UINT64_MAX;
+	c->handle.data[1] = UINT64_MAX;
+	if (!async_read_issue(c)) {
+		TALLOC_FREE(c->rreq2);
+		goto failed;
 	}
-	c->rreq->transport->options.request_timeout = 0;
-	c->rreq->async.fn = async_read_recv;
-	c->rreq->async.private_data = c;
+	return 1;
+
+  failed:
+	smb2_transport_compound_start(transport, 0);
+	return 0;
+}
+
+static void async_close_recv2(struct smb2_request *req)
+{
+	struct async_context *c = req->async.private_data;
+
+	smb2_close_recv(req, &c->io_close->smb2);
+	async_close_done(c);
+}
+
+static int async_close2(struct async_context *c)
+{
+	struct smb2_request *req;
+
+	c->io_close->smb2.level = RAW_CLOSE_SMB2;
+	c->io_close->smb2.in.file.handle = c->handle;
+	req = smb2_close_send(c->tree2, &c->io_close->smb2);
+	if (!req)
+		return 0;
+	req->async.fn = async_close_recv2;
+	req->async.private_data = c;
 	return 1;
 }
+#endif
 
 int async_open(struct async_context *c, const char *fn, int open_mode)
 {
 	DEBUG(1, ("IN: async_open(%s, %d)\n", fn, open_mode));
+	c->closing = 0;
+	c->read_failed = 0;
+	c->read_head = c->read_tail = 0;
 	c->io_open = talloc_zero(c, union smb_open);
 	if (!c->io_open)
 		goto failed;
+#ifdef HAVE_SMB2
+	if (c->tree2) {
+		if (async_open2(c, fn))
+			return 1;
+		goto failed;
+	}
+#endif
 	c->io_open->ntcreatex.level = RAW_OPEN_NTCREATEX;
 	c->io_open->ntcreatex.in.flags = 0;
 	c->io_open->ntcreatex.in.root_fid.fnum = 0;
@@ -192,50 +545,118 @@ int async_open(struct async_context *c, const char *fn, int open_mode)
 	return 0;
 }
 
+static int async_write_send(struct async_context *c, const void *buf, int len)
+{
+	struct async_write_slot *w = talloc_zero(c, struct async_write_slot);
+	int ok;
+
+	if (!w)
+		return 0;
+	w->c = c;
+	w->len = len;
+#ifdef HAVE_SMB2
+	if (c->tree2)
+		ok = async_write_send2(c, w, buf, len);
+	else
+#endif
+	{
+		w->io.write.level = RAW_WRITE_WRITE;
+		w->io.write.in.remaining = 0;
+		w->io.write.in.file.fnum = c->fd;
+		w->io.write.in.offset = 0;
+		w->io.write.in.count = len;
+		w->io.write.in.data = buf;
+		w->req = smb_raw_write_send(c->tree, &w->io);
+		ok = w->req != NULL;
+		if (ok) {
+			w->req->async.fn = async_write_recv;
+			w->req->async.private_data = w;
+		}
+	}
+	if (!ok) {
+		talloc_free(w);
+		return 0;
+	}
+	w->next = c->writes;
+	c->writes = w;
+	c->writes_pending++;
+	return 1;
+}
+
 int async_write(struct async_context *c, const void *buf, int len)
 {
-	if (c->wreq) {
-		list_enqueue(&c->wq, buf, len);
+	if (!ring_put(c, buf, len)) {
+		DEBUG(1, ("ERROR: async_write\n"));
 		return 0;
 	}
-	if (!c->io_write) {
-		c->io_write = talloc_zero(c, union smb_write);
-		if (!c->io_write)
-			goto failed;
-		c->io_write->write.level = RAW_WRITE_WRITE;
-		c->io_write->write.in.remaining = 0;
-		c->io_write->write.in.file.fnum = c->fd;
-		c->io_write->write.in.offset = 0;
-	}
-	c->io_write->write.in.count = len;
-	c->io_write->write.in.data = buf;
-	struct smbcli_request *req = smb_raw_write_send(c->tree, c->io_write);
-	if (!req)
-		goto failed;
-	req->async.fn = async_write_recv;
-	req->async.private_data = c;
+	async_write_flush(c);
 	return 1;
-  failed:
-	DEBUG(1, ("ERROR: async_write\n"));
-	talloc_free(c->io_write);
-	c->io_write = 0;
-	return 0;
+}
+
+/* Bytes given to async_write() and not sent yet */
+int async_write_queued(struct async_context *c)
+{
+	return c->wq.len;
+}
+
+/* Writes sent and not answered yet */
+int async_write_pending(struct async_context *c)
+{
+	return c->writes_pending;
+}
+
+/* While paused no reads are sent, the ones in flight are still delivered */
+void async_read_pause(struct async_context *c, int pause)
+{
+	c->read_paused = pause;
+	/* An open in flight starts the reads itself */
+	if (!pause && !c->io_open)
+		async_read(c);
 }
 
 int async_close(struct async_context *c)
 {
+	struct async_write_slot *w;
+	struct smbcli_request *req;
+	int i;
+
+	c->closing = 1;
 	if (c->rreq)
 		smbcli_request_destroy(c->rreq);
-	if (c->wreq)
-		smbcli_request_destroy(c->wreq);
-	c->rreq = c->wreq = NULL;
+	c->rreq = NULL;
+	TALLOC_FREE(c->rreq2);
+	for (i = 0; i < ASYNC_WINDOW_MAX; ++i) {
+		if (!c->reads[i])
+			continue;
+		if (c->reads[i]->req)
+			smbcli_request_destroy(c->reads[i]->req);
+		c->reads[i]->req = NULL;
+		TALLOC_FREE(c->reads[i]->req2);
+	}
+	c->read_head = c->read_tail;
+	while ((w = c->writes)) {
+		c->writes = w->next;
+		if (w->req)
+			smbcli_request_destroy(w->req);
+		talloc_free(w->req2);
+		talloc_free(w);
+	}
+	c->writes_pending = 0;
+	ring_consume(&c->wq, c->wq.len);
 	c->io_close = talloc_zero(c, union smb_close);
 	if (!c->io_close)
 		goto failed;
+#ifdef HAVE_SMB2
+	if (c->tree2) {
+		if (async_close2(c))
+			return 1;
+		goto failed;
+	}
+#endif
 	c->io_close->close.level = RAW_CLOSE_CLOSE;
 	c->io_close->close.in.file.fnum = c->fd;
 	c->io_close->close.in.write_time = 0;
-	struct smbcli_request *req = smb_raw_close_send(c->tree, c->io_close);
+	req = smb_raw_close_send(c->tree, c->io_close);
 	if (!req)
 		goto failed;
 	req->async.fn = async_close_recv;
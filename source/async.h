@@ -4,6 +4,41 @@
   License: GNU General Public License version 3
 */
 
+/*
+  Reads start at ASYNC_READ_MIN bytes and double every time one comes back
+  full, up to what the transport can carry in one READX.
+*/
+#define ASYNC_READ_MIN 256
+#define ASYNC_READ_MAX 0xFFFF
+
+/*
+  Up to read_window READX and write_window WRITE requests may be in flight
+  at once. Reads are handed to cb_read in the order they were issued,
+  whatever order the replies come back in; writes are issued in the order
+  async_write() was called and rely on the server applying them in that
+  order, as it does for a single pipe handle.
+*/
+#define ASYNC_WINDOW_MAX 16
+
+/*
+  Data given to async_write() while write_window writes are in flight is
+  kept in a ring buffer and sent as one write of up to what the transport
+  carries once a slot frees up. The ring grows as needed, producers which
+  can wait should check async_write_queued() and hold back.
+*/
+#define ASYNC_WRITE_MAX 0xFFFF
+#define ASYNC_WQ_MIN 4096
+
+/*
+  With tree2 set the pipe is driven over SMB2 instead: the create goes out
+  compounded with the first read and enough credits are asked for to keep
+  the windows of all pipes of a connection in flight. Needs HAVE_SMB2.
+*/
+#define ASYNC_SMB2_CREDITS (4 * ASYNC_WINDOW_MAX)
+
+struct smb2_tree;
+struct smb2_request;
+
 enum { ASYNC_OPEN, ASYNC_OPEN_RECV, ASYNC_READ, ASYNC_READ_RECV,
        ASYNC_WRITE, ASYNC_WRITE_RECV, ASYNC_CLOSE, ASYNC_CLOSE_RECV };
 
@@ -13,38 +48,84 @@ typedef void (*async_cb_write) (void *ctx);
 typedef void (*async_cb_close) (void *ctx);
 typedef void (*async_cb_error) (void *ctx, int func, NTSTATUS status);
 
-struct list_item {
-	struct list_item *next;
+/* Completed requests and bytes moved, for reports */
+struct async_stats {
+	unsigned int reads;
+	unsigned int writes;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
+struct async_ring {
+	char *data;
+	int size;
+	int start;
+	int len;
+};
+
+struct async_read_slot {
+	struct async_context *c;
+	struct smbcli_request *req;
+	struct smb2_request *req2;
+	union smb_read io;
+	char *buffer;
+	int buffer_size;
 	int size;
-	char data[0];
+	int done;
+	NTSTATUS status;
+	const char *data;
+	int nread;
 };
 
-struct data_list {
-	struct list_item *begin;
-	struct list_item *end;
+struct async_write_slot {
+	struct async_write_slot *next;
+	struct async_context *c;
+	struct smbcli_request *req;
+	struct smb2_request *req2;
+	union smb_write io;
+	int len;
 };
 
 struct async_context {
-/* Public - must be initialized by client */
+/* Public - must be initialized by client, tree2 instead of tree for SMB2 */
 	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
 	void *cb_ctx;
 	async_cb_open cb_open;
 	async_cb_read cb_read;
 	async_cb_write cb_write;
 	async_cb_close cb_close;
 	async_cb_error cb_error;
+/* Public - optional, 0 means no limit besides the transport */
+	int read_max;
+/* Public - optional, requests kept in flight, 0 means 1 */
+	int read_window;
+	int write_window;
+/* Public - optional, counters are added to it and it may outlive the pipe */
+	struct async_stats *stats;
 /* Private - internal usage, initialize to zeros */
 	int fd;
+	struct smb2_handle handle;
 	union smb_open *io_open;
-	union smb_read *io_read;
-	union smb_write *io_write;
 	union smb_close *io_close;
 	struct smbcli_request *rreq;
-	struct smbcli_request *wreq;
-	struct data_list wq;
-	char buffer[256];
+	struct smb2_request *rreq2;
+	struct async_ring wq;
+	char *wbuf;
+	struct async_read_slot *reads[ASYNC_WINDOW_MAX];
+	unsigned int read_head;
+	unsigned int read_tail;
+	int read_size;
+	int read_failed;
+	int read_paused;
+	struct async_write_slot *writes;
+	int writes_pending;
+	int closing;
 };
 
 int async_open(struct async_context *c, const char *fn, int open_mode);
 int async_write(struct async_context *c, const void *buf, int len);
+int async_write_queued(struct async_context *c);
+int async_write_pending(struct async_context *c);
+void async_read_pause(struct async_context *c, int pause);
 int async_close(struct async_context *c);
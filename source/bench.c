@@ -0,0 +1,368 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+
+/*
+  winexe-bench: runs COMMAND on HOST a number of times through libwinexe
+  and reports commands per second, the latency to the first byte of
+  standard output and the standard output throughput.  Meant to be
+  pointed at a samba server with the "ahexec" service, which stands in
+  for the winexe service on Linux, so client changes can be measured
+  without a Windows host.
+*/
+
+#include <sys/fcntl.h>
+#include <sys/unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <tevent.h>
+#include <popt.h>
+#include <util/memory.h>
+#include <credentials.h>
+#include <util/time.h>
+#include <util/debug.h>
+#include <smb_cliraw.h>
+#include <smb_cli.h>
+#include <dcerpc.h>
+#include <iconv.h>
+#include <errno.h>
+
+#include "async.h"
+#include "svcinstall.h"
+#include "hostcache.h"
+#include "transfer.h"
+#include "winexesvc.h"
+#include "winexe.h"
+
+#define DEFAULT_COUNT 100
+#define DEFAULT_WINDOW 4
+
+struct bench_context;
+
+/* One run of the command */
+struct bench_cmd {
+	struct bench_context *b;
+	struct timeval start;
+	/* Until the first byte of stdout, -1 if there was none */
+	int64_t first_usec;
+};
+
+struct bench_context {
+	struct program_options *args;
+	struct tevent_context *ev;
+	struct loadparm_context *lp_ctx;
+	int count;
+	int parallel;
+	int started;
+	int finished;
+	int failed;
+	uint64_t out_bytes;
+	uint64_t err_bytes;
+	int64_t *first_usec;
+	int num_first;
+	/* Commands are timed from here, with --reuse once the pipe is ready */
+	struct timeval start;
+	/* --reuse: the parked control pipe the commands run on as jobs */
+	struct winexe_context *owner;
+};
+
+static void bench_start_next(struct bench_context *b);
+
+static void bench_output(struct bench_cmd *cmd, int fd, const char *data, int len)
+{
+	struct bench_context *b = cmd->b;
+
+	if (fd == 2) {
+		b->err_bytes += len;
+		return;
+	}
+	if (cmd->first_usec < 0 && len > 0) {
+		struct timeval now = timeval_current();
+		cmd->first_usec = usec_time_diff(&now, &cmd->start);
+	}
+	b->out_bytes += len;
+}
+
+static void bench_cmd_done(struct bench_cmd *cmd, int return_code, const char *status)
+{
+	struct bench_context *b = cmd->b;
+
+	++b->finished;
+	if (return_code || strcmp(status, "done")) {
+		DEBUG(1, ("Command %d: status %s, return code %d\n", b->finished, status, return_code));
+		++b->failed;
+	}
+	if (cmd->first_usec >= 0)
+		b->first_usec[b->num_first++] = cmd->first_usec;
+	talloc_free(cmd);
+}
+
+static void bench_run_done(struct tevent_req *req)
+{
+	struct bench_cmd *cmd = tevent_req_callback_data(req, struct bench_cmd);
+	struct bench_context *b = cmd->b;
+	int return_code = RET_CODE_UNKNOWN_ERROR;
+	const char *status = "unknown-error";
+	NTSTATUS ret;
+
+	ret = winexe_run_recv(req, &return_code, &status, NULL);
+	talloc_free(req);
+	if (!NT_STATUS_IS_OK(ret))
+		DEBUG(0, ("ERROR: Command failed - %s\n", nt_errstr(ret)));
+	bench_cmd_done(cmd, return_code, status);
+	bench_start_next(b);
+}
+
+static void bench_next_handler(struct tevent_context *ev, struct tevent_timer *te,
+                               struct timeval current_time, void *private_data)
+{
+	bench_start_next(talloc_get_type(private_data, struct bench_context));
+}
+
+/* Called as the job is freed, the next one is started from a zero timer */
+static void bench_job_finish(struct bench_cmd *cmd, struct winexe_context *c)
+{
+	struct bench_context *b = cmd->b;
+
+	bench_cmd_done(cmd, c->return_code, c->status);
+	tevent_add_timer(b->ev, b, timeval_zero(), bench_next_handler, b);
+}
+
+static int bench_start_job(struct bench_context *b, struct bench_cmd *cmd)
+{
+	struct winexe_context *c;
+
+	c = winexe_job_init(b, b->owner, b->args);
+	if (c == NULL)
+		return 0;
+	c->cb_ctx = cmd;
+	c->cb_output = (winexe_cb_output) bench_output;
+	c->cb_finish = (winexe_cb_finish) bench_job_finish;
+	c->stdin_mode = STDIN_NONE;
+	winexe_context_run(c);
+	return 1;
+}
+
+static void bench_start_next(struct bench_context *b)
+{
+	while (b->started < b->count && b->started - b->finished < b->parallel) {
+		struct bench_cmd *cmd;
+		struct tevent_req *req;
+
+		cmd = talloc_zero(b, struct bench_cmd);
+		if (cmd == NULL)
+			break;
+		cmd->b = b;
+		cmd->first_usec = -1;
+		cmd->start = timeval_current();
+		++b->started;
+
+		if (b->owner) {
+			if (!bench_start_job(b, cmd)) {
+				DEBUG(0, ("ERROR: Cannot start a job, the service needs version %d.%d\n",
+				          JOBS_MIN_VERSION / 100, JOBS_MIN_VERSION % 100));
+				bench_cmd_done(cmd, RET_CODE_UNKNOWN_ERROR, "unknown-error");
+			}
+			continue;
+		}
+
+		req = winexe_run_send(b, b->ev, b->lp_ctx, b->args, b->args->hostname,
+		                      (winexe_cb_output) bench_output, cmd);
+		if (req == NULL) {
+			bench_cmd_done(cmd, RET_CODE_UNKNOWN_ERROR, "unknown-error");
+			continue;
+		}
+		winexe_run_input(req, NULL, 0);
+		tevent_req_set_callback(req, bench_run_done, cmd);
+	}
+}
+
+static void bench_owner_ready(struct bench_context *b, struct winexe_context *c)
+{
+	struct timeval now = timeval_current();
+
+	printf("control     ready in %.2f ms, service version %d.%d\n",
+	       usec_time_diff(&now, &b->start) / 1000.0,
+	       c->service_version / 100, c->service_version % 100);
+	b->start = now;
+	bench_start_next(b);
+}
+
+/* The parked control pipe went away, jobs still queued cannot run */
+static void bench_owner_finish(struct bench_context *b, struct winexe_context *c)
+{
+	DEBUG(0, ("ERROR: Control pipe closed, status %s\n", c->status));
+	b->owner = NULL;
+	b->failed += b->count - b->started;
+	b->finished += b->count - b->started;
+	b->started = b->count;
+}
+
+static int int64_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const int64_t *v, int n, int pct)
+{
+	int i = (n * pct + 99) / 100 - 1;
+	return v[i < 0 ? 0 : i] / 1000.0;
+}
+
+static void bench_report(struct bench_context *b, int64_t usec)
+{
+	double sec = usec / 1000000.0;
+
+	printf("commands    %d (%d failed) in %.3f s, %.2f commands/sec\n",
+	       b->finished, b->failed, sec, sec > 0 ? b->finished / sec : 0.0);
+	if (b->num_first) {
+		qsort(b->first_usec, b->num_first, sizeof(int64_t), int64_cmp);
+		printf("first byte  p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms (%d commands)\n",
+		       percentile_ms(b->first_usec, b->num_first, 50),
+		       percentile_ms(b->first_usec, b->num_first, 90),
+		       percentile_ms(b->first_usec, b->num_first, 99),
+		       b->first_usec[b->num_first - 1] / 1000.0, b->num_first);
+	} else {
+		printf("first byte  no command wrote to stdout\n");
+	}
+	printf("stdout      %llu bytes, %.2f MB/s\n", (unsigned long long) b->out_bytes,
+	       sec > 0 ? b->out_bytes / sec / (1024 * 1024) : 0.0);
+	if (b->err_bytes)
+		printf("stderr      %llu bytes\n", (unsigned long long) b->err_bytes);
+}
+
+int main(int argc, char *argv[])
+{
+	struct program_options options;
+	struct bench_context *b;
+	struct cli_credentials *cred;
+	struct loadparm_context *lp_ctx;
+	struct timeval now;
+	poptContext pc;
+	const char **args;
+	int opt;
+
+	int count = DEFAULT_COUNT;
+	int parallel = 1;
+	int flag_help = 0;
+	int flag_reuse = 0;
+	int flag_smb2 = 0;
+	int flag_nopass = 0;
+	char *opt_user = NULL;
+	char *opt_auth_file = NULL;
+	char *opt_debuglevel = NULL;
+
+	memset(&options, 0, sizeof(options));
+	options.window = DEFAULT_WINDOW;
+
+	struct poptOption long_options[] = {
+		{ "help", 'h', POPT_ARG_NONE, &flag_help, 0,
+		  "Display help message" },
+		{ "user", 'U', POPT_ARG_STRING, &opt_user, 0,
+		  "Set the network username", "[DOMAIN/]USERNAME[%PASSWORD]" },
+		{ "authentication-file", 'A', POPT_ARG_STRING, &opt_auth_file, 0,
+		  "Get the credentials from a file", "FILE" },
+		{ "no-pass", 'N', POPT_ARG_NONE, &flag_nopass, 0,
+		  "Do not ask for a password", NULL },
+		{ "debuglevel", 'd', POPT_ARG_STRING, &opt_debuglevel, 0,
+		  "Set debug level", "DEBUGLEVEL" },
+		{ "count", 0, POPT_ARG_INT, &count, 0,
+		  "Run the command COUNT times (default 100)", "COUNT" },
+		{ "parallel", 0, POPT_ARG_INT, &parallel, 0,
+		  "Keep up to N commands running (default 1)", "N" },
+		{ "reuse", 0, POPT_ARG_NONE, &flag_reuse, 0,
+		  "Run the commands as jobs on one control pipe instead of logging in for each", NULL },
+		{ "smb2", 0, POPT_ARG_NONE, &flag_smb2, 0,
+		  "Use SMB2 instead of SMB1", NULL },
+		{ "window", 0, POPT_ARG_INT, &options.window, 0,
+		  "Reads and writes in flight per std pipe (default 4)", "N" },
+		{ "compress", 0, POPT_ARG_INT, &options.compress, 0,
+		  "Have the service compress the output at zlib LEVEL", "LEVEL" },
+		POPT_TABLEEND
+	};
+
+	dcerpc_init();
+	lp_ctx = loadparm_init_global(false);
+
+	pc = poptGetContext(argv[0], argc, (const char **) argv, long_options, 0);
+	poptSetOtherOptionHelp(pc, "[OPTION]... //HOST COMMAND\nOptions:");
+	opt = poptGetNextOpt(pc);
+	args = poptGetArgs(pc);
+	if (flag_help) {
+		poptPrintHelp(pc, stdout, 0);
+		return 0;
+	}
+	if (opt != -1 || !args || !args[0] || !args[1] || args[2]
+	    || args[0][0] != '/' || args[0][1] != '/'
+	    || count < 1 || parallel < 1 || options.window < 1 || options.window > ASYNC_WINDOW_MAX
+	    || options.compress < 0 || options.compress > 9) {
+		poptPrintHelp(pc, stdout, 0);
+		return 1;
+	}
+#ifndef HAVE_SMB2
+	if (flag_smb2) {
+		DEBUG(0, ("ERROR: This winexe-bench was built without SMB2 support\n"));
+		return 1;
+	}
+#endif
+
+	if (opt_debuglevel)
+		lpcfg_set_cmdline(lp_ctx, "log level", opt_debuglevel);
+
+	cred = cli_credentials_init(talloc_autofree_context());
+	if (opt_user)
+		cli_credentials_parse_string(cred, opt_user, CRED_SPECIFIED);
+	else if (opt_auth_file)
+		cli_credentials_parse_file(cred, opt_auth_file, CRED_SPECIFIED);
+	cli_credentials_guess(cred, lp_ctx);
+	if (!cli_credentials_get_password(cred) && !flag_nopass) {
+		char *p = getpass("Enter password: ");
+		if (*p)
+			cli_credentials_set_password(cred, p, CRED_SPECIFIED);
+	}
+
+	options.credentials = cred;
+	options.hostname = discard_const_p(char, args[0] + 2);
+	options.cmd = discard_const_p(char, args[1]);
+	options.flags = SVC_IGNORE_INTERACTIVE | SVC_OSCHOOSE | (flag_smb2 ? SVC_SMB2 : 0);
+
+	b = talloc_zero(talloc_autofree_context(), struct bench_context);
+	if (b == NULL)
+		return 1;
+	b->args = &options;
+	b->lp_ctx = lp_ctx;
+	b->count = count;
+	b->parallel = parallel;
+	b->first_usec = talloc_array(b, int64_t, count);
+	b->ev = tevent_context_init(b);
+	if (b->first_usec == NULL || b->ev == NULL)
+		return 1;
+
+	b->start = timeval_current();
+	if (flag_reuse) {
+		b->owner = winexe_context_init(b, b->ev, lp_ctx, &options, options.hostname);
+		if (b->owner == NULL)
+			return 1;
+		b->owner->cb_ctx = b;
+		b->owner->cb_ready = (winexe_cb_ready) bench_owner_ready;
+		b->owner->cb_finish = (winexe_cb_finish) bench_owner_finish;
+		b->owner->stdin_mode = STDIN_NONE;
+		winexe_context_start(b->owner, NULL, NULL);
+	} else {
+		bench_start_next(b);
+	}
+
+	while (b->finished < b->count) {
+		if (tevent_loop_once(b->ev) != 0) {
+			DEBUG(0, ("ERROR: Event loop failed - %s\n", strerror(errno)));
+			return 1;
+		}
+	}
+	now = timeval_current();
+
+	bench_report(b, usec_time_diff(&now, &b->start));
+	return b->failed ? 1 : 0;
+}
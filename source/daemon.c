@@ -0,0 +1,897 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/fcntl.h>
+#include <sys/unistd.h>
+#include <sys/termios.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <tevent.h>
+#include <util/memory.h>
+#include <credentials.h>
+#include <util/time.h>
+#include <util/debug.h>
+#include <smb_cliraw.h>
+#include <iconv.h>
+#include <errno.h>
+
+#include "async.h"
+#include "svcinstall.h"
+#include "hostcache.h"
+#include "transfer.h"
+#include "winexesvc.h"
+#include "winexe.h"
+
+/*
+  Frames exchanged on the daemon socket: a type byte, the payload length as
+  a 32-bit big endian number and the payload.
+*/
+enum {
+	FRAME_RUN = 'r',		/* flags, HOST\0RUNAS\0COMMAND\0 */
+	FRAME_STDIN = 'i',		/* empty payload closes remote stdin */
+	FRAME_ABORT = 'a',
+	FRAME_STDOUT = 'o',
+	FRAME_STDERR = 'e',
+	FRAME_RETURN_CODE = 'x'		/* return code */
+};
+
+#define FRAME_HEADER_SIZE 5
+#define FRAME_MAX_PAYLOAD 0x10000
+
+/*
+  Output queued for a front-end beyond which the host's stdout and stderr
+  are no longer read, until the front-end catches up
+*/
+#define CLIENT_OUT_MAX 0x100000
+
+/* Flags a front-end may set per command, everything else is the daemon's */
+#define DAEMON_CLIENT_FLAGS (SVC_SYSTEM | SVC_PROFILE)
+
+struct daemon_context {
+	struct program_options *args;
+	struct daemon_host *hosts;
+	int listen_fd;
+};
+
+/* Connection kept open to one host */
+struct daemon_host {
+	struct daemon_host *next;
+	struct daemon_context *d;
+	const char *hostname;
+	/* Taken over from the first control pipe which got ready */
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	/*
+	  Control pipe being prepared or parked in STATE_READY; with a service
+	  supporting jobs it is kept and every command runs as one of its jobs.
+	*/
+	struct daemon_job *spare;
+	/* Clients waiting for a control pipe, in arrival order */
+	struct daemon_client *waiting;
+	int running;
+	int retired;
+	int freeing;
+	struct tevent_timer *ev_idle;
+};
+
+/* One winexe_context on a host, client is NULL for the spare */
+struct daemon_job {
+	struct daemon_host *host;
+	struct daemon_client *client;
+	struct winexe_context *c;
+	struct program_options args;
+};
+
+struct daemon_client {
+	struct daemon_client *next;
+	struct daemon_context *d;
+	int fd;
+	struct tevent_fd *fde;
+	const char *hostname;
+	const char *runas;
+	const char *cmd;
+	int flags;
+	/* Host this client waits on */
+	struct daemon_host *host;
+	struct daemon_job *job;
+	uint8_t *in;
+	int in_len;
+	uint8_t *out;
+	int out_len;
+	int out_paused;
+	int closing;
+};
+
+static const char *daemon_socket_path;
+
+static struct termios termios_orig;
+static int termios_orig_is_valid = 0;
+
+static int client_abort_requested = 0;
+
+static void daemon_host_check(struct daemon_host *h);
+static void daemon_host_prepare(struct daemon_host *h);
+static void daemon_client_dispatch(struct daemon_client *cl);
+static int daemon_client_process(struct daemon_client *cl);
+
+static int frame_append(TALLOC_CTX *mem_ctx, uint8_t **pbuf, int *plen, int type, const void *data, int len)
+{
+	uint8_t *buf;
+	uint32_t n = htonl(len);
+
+	buf = talloc_realloc(mem_ctx, *pbuf, uint8_t, *plen + FRAME_HEADER_SIZE + len);
+	if (!buf)
+		return 0;
+	buf[*plen] = type;
+	memcpy(buf + *plen + 1, &n, sizeof(n));
+	if (len)
+		memcpy(buf + *plen + FRAME_HEADER_SIZE, data, len);
+	*pbuf = buf;
+	*plen += FRAME_HEADER_SIZE + len;
+	return 1;
+}
+
+/* Returns the payload length of a complete frame at buf, -1 if incomplete */
+static int frame_check(const uint8_t *buf, int len)
+{
+	uint32_t n;
+
+	if (len < FRAME_HEADER_SIZE)
+		return -1;
+	memcpy(&n, buf + 1, sizeof(n));
+	n = ntohl(n);
+	if (n > FRAME_MAX_PAYLOAD)
+		return -2;
+	if (len < FRAME_HEADER_SIZE + n)
+		return -1;
+	return n;
+}
+
+static void frame_consume(uint8_t *buf, int *plen, int payload)
+{
+	int l = FRAME_HEADER_SIZE + payload;
+
+	memmove(buf, buf + l, *plen - l);
+	*plen -= l;
+}
+
+static const char *frame_string(const char **p, const char *end)
+{
+	const char *s = *p;
+	const char *z = memchr(s, 0, end - s);
+
+	if (!z)
+		return NULL;
+	*p = z + 1;
+	return s;
+}
+
+static void daemon_client_update(struct daemon_client *cl)
+{
+	uint16_t flags = 0;
+
+	/* Like local stdin, stop reading while the remote stdin is backed up */
+	if (!cl->host && !cl->closing && !(cl->job && winexe_context_input_full(cl->job->c)))
+		flags |= TEVENT_FD_READ;
+	if (cl->out_len)
+		flags |= TEVENT_FD_WRITE;
+	tevent_fd_set_flags(cl->fde, flags);
+}
+
+static void daemon_client_send(struct daemon_client *cl, int type, const void *data, int len)
+{
+	if (!frame_append(cl, &cl->out, &cl->out_len, type, data, len))
+		DEBUG(0, ("ERROR: Out of memory, dropping %d bytes for client\n", len));
+	if (cl->job && !cl->out_paused && cl->out_len >= CLIENT_OUT_MAX) {
+		cl->out_paused = 1;
+		winexe_context_pause_output(cl->job->c, 1);
+	}
+	daemon_client_update(cl);
+}
+
+static void daemon_client_finish(struct daemon_client *cl, int return_code)
+{
+	uint32_t rc = htonl(return_code);
+
+	daemon_client_send(cl, FRAME_RETURN_CODE, &rc, sizeof(rc));
+	cl->closing = 1;
+	daemon_client_update(cl);
+}
+
+static int daemon_client_destructor(struct daemon_client *cl)
+{
+	struct daemon_client **pp;
+
+	if (cl->host) {
+		for (pp = &cl->host->waiting; *pp; pp = &(*pp)->next) {
+			if (*pp == cl) {
+				*pp = cl->next;
+				break;
+			}
+		}
+		daemon_host_check(cl->host);
+	}
+	if (cl->job) {
+		/* The front-end went away, do not leave its command behind */
+		cl->job->client = NULL;
+		if (cl->out_paused)
+			winexe_context_pause_output(cl->job->c, 0);
+		winexe_context_abort(cl->job->c);
+	}
+	TALLOC_FREE(cl->fde);
+	close(cl->fd);
+	return 0;
+}
+
+static void on_job_output(struct daemon_job *job, int fd, const char *data, int len)
+{
+	if (job->client)
+		daemon_client_send(job->client, (fd == 2) ? FRAME_STDERR : FRAME_STDOUT, data, len);
+}
+
+static void on_job_input(struct daemon_job *job, struct winexe_context *c)
+{
+	if (job->client)
+		daemon_client_process(job->client);
+}
+
+static void on_job_ready(struct daemon_job *job, struct winexe_context *c);
+static void on_job_finish(struct daemon_job *job, struct winexe_context *c);
+
+static void daemon_job_hooks(struct daemon_job *job)
+{
+	job->c->cb_ctx = job;
+	job->c->cb_output = (winexe_cb_output) on_job_output;
+	job->c->cb_ready = (winexe_cb_ready) on_job_ready;
+	job->c->cb_finish = (winexe_cb_finish) on_job_finish;
+	job->c->cb_input = (winexe_cb_input) on_job_input;
+	job->c->stdin_mode = STDIN_EXTERNAL;
+}
+
+static int daemon_host_shared(struct daemon_host *h)
+{
+	return h->spare && h->spare->c->state == STATE_READY
+		&& h->spare->c->service_version >= JOBS_MIN_VERSION;
+}
+
+/* Hands the parked control pipe, or a job on it, to the first waiting client */
+static struct daemon_client *daemon_host_attach(struct daemon_host *h)
+{
+	struct program_options *defaults = h->d->args;
+	struct daemon_client *cl = h->waiting;
+	int shared = daemon_host_shared(h);
+	struct daemon_job *job;
+
+	h->waiting = cl->next;
+	cl->next = NULL;
+	cl->host = NULL;
+	TALLOC_FREE(h->ev_idle);
+
+	if (shared) {
+		job = talloc_zero(h, struct daemon_job);
+		if (job)
+			job->c = winexe_job_init(h, h->spare->c, &job->args);
+		if (!job || !job->c) {
+			DEBUG(0, ("ERROR: %s: Cannot create job\n", h->hostname));
+			talloc_free(job);
+			daemon_client_finish(cl, RET_CODE_UNKNOWN_ERROR);
+			return cl;
+		}
+		job->host = h;
+		daemon_job_hooks(job);
+	} else {
+		job = h->spare;
+		h->spare = NULL;
+	}
+	++h->running;
+
+	job->args = *defaults;
+	job->args.hostname = discard_const_p(char, h->hostname);
+	job->args.cmd = talloc_strdup(job, cl->cmd);
+	job->args.runas = cl->runas ? talloc_strdup(job, cl->runas) : defaults->runas;
+	job->args.flags = (defaults->flags & ~DAEMON_CLIENT_FLAGS) | (cl->flags & DAEMON_CLIENT_FLAGS);
+	job->client = cl;
+	job->c->args = &job->args;
+	cl->job = job;
+
+	DEBUG(1, ("%s: running %s\n", h->hostname, job->args.cmd));
+	winexe_context_run(job->c);
+	/* The next command finds a control pipe ready */
+	if (!shared)
+		daemon_host_prepare(h);
+	daemon_client_update(cl);
+	return cl;
+}
+
+static void on_job_ready(struct daemon_job *job, struct winexe_context *c)
+{
+	struct daemon_host *h = job->host;
+	struct daemon_client *cl;
+
+	if (!h->tree && !h->tree2) {
+		h->tree = talloc_steal(h, c->tree);
+		h->tree2 = talloc_steal(h, c->tree2);
+	}
+	if (!h->waiting) {
+		daemon_host_check(h);
+		return;
+	}
+	do {
+		cl = daemon_host_attach(h);
+		/* Frames which arrived while the client was waiting */
+		daemon_client_process(cl);
+	} while (h->waiting && daemon_host_shared(h));
+}
+
+static void daemon_host_retire(struct daemon_host *h)
+{
+	struct daemon_host **pp;
+
+	if (h->retired)
+		return;
+	h->retired = 1;
+	for (pp = &h->d->hosts; *pp; pp = &(*pp)->next) {
+		if (*pp == h) {
+			*pp = h->next;
+			break;
+		}
+	}
+	TALLOC_FREE(h->ev_idle);
+	if (h->spare)
+		winexe_context_abort(h->spare->c);
+	daemon_host_check(h);
+}
+
+static void on_spare_finish(struct daemon_host *h, struct winexe_context *c)
+{
+	struct daemon_client *cl;
+
+	if ((h->tree || h->tree2) && !h->retired) {
+		/* The kept connection broke, waiting clients start over */
+		DEBUG(1, ("%s: connection lost - %s\n", h->hostname, c->status));
+		cl = h->waiting;
+		h->waiting = NULL;
+		daemon_host_retire(h);
+		while (cl) {
+			struct daemon_client *next = cl->next;
+			cl->next = NULL;
+			cl->host = NULL;
+			daemon_client_dispatch(cl);
+			cl = next;
+		}
+		return;
+	}
+
+	while ((cl = h->waiting)) {
+		h->waiting = cl->next;
+		cl->next = NULL;
+		cl->host = NULL;
+		daemon_client_finish(cl, c->return_code);
+	}
+	daemon_host_retire(h);
+}
+
+static void on_job_finish(struct daemon_job *job, struct winexe_context *c)
+{
+	struct daemon_host *h = job->host;
+
+	if (job == h->spare) {
+		h->spare = NULL;
+		talloc_free(job);
+		on_spare_finish(h, c);
+	} else {
+		--h->running;
+		if (job->client) {
+			job->client->job = NULL;
+			daemon_client_finish(job->client, c->return_code);
+		}
+		talloc_free(job);
+	}
+	daemon_host_check(h);
+}
+
+static void daemon_host_prepare(struct daemon_host *h)
+{
+	struct daemon_job *job;
+
+	if (h->spare || h->retired)
+		return;
+	job = talloc_zero(h, struct daemon_job);
+	if (!job)
+		goto failed;
+	job->host = h;
+	job->c = winexe_context_init(h, ev_ctx, ldprm_ctx, h->d->args, h->hostname);
+	if (!job->c)
+		goto failed;
+	daemon_job_hooks(job);
+	h->spare = job;
+	winexe_context_start(job->c, h->tree, h->tree2);
+	return;
+
+  failed:
+	DEBUG(0, ("ERROR: %s: Cannot prepare control pipe\n", h->hostname));
+	talloc_free(job);
+}
+
+static void daemon_host_free_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	struct daemon_host *h = talloc_get_type(private_data, struct daemon_host);
+
+	DEBUG(1, ("%s: connection closed\n", h->hostname));
+	talloc_free(h);
+}
+
+static void daemon_host_idle_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	struct daemon_host *h = talloc_get_type(private_data, struct daemon_host);
+
+	h->ev_idle = NULL;
+	if (h->running || h->waiting)
+		return;
+	if (h->spare && h->spare->c->state != STATE_READY) {
+		/* Never free the tree under a pending open */
+		daemon_host_check(h);
+		return;
+	}
+	DEBUG(1, ("%s: idle for %d seconds\n", h->hostname, h->d->args->idle_timeout));
+	daemon_host_retire(h);
+}
+
+/* Frees a retired host once unused, keeps the idle timer of a live one */
+static void daemon_host_check(struct daemon_host *h)
+{
+	if (h->retired) {
+		if (!h->running && !h->spare && !h->waiting && !h->freeing) {
+			h->freeing = 1;
+			/* The last context is still being torn down, free later */
+			tevent_add_timer(ev_ctx, h->d, timeval_zero(), daemon_host_free_handler, h);
+		}
+		return;
+	}
+	if (h->running || h->waiting) {
+		TALLOC_FREE(h->ev_idle);
+		return;
+	}
+	if (!h->ev_idle)
+		h->ev_idle = tevent_add_timer(ev_ctx, h,
+		                              timeval_current_ofs(h->d->args->idle_timeout, 0),
+		                              daemon_host_idle_handler, h);
+}
+
+static void daemon_client_dispatch(struct daemon_client *cl)
+{
+	struct daemon_context *d = cl->d;
+	struct daemon_client **pp;
+	struct daemon_host *h;
+
+	for (h = d->hosts; h; h = h->next)
+		if (!strcasecmp(h->hostname, cl->hostname))
+			break;
+	if (!h) {
+		h = talloc_zero(d, struct daemon_host);
+		if (!h || !(h->hostname = talloc_strdup(h, cl->hostname))) {
+			DEBUG(0, ("ERROR: Failed to allocate struct daemon_host\n"));
+			talloc_free(h);
+			daemon_client_finish(cl, RET_CODE_UNKNOWN_ERROR);
+			return;
+		}
+		h->d = d;
+		h->next = d->hosts;
+		d->hosts = h;
+	}
+
+	for (pp = &h->waiting; *pp; pp = &(*pp)->next)
+		;
+	*pp = cl;
+	cl->host = h;
+	TALLOC_FREE(h->ev_idle);
+	if (h->spare && h->spare->c->state == STATE_READY)
+		daemon_host_attach(h);
+	else
+		daemon_host_prepare(h);
+	daemon_client_update(cl);
+}
+
+static int daemon_client_frame(struct daemon_client *cl, int type, const char *data, int len)
+{
+	const char *p = data + sizeof(uint32_t);
+	const char *end = data + len;
+	uint32_t flags;
+
+	switch (type) {
+	case FRAME_RUN:
+		if (cl->cmd || len < (int)sizeof(flags))
+			return 0;
+		memcpy(&flags, data, sizeof(flags));
+		cl->flags = ntohl(flags);
+		cl->hostname = frame_string(&p, end);
+		cl->runas = cl->hostname ? frame_string(&p, end) : NULL;
+		cl->cmd = cl->runas ? frame_string(&p, end) : NULL;
+		if (!cl->cmd || !*cl->hostname || !*cl->cmd)
+			return 0;
+		cl->hostname = talloc_strdup(cl, cl->hostname);
+		cl->runas = *cl->runas ? talloc_strdup(cl, cl->runas) : NULL;
+		cl->cmd = talloc_strdup(cl, cl->cmd);
+		daemon_client_dispatch(cl);
+		return 1;
+	case FRAME_STDIN:
+		if (!cl->job)
+			return 0;
+		winexe_context_input(cl->job->c, data, len);
+		return 1;
+	case FRAME_ABORT:
+		if (cl->job)
+			winexe_context_abort(cl->job->c);
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns 0 if the client was freed */
+static int daemon_client_process(struct daemon_client *cl)
+{
+	int len;
+
+	while (!cl->host && !cl->closing && !(cl->job && winexe_context_input_full(cl->job->c))
+	       && (len = frame_check(cl->in, cl->in_len)) != -1) {
+		if (len < 0 || !daemon_client_frame(cl, cl->in[0], (const char *)cl->in + FRAME_HEADER_SIZE, len)) {
+			DEBUG(1, ("ERROR: Protocol error on daemon socket, closing client\n"));
+			talloc_free(cl);
+			return 0;
+		}
+		frame_consume(cl->in, &cl->in_len, len);
+	}
+	daemon_client_update(cl);
+	return 1;
+}
+
+static void on_client_fd_event(struct tevent_context *ev, struct tevent_fd *fde, uint16_t flags, void *private_data)
+{
+	struct daemon_client *cl = talloc_get_type(private_data, struct daemon_client);
+	ssize_t n;
+
+	if (flags & TEVENT_FD_WRITE) {
+		n = write(cl->fd, cl->out, cl->out_len);
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			talloc_free(cl);
+			return;
+		}
+		if (n > 0) {
+			memmove(cl->out, cl->out + n, cl->out_len - n);
+			cl->out_len -= n;
+		}
+		if (cl->out_paused && cl->out_len < CLIENT_OUT_MAX) {
+			cl->out_paused = 0;
+			if (cl->job)
+				winexe_context_pause_output(cl->job->c, 0);
+		}
+		if (!cl->out_len && cl->closing) {
+			talloc_free(cl);
+			return;
+		}
+		daemon_client_update(cl);
+	}
+
+	if (flags & TEVENT_FD_READ) {
+		uint8_t *buf = talloc_realloc(cl, cl->in, uint8_t, cl->in_len + 4096);
+		if (!buf) {
+			talloc_free(cl);
+			return;
+		}
+		cl->in = buf;
+		n = read(cl->fd, cl->in + cl->in_len, 4096);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			talloc_free(cl);
+			return;
+		}
+		if (n > 0) {
+			cl->in_len += n;
+			daemon_client_process(cl);
+		}
+	}
+}
+
+static void on_listen_fd_event(struct tevent_context *ev, struct tevent_fd *fde, uint16_t flags, void *private_data)
+{
+	struct daemon_context *d = talloc_get_type(private_data, struct daemon_context);
+	struct daemon_client *cl;
+	int fd;
+
+	fd = accept(d->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	cl = talloc_zero(d, struct daemon_client);
+	if (!cl) {
+		DEBUG(0, ("ERROR: Failed to allocate struct daemon_client\n"));
+		close(fd);
+		return;
+	}
+	cl->d = d;
+	cl->fd = fd;
+	talloc_set_destructor(cl, daemon_client_destructor);
+	cl->fde = tevent_add_fd(ev_ctx, cl, fd, TEVENT_FD_READ, on_client_fd_event, cl);
+	if (!cl->fde)
+		talloc_free(cl);
+}
+
+static void catch_daemon_exit(int sig)
+{
+	unlink(daemon_socket_path);
+	_exit(0);
+}
+
+static int socket_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		DEBUG(0, ("ERROR: Socket path too long - %s\n", path));
+		return 0;
+	}
+	strcpy(addr->sun_path, path);
+	return 1;
+}
+
+/*
+  Serves commands submitted by "winexe --socket" front-ends. Connections
+  and one version checked control pipe per host are kept open, so a command
+  costs a single control pipe round trip plus opening the std pipes. With
+  service 1.2 or newer all commands for a host run concurrently as jobs on
+  that one control pipe.
+*/
+int daemon_main(struct program_options *options)
+{
+	struct daemon_context *d;
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t old_umask;
+	int ret;
+
+	d = talloc_zero(talloc_autofree_context(), struct daemon_context);
+	if (d == NULL) {
+		DEBUG(0, ("ERROR: Failed to allocate struct daemon_context\n"));
+		return 1;
+	}
+	/* The service is kept installed for the next command */
+	options->flags &= ~SVC_UNINSTALL;
+	d->args = options;
+	daemon_socket_path = options->daemon_socket;
+
+	if (!socket_address(&addr, daemon_socket_path))
+		return 1;
+	if (lstat(daemon_socket_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			DEBUG(0, ("ERROR: %s exists and is not a socket\n", daemon_socket_path));
+			return 1;
+		}
+		unlink(daemon_socket_path);
+	}
+
+	d->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (d->listen_fd < 0) {
+		DEBUG(0, ("ERROR: socket - %s\n", strerror(errno)));
+		return 1;
+	}
+	/* Commands run with the daemon's credentials, keep the socket private */
+	old_umask = umask(0077);
+	ret = bind(d->listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_umask);
+	if (ret < 0 || listen(d->listen_fd, SOMAXCONN) < 0) {
+		DEBUG(0, ("ERROR: Cannot listen on %s - %s\n", daemon_socket_path, strerror(errno)));
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, catch_daemon_exit);
+	signal(SIGTERM, catch_daemon_exit);
+
+	if (!tevent_add_fd(ev_ctx, d, d->listen_fd, TEVENT_FD_READ, on_listen_fd_event, d)) {
+		unlink(daemon_socket_path);
+		return 1;
+	}
+	DEBUG(1, ("Listening on %s\n", daemon_socket_path));
+
+	while (tevent_loop_once(ev_ctx) == 0)
+		;
+
+	DEBUG(0, ("ERROR: Event loop failed - %s\n", strerror(errno)));
+	unlink(daemon_socket_path);
+	return 1;
+}
+
+static void catch_client_abort(int sig)
+{
+	if (++client_abort_requested > 1) {
+		if (termios_orig_is_valid)
+			tcsetattr(0, TCSANOW, &termios_orig);
+		_exit(1);
+	}
+}
+
+static int write_all(int fd, const uint8_t *data, int len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int client_send(int fd, int type, const void *data, int len)
+{
+	uint8_t *buf = NULL;
+	int buf_len = 0;
+	int ret;
+
+	if (!frame_append(NULL, &buf, &buf_len, type, data, len))
+		return 0;
+	ret = write_all(fd, buf, buf_len);
+	talloc_free(buf);
+	return ret;
+}
+
+/*
+  Thin front-end: submits the command and relays stdin, stdout and stderr.
+  The daemon stops reading the socket while the remote stdin is backed up
+  and stops reading the host's output while the socket is, so frames going
+  to it are queued and written as the socket takes them, stdin is not read
+  while any are left and output is read all the time.
+*/
+int daemon_client_main(struct program_options *options)
+{
+	struct sockaddr_un addr;
+	struct pollfd pfd[2];
+	const char *runas = options->runas ? options->runas : "";
+	int lh = strlen(options->hostname) + 1;
+	int lr = strlen(runas) + 1;
+	int lc = strlen(options->cmd) + 1;
+	uint32_t flags = htonl(options->flags);
+	uint8_t *in = NULL;
+	int in_len = 0;
+	uint8_t *out = NULL;
+	int out_len = 0;
+	int stdin_open = 1;
+	int abort_sent = 0;
+	int ret = RET_CODE_UNKNOWN_ERROR;
+	int done = 0;
+	char *run;
+	int fd;
+
+	if (!socket_address(&addr, options->client_socket))
+		return 1;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		DEBUG(0, ("ERROR: Cannot connect to daemon at %s - %s\n", options->client_socket, strerror(errno)));
+		return 1;
+	}
+
+	run = talloc_size(NULL, sizeof(flags) + lh + lr + lc);
+	if (!run)
+		return 1;
+	memcpy(run, &flags, sizeof(flags));
+	memcpy(run + sizeof(flags), options->hostname, lh);
+	memcpy(run + sizeof(flags) + lh, runas, lr);
+	memcpy(run + sizeof(flags) + lh + lr, options->cmd, lc);
+	if (!client_send(fd, FRAME_RUN, run, sizeof(flags) + lh + lr + lc)) {
+		DEBUG(0, ("ERROR: Cannot send command to daemon - %s\n", strerror(errno)));
+		return 1;
+	}
+	talloc_free(run);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	signal(SIGINT, catch_client_abort);
+	signal(SIGTERM, catch_client_abort);
+	if (isatty(0)) {
+		struct termios termios_tmp;
+		tcgetattr(0, &termios_orig);
+		termios_orig_is_valid = 1;
+		termios_tmp = termios_orig;
+		termios_tmp.c_lflag &= ~ICANON;
+		tcsetattr(0, TCSANOW, &termios_tmp);
+	}
+
+	pfd[0].fd = fd;
+	pfd[1].events = POLLIN;
+	while (!done) {
+		char data[4096];
+		ssize_t n;
+		int len;
+
+		if (client_abort_requested && !abort_sent) {
+			fprintf(stderr, "Aborting...\n");
+			if (!frame_append(NULL, &out, &out_len, FRAME_ABORT, NULL, 0))
+				break;
+			abort_sent = 1;
+		}
+		pfd[0].events = out_len ? (POLLIN | POLLOUT) : POLLIN;
+		pfd[1].fd = (stdin_open && !out_len) ? 0 : -1;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents) {
+			n = read(0, data, sizeof(data));
+			if (n <= 0) {
+				/* Remote stdin sees EOF, keep relaying output */
+				stdin_open = 0;
+				n = 0;
+			}
+			if (!frame_append(NULL, &out, &out_len, FRAME_STDIN, data, n))
+				break;
+		}
+
+		if (pfd[0].revents & POLLOUT) {
+			n = write(fd, out, out_len);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				DEBUG(0, ("ERROR: Cannot send to daemon - %s\n", strerror(errno)));
+				break;
+			}
+			if (n > 0) {
+				memmove(out, out + n, out_len - n);
+				out_len -= n;
+			}
+		}
+
+		if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		in = talloc_realloc(NULL, in, uint8_t, in_len + sizeof(data));
+		if (!in)
+			break;
+		n = read(fd, in + in_len, sizeof(data));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n <= 0) {
+			DEBUG(0, ("ERROR: Daemon closed the connection\n"));
+			break;
+		}
+		in_len += n;
+		while ((len = frame_check(in, in_len)) >= 0) {
+			const uint8_t *payload = in + FRAME_HEADER_SIZE;
+			uint32_t rc;
+
+			switch (in[0]) {
+			case FRAME_STDOUT:
+				write_all(1, payload, len);
+				break;
+			case FRAME_STDERR:
+				write_all(2, payload, len);
+				break;
+			case FRAME_RETURN_CODE:
+				if (len == sizeof(rc)) {
+					memcpy(&rc, payload, sizeof(rc));
+					ret = ntohl(rc);
+				}
+				done = 1;
+				break;
+			}
+			frame_consume(in, &in_len, len);
+		}
+		if (len == -2)
+			break;
+	}
+
+	if (termios_orig_is_valid)
+		tcsetattr(0, TCSANOW, &termios_orig);
+	talloc_free(in);
+	talloc_free(out);
+	close(fd);
+	return ret;
+}
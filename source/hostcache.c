@@ -0,0 +1,125 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+
+#include <sys/fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <talloc.h>
+#include <tdb.h>
+#include <util/debug.h>
+
+#include "hostcache.h"
+
+/* Bumped whenever the record format changes, other records are ignored */
+#define HOST_CACHE_FORMAT "winexe1"
+
+struct host_cache {
+	struct tdb_context *tdb;
+	int ttl;
+};
+
+static int host_cache_destructor(struct host_cache *hc)
+{
+	tdb_close(hc->tdb);
+	return 0;
+}
+
+/*
+  Opens or creates the cache file; the tdb locks records, so any number of
+  winexe processes may share it.
+*/
+struct host_cache *host_cache_open(TALLOC_CTX *mem_ctx, const char *fn, int ttl)
+{
+	struct host_cache *hc;
+
+	hc = talloc_zero(mem_ctx, struct host_cache);
+	if (!hc)
+		return NULL;
+	hc->tdb = tdb_open(fn, 0, TDB_DEFAULT, O_RDWR | O_CREAT, 0600);
+	if (!hc->tdb) {
+		DEBUG(0, ("ERROR: Cannot open host cache %s - %s\n", fn, strerror(errno)));
+		talloc_free(hc);
+		return NULL;
+	}
+	hc->ttl = ttl;
+	talloc_set_destructor(hc, host_cache_destructor);
+	return hc;
+}
+
+static TDB_DATA host_cache_key(char *buf, size_t size, const char *hostname)
+{
+	TDB_DATA key;
+	size_t i;
+
+	for (i = 0; hostname[i] && i < size - 1; ++i)
+		buf[i] = tolower((unsigned char)hostname[i]);
+	buf[i] = 0;
+	key.dptr = (unsigned char *)buf;
+	key.dsize = i;
+	return key;
+}
+
+/* True if hostname has an entry verified less than ttl seconds ago */
+bool host_cache_fetch(struct host_cache *hc, const char *hostname, struct host_cache_entry *e)
+{
+	char buf[256], rec[128];
+	long long t;
+	TDB_DATA data;
+	int n;
+
+	if (!hc)
+		return false;
+	data = tdb_fetch(hc->tdb, host_cache_key(buf, sizeof(buf), hostname));
+	if (!data.dptr)
+		return false;
+	n = data.dsize < sizeof(rec) ? data.dsize : sizeof(rec) - 1;
+	memcpy(rec, data.dptr, n);
+	rec[n] = 0;
+	free(data.dptr);
+
+	if (sscanf(rec, HOST_CACHE_FORMAT " %lld %d %d %d", &t, &e->service_version,
+	           &e->os64bit, &e->interactive) != 4)
+		return false;
+	e->time = t;
+	if (e->time > time(NULL) || time(NULL) - e->time >= hc->ttl) {
+		DEBUG(2, ("%s: host cache entry expired\n", hostname));
+		return false;
+	}
+	DEBUG(2, ("%s: host cache hit, version %d, 64-bit %d, interactive %d\n", hostname,
+	          e->service_version, e->os64bit, e->interactive));
+	return true;
+}
+
+/* Stores e as verified now */
+void host_cache_store(struct host_cache *hc, const char *hostname, struct host_cache_entry *e)
+{
+	char buf[256], rec[128];
+	TDB_DATA data;
+
+	if (!hc)
+		return;
+	e->time = time(NULL);
+	snprintf(rec, sizeof(rec), HOST_CACHE_FORMAT " %lld %d %d %d", (long long)e->time,
+	         e->service_version, e->os64bit, e->interactive);
+	data.dptr = (unsigned char *)rec;
+	data.dsize = strlen(rec);
+	if (tdb_store(hc->tdb, host_cache_key(buf, sizeof(buf), hostname), data, TDB_REPLACE))
+		DEBUG(1, ("%s: Cannot store host cache entry - %s\n", hostname, tdb_errorstr(hc->tdb)));
+}
+
+void host_cache_delete(struct host_cache *hc, const char *hostname)
+{
+	char buf[256];
+
+	if (!hc)
+		return;
+	tdb_delete(hc->tdb, host_cache_key(buf, sizeof(buf), hostname));
+}
@@ -0,0 +1,26 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+
+/*
+  What a previous run learned about a host, kept in a tdb keyed by the
+  lower-cased host name. Fields are -1 while unknown.
+*/
+struct host_cache_entry {
+	time_t time;		/* when the entry was last verified */
+	int service_version;	/* reply to get version */
+	int os64bit;		/* service binary uploaded, 1 for 64-bit */
+	int interactive;	/* SERVICE_INTERACTIVE_PROCESS set on the service */
+};
+
+/* Default number of seconds an entry is trusted */
+#define HOST_CACHE_DEFAULT_TTL 3600
+
+struct host_cache;
+
+struct host_cache *host_cache_open(TALLOC_CTX *mem_ctx, const char *fn, int ttl);
+bool host_cache_fetch(struct host_cache *hc, const char *hostname, struct host_cache_entry *e);
+void host_cache_store(struct host_cache *hc, const char *hostname, struct host_cache_entry *e);
+void host_cache_delete(struct host_cache *hc, const char *hostname);
@@ -0,0 +1,1691 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/unistd.h>
+#include <sys/termios.h>
+#include <string.h>
+#include <stdlib.h>
+#include <tevent.h>
+#include <util/memory.h>
+#include <credentials.h>
+#include <util/time.h>
+#include <util/debug.h>
+#include <util/tevent_ntstatus.h>
+#include <smb_cliraw.h>
+#include <smb_cli.h>
+#include <smb_composite.h>
+#ifdef HAVE_SMB2
+#include <libcli/smb2/smb2.h>
+#include <libcli/smb2/smb2_calls.h>
+#endif
+#include <composite.h>
+#include <dcerpc.h>
+#include <iconv.h>
+#include <zlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <credentials.h>
+
+#include "async.h"
+#include "svcinstall.h"
+#include "hostcache.h"
+#include "transfer.h"
+#include "winexesvc.h"
+#include "winexe.h"
+
+#define SERVICE_FILENAME SERVICE_NAME ".exe"
+
+/* How many times the service is (re)installed before giving up on a host */
+#define MAX_INSTALL_ATTEMPTS 3
+
+/* Read size limit of stdout/stderr when a user types at the terminal */
+#define INTERACTIVE_READ_MAX 4096
+
+/* Local stdin is read in chunks of this size and not read while more than
+   STDIN_QUEUE_MAX bytes wait to be written to the remote command */
+#define STDIN_READ_SIZE 4096
+#define STDIN_QUEUE_MAX 0x10000
+
+/* Terminal settings of fd 0 before a STDIN_LOCAL context made it raw */
+static struct termios termios_orig;
+static int termios_orig_is_valid = 0;
+
+/* winexesvc32.exe binary blob */
+extern unsigned int winexesvc32_exe_len;
+extern unsigned char winexesvc32_exe[];
+
+/* winexesvc64.exe binary blob */
+extern unsigned int winexesvc64_exe_len;
+extern unsigned char winexesvc64_exe[];
+
+static const char *phase_names[PHASE_MAX] = {
+	"connect", "install", "ctrl_open", "version", "ready",
+	"launch", "run", "drain", "uninstall"
+};
+
+static const char *pipe_names[STATS_PIPE_MAX] = {
+	"ctrl", "stdin", "stdout", "stderr"
+};
+
+/* Ends the current phase of c, if any, and starts phase; PHASE_MAX stops */
+static void host_phase(struct winexe_context *c, int phase)
+{
+	struct winexe_stats *s = &c->stats;
+	struct timeval now = timeval_current();
+
+	if (s->phase < PHASE_MAX)
+		s->usec[s->phase] += usec_time_diff(&now, &s->mark);
+	s->phase = phase;
+	s->mark = now;
+}
+
+static void on_in_pipe_open(struct winexe_context *c);
+static void on_in_pipe_write(struct winexe_context *c);
+static void on_std_pipe_close(struct winexe_context *c);
+
+static void on_out_pipe_read(struct winexe_context *c, const char *data, int len);
+static void on_err_pipe_read(struct winexe_context *c, const char *data, int len);
+
+static void on_in_pipe_error(struct winexe_context *c, int func, NTSTATUS status);
+static void on_out_pipe_error(struct winexe_context *c, int func, NTSTATUS status);
+static void on_err_pipe_error(struct winexe_context *c, int func, NTSTATUS status);
+
+static void host_open_ctrl_pipe(struct winexe_context *c);
+static void host_schedule_install(struct winexe_context *c);
+static void host_install_start(struct winexe_context *c);
+static void host_check_done(struct winexe_context *c);
+static void host_finish(struct winexe_context *c);
+static void host_xfer_start(struct winexe_context *c, int get);
+
+static const char *cmd_check(const char *data, const char *cmd, int len)
+{
+	int lcmd = strlen(cmd);
+	if (lcmd >= len)
+		return 0;
+	if (
+		!strncmp(data, cmd, lcmd)
+		&& (data[lcmd] == ' ' || data[lcmd] == '\n')
+	) {
+		return data + lcmd + 1;
+	}
+	return 0;
+}
+
+/* The service talks our protocol, run or park the control pipe */
+static void host_version_ok(struct winexe_context *c)
+{
+	if (c->cb_ready) {
+		c->state = STATE_READY;
+		host_phase(c, PHASE_READY);
+		c->cb_ready(c->cb_ctx, c);
+	} else {
+		winexe_context_run(c);
+	}
+}
+
+/*
+  The service is not what the cache says, drop the entry. The architecture
+  is still trusted for the reinstall, which retries without it on failure.
+*/
+static void host_cache_invalidate(struct winexe_context *c)
+{
+	if (!c->cache_hit)
+		return;
+	c->cache_hit = 0;
+	c->cached.service_version = -1;
+	host_cache_delete(c->args->cache, c->hostname);
+}
+
+static void on_ctrl_pipe_open(struct winexe_context *c)
+{
+	char *str = (c->args->flags & SVC_CONVERT) ? "get codepage\nget version\n" : "get version\n";
+
+	if (c->cache_hit && c->cached.service_version/10 == VERSION/10) {
+		/* Checked less than the cache TTL ago, save the round trip */
+		DEBUG(1, ("CTRL: Service version %d.%d known from the host cache\n",
+		          c->cached.service_version/100, c->cached.service_version%100));
+		c->service_version = c->cached.service_version;
+		if (c->args->flags & SVC_CONVERT)
+			async_write(c->ac_ctrl, "get codepage\n", 13);
+		host_version_ok(c);
+		return;
+	}
+
+	DEBUG(1, ("CTRL: Sending command: %s", str));
+	c->state = STATE_GETTING_VERSION;
+	host_phase(c, PHASE_VERSION);
+	async_write(c->ac_ctrl, str, strlen(str));
+}
+
+/* The owner's control pipe is gone, so are the results of its jobs */
+static void jobs_ctrl_finished(struct winexe_context *c)
+{
+	struct winexe_context *j, *next;
+
+	for (j = c->jobs; j; j = next) {
+		next = j->next_job;
+		if (j->ctrl_finished)
+			continue;
+		j->return_code = RET_CODE_CTRL_PIPE_ERROR;
+		j->status = "ctrl-pipe-error";
+		j->ctrl_finished = 1;
+		host_check_done(j);
+	}
+}
+
+static void on_ctrl_pipe_close(struct winexe_context *c)
+{
+	TALLOC_FREE(c->ev_stdin);
+	if (c->state == STATE_CLOSING_FOR_REINSTALL) {
+		host_schedule_install(c);
+		return;
+	}
+	c->ctrl_finished = 1;
+	jobs_ctrl_finished(c);
+	host_check_done(c);
+}
+
+static void on_ctrl_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
+{
+	DEBUG(1, ("ERROR: on_ctrl_pipe_error - %s\n", nt_errstr(status)));
+	if (func == ASYNC_OPEN_RECV) {
+		if (c->state == STATE_OPENING) {
+			DEBUG(1, ("ERROR: Cannot open control pipe - %s, installing service\n", nt_errstr(status)));
+			host_cache_invalidate(c);
+			c->state = STATE_INSTALLING;
+			host_schedule_install(c);
+			return;
+		}
+		DEBUG(1, ("ERROR: Control pipe - %s, closing\n", nt_errstr(status)));
+		c->state = STATE_CLOSING;
+		c->return_code = RET_CODE_CTRL_PIPE_ERROR;
+		c->status = "ctrl-pipe-error";
+	} else if (c->state == STATE_READY) {
+		/* A parked control pipe died before it was used */
+		c->return_code = RET_CODE_CTRL_PIPE_ERROR;
+		c->status = "ctrl-pipe-error";
+	}
+
+	TALLOC_FREE(c->ev_stdin);
+	c->ctrl_finished = 1;
+	jobs_ctrl_finished(c);
+	host_check_done(c);
+}
+
+/* write_conv_buf() relies on all of these being ASCII compatible */
+const char *codepage_to_string(int cp)
+{
+	switch (cp) {
+	  case 850: return "CP850";
+	  case 852: return "CP852";
+	  case 65001: return "UTF-8";
+	  default: return "CP850";
+	}
+}
+
+static struct async_context *std_pipe_open(struct winexe_context *c, const char *fmt, unsigned int npipe)
+{
+	struct async_context *ac;
+	char *fn;
+
+	ac = talloc_zero(c, struct async_context);
+	if (!ac)
+		return NULL;
+	ac->tree = c->tree;
+	ac->tree2 = c->tree2;
+	ac->cb_ctx = c;
+	ac->cb_close = (async_cb_close) on_std_pipe_close;
+	if (c->stdin_mode == STDIN_LOCAL && isatty(0))
+		ac->read_max = INTERACTIVE_READ_MAX;
+	ac->read_window = c->args->window;
+	ac->write_window = c->args->window;
+	fn = talloc_asprintf(ac, fmt, npipe);
+	++c->open_pipes;
+	if (!async_open(ac, fn, OPENX_MODE_ACCESS_RDWR)) {
+		/* async_open() frees the context on failure */
+		--c->open_pipes;
+		return NULL;
+	}
+	return ac;
+}
+
+static void std_pipe_close(struct winexe_context *c, struct async_context **pac)
+{
+	struct async_context *ac = *pac;
+
+	if (!ac)
+		return;
+	*pac = NULL;
+	if (!async_close(ac))
+		on_std_pipe_close(c);
+}
+
+static void open_std_pipes(struct winexe_context *c, unsigned int npipe)
+{
+	host_phase(c, PHASE_RUN);
+	/* Open in */
+	c->ac_in = std_pipe_open(c, "\\" PIPE_NAME_IN, npipe);
+	if (c->ac_in) {
+		c->ac_in->stats = &c->stats.pipes[STATS_PIPE_IN];
+		c->ac_in->cb_open = (async_cb_open) on_in_pipe_open;
+		c->ac_in->cb_write = (async_cb_write) on_in_pipe_write;
+		c->ac_in->cb_error = (async_cb_error) on_in_pipe_error;
+	}
+	/* Open out */
+	c->ac_out = std_pipe_open(c, "\\" PIPE_NAME_OUT, npipe);
+	if (c->ac_out) {
+		c->ac_out->stats = &c->stats.pipes[STATS_PIPE_OUT];
+		c->ac_out->cb_read = (async_cb_read) on_out_pipe_read;
+		c->ac_out->cb_error = (async_cb_error) on_out_pipe_error;
+		c->ac_out->read_paused = c->output_paused;
+	}
+	/* Open err */
+	c->ac_err = std_pipe_open(c, "\\" PIPE_NAME_ERR, npipe);
+	if (c->ac_err) {
+		c->ac_err->stats = &c->stats.pipes[STATS_PIPE_ERR];
+		c->ac_err->cb_read = (async_cb_read) on_err_pipe_read;
+		c->ac_err->cb_error = (async_cb_error) on_err_pipe_error;
+		c->ac_err->read_paused = c->output_paused;
+	}
+}
+
+static struct winexe_context *find_job(struct winexe_context *c, unsigned int id)
+{
+	struct winexe_context *j;
+
+	for (j = c->jobs; j; j = j->next_job)
+		if (j->job_id == id)
+			return j;
+	return NULL;
+}
+
+/* Messages of one job, each job ends with either return_code or error */
+static void on_job_ctrl_line(struct winexe_context *c, const char *data, int len)
+{
+	const char *p;
+
+	if (c->ctrl_finished)
+		return;
+	if ((p = cmd_check(data, CMD_STD_IO_ERR, len))) {
+		open_std_pipes(c, strtoul(p, 0, 16));
+		return;
+	}
+	if ((p = cmd_check(data, CMD_RETURN_CODE, len))) {
+		c->return_code = strtoul(p, 0, 16);
+		c->status = "done";
+		host_phase(c, PHASE_DRAIN);
+	} else {
+		DEBUG(0, ("Error: %s: %.*s", c->hostname, len, data));
+	}
+	c->ctrl_finished = 1;
+	host_check_done(c);
+}
+
+static void on_ctrl_pipe_line(struct winexe_context *c, const char *data, int len)
+{
+	const char *p;
+	DEBUG(1, ("CTRL: Received: %.*s", len, data));
+	if ((p = cmd_check(data, "job", len))) {
+		char *e;
+		unsigned int id = strtoul(p, &e, 10);
+		struct winexe_context *j = find_job(c, id);
+		if (*e == ' ' && j)
+			on_job_ctrl_line(j, e + 1, len - (e + 1 - data));
+		else
+			DEBUG(0, ("CTRL: Message for unknown job: %.*s", len, data));
+	} else if ((p = cmd_check(data, CMD_STD_IO_ERR, len))) {
+		open_std_pipes(c, strtoul(p, 0, 16));
+	} else if ((p = cmd_check(data, CMD_RETURN_CODE, len))) {
+		c->return_code = strtoul(p, 0, 16);
+		c->status = "done";
+		host_phase(c, PHASE_DRAIN);
+		host_xfer_start(c, 1);
+	} else if ((p = cmd_check(data, "version", len))) {
+		int ver = strtoul(p, 0, 0);
+		c->service_version = ver;
+		if (ver/10 != VERSION/10) {
+			DEBUG(1, ("CTRL: Bad version of service (is %d.%d, expected %d.%d), reinstalling.\n", ver/100, ver%100, VERSION/100, VERSION%100));
+			host_cache_invalidate(c);
+			async_close(c->ac_ctrl);
+			c->state = STATE_CLOSING_FOR_REINSTALL;
+		} else {
+			c->cached.service_version = ver;
+			host_cache_store(c->args->cache, c->hostname, &c->cached);
+			host_version_ok(c);
+		}
+	} else if ((p = cmd_check(data, "codepage", len))) {
+		int cp = strtoul(p, 0, 0);
+		const char *cp_str = codepage_to_string(cp);
+		DEBUG(1,("Creating iconv for %s\n", cp_str));
+		c->codepage = cp_str;
+		c->iconv_enc = iconv_open(cp_str, "UTF-8");
+		c->iconv_dec = iconv_open("UTF-8//TRANSLIT", cp_str);
+	} else if ((p = cmd_check(data, "error", len))) {
+		DEBUG(0, ("Error: %.*s", len, data));
+		if (c->state == STATE_GETTING_VERSION) {
+			DEBUG(0, ("CTRL: Probably old version of service, reinstalling.\n"));
+			host_cache_invalidate(c);
+			async_close(c->ac_ctrl);
+			c->state = STATE_CLOSING_FOR_REINSTALL;
+		}
+	} else {
+		DEBUG(0, ("CTRL: Unknown command: %.*s", len, data));
+	}
+}
+
+/*
+  Appends to a partial line kept by length, the data may hold nul bytes
+  (UTF-16 or binary output). On failure the data is dropped.
+*/
+static void line_append(TALLOC_CTX *mem_ctx, char **pline, int *plen, const char *data, int len)
+{
+	char *line = talloc_realloc(mem_ctx, *pline, char, *plen + len);
+
+	if (!line) {
+		DEBUG(0, ("ERROR: Out of memory, dropping %d bytes of a line\n", len));
+		return;
+	}
+	memcpy(line + *plen, data, len);
+	*pline = line;
+	*plen += len;
+}
+
+/* Messages may be split or coalesced by the pipe, handle whole lines */
+static void on_ctrl_pipe_read(struct winexe_context *c, const char *data, int len)
+{
+	const char *nl;
+
+	while (len > 0 && (nl = memchr(data, '\n', len))) {
+		int l = nl - data + 1;
+		if (c->ctrl_line) {
+			line_append(c, &c->ctrl_line, &c->ctrl_line_len, data, l);
+			on_ctrl_pipe_line(c, c->ctrl_line, c->ctrl_line_len);
+			TALLOC_FREE(c->ctrl_line);
+			c->ctrl_line_len = 0;
+		} else {
+			on_ctrl_pipe_line(c, data, l);
+		}
+		data += l;
+		len -= l;
+	}
+
+	if (len > 0)
+		line_append(c, &c->ctrl_line, &c->ctrl_line_len, data, len);
+}
+
+static int inflate_destructor(z_stream *z)
+{
+	inflateEnd(z);
+	return 0;
+}
+
+static z_stream *inflate_new(TALLOC_CTX *mem_ctx)
+{
+	z_stream *z = talloc_zero(mem_ctx, z_stream);
+
+	if (!z)
+		return NULL;
+	if (inflateInit(z) != Z_OK) {
+		talloc_free(z);
+		return NULL;
+	}
+	talloc_set_destructor(z, inflate_destructor);
+	return z;
+}
+
+/*
+  Returns the "set compress" line for the run request and prepares the
+  decompressors if --compress is on and the service understands it.
+*/
+static const char *compress_setting(struct winexe_context *c)
+{
+	int version = c->owner ? c->owner->service_version : c->service_version;
+
+	if (version < COMPRESS_MIN_VERSION)
+		return "";
+	if (c->args->compress) {
+		c->z_out = inflate_new(c);
+		c->z_err = inflate_new(c);
+		if (c->z_out && c->z_err)
+			return talloc_asprintf(c, "set compress %d\n", c->args->compress);
+		DEBUG(0, ("ERROR: %s: Cannot set up decompression, output is sent as is\n", c->hostname));
+		TALLOC_FREE(c->z_out);
+		TALLOC_FREE(c->z_err);
+	}
+	/* Settings are per connection, a job must not inherit compression */
+	return c->owner ? "set compress 0\n" : "";
+}
+
+/* Sends the run request on a control pipe which passed the version check */
+void winexe_context_run(struct winexe_context *c)
+{
+	char *str = "";
+	const char *compress;
+
+	if (c->xfer_req && !c->xfer_get) {
+		/* The command may need the files, host_xfer_done() runs it */
+		DEBUG(1, ("%s: Waiting for --put to finish\n", c->hostname));
+		c->run_waiting = 1;
+		host_phase(c, PHASE_READY);
+		return;
+	}
+	compress = compress_setting(c);
+
+	if (c->owner) {
+		/* Settings are per connection, a job sets all of them */
+		str = talloc_asprintf(c, "set profile %d\nset system %d\nset runas %s\n%sjob %u run %s\n",
+		                      (c->args->flags & SVC_PROFILE) ? 1 : 0,
+		                      (c->args->flags & SVC_SYSTEM) ? 1 : 0,
+		                      c->args->runas ? c->args->runas : "",
+		                      compress, c->job_id, c->args->cmd);
+		DEBUG(1, ("CTRL: Sending command: %s", str));
+		async_write(c->owner->ac_ctrl, str, strlen(str));
+		talloc_free(str);
+		c->state = STATE_RUNNING;
+		host_phase(c, PHASE_LAUNCH);
+		return;
+	}
+
+	if (c->args->flags & SVC_PROFILE)
+		str = "set profile 1\n";
+	if (c->args->runas)
+		str = talloc_asprintf(c, "%s%sset runas %s\nrun %s\n", str, compress, c->args->runas, c->args->cmd);
+	else
+		str = talloc_asprintf(c, "%s%s%srun %s\n", str, compress, (c->args->flags & SVC_SYSTEM) ? "set system 1\n" : "" , c->args->cmd);
+	DEBUG(1, ("CTRL: Sending command: %s", str));
+	async_write(c->ac_ctrl, str, strlen(str));
+	talloc_free(str);
+	c->state = STATE_RUNNING;
+	host_phase(c, PHASE_LAUNCH);
+}
+
+static void write_in_pipe(struct winexe_context *c, const char *data, int len)
+{
+	if (c->iconv_enc == (iconv_t)(-1)) {
+		async_write(c->ac_in, data, len);
+		return;
+	}
+
+	char *pdata = discard_const_p(char, data);
+	size_t l = len;
+	while (l > 0) {
+		char buf[4096];
+		char *p = buf;
+		size_t left = sizeof(buf);
+
+		size_t nchars = iconv(c->iconv_enc, (char **)&pdata, &l, &p, &left);
+
+		if (p - buf > 0)
+			async_write(c->ac_in, buf, p - buf);
+		if (nchars == -1) {
+			DEBUG(9, ("Could not convert: \"%.*s\", errno=%d\n", (int)l, pdata, errno));
+			async_write(c->ac_in, pdata, l);
+			return;
+		}
+
+	}
+}
+
+/* Undoes the raw mode a STDIN_LOCAL context put the terminal in */
+void winexe_restore_terminal(void)
+{
+	if (!termios_orig_is_valid)
+		return;
+	tcsetattr(0, TCSANOW, &termios_orig);
+	termios_orig_is_valid = 0;
+}
+
+static void on_stdin_read_event(struct tevent_context *ev,
+                                struct tevent_fd *fde,
+                                uint16_t flags,
+                                struct winexe_context *c)
+{
+	char data[STDIN_READ_SIZE];
+	int len;
+	if (!c->ac_in) {
+		TALLOC_FREE(c->ev_stdin);
+		return;
+	}
+	if ((len = read(0, &data, sizeof(data))) > 0) {
+		write_in_pipe(c, data, len);
+	} else {
+		usleep(10);
+	}
+	/* The remote side is slower than us, wait for on_in_pipe_write() */
+	if (c->ev_stdin && c->ac_in && async_write_queued(c->ac_in) >= STDIN_QUEUE_MAX)
+		tevent_fd_set_flags(c->ev_stdin, 0);
+}
+
+static bool is_fd_pollable(int fd)
+{
+	struct epoll_event ev = {};
+
+	/* dirty check, probably not portable */
+	epoll_ctl(fd, EPOLL_CTL_ADD, fd, &ev);
+
+	return errno != EPERM;
+}
+
+static void in_pipe_close_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	struct winexe_context *c = talloc_get_type(private_data, struct winexe_context);
+	std_pipe_close(c, &c->ac_in);
+}
+
+/*
+  Sends EOF to the remote command once all of its input is written,
+  async_close() would drop what is still queued or in flight
+*/
+static void in_pipe_close_drained(struct winexe_context *c)
+{
+	if (!c->ac_in || async_write_queued(c->ac_in) || async_write_pending(c->ac_in))
+		return;
+	tevent_add_timer(c->ev, c, timeval_zero(), in_pipe_close_handler, c);
+}
+
+/*
+  Feeds the remote command's stdin in STDIN_EXTERNAL mode, len == 0 means
+  end of input. Data arriving before the pipe is open is kept until then.
+*/
+void winexe_context_input(struct winexe_context *c, const char *data, int len)
+{
+	if (c->input_eof)
+		return;
+	if (!len)
+		c->input_eof = 1;
+
+	if (!c->in_open) {
+		if (len) {
+			c->input = talloc_realloc(c, c->input, char, c->input_len + len);
+			if (!c->input) {
+				c->input_len = 0;
+				return;
+			}
+			memcpy(c->input + c->input_len, data, len);
+			c->input_len += len;
+		}
+		return;
+	}
+
+	if (!c->ac_in)
+		return;
+	if (len)
+		write_in_pipe(c, data, len);
+	else
+		in_pipe_close_drained(c);
+}
+
+/*
+  True while more than STDIN_QUEUE_MAX bytes of input wait to be written,
+  the owner should stop feeding winexe_context_input() until cb_input
+*/
+int winexe_context_input_full(struct winexe_context *c)
+{
+	if (!c->in_open)
+		return c->input_len >= STDIN_QUEUE_MAX;
+	return c->ac_in && async_write_queued(c->ac_in) >= STDIN_QUEUE_MAX;
+}
+
+/*
+  Stops or resumes reading stdout and stderr of the command, for an owner
+  whose consumer is slower than the host. Reads in flight still arrive.
+*/
+void winexe_context_pause_output(struct winexe_context *c, int pause)
+{
+	c->output_paused = pause;
+	if (c->ac_out)
+		async_read_pause(c->ac_out, pause);
+	if (c->ac_err)
+		async_read_pause(c->ac_err, pause);
+}
+
+static void on_in_pipe_open(struct winexe_context *c)
+{
+	c->in_open = 1;
+
+	if (c->stdin_mode == STDIN_NONE) {
+		/* stdin is not shared between hosts, send EOF to the command */
+		tevent_add_timer(c->ev, c, timeval_zero(), in_pipe_close_handler, c);
+		return;
+	}
+
+	if (c->stdin_mode == STDIN_EXTERNAL) {
+		if (c->input_len)
+			write_in_pipe(c, c->input, c->input_len);
+		TALLOC_FREE(c->input);
+		c->input_len = 0;
+		if (c->input_eof)
+			in_pipe_close_drained(c);
+		else if (c->cb_input)
+			c->cb_input(c->cb_ctx, c);
+		return;
+	}
+
+	if (is_fd_pollable(0))
+	    c->ev_stdin = tevent_add_fd(c->ev,
+	                            c, 0, TEVENT_FD_READ,
+	                            (tevent_fd_handler_t) on_stdin_read_event, c);
+	else
+	    on_stdin_read_event(NULL, NULL, 0, c);
+
+	struct termios termios_tmp;
+	if (!termios_orig_is_valid) {
+		tcgetattr(0, &termios_orig);
+		termios_orig_is_valid = 1;
+	}
+	termios_tmp = termios_orig;
+	termios_tmp.c_lflag &= ~ICANON;
+	tcsetattr(0, TCSANOW, &termios_tmp);
+	setbuf(stdin, NULL);
+}
+
+static void on_in_pipe_write(struct winexe_context *c)
+{
+	if (c->stdin_mode == STDIN_EXTERNAL) {
+		if (c->input_eof)
+			in_pipe_close_drained(c);
+		else if (c->cb_input)
+			c->cb_input(c->cb_ctx, c);
+		return;
+	}
+	if (c->ev_stdin) {
+		if (async_write_queued(c->ac_in) < STDIN_QUEUE_MAX)
+			tevent_fd_set_flags(c->ev_stdin, TEVENT_FD_READ);
+		return;
+	}
+	if (c->stdin_mode != STDIN_LOCAL || async_write_queued(c->ac_in) >= STDIN_QUEUE_MAX)
+		return;
+
+	on_stdin_read_event(NULL, NULL, 0, c);
+}
+
+static void on_std_pipe_close(struct winexe_context *c)
+{
+	--c->open_pipes;
+	host_check_done(c);
+}
+
+static void write_checking_retval(int fd, const char *data, int len)
+{
+	ssize_t r = write(fd, data, len);
+	if (r < len)
+		DEBUG(0, ("ERROR: Failed trying to write %d bytes; value returned was %d\n",
+		      len, (int)r));
+	return;
+}
+
+/*
+  Writes command output to the local fd or the owner's cb_output; with
+  --hosts every complete line is prefixed with the host name, partial lines
+  are kept until they are terminated so output of concurrent hosts is never
+  interleaved.
+*/
+static void write_host_output(int fd, struct winexe_context *c, const char *data, int len)
+{
+	char **pline = (fd == 2) ? &c->err_line : &c->out_line;
+	int *plen = (fd == 2) ? &c->err_line_len : &c->out_line_len;
+	int hlen = strlen(c->hostname);
+	const char *nl;
+
+	if (c->cb_output) {
+		c->cb_output(c->cb_ctx, fd, data, len);
+		return;
+	}
+
+	if (!c->prefix_output) {
+		write_checking_retval(fd, data, len);
+		return;
+	}
+
+	while (len > 0 && (nl = memchr(data, '\n', len))) {
+		int l = nl - data + 1;
+		char *line = talloc_array(c, char, hlen + 2 + *plen + l);
+		if (line) {
+			memcpy(line, c->hostname, hlen);
+			memcpy(line + hlen, ": ", 2);
+			if (*plen)
+				memcpy(line + hlen + 2, *pline, *plen);
+			memcpy(line + hlen + 2 + *plen, data, l);
+			write_checking_retval(fd, line, hlen + 2 + *plen + l);
+			talloc_free(line);
+		}
+		TALLOC_FREE(*pline);
+		*plen = 0;
+		data += l;
+		len -= l;
+	}
+
+	if (len > 0)
+		line_append(c, pline, plen, data, len);
+}
+
+/*
+  Longest ASCII prefix of data. Checks a word at a time, which the compiler
+  widens to vector registers where it can; large plain text output spends
+  its time here rather than in iconv.
+*/
+static size_t ascii_run(const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		if (w & 0x8080808080808080ULL)
+			break;
+	}
+	while (i < len && p[i] < 0x80)
+		++i;
+	return i;
+}
+
+static size_t non_ascii_run(const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	size_t i = 0;
+
+	while (i < len && p[i] >= 0x80)
+		++i;
+	return i;
+}
+
+/*
+  Converts a span of non-ASCII bytes, returns the length of an incomplete
+  multibyte sequence left at its end. Invalid bytes are passed on as is.
+*/
+static size_t conv_span(int fd, struct winexe_context *c, const char *data, size_t len)
+{
+	char *in = discard_const_p(char, data);
+
+	while (len > 0) {
+		char buf[4096];
+		char *p = buf;
+		size_t left = sizeof(buf);
+		size_t nchars = iconv(c->iconv_dec, &in, &len, &p, &left);
+
+		if (p > buf)
+			write_host_output(fd, c, buf, p - buf);
+		if (nchars != (size_t) -1 || errno == E2BIG)
+			continue;
+		if (errno == EINVAL)
+			return len;
+		DEBUG(9, ("Could not convert: \"%.*s\", errno=%d\n", (int)len, in, errno));
+		write_host_output(fd, c, in, 1);
+		++in;
+		--len;
+	}
+	return 0;
+}
+
+/*
+  Converts output from the host's codepage. All codepages given by
+  codepage_to_string() keep ASCII as is and never use ASCII bytes inside
+  multibyte sequences, so ASCII runs are written straight from the
+  received data and only the rest goes through iconv. A sequence split
+  between two reads is kept in conv_carry until the next one.
+*/
+static void write_conv_buf(int fd, struct winexe_context *c, const char *data, int len)
+{
+	char *carry;
+	int *carry_len;
+	size_t n, rest;
+
+	if (c->iconv_dec == (iconv_t)(-1)) {
+		write_host_output(fd, c, data, len);
+		return;
+	}
+
+	carry = c->conv_carry[fd == 2];
+	carry_len = &c->conv_carry_len[fd == 2];
+	while (*carry_len) {
+		n = non_ascii_run(data, len);
+		if (n > CONV_CARRY_MAX - *carry_len)
+			n = CONV_CARRY_MAX - *carry_len;
+		memcpy(carry + *carry_len, data, n);
+		*carry_len += n;
+		data += n;
+		len -= n;
+		rest = conv_span(fd, c, carry, *carry_len);
+		memmove(carry, carry + *carry_len - rest, rest);
+		*carry_len = rest;
+		if (!rest)
+			break;
+		if (!len)
+			return;
+		if (rest == CONV_CARRY_MAX) {
+			/* Longer than any sequence, pass a byte on as invalid */
+			write_host_output(fd, c, carry, 1);
+			memmove(carry, carry + 1, --*carry_len);
+		} else if ((unsigned char) *data < 0x80) {
+			/* Cut short by ASCII, it will never be complete */
+			write_host_output(fd, c, carry, rest);
+			*carry_len = 0;
+		}
+	}
+
+	while (len > 0) {
+		n = ascii_run(data, len);
+		if (n) {
+			write_host_output(fd, c, data, n);
+			data += n;
+			len -= n;
+			if (!len)
+				break;
+		}
+		n = non_ascii_run(data, len);
+		rest = conv_span(fd, c, data, n);
+		data += n;
+		len -= n;
+		if (rest && !len && rest <= CONV_CARRY_MAX) {
+			memcpy(carry, data - rest, rest);
+			*carry_len = rest;
+		} else if (rest) {
+			write_host_output(fd, c, data - rest, rest);
+		}
+	}
+}
+
+static void flush_host_output(struct winexe_context *c)
+{
+	int i;
+
+	/* Whatever was left of a multibyte sequence goes out unconverted */
+	for (i = 0; i < 2; ++i) {
+		if (c->conv_carry_len[i]) {
+			write_host_output(i + 1, c, c->conv_carry[i], c->conv_carry_len[i]);
+			c->conv_carry_len[i] = 0;
+		}
+	}
+	if (c->out_line)
+		write_host_output(1, c, "\n", 1);
+	if (c->err_line)
+		write_host_output(2, c, "\n", 1);
+}
+
+/*
+  Output of a compressing service is one zlib stream per pipe, flushed at
+  the end of every chunk the command wrote, so whatever arrived can be
+  passed on at once. Returns false on corrupt data.
+*/
+static bool write_inflated(int fd, struct winexe_context *c, z_stream *z, const char *data, int len)
+{
+	uint64_t *inflated = &c->stats.inflated[fd == 1 ? STATS_PIPE_OUT : STATS_PIPE_ERR];
+	char buf[16384];
+	int res;
+
+	z->next_in = (Bytef *) discard_const_p(char, data);
+	z->avail_in = len;
+	do {
+		z->next_out = (Bytef *) buf;
+		z->avail_out = sizeof(buf);
+		res = inflate(z, Z_SYNC_FLUSH);
+		if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+			DEBUG(0, ("ERROR: %s: Corrupt compressed output - %s\n", c->hostname,
+			          z->msg ? z->msg : zError(res)));
+			return false;
+		}
+		if (z->avail_out < sizeof(buf)) {
+			*inflated += sizeof(buf) - z->avail_out;
+			write_conv_buf(fd, c, buf, sizeof(buf) - z->avail_out);
+		}
+		if (res == Z_STREAM_END && z->avail_in) {
+			DEBUG(0, ("ERROR: %s: Data after the end of compressed output\n", c->hostname));
+			return false;
+		}
+	} while (z->avail_out == 0);
+	return true;
+}
+
+static void on_out_pipe_read(struct winexe_context *c, const char *data, int len)
+{
+	if (!c->z_out)
+		write_conv_buf(1, c, data, len);
+	else if (!write_inflated(1, c, c->z_out, data, len))
+		std_pipe_close(c, &c->ac_out);
+}
+
+static void on_in_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
+{
+	std_pipe_close(c, &c->ac_in);
+}
+
+static void on_out_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
+{
+	std_pipe_close(c, &c->ac_out);
+}
+
+static void on_err_pipe_read(struct winexe_context *c, const char *data, int len)
+{
+	if (!c->z_err)
+		write_conv_buf(2, c, data, len);
+	else if (!write_inflated(2, c, c->z_err, data, len))
+		std_pipe_close(c, &c->ac_err);
+}
+
+static void on_err_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
+{
+	std_pipe_close(c, &c->ac_err);
+}
+
+static void host_install_fail(struct winexe_context *c)
+{
+	/* A failed first-contact install keeps the old exit code */
+	c->return_code = c->install_attempts ? RET_CODE_INSTALL_ERROR : 1;
+	c->status = "install-error";
+	host_finish(c);
+}
+
+static void host_install_done(struct tevent_req *subreq)
+{
+	struct winexe_context *c = tevent_req_callback_data(subreq, struct winexe_context);
+	NTSTATUS status;
+
+	status = svc_install_recv(subreq, &c->stats.install);
+	TALLOC_FREE(subreq);
+	if (c->finished)
+		return;
+	if (!NT_STATUS_IS_OK(status) && (c->args->flags & SVC_OSCHOOSE) && c->cached.os64bit >= 0) {
+		DEBUG(1, ("%s: Install failed, probing the architecture again\n", c->hostname));
+		c->cached.os64bit = -1;
+		host_cache_delete(c->args->cache, c->hostname);
+		host_install_start(c);
+		return;
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		host_install_fail(c);
+		return;
+	}
+	/* Stored in the cache once the service answers get version */
+	if (c->stats.install.os64bit >= 0)
+		c->cached.os64bit = c->stats.install.os64bit;
+	if (!(c->args->flags & SVC_IGNORE_INTERACTIVE))
+		c->cached.interactive = (c->args->flags & SVC_INTERACTIVE) != 0;
+	host_open_ctrl_pipe(c);
+}
+
+static void host_install_start(struct winexe_context *c)
+{
+	struct tevent_req *subreq;
+	int flags = c->args->flags;
+
+	/* The architecture is known, skip the SysWoW64 probe */
+	if ((flags & SVC_OSCHOOSE) && c->cached.os64bit >= 0)
+		flags = (flags & ~SVC_OSCHOOSE) | (c->cached.os64bit ? SVC_OS64BIT : 0);
+
+	DEBUG(1,("Installing service\n"));
+	subreq = svc_install_send(c, c->ev, c->tree, c->tree2, c->hostname,
+	                          SERVICE_NAME, SERVICE_FILENAME,
+	                          winexesvc32_exe, winexesvc32_exe_len,
+	                          winexesvc64_exe, winexesvc64_exe_len,
+	                          flags);
+	if (!subreq) {
+		host_install_fail(c);
+		return;
+	}
+	tevent_req_set_callback(subreq, host_install_done, c);
+}
+
+static void host_uninstall_done(struct tevent_req *subreq)
+{
+	struct winexe_context *c = tevent_req_callback_data(subreq, struct winexe_context);
+
+	svc_uninstall_recv(subreq);
+	TALLOC_FREE(subreq);
+	if (c->finished)
+		return;
+	host_install_start(c);
+}
+
+/*
+  Installs the service on the loop shared by all hosts, then opens the
+  control pipe. Everything runs on the session of the IPC$ connection.
+*/
+static void host_install(struct winexe_context *c, int uninstall_first)
+{
+	struct tevent_req *subreq;
+
+	c->state = STATE_INSTALLING;
+	host_phase(c, PHASE_INSTALL);
+	if (!uninstall_first) {
+		host_install_start(c);
+		return;
+	}
+	DEBUG(1,("Uninstalling service\n"));
+	subreq = svc_uninstall_send(c, c->ev, c->tree, c->tree2, c->hostname,
+	                            SERVICE_NAME, SERVICE_FILENAME,
+	                            c->args->flags);
+	if (!subreq) {
+		host_install_fail(c);
+		return;
+	}
+	tevent_req_set_callback(subreq, host_uninstall_done, c);
+}
+
+static void host_install_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	struct winexe_context *c = talloc_get_type(private_data, struct winexe_context);
+
+	if (++c->install_attempts > MAX_INSTALL_ATTEMPTS) {
+		DEBUG(0, ("ERROR: %s: Control pipe still unavailable after installing service\n", c->hostname));
+		c->return_code = RET_CODE_CTRL_PIPE_ERROR;
+		c->status = "ctrl-pipe-error";
+		host_finish(c);
+		return;
+	}
+
+	host_install(c, c->state == STATE_CLOSING_FOR_REINSTALL);
+}
+
+static void host_schedule_install(struct winexe_context *c)
+{
+	tevent_add_timer(c->ev, c, timeval_zero(), host_install_handler, c);
+}
+
+static void host_open_ctrl_pipe(struct winexe_context *c)
+{
+	if (!c->ac_ctrl) {
+		c->ac_ctrl = talloc_zero(c, struct async_context);
+		if (!c->ac_ctrl)
+			goto failed;
+		c->ac_ctrl->tree = c->tree;
+		c->ac_ctrl->tree2 = c->tree2;
+		c->ac_ctrl->cb_ctx = c;
+		c->ac_ctrl->stats = &c->stats.pipes[STATS_PIPE_CTRL];
+		c->ac_ctrl->cb_open = (async_cb_open) on_ctrl_pipe_open;
+		c->ac_ctrl->cb_close = (async_cb_close) on_ctrl_pipe_close;
+		c->ac_ctrl->cb_read = (async_cb_read) on_ctrl_pipe_read;
+		c->ac_ctrl->cb_error = (async_cb_error) on_ctrl_pipe_error;
+	}
+	c->state = STATE_OPENING;
+	host_phase(c, PHASE_CTRL_OPEN);
+	if (async_open(c->ac_ctrl, "\\" PIPE_NAME, OPENX_MODE_ACCESS_RDWR))
+		return;
+	/* async_open() frees the context on failure */
+	c->ac_ctrl = NULL;
+  failed:
+	c->return_code = RET_CODE_CTRL_PIPE_ERROR;
+	c->status = "ctrl-pipe-error";
+	host_finish(c);
+}
+
+static void host_connect_done(struct winexe_context *c, NTSTATUS status)
+{
+	if (!NT_STATUS_IS_OK(status)) {
+		if (NT_STATUS_EQUAL(status, NT_STATUS_NO_MEMORY))
+			status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
+		DEBUG(0,
+			("ERROR: %s: Failed to open connection - %s\n",
+			c->hostname, nt_errstr(status)));
+		c->return_code = 1;
+		c->status = "connect-error";
+		host_finish(c);
+		return;
+	}
+
+	/*
+	  The svcctl pipe, ADMIN$ and the shares of --put reuse this
+	  connection's session. An --interactive setting the cache says the
+	  service already has needs no trip to the service manager.
+	*/
+	host_xfer_start(c, 0);
+	if (c->finished)
+		return;
+	if (c->args->flags & SVC_FORCE_UPLOAD)
+		host_install(c, 1);
+	else if (!(c->args->flags & SVC_IGNORE_INTERACTIVE)
+	         && c->cached.interactive != ((c->args->flags & SVC_INTERACTIVE) != 0))
+		host_install(c, 0);
+	else
+		host_open_ctrl_pipe(c);
+}
+
+static void on_host_connect(struct composite_context *creq)
+{
+	struct winexe_context *c = talloc_get_type(creq->async.private_data, struct winexe_context);
+	NTSTATUS status;
+
+	status = smb_composite_connect_recv(creq, c);
+	if (NT_STATUS_IS_OK(status))
+		c->tree = c->io_connect->out.tree;
+	TALLOC_FREE(c->io_connect);
+	host_connect_done(c, status);
+}
+
+#ifdef HAVE_SMB2
+static void on_host_connect2(struct composite_context *creq)
+{
+	struct winexe_context *c = talloc_get_type(creq->async.private_data, struct winexe_context);
+
+	host_connect_done(c, smb2_connect_recv(creq, c, &c->tree2));
+}
+
+static void host_connect2(struct winexe_context *c)
+{
+	struct smbcli_options options;
+	struct composite_context *creq;
+
+	lpcfg_smbcli_options(c->lp_ctx, &options);
+	creq = smb2_connect_send(c, c->hostname, lpcfg_smb_ports(c->lp_ctx), "IPC$",
+	                         lpcfg_resolve_context(c->lp_ctx), c->args->credentials,
+	                         c->ev, &options, lpcfg_socket_options(c->lp_ctx),
+	                         lpcfg_gensec_settings(c, c->lp_ctx));
+	if (!creq) {
+		DEBUG(0, ("ERROR: %s: Failed to start connection\n", c->hostname));
+		c->return_code = 1;
+		c->status = "connect-error";
+		host_finish(c);
+		return;
+	}
+	creq->async.fn = on_host_connect2;
+	creq->async.private_data = c;
+}
+#endif
+
+static const char *called_name(TALLOC_CTX *mem_ctx, const char *hostname)
+{
+	char *name = talloc_strdup(mem_ctx, hostname);
+	char *p;
+
+	for (p = name; p && *p; ++p)
+		*p = toupper((unsigned char)*p);
+	return name;
+}
+
+static void host_connect(struct winexe_context *c)
+{
+	struct smb_composite_connect *io;
+	struct composite_context *creq;
+
+#ifdef HAVE_SMB2
+	if (c->args->flags & SVC_SMB2) {
+		host_connect2(c);
+		return;
+	}
+#endif
+
+	io = talloc_zero(c, struct smb_composite_connect);
+	if (!io)
+		goto failed;
+	io->in.dest_host = c->hostname;
+	io->in.dest_ports = lpcfg_smb_ports(c->lp_ctx);
+	io->in.socket_options = lpcfg_socket_options(c->lp_ctx);
+	io->in.called_name = called_name(io, c->hostname);
+	io->in.service = "IPC$";
+	io->in.service_type = NULL;
+	io->in.credentials = c->args->credentials;
+	io->in.gensec_settings = lpcfg_gensec_settings(io, c->lp_ctx);
+	io->in.fallback_to_anonymous = false;
+	io->in.workgroup = "";
+	lpcfg_smbcli_options(c->lp_ctx, &io->in.options);
+	lpcfg_smbcli_session_options(c->lp_ctx, &io->in.session_options);
+	c->io_connect = io;
+
+	creq = smb_composite_connect_send(io, c, lpcfg_resolve_context(c->lp_ctx), c->ev);
+	if (!creq)
+		goto failed;
+	creq->async.fn = on_host_connect;
+	creq->async.private_data = c;
+	return;
+
+  failed:
+	DEBUG(0, ("ERROR: %s: Failed to start connection\n", c->hostname));
+	c->return_code = 1;
+	c->status = "connect-error";
+	host_finish(c);
+}
+
+static void host_check_done(struct winexe_context *c)
+{
+	if (c->ctrl_finished && !c->open_pipes && !c->jobs && !c->xfer_req)
+		host_finish(c);
+}
+
+/*
+  A failed put keeps the command from running, a failed get turns a
+  successful return code into RET_CODE_TRANSFER_ERROR.
+*/
+static void host_xfer_failed(struct winexe_context *c, int get)
+{
+	c->status = "transfer-error";
+	if (!get || !c->return_code)
+		c->return_code = RET_CODE_TRANSFER_ERROR;
+	if (get)
+		host_check_done(c);
+	else
+		host_finish(c);
+}
+
+static void host_xfer_done(struct tevent_req *subreq)
+{
+	struct winexe_context *c = tevent_req_callback_data(subreq, struct winexe_context);
+	int get = c->xfer_get;
+	NTSTATUS status;
+
+	status = xfer_recv(subreq, get ? &c->stats.get : &c->stats.put);
+	TALLOC_FREE(subreq);
+	c->xfer_req = NULL;
+	if (c->finished)
+		return;
+	if (!NT_STATUS_IS_OK(status)) {
+		host_xfer_failed(c, get);
+	} else if (get) {
+		host_check_done(c);
+	} else if (c->run_waiting) {
+		c->run_waiting = 0;
+		winexe_context_run(c);
+	}
+}
+
+/*
+  Puts start as soon as the session is up and overlap the service install
+  and the control pipe handshake, gets start with the return code and
+  overlap the draining of stdout and stderr. Jobs move no files.
+*/
+static void host_xfer_start(struct winexe_context *c, int get)
+{
+	const struct xfer_item *it;
+
+	if (c->owner)
+		return;
+	for (it = c->args->xfers; it; it = it->next)
+		if (it->get == get)
+			break;
+	if (!it)
+		return;
+	c->xfer_get = get;
+	c->xfer_req = xfer_send(c, c->ev, c->tree, c->tree2, c->hostname, c->args->xfers, get);
+	if (!c->xfer_req) {
+		host_xfer_failed(c, get);
+		return;
+	}
+	tevent_req_set_callback(c->xfer_req, host_xfer_done, c);
+}
+
+static void host_cleanup(struct winexe_context *c)
+{
+	struct winexe_context *owner = c->owner;
+
+	if (owner) {
+		struct winexe_context **pj;
+		for (pj = &owner->jobs; *pj; pj = &(*pj)->next_job) {
+			if (*pj == c) {
+				*pj = c->next_job;
+				break;
+			}
+		}
+	}
+	flush_host_output(c);
+	host_phase(c, PHASE_MAX);
+	c->stats.total_usec = usec_time_diff(&c->stats.mark, &c->stats.start);
+	if (c->stdin_mode == STDIN_LOCAL && c->in_open)
+		winexe_restore_terminal();
+	if (c->iconv_enc != (iconv_t)-1)
+		iconv_close(c->iconv_enc);
+	if (c->iconv_dec != (iconv_t)-1)
+		iconv_close(c->iconv_dec);
+
+	DEBUG(1, ("%s: finished, status %s, return code %d\n", c->hostname, c->status, c->return_code));
+	if (c->cb_finish)
+		c->cb_finish(c->cb_ctx, c);
+	talloc_free(c);
+	if (owner)
+		host_check_done(owner);
+}
+
+static void host_cleanup_uninstalled(struct tevent_req *subreq)
+{
+	struct winexe_context *c = tevent_req_callback_data(subreq, struct winexe_context);
+
+	svc_uninstall_recv(subreq);
+	TALLOC_FREE(subreq);
+	host_cleanup(c);
+}
+
+/* Runs from a timer, so the connection is never freed under a callback */
+static void host_cleanup_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	struct winexe_context *c = talloc_get_type(private_data, struct winexe_context);
+	struct tevent_req *subreq;
+
+	if (!c->owner && (c->tree || c->tree2) && (c->args->flags & SVC_UNINSTALL)) {
+		subreq = svc_uninstall_send(c, c->ev, c->tree, c->tree2, c->hostname,
+		                            SERVICE_NAME, SERVICE_FILENAME,
+		                            c->args->flags);
+		if (subreq) {
+			host_phase(c, PHASE_UNINSTALL);
+			tevent_req_set_callback(subreq, host_cleanup_uninstalled, c);
+			return;
+		}
+	}
+	host_cleanup(c);
+}
+
+static void host_finish(struct winexe_context *c)
+{
+	if (c->finished)
+		return;
+	c->finished = 1;
+	TALLOC_FREE(c->ev_stdin);
+	tevent_add_timer(c->ev, c->ev, timeval_zero(), host_cleanup_handler, c);
+}
+
+/*
+  Asks the remote command to terminate; a parked control pipe is closed and
+  a context which did not reach the service yet finishes as "aborted".
+*/
+void winexe_context_abort(struct winexe_context *c)
+{
+	if (c->finished)
+		return;
+	if (c->owner) {
+		char *str = talloc_asprintf(c, "job %u abort\n", c->job_id);
+		if (str)
+			async_write(c->owner->ac_ctrl, str, strlen(str));
+		talloc_free(str);
+		return;
+	}
+	switch (c->state) {
+	case STATE_RUNNING:
+		async_write(c->ac_ctrl, "abort\n", 6);
+		break;
+	case STATE_READY:
+		c->state = STATE_CLOSING;
+		c->status = "aborted";
+		if (!async_close(c->ac_ctrl))
+			host_finish(c);
+		break;
+	default:
+		c->status = "aborted";
+		host_finish(c);
+	}
+}
+
+/*
+  Creates a context running on ev, lp_ctx gives the connection settings.
+  args, lp_ctx and the credentials in args may be shared by any number of
+  contexts and must outlive them.
+*/
+struct winexe_context *winexe_context_init(TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+                                           struct loadparm_context *lp_ctx,
+                                           struct program_options *args, const char *hostname)
+{
+	struct winexe_context *c;
+
+	c = talloc_zero(mem_ctx, struct winexe_context);
+	if (c == NULL) {
+		DEBUG(0, ("ERROR: Failed to allocate struct winexe_context\n"));
+		return NULL;
+	}
+	c->ev = ev;
+	c->lp_ctx = lp_ctx;
+	c->args = args;
+	c->hostname = hostname;
+	c->return_code = RET_CODE_UNKNOWN_ERROR;
+	c->status = "unknown-error";
+	c->iconv_dec = (iconv_t)-1;
+	c->iconv_enc = (iconv_t)-1;
+	c->state = STATE_OPENING;
+	c->stats.phase = PHASE_MAX;
+	c->stats.start = timeval_current();
+	return c;
+}
+
+/*
+  Creates a job running on the control pipe of owner, which must be parked in
+  STATE_READY with a service of at least JOBS_MIN_VERSION. The job is ready
+  for winexe_context_run() once its hooks are set.
+*/
+struct winexe_context *winexe_job_init(TALLOC_CTX *mem_ctx, struct winexe_context *owner, struct program_options *args)
+{
+	struct winexe_context *c;
+
+	if (owner->state != STATE_READY || owner->service_version < JOBS_MIN_VERSION)
+		return NULL;
+	c = winexe_context_init(mem_ctx, owner->ev, owner->lp_ctx, args, owner->hostname);
+	if (c == NULL)
+		return NULL;
+	c->owner = owner;
+	c->tree = owner->tree;
+	c->tree2 = owner->tree2;
+	c->job_id = ++owner->next_job_id;
+	c->state = STATE_READY;
+	if (owner->codepage) {
+		c->iconv_enc = iconv_open(owner->codepage, "UTF-8");
+		c->iconv_dec = iconv_open("UTF-8//TRANSLIT", owner->codepage);
+	}
+	c->next_job = owner->jobs;
+	owner->jobs = c;
+	return c;
+}
+
+/*
+  Starts the state machine; with NULL trees a new IPC$ connection is made,
+  otherwise the control pipe is opened on the caller's SMB1 tree or SMB2
+  tree2, which must outlive the context.
+*/
+void winexe_context_start(struct winexe_context *c, struct smbcli_tree *tree, struct smb2_tree *tree2)
+{
+	c->cache_hit = host_cache_fetch(c->args->cache, c->hostname, &c->cached);
+	if (!c->cache_hit) {
+		c->cached.service_version = -1;
+		c->cached.os64bit = -1;
+		c->cached.interactive = -1;
+	}
+	c->stats.cache_hit = c->cache_hit;
+
+	if (tree || tree2) {
+		c->tree = tree;
+		c->tree2 = tree2;
+		host_open_ctrl_pipe(c);
+		return;
+	}
+
+	host_phase(c, PHASE_CONNECT);
+	host_connect(c);
+}
+
+static char *json_string(TALLOC_CTX *mem_ctx, const char *str)
+{
+	char *js = talloc_strdup(mem_ctx, "\"");
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)str; js && p && *p; ++p) {
+		if (*p == '"' || *p == '\\')
+			js = talloc_asprintf_append(js, "\\%c", *p);
+		else if (*p < 0x20)
+			js = talloc_asprintf_append(js, "\\u%04x", *p);
+		else
+			js = talloc_asprintf_append(js, "%c", *p);
+	}
+	return js ? talloc_asprintf_append(js, "\"") : NULL;
+}
+
+/*
+  Formats the outcome of a host as one JSON object; times are in
+  microseconds, the bytes of each pipe are those of completed requests.
+*/
+char *winexe_stats_json(TALLOC_CTX *mem_ctx, const char *hostname, int return_code,
+                        const char *status, const struct winexe_stats *stats)
+{
+	const struct svc_install_stats *in = &stats->install;
+	char *host, *st, *js;
+	int i;
+
+	host = json_string(mem_ctx, hostname);
+	st = json_string(host, status);
+	if (!st) {
+		talloc_free(host);
+		return NULL;
+	}
+	js = talloc_asprintf(mem_ctx, "{\"host\": %s, \"return_code\": %d, \"status\": %s, "
+	                     "\"cache_hit\": %s, \"total_usec\": %lld, \"phases_usec\": {",
+	                     host, return_code, st, stats->cache_hit ? "true" : "false",
+	                     (long long)stats->total_usec);
+	talloc_free(host);
+	for (i = 0; js && i < PHASE_MAX; ++i)
+		js = talloc_asprintf_append(js, "%s\"%s\": %lld", i ? ", " : "",
+		                            phase_names[i], (long long)stats->usec[i]);
+	if (js)
+		js = talloc_asprintf_append(js, "}, \"install_usec\": {\"scm\": %lld, \"upload\": %lld, "
+		                            "\"start\": %lld}, \"upload_bytes\": {\"compared\": %llu, "
+		                            "\"written\": %llu}, \"pipes\": {",
+		                            (long long)in->scm_usec, (long long)in->upload_usec,
+		                            (long long)in->start_usec,
+		                            (unsigned long long)in->upload_compared,
+		                            (unsigned long long)in->upload_written);
+	for (i = 0; js && i < STATS_PIPE_MAX; ++i) {
+		const struct async_stats *ps = &stats->pipes[i];
+		js = talloc_asprintf_append(js, "%s\"%s\": {\"reads\": %u, \"writes\": %u, "
+		                            "\"bytes_read\": %llu, \"bytes_written\": %llu, "
+		                            "\"bytes_inflated\": %llu}",
+		                            i ? ", " : "", pipe_names[i], ps->reads, ps->writes,
+		                            (unsigned long long)ps->bytes_read,
+		                            (unsigned long long)ps->bytes_written,
+		                            (unsigned long long)stats->inflated[i]);
+	}
+	if (js)
+		js = talloc_asprintf_append(js, "}, \"transfer\": {\"put\": {\"files\": %u, \"bytes\": %llu, "
+		                            "\"usec\": %lld}, \"get\": {\"files\": %u, \"bytes\": %llu, "
+		                            "\"usec\": %lld}",
+		                            stats->put.files, (unsigned long long)stats->put.bytes,
+		                            (long long)stats->put.usec,
+		                            stats->get.files, (unsigned long long)stats->get.bytes,
+		                            (long long)stats->get.usec);
+	return js ? talloc_asprintf_append(js, "}}") : NULL;
+}
+
+/*
+  tevent_req wrapper running one command on one host. The context lives on
+  ev rather than on the request, so freeing the request early only detaches
+  it: the command is aborted and the context cleans up on its own.
+*/
+struct winexe_run_state {
+	struct winexe_context *c;
+	winexe_cb_output cb_output;
+	void *cb_ctx;
+	int return_code;
+	const char *status;
+	struct winexe_stats stats;
+};
+
+static void winexe_run_output(struct tevent_req *req, int fd, const char *data, int len)
+{
+	struct winexe_run_state *state;
+
+	/* NULL once the request is gone, late output is dropped */
+	if (!req)
+		return;
+	state = tevent_req_data(req, struct winexe_run_state);
+	state->cb_output(state->cb_ctx, fd, data, len);
+}
+
+static void winexe_run_finish(struct tevent_req *req, struct winexe_context *c)
+{
+	struct winexe_run_state *state = tevent_req_data(req, struct winexe_run_state);
+
+	state->c = NULL;
+	state->return_code = c->return_code;
+	state->status = c->status;
+	state->stats = c->stats;
+	tevent_req_done(req);
+}
+
+static int winexe_run_state_destructor(struct winexe_run_state *state)
+{
+	struct winexe_context *c = state->c;
+
+	if (!c)
+		return 0;
+	state->c = NULL;
+	c->cb_ctx = NULL;
+	c->cb_output = (winexe_cb_output) winexe_run_output;
+	c->cb_finish = NULL;
+	winexe_context_abort(c);
+	return 0;
+}
+
+/*
+  Runs args->cmd on hostname over a new IPC$ connection. Output of the
+  command is streamed to cb_output as it arrives, fd 1 for stdout and fd 2
+  for stderr; with a NULL cb_output it goes to the local fds. The command's
+  stdin is fed with winexe_run_input(), it waits for input until len 0 is
+  passed.
+*/
+struct tevent_req *winexe_run_send(TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+                                   struct loadparm_context *lp_ctx,
+                                   struct program_options *args, const char *hostname,
+                                   winexe_cb_output cb_output, void *cb_ctx)
+{
+	struct tevent_req *req;
+	struct winexe_run_state *state;
+	struct winexe_context *c;
+
+	req = tevent_req_create(mem_ctx, &state, struct winexe_run_state);
+	if (req == NULL)
+		return NULL;
+	state->cb_output = cb_output;
+	state->cb_ctx = cb_ctx;
+
+	c = winexe_context_init(ev, ev, lp_ctx, args, hostname);
+	if (tevent_req_nomem(c, req))
+		return tevent_req_post(req, ev);
+	c->cb_ctx = req;
+	if (cb_output)
+		c->cb_output = (winexe_cb_output) winexe_run_output;
+	c->cb_finish = (winexe_cb_finish) winexe_run_finish;
+	c->stdin_mode = STDIN_EXTERNAL;
+	state->c = c;
+	talloc_set_destructor(state, winexe_run_state_destructor);
+
+	winexe_context_start(c, NULL, NULL);
+	return req;
+}
+
+/* Feeds the command's stdin, len == 0 closes it */
+void winexe_run_input(struct tevent_req *req, const char *data, int len)
+{
+	struct winexe_run_state *state = tevent_req_data(req, struct winexe_run_state);
+
+	if (state->c)
+		winexe_context_input(state->c, data, len);
+}
+
+/* Asks the command to terminate, the request still completes normally */
+void winexe_run_abort(struct tevent_req *req)
+{
+	struct winexe_run_state *state = tevent_req_data(req, struct winexe_run_state);
+
+	if (state->c)
+		winexe_context_abort(state->c);
+}
+
+/*
+  NT_STATUS_OK once the host is done, whatever the outcome: return_code is
+  the exit code of the command or one of RET_CODE_*, status is the same
+  short word written to the --summary file, stats the timings and counters.
+*/
+NTSTATUS winexe_run_recv(struct tevent_req *req, int *return_code, const char **status,
+                         struct winexe_stats *stats)
+{
+	struct winexe_run_state *state = tevent_req_data(req, struct winexe_run_state);
+	NTSTATUS ret;
+
+	if (tevent_req_is_nterror(req, &ret)) {
+		tevent_req_received(req);
+		return ret;
+	}
+	if (return_code)
+		*return_code = state->return_code;
+	if (status)
+		*status = state->status;
+	if (stats)
+		*stats = state->stats;
+	tevent_req_received(req);
+	return NT_STATUS_OK;
+}
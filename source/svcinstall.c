@@ -4,17 +4,24 @@
   License: GNU General Public License version 3
 */
 #include <stdint.h>
+#include <string.h>
 #include <core/ntstatus.h>
 #include <fcntl.h>
 
 #include <tevent.h>
 #include <credentials.h>
 #include <util/time.h>
+#include <util/data_blob.h>
+#include <util/tevent_ntstatus.h>
 #include <gen_ndr/ndr_svcctl_c.h>
 #include <smb_cliraw.h>
-#include <smb_cli.h>
-#include <smb_composite.h>
+#include <composite.h>
+#include <dcerpc.h>
 #include <util/debug.h>
+#ifdef HAVE_SMB2
+#include <libcli/smb2/smb2.h>
+#include <libcli/smb2/smb2_calls.h>
+#endif
 
 #include "winexesvc.h"
 #include "svcinstall.h"
@@ -32,388 +39,1764 @@
 #define SERVICE_CONTROL_STOP (0x00000001)
 #define NT_STATUS_SERVICE_DOES_NOT_EXIST NT_STATUS(0xc0000424)
 
-#define NT_ERR(status, lvl, args...) if (!NT_STATUS_IS_OK(status)) { DEBUG(lvl,("ERROR: " args)); DEBUG(lvl,(". %s.\n", nt_errstr(status))); return status; }
+#define SVCCTL_PIPE "\\pipe\\svcctl"
+
+/* Largest SMB2 write every dialect accepts */
+#define SMB2_WRITE_MAX 0x10000
+
+#ifndef MIN_SMB_SIZE
+#define MIN_SMB_SIZE 35
+#endif
+
+/*
+  Pending service states and a binary still held by an exiting service
+  are retried after SVC_POLL_MIN ms, doubling up to SVC_POLL_MAX ms,
+  for at most SVC_POLL_TIMEOUT seconds.
+*/
+#define SVC_POLL_MIN 10
+#define SVC_POLL_MAX 1000
+#define SVC_POLL_TIMEOUT 60
+
 #define NT_RES(status, werr) (NT_STATUS_IS_OK(status) ? werror_to_ntstatus(werr) : status)
 
-static NTSTATUS svc_pipe_connect(struct tevent_context *ev_ctx, 
-                                 struct dcerpc_pipe **psvc_pipe,
-                                 const char *hostname,
-                                 struct cli_credentials *credentials,
-                                 struct loadparm_context *ldprm_ctx)
+union svc_rpc {
+	struct svcctl_OpenSCManagerW open_scm;
+	struct svcctl_OpenServiceW open_svc;
+	struct svcctl_CreateServiceW create;
+	struct svcctl_ChangeServiceConfigW config;
+	struct svcctl_StartServiceW start;
+	struct svcctl_ControlService control;
+	struct svcctl_QueryServiceStatus query;
+	struct svcctl_DeleteService delete;
+	struct svcctl_CloseServiceHandle close;
+};
+
+struct svc_finish_state {
+	struct tevent_req *req;
+	NTSTATUS status;
+};
+
+static void svc_finish_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	struct svc_finish_state *f = talloc_get_type(private_data, struct svc_finish_state);
+	struct tevent_req *req = f->req;
+	NTSTATUS status = f->status;
+
+	talloc_free(f);
+	if (tevent_req_nterror(req, status))
+		return;
+	tevent_req_done(req);
+}
+
+/*
+  Completes req from a zero timer. The requests which own a pipe or a
+  connection finish this way, so their caller can free them without
+  unwinding through the transport that delivered the last reply.
+*/
+void svc_finish(struct tevent_req *req, struct tevent_context *ev_ctx, NTSTATUS status)
+{
+	struct svc_finish_state *f;
+
+	f = talloc(req, struct svc_finish_state);
+	if (f) {
+		f->req = req;
+		f->status = status;
+		if (tevent_add_timer(ev_ctx, f, timeval_zero(), svc_finish_handler, f))
+			return;
+		talloc_free(f);
+	}
+	tevent_req_nterror(req, NT_STATUS_NO_MEMORY);
+}
+
+/*
+  Arms a retry timer after *delay ms and doubles the delay, fails once
+  SVC_POLL_TIMEOUT seconds have passed since start.
+*/
+static NTSTATUS svc_backoff(struct tevent_context *ev_ctx, TALLOC_CTX *mem_ctx,
+                            const struct timeval *start, uint32_t *delay,
+                            tevent_timer_handler_t handler, void *private_data)
+{
+	if (timeval_elapsed(start) > SVC_POLL_TIMEOUT)
+		return NT_STATUS_IO_TIMEOUT;
+	if (!tevent_add_timer(ev_ctx, mem_ctx, timeval_current_ofs_msec(*delay), handler, private_data))
+		return NT_STATUS_NO_MEMORY;
+	*delay = MIN(*delay * 2, SVC_POLL_MAX);
+	return NT_STATUS_OK;
+}
+
+static struct tevent_req *svc_OpenSCManager_send(TALLOC_CTX *mem_ctx,
+                                                 struct tevent_context *ev_ctx,
+                                                 struct dcerpc_binding_handle *binding_handle,
+                                                 const char *hostname,
+                                                 struct policy_handle * pscm_handle,
+                                                 struct svcctl_OpenSCManagerW *r)
+{
+	r->in.MachineName = hostname;
+	r->in.DatabaseName = NULL;
+	r->in.access_mask = SEC_FLAG_MAXIMUM_ALLOWED;
+	r->out.handle = pscm_handle;
+	return dcerpc_svcctl_OpenSCManagerW_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_OpenService_send(TALLOC_CTX *mem_ctx,
+                                               struct tevent_context *ev_ctx,
+                                               struct dcerpc_binding_handle *binding_handle,
+                                               struct policy_handle * pscm_handle,
+                                               const char *ServiceName,
+                                               struct policy_handle * psvc_handle,
+                                               struct svcctl_OpenServiceW *r)
+{
+	r->in.scmanager_handle = pscm_handle;
+	r->in.ServiceName = ServiceName;
+	r->in.access_mask = SERVICE_ALL_ACCESS;
+	r->out.handle = psvc_handle;
+	return dcerpc_svcctl_OpenServiceW_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_CreateService_send(TALLOC_CTX *mem_ctx,
+                                                 struct tevent_context *ev_ctx,
+                                                 struct dcerpc_binding_handle *binding_handle,
+                                                 struct policy_handle * pscm_handle,
+                                                 const char *ServiceName,
+                                                 uint32_t type,
+                                                 const char *binary_path,
+                                                 struct policy_handle * psvc_handle,
+                                                 struct svcctl_CreateServiceW *r)
+{
+	r->in.scmanager_handle = pscm_handle;
+	r->in.ServiceName = ServiceName;
+	r->in.DisplayName = NULL;
+	r->in.desired_access = SERVICE_ALL_ACCESS;
+	r->in.type = type;
+	r->in.start_type = SERVICE_DEMAND_START;
+	r->in.error_control = SERVICE_ERROR_NORMAL;
+	r->in.binary_path = binary_path;
+	r->in.LoadOrderGroupKey = NULL;
+	r->in.TagId = NULL;
+	r->in.dependencies = NULL;
+	r->in.dependencies_size = 0;
+	r->in.service_start_name = NULL;
+	r->in.password = NULL;
+	r->in.password_size = 0;
+	r->out.handle = psvc_handle;
+	r->out.TagId = NULL;
+	return dcerpc_svcctl_CreateServiceW_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_ChangeServiceConfig_send(TALLOC_CTX *mem_ctx,
+                                                       struct tevent_context *ev_ctx,
+                                                       struct dcerpc_binding_handle *binding_handle,
+                                                       struct policy_handle * psvc_handle,
+                                                       uint32_t type,
+                                                       const char *binary_path,
+                                                       struct svcctl_ChangeServiceConfigW *r)
+{
+	r->in.handle = psvc_handle;
+	r->in.type = type;
+	r->in.start_type = SERVICE_NO_CHANGE;
+	r->in.error_control = SERVICE_NO_CHANGE;
+	r->in.binary_path = binary_path;
+	r->in.load_order_group = NULL;
+	r->in.dependencies = NULL;
+	r->in.service_start_name = NULL;
+	r->in.password = NULL;
+	r->in.display_name = NULL;
+	r->out.tag_id = NULL;
+	return dcerpc_svcctl_ChangeServiceConfigW_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_StartService_send(TALLOC_CTX *mem_ctx,
+                                                struct tevent_context *ev_ctx,
+                                                struct dcerpc_binding_handle *binding_handle,
+                                                struct policy_handle * psvc_handle,
+                                                struct svcctl_StartServiceW *r)
+{
+	r->in.handle = psvc_handle;
+	r->in.NumArgs = 0;
+	r->in.Arguments = NULL;
+	return dcerpc_svcctl_StartServiceW_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_ControlService_send(TALLOC_CTX *mem_ctx,
+                                                  struct tevent_context *ev_ctx,
+                                                  struct dcerpc_binding_handle *binding_handle,
+                                                  struct policy_handle * psvc_handle,
+                                                  int control, struct SERVICE_STATUS * sstatus,
+                                                  struct svcctl_ControlService *r)
+{
+	r->in.handle = psvc_handle;
+	r->in.control = control;
+	r->out.service_status = sstatus;
+	return dcerpc_svcctl_ControlService_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_QueryServiceStatus_send(TALLOC_CTX *mem_ctx,
+                                                      struct tevent_context *ev_ctx,
+                                                      struct dcerpc_binding_handle *binding_handle,
+                                                      struct policy_handle * psvc_handle,
+                                                      struct SERVICE_STATUS * sstatus,
+                                                      struct svcctl_QueryServiceStatus *r)
+{
+	r->in.handle = psvc_handle;
+	r->out.service_status = sstatus;
+	return dcerpc_svcctl_QueryServiceStatus_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_DeleteService_send(TALLOC_CTX *mem_ctx,
+                                                 struct tevent_context *ev_ctx,
+                                                 struct dcerpc_binding_handle *binding_handle,
+                                                 struct policy_handle * psvc_handle,
+                                                 struct svcctl_DeleteService *r)
+{
+	r->in.handle = psvc_handle;
+	return dcerpc_svcctl_DeleteService_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+static struct tevent_req *svc_CloseServiceHandle_send(TALLOC_CTX *mem_ctx,
+                                                      struct tevent_context *ev_ctx,
+                                                      struct dcerpc_binding_handle *binding_handle,
+                                                      struct policy_handle * psvc_handle,
+                                                      struct svcctl_CloseServiceHandle *r)
+{
+	r->in.handle = psvc_handle;
+	r->out.handle = psvc_handle;
+	return dcerpc_svcctl_CloseServiceHandle_r_send(mem_ctx, ev_ctx, binding_handle, r);
+}
+
+/*
+  Polls the service while it is in the pending state. The first query
+  goes out at once and the following ones back off, so a service which
+  settles quickly costs a single round trip.
+*/
+struct svc_wait_state {
+	struct tevent_context *ev_ctx;
+	struct dcerpc_binding_handle *binding_handle;
+	struct policy_handle *svc_handle;
+	struct svcctl_QueryServiceStatus r;
+	struct SERVICE_STATUS s;
+	uint32_t pending;
+	uint32_t delay;
+	struct timeval start;
+};
+
+static void svc_wait_done(struct tevent_req *subreq);
+
+static void svc_wait_query(struct tevent_req *req)
+{
+	struct svc_wait_state *state = tevent_req_data(req, struct svc_wait_state);
+	struct tevent_req *subreq;
+
+	subreq = svc_QueryServiceStatus_send(state, state->ev_ctx, state->binding_handle,
+	                                     state->svc_handle, &state->s, &state->r);
+	if (tevent_req_nomem(subreq, req))
+		return;
+	tevent_req_set_callback(subreq, svc_wait_done, req);
+}
+
+static void svc_wait_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	svc_wait_query(talloc_get_type(private_data, struct tevent_req));
+}
+
+static void svc_wait_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_wait_state *state = tevent_req_data(req, struct svc_wait_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_QueryServiceStatus_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.out.result);
+	if (tevent_req_nterror(req, status))
+		return;
+	if (state->s.state != state->pending) {
+		tevent_req_done(req);
+		return;
+	}
+	status = svc_backoff(state->ev_ctx, state, &state->start, &state->delay,
+	                     svc_wait_handler, req);
+	tevent_req_nterror(req, status);
+}
+
+static struct tevent_req *svc_wait_send(TALLOC_CTX *mem_ctx,
+                                        struct tevent_context *ev_ctx,
+                                        struct dcerpc_binding_handle *binding_handle,
+                                        struct policy_handle *psvc_handle,
+                                        uint32_t pending)
+{
+	struct tevent_req *req;
+	struct svc_wait_state *state;
+
+	req = tevent_req_create(mem_ctx, &state, struct svc_wait_state);
+	if (!req)
+		return NULL;
+	state->ev_ctx = ev_ctx;
+	state->binding_handle = binding_handle;
+	state->svc_handle = psvc_handle;
+	state->pending = pending;
+	state->delay = SVC_POLL_MIN;
+	state->start = timeval_current();
+	svc_wait_query(req);
+	if (!tevent_req_is_in_progress(req))
+		return tevent_req_post(req, ev_ctx);
+	return req;
+}
+
+static NTSTATUS svc_wait_recv(struct tevent_req *req, struct SERVICE_STATUS *sstatus)
 {
+	struct svc_wait_state *state = tevent_req_data(req, struct svc_wait_state);
 	NTSTATUS status;
-	char *binding;
 
-	if (asprintf(&binding, "ncacn_np:%s%s", hostname, DEBUGLVL(9)?"[print]":"") == -1) {
-		DEBUG(0, ("ERROR: Failed trying to format a string"));
-		return NT_STATUS_UNSUCCESSFUL;
+	if (tevent_req_is_nterror(req, &status)) {
+		tevent_req_received(req);
+		return status;
 	}
-	status = dcerpc_pipe_connect(ev_ctx, psvc_pipe, binding,
-	                             &ndr_table_svcctl, credentials, ev_ctx, ldprm_ctx);
-	free(binding);
-	return status;
+	*sstatus = state->s;
+	tevent_req_received(req);
+	return NT_STATUS_OK;
 }
 
-static NTSTATUS svc_OpenSCManager(struct dcerpc_binding_handle *binding_handle,
-                                  const char *hostname,
-                                  struct policy_handle * pscm_handle)
+/* Opens and binds the svcctl pipe on the caller's IPC$ tree */
+struct svc_pipe_state {
+	struct dcerpc_pipe *p;
+	int smb2;
+};
+
+static void svc_pipe_bound(struct composite_context *creq)
 {
+	struct tevent_req *req = talloc_get_type(creq->async.private_data, struct tevent_req);
+
+	if (tevent_req_nterror(req, dcerpc_bind_auth_none_recv(creq)))
+		return;
+	tevent_req_done(req);
+}
+
+static void svc_pipe_opened(struct composite_context *creq)
+{
+	struct tevent_req *req = talloc_get_type(creq->async.private_data, struct tevent_req);
+	struct svc_pipe_state *state = tevent_req_data(req, struct svc_pipe_state);
 	NTSTATUS status;
-	struct svcctl_OpenSCManagerW r;
 
-	r.in.MachineName = hostname;
-	r.in.DatabaseName = NULL;
-	r.in.access_mask = SEC_FLAG_MAXIMUM_ALLOWED;
-	r.out.handle = pscm_handle;
-	status = dcerpc_svcctl_OpenSCManagerW_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+#ifdef HAVE_SMB2
+	if (state->smb2)
+		status = dcerpc_pipe_open_smb2_recv(creq);
+	else
+#endif
+		status = dcerpc_pipe_open_smb_recv(creq);
+	if (tevent_req_nterror(req, status))
+		return;
+	creq = dcerpc_bind_auth_none_send(state, state->p, &ndr_table_svcctl);
+	if (tevent_req_nomem(creq, req))
+		return;
+	creq->async.fn = svc_pipe_bound;
+	creq->async.private_data = req;
 }
 
-static NTSTATUS svc_OpenService(struct dcerpc_binding_handle *binding_handle,
-                                struct policy_handle * pscm_handle,
-                                const char *ServiceName,
-                                struct policy_handle * psvc_handle)
+static struct tevent_req *svc_pipe_open_send(TALLOC_CTX *mem_ctx,
+                                             struct tevent_context *ev_ctx,
+                                             struct smbcli_tree *tree,
+                                             struct smb2_tree *tree2)
 {
+	struct tevent_req *req;
+	struct svc_pipe_state *state;
+	struct composite_context *creq;
+
+	req = tevent_req_create(mem_ctx, &state, struct svc_pipe_state);
+	if (!req)
+		return NULL;
+	state->p = dcerpc_pipe_init(state, ev_ctx);
+	if (tevent_req_nomem(state->p, req))
+		return tevent_req_post(req, ev_ctx);
+	if (DEBUGLVL(9))
+		state->p->conn->flags |= DCERPC_DEBUG_PRINT_BOTH;
+#ifdef HAVE_SMB2
+	if (tree2) {
+		state->smb2 = 1;
+		creq = dcerpc_pipe_open_smb2_send(state->p, tree2, SVCCTL_PIPE);
+	} else
+#endif
+		creq = dcerpc_pipe_open_smb_send(state->p, tree, SVCCTL_PIPE);
+	if (tevent_req_nomem(creq, req))
+		return tevent_req_post(req, ev_ctx);
+	creq->async.fn = svc_pipe_opened;
+	creq->async.private_data = req;
+	return req;
+}
+
+static NTSTATUS svc_pipe_open_recv(struct tevent_req *req, TALLOC_CTX *mem_ctx,
+                                   struct dcerpc_pipe **pp)
+{
+	struct svc_pipe_state *state = tevent_req_data(req, struct svc_pipe_state);
 	NTSTATUS status;
-	struct svcctl_OpenServiceW r;
 
-	r.in.scmanager_handle = pscm_handle;
-	r.in.ServiceName = ServiceName;
-	r.in.access_mask = SERVICE_ALL_ACCESS;
-	r.out.handle = psvc_handle;
-	status = dcerpc_svcctl_OpenServiceW_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+	if (tevent_req_is_nterror(req, &status)) {
+		tevent_req_received(req);
+		return status;
+	}
+	*pp = talloc_steal(mem_ctx, state->p);
+	tevent_req_received(req);
+	return NT_STATUS_OK;
 }
 
-static NTSTATUS svc_CreateService(struct dcerpc_binding_handle *binding_handle,
-                                  struct policy_handle * pscm_handle,
-                                  const char *ServiceName,
-                                  uint32_t type,
-                                  const char *binary_path,
-                                  struct policy_handle * psvc_handle)
+/*
+  Connects share as a second tree of the caller's session, so the upload
+  costs one TCON rather than a negotiate and session setup of its own.
+  The tree only references the session, the caller keeps owning it.
+*/
+struct svc_share_state {
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	union smb_tcon io;
+};
+
+static void svc_share_connected(struct smbcli_request *req1)
 {
+	struct tevent_req *req = talloc_get_type(req1->async.private_data, struct tevent_req);
+	struct svc_share_state *state = tevent_req_data(req, struct svc_share_state);
 	NTSTATUS status;
-	struct svcctl_CreateServiceW r;
 
-	r.in.scmanager_handle = pscm_handle;
-	r.in.ServiceName = ServiceName;
-	r.in.DisplayName = NULL;
-	r.in.desired_access = SERVICE_ALL_ACCESS;
-	r.in.type = type;
-	r.in.start_type = SERVICE_DEMAND_START;
-	r.in.error_control = SERVICE_ERROR_NORMAL;
-	r.in.binary_path = binary_path;
-	r.in.LoadOrderGroupKey = NULL;
-	r.in.TagId = NULL;
-	r.in.dependencies = NULL;
-	r.in.dependencies_size = 0;
-	r.in.service_start_name = NULL;
-	r.in.password = NULL;
-	r.in.password_size = 0;
-	r.out.handle = psvc_handle;
-	r.out.TagId = NULL;
-	status = dcerpc_svcctl_CreateServiceW_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+	status = smb_raw_tcon_recv(req1, state, &state->io);
+	if (tevent_req_nterror(req, status))
+		return;
+	state->tree->tid = state->io.tconx.out.tid;
+	tevent_req_done(req);
 }
 
-static NTSTATUS svc_ChangeServiceConfig(struct dcerpc_binding_handle *binding_handle,
-                                        struct policy_handle * psvc_handle,
-                                        uint32_t type,
-                                        const char *binary_path)
+#ifdef HAVE_SMB2
+static void svc_share_connected2(struct smb2_request *req2)
 {
+	struct tevent_req *req = talloc_get_type(req2->async.private_data, struct tevent_req);
+	struct svc_share_state *state = tevent_req_data(req, struct svc_share_state);
 	NTSTATUS status;
-	struct svcctl_ChangeServiceConfigW r;
 
-	r.in.handle = psvc_handle;
-	r.in.type = type;
-	r.in.start_type = SERVICE_NO_CHANGE;
-	r.in.error_control = SERVICE_NO_CHANGE;
-	r.in.binary_path = binary_path;
-	r.in.load_order_group = NULL;
-	r.in.dependencies = NULL;
-	r.in.service_start_name = NULL;
-	r.in.password = NULL;
-	r.in.display_name = NULL;
-	r.out.tag_id = NULL;
-	status = dcerpc_svcctl_ChangeServiceConfigW_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+	status = smb2_tree_connect_recv(req2, &state->io.smb2);
+	if (tevent_req_nterror(req, status))
+		return;
+	state->tree2->tid = state->io.smb2.out.tid;
+	tevent_req_done(req);
+}
+#endif
+
+struct tevent_req *svc_share_connect_send(TALLOC_CTX *mem_ctx,
+                                          struct tevent_context *ev_ctx,
+                                          const char *hostname, const char *share,
+                                          struct smbcli_tree *tree,
+                                          struct smb2_tree *tree2)
+{
+	struct tevent_req *req;
+	struct svc_share_state *state;
+	struct smbcli_request *req1;
+	char *path;
+
+	req = tevent_req_create(mem_ctx, &state, struct svc_share_state);
+	if (!req)
+		return NULL;
+	path = talloc_asprintf(state, "\\\\%s\\%s", hostname, share);
+	if (tevent_req_nomem(path, req))
+		return tevent_req_post(req, ev_ctx);
+#ifdef HAVE_SMB2
+	if (tree2) {
+		struct smb2_request *req2;
+
+		state->tree2 = smb2_tree_init(tree2->session, state, false);
+		if (tevent_req_nomem(state->tree2, req))
+			return tevent_req_post(req, ev_ctx);
+		state->io.smb2.level = RAW_TCON_SMB2;
+		state->io.smb2.in.reserved = 0;
+		state->io.smb2.in.path = path;
+		req2 = smb2_tree_connect_send(state->tree2, &state->io.smb2);
+		if (tevent_req_nomem(req2, req))
+			return tevent_req_post(req, ev_ctx);
+		talloc_steal(state, req2);
+		req2->async.fn = svc_share_connected2;
+		req2->async.private_data = req;
+		return req;
+	}
+#endif
+	state->tree = smbcli_tree_init(tree->session, state, false);
+	if (tevent_req_nomem(state->tree, req))
+		return tevent_req_post(req, ev_ctx);
+	state->io.tconx.level = RAW_TCON_TCONX;
+	state->io.tconx.in.flags = 0;
+	state->io.tconx.in.password = data_blob_null;
+	state->io.tconx.in.path = path;
+	state->io.tconx.in.device = "?????";
+	req1 = smb_raw_tcon_send(state->tree, &state->io);
+	if (tevent_req_nomem(req1, req))
+		return tevent_req_post(req, ev_ctx);
+	talloc_steal(state, req1);
+	req1->async.fn = svc_share_connected;
+	req1->async.private_data = req;
+	return req;
 }
 
-static NTSTATUS svc_StartService(struct dcerpc_binding_handle *binding_handle,
-                                 struct policy_handle * psvc_handle)
+NTSTATUS svc_share_connect_recv(struct tevent_req *req, TALLOC_CTX *mem_ctx,
+                                struct smbcli_tree **tree, struct smb2_tree **tree2)
 {
+	struct svc_share_state *state = tevent_req_data(req, struct svc_share_state);
 	NTSTATUS status;
-	struct svcctl_StartServiceW r;
 
-	r.in.handle = psvc_handle;
-	r.in.NumArgs = 0;
-	r.in.Arguments = NULL;
-	status = dcerpc_svcctl_StartServiceW_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+	if (tevent_req_is_nterror(req, &status)) {
+		tevent_req_received(req);
+		return status;
+	}
+	*tree = talloc_steal(mem_ctx, state->tree);
+	*tree2 = talloc_steal(mem_ctx, state->tree2);
+	tevent_req_received(req);
+	return NT_STATUS_OK;
 }
 
-static NTSTATUS svc_ControlService(struct dcerpc_binding_handle *binding_handle,
-                                   struct policy_handle * psvc_handle,
-                                   int control, struct SERVICE_STATUS * sstatus)
+/*
+  NTCREATEX or SMB2 create of fname on the share. The protocol request is
+  parented to the state, freeing the tevent_req takes it off the wire.
+*/
+struct svc_open_state {
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	union smb_open io;
+};
+
+static void svc_open_done(struct smbcli_request *req1)
 {
+	struct tevent_req *req = talloc_get_type(req1->async.private_data, struct tevent_req);
+	struct svc_open_state *state = tevent_req_data(req, struct svc_open_state);
 	NTSTATUS status;
-	struct svcctl_ControlService r;
 
-	r.in.handle = psvc_handle;
-	r.in.control = control;
-	r.out.service_status = sstatus;
-	status = dcerpc_svcctl_ControlService_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+	status = smb_raw_open_recv(req1, state, &state->io);
+	if (tevent_req_nterror(req, status))
+		return;
+	tevent_req_done(req);
 }
 
-static NTSTATUS svc_QueryServiceStatus(struct dcerpc_binding_handle *binding_handle,
-                                       struct policy_handle * psvc_handle,
-                                       struct SERVICE_STATUS * sstatus)
+#ifdef HAVE_SMB2
+static void svc_open_done2(struct smb2_request *req2)
 {
+	struct tevent_req *req = talloc_get_type(req2->async.private_data, struct tevent_req);
+	struct svc_open_state *state = tevent_req_data(req, struct svc_open_state);
 	NTSTATUS status;
-	struct svcctl_QueryServiceStatus r;
 
-	r.in.handle = psvc_handle;
-	r.out.service_status = sstatus;
-	status = dcerpc_svcctl_QueryServiceStatus_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+	status = smb2_create_recv(req2, state, &state->io.smb2);
+	if (tevent_req_nterror(req, status))
+		return;
+	tevent_req_done(req);
 }
+#endif
 
-static NTSTATUS svc_DeleteService(struct dcerpc_binding_handle *binding_handle,
-                                  struct policy_handle * psvc_handle)
+struct tevent_req *svc_open_send(TALLOC_CTX *mem_ctx,
+                                 struct tevent_context *ev_ctx,
+                                 struct smbcli_tree *tree,
+                                 struct smb2_tree *tree2,
+                                 const char *fname,
+                                 uint32_t access_mask,
+                                 uint32_t disposition,
+                                 uint32_t create_options)
 {
+	struct tevent_req *req;
+	struct svc_open_state *state;
+	struct smbcli_request *req1;
+	uint32_t attr = (create_options & NTCREATEX_OPTIONS_DIRECTORY) ?
+	                FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+	uint32_t share_access = NTCREATEX_SHARE_ACCESS_READ |
+	                        NTCREATEX_SHARE_ACCESS_WRITE |
+	                        NTCREATEX_SHARE_ACCESS_DELETE;
+
+	req = tevent_req_create(mem_ctx, &state, struct svc_open_state);
+	if (!req)
+		return NULL;
+	state->tree = tree;
+	state->tree2 = tree2;
+#ifdef HAVE_SMB2
+	if (tree2) {
+		struct smb2_request *req2;
+
+		state->io.smb2.level = RAW_OPEN_SMB2;
+		state->io.smb2.in.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+		state->io.smb2.in.desired_access = access_mask;
+		state->io.smb2.in.file_attributes = attr;
+		state->io.smb2.in.share_access = share_access;
+		state->io.smb2.in.create_disposition = disposition;
+		state->io.smb2.in.create_options = create_options;
+		state->io.smb2.in.fname = fname;
+		req2 = smb2_create_send(tree2, &state->io.smb2);
+		if (tevent_req_nomem(req2, req))
+			return tevent_req_post(req, ev_ctx);
+		talloc_steal(state, req2);
+		req2->async.fn = svc_open_done2;
+		req2->async.private_data = req;
+		return req;
+	}
+#endif
+	state->io.ntcreatex.level = RAW_OPEN_NTCREATEX;
+	state->io.ntcreatex.in.flags = 0;
+	state->io.ntcreatex.in.root_fid.fnum = 0;
+	state->io.ntcreatex.in.access_mask = access_mask;
+	state->io.ntcreatex.in.alloc_size = 0;
+	state->io.ntcreatex.in.file_attr = attr;
+	state->io.ntcreatex.in.share_access = share_access;
+	state->io.ntcreatex.in.open_disposition = disposition;
+	state->io.ntcreatex.in.create_options = create_options;
+	state->io.ntcreatex.in.impersonation = NTCREATEX_IMPERSONATION_IMPERSONATION;
+	state->io.ntcreatex.in.security_flags = 0;
+	state->io.ntcreatex.in.fname = fname;
+	req1 = smb_raw_open_send(tree, &state->io);
+	if (tevent_req_nomem(req1, req))
+		return tevent_req_post(req, ev_ctx);
+	talloc_steal(state, req1);
+	req1->async.fn = svc_open_done;
+	req1->async.private_data = req;
+	return req;
+}
+
+NTSTATUS svc_open_recv(struct tevent_req *req, union smb_handle *file, uint64_t *size)
+{
+	struct svc_open_state *state = tevent_req_data(req, struct svc_open_state);
+	NTSTATUS status;
+
+	if (tevent_req_is_nterror(req, &status)) {
+		tevent_req_received(req);
+		return status;
+	}
+#ifdef HAVE_SMB2
+	if (state->tree2) {
+		*file = state->io.smb2.out.file;
+		*size = state->io.smb2.out.size;
+	} else
+#endif
+	{
+		*file = state->io.ntcreatex.out.file;
+		*size = state->io.ntcreatex.out.size;
+	}
+	tevent_req_received(req);
+	return NT_STATUS_OK;
+}
+
+struct svc_close_state {
+	union smb_close io;
+};
+
+static void svc_close_done(struct smbcli_request *req1)
+{
+	struct tevent_req *req = talloc_get_type(req1->async.private_data, struct tevent_req);
+
+	if (tevent_req_nterror(req, smbcli_request_simple_recv(req1)))
+		return;
+	tevent_req_done(req);
+}
+
+#ifdef HAVE_SMB2
+static void svc_close_done2(struct smb2_request *req2)
+{
+	struct tevent_req *req = talloc_get_type(req2->async.private_data, struct tevent_req);
+	struct svc_close_state *state = tevent_req_data(req, struct svc_close_state);
+
+	if (tevent_req_nterror(req, smb2_close_recv(req2, &state->io.smb2)))
+		return;
+	tevent_req_done(req);
+}
+#endif
+
+struct tevent_req *svc_close_send(TALLOC_CTX *mem_ctx,
+                                  struct tevent_context *ev_ctx,
+                                  struct smbcli_tree *tree,
+                                  struct smb2_tree *tree2,
+                                  union smb_handle file)
+{
+	struct tevent_req *req;
+	struct svc_close_state *state;
+	struct smbcli_request *req1;
+
+	req = tevent_req_create(mem_ctx, &state, struct svc_close_state);
+	if (!req)
+		return NULL;
+#ifdef HAVE_SMB2
+	if (tree2) {
+		struct smb2_request *req2;
+
+		state->io.smb2.level = RAW_CLOSE_SMB2;
+		state->io.smb2.in.file = file;
+		req2 = smb2_close_send(tree2, &state->io.smb2);
+		if (tevent_req_nomem(req2, req))
+			return tevent_req_post(req, ev_ctx);
+		talloc_steal(state, req2);
+		req2->async.fn = svc_close_done2;
+		req2->async.private_data = req;
+		return req;
+	}
+#endif
+	state->io.close.level = RAW_CLOSE_CLOSE;
+	state->io.close.in.file = file;
+	state->io.close.in.write_time = 0;
+	req1 = smb_raw_close_send(tree, &state->io);
+	if (tevent_req_nomem(req1, req))
+		return tevent_req_post(req, ev_ctx);
+	talloc_steal(state, req1);
+	req1->async.fn = svc_close_done;
+	req1->async.private_data = req;
+	return req;
+}
+
+NTSTATUS svc_close_recv(struct tevent_req *req)
+{
+	return tevent_req_simple_recv_ntstatus(req);
+}
+
+/* Largest READX/WRITEX or SMB2 read/write the transport carries */
+unsigned int svc_io_max(struct smbcli_tree *tree, struct smb2_tree *tree2)
+{
+	if (tree2)
+		return SMB2_WRITE_MAX;
+	/* see smbcli_read() */
+	return MIN(tree->session->transport->negotiate.max_xmit - (MIN_SMB_SIZE + 32), 0xFFFF);
+}
+
+/*
+  The service binary is uploaded by svc_upload_send() with UPLOAD_WINDOW
+  writes in flight. The last chunk is written once all others are, so a
+  remote copy of the full size is complete, and one which is shorter is
+  complete up to UPLOAD_WINDOW chunks before its end.
+
+  An existing copy is not read back: UPLOAD_PROBES reads of
+  UPLOAD_PROBE_SIZE bytes spread over its complete part, the first one
+  covering the PE header with its link time stamp, are compared with the
+  embedded binary. If they match, a copy of the full size is up to date
+  and a shorter one is continued where it is complete, otherwise the whole
+  binary is written again.
+*/
+#define UPLOAD_WINDOW 8
+#define UPLOAD_PROBES 8
+#define UPLOAD_PROBE_SIZE 4096
+/* The largest chunk any transport writes, see svc_io_max() */
+#define UPLOAD_CHUNK_MAX MAX(SMB2_WRITE_MAX, 0xFFFF)
+
+/* What follows the close in flight */
+enum {
+	UPLOAD_NEXT_SELECT64,
+	UPLOAD_NEXT_CREATE,
+	UPLOAD_NEXT_DONE
+};
+
+struct svc_upload_state {
+	struct tevent_context *ev_ctx;
+	struct tevent_req *req;
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	const char *fname;
+	unsigned char *svc32_exe;
+	unsigned int svc32_exe_len;
+	unsigned char *svc64_exe;
+	unsigned int svc64_exe_len;
+	int flags;
+	union smb_handle file;
+	uint64_t size;
+	const unsigned char *data;
+	unsigned int len;
+	unsigned int chunk;
+	/* Current pass: next offset to request and where to stop */
+	unsigned int ofs;
+	unsigned int end;
+	int writing;
+	int pending;
 	NTSTATUS status;
-	struct svcctl_DeleteService r;
+	/* Probe reads issued, and the part of the remote copy they check */
+	unsigned int probes;
+	unsigned int nprobes;
+	unsigned int probe_size;
+	/* Where writing starts, 0 once a probe differs */
+	unsigned int diff;
+	int next;
+	struct svc_install_stats stats;
+};
 
-	r.in.handle = psvc_handle;
-	status = dcerpc_svcctl_DeleteService_r(binding_handle, NULL, &r);
-	return NT_RES(status, r.out.result);
+struct svc_upload_req {
+	struct svc_upload_state *u;
+	unsigned int ofs;
+	unsigned int size;
+	union smb_read rd;
+	union smb_write wr;
+	uint8_t *buf;
+};
+
+static void svc_upload_pump(struct svc_upload_state *u);
+static void svc_upload_pass_done(struct svc_upload_state *u);
+
+static void svc_upload_done(struct svc_upload_req *r, NTSTATUS status, const uint8_t *data, unsigned int n)
+{
+	struct svc_upload_state *u = r->u;
+
+	--u->pending;
+	if (!NT_STATUS_IS_OK(status)) {
+		if (NT_STATUS_IS_OK(u->status))
+			u->status = status;
+	} else if (u->writing) {
+		u->stats.upload_written += n;
+		if (n != r->size && NT_STATUS_IS_OK(u->status))
+			u->status = NT_STATUS_DISK_FULL;
+	} else {
+		u->stats.upload_compared += n;
+		if (n != r->size || memcmp(data, u->data + r->ofs, n))
+			u->diff = 0;
+	}
+	talloc_free(r);
+	svc_upload_pump(u);
+	if (!u->pending)
+		svc_upload_pass_done(u);
 }
 
-static NTSTATUS svc_CloseServiceHandle(struct dcerpc_binding_handle *binding_handle,
-				struct policy_handle * psvc_handle)
+static void svc_upload_io_done(struct smbcli_request *req)
 {
+	struct svc_upload_req *r = req->async.private_data;
 	NTSTATUS status;
-	struct svcctl_CloseServiceHandle r;
 
-	r.in.handle = psvc_handle;
-	r.out.handle = psvc_handle;
-	status = dcerpc_svcctl_CloseServiceHandle_r(binding_handle, NULL, &r);
-	return status;
+	if (r->u->writing) {
+		status = smb_raw_write_recv(req, &r->wr);
+		svc_upload_done(r, status, NULL, r->wr.writex.out.nwritten);
+	} else {
+		status = smb_raw_read_recv(req, &r->rd);
+		svc_upload_done(r, status, r->buf, r->rd.readx.out.nread);
+	}
 }
 
-static NTSTATUS svc_UploadService(struct tevent_context *ev_ctx, 
-                                  const char *hostname,
-                                  const char *service_filename,
-                                  unsigned char *svc32_exe, unsigned int svc32_exe_len,
-                                  unsigned char *svc64_exe, unsigned int svc64_exe_len,
-                                  struct cli_credentials *credentials,
-                                  struct loadparm_context *ldprm_ctx,
-                                  int flags)
+#ifdef HAVE_SMB2
+static void svc_upload_io_done2(struct smb2_request *req)
 {
-	struct smb_composite_savefile *io;
-	struct smbcli_state *cli;
+	struct svc_upload_req *r = req->async.private_data;
 	NTSTATUS status;
-	struct smbcli_options options;
-	struct smbcli_session_options session_options;
 
-	lpcfg_smbcli_options(ldprm_ctx, &options);
-	lpcfg_smbcli_session_options(ldprm_ctx, &session_options);
+	if (r->u->writing) {
+		status = smb2_write_recv(req, &r->wr.smb2);
+		svc_upload_done(r, status, NULL, r->wr.smb2.out.nwritten);
+	} else {
+		status = smb2_read_recv(req, r, &r->rd.smb2);
+		svc_upload_done(r, status, r->rd.smb2.out.data.data, r->rd.smb2.out.data.length);
+	}
+}
+
+static int svc_upload_io_send2(struct svc_upload_state *u, struct svc_upload_req *r)
+{
+	struct smb2_request *req;
+
+	if (u->writing) {
+		r->wr.smb2.level = RAW_WRITE_SMB2;
+		r->wr.smb2.in.file = u->file;
+		r->wr.smb2.in.offset = r->ofs;
+		r->wr.smb2.in.data = data_blob_const(u->data + r->ofs, r->size);
+		req = smb2_write_send(u->tree2, &r->wr.smb2);
+	} else {
+		r->rd.smb2.level = RAW_READ_SMB2;
+		r->rd.smb2.in.file = u->file;
+		r->rd.smb2.in.offset = r->ofs;
+		r->rd.smb2.in.length = r->size;
+		r->rd.smb2.in.min_count = r->size;
+		req = smb2_read_send(u->tree2, &r->rd.smb2);
+	}
+	if (!req)
+		return 0;
+	talloc_steal(r, req);
+	req->async.fn = svc_upload_io_done2;
+	req->async.private_data = r;
+	return 1;
+}
+#endif
+
+static int svc_upload_io_send(struct svc_upload_state *u, struct svc_upload_req *r)
+{
+	struct smbcli_request *req;
 
-	status = smbcli_full_connection(NULL, &cli, hostname, lpcfg_smb_ports(ldprm_ctx),
-	                                "ADMIN$", NULL,
-	                                lpcfg_socket_options(ldprm_ctx), credentials,
-	                                lpcfg_resolve_context(ldprm_ctx), ev_ctx,
-	                                &options, &session_options,
-	                                lpcfg_gensec_settings(NULL, ldprm_ctx));
-	NT_ERR(status, 0, "Failed to open ADMIN$ share");
-	if (flags & SVC_FORCE_UPLOAD) {
-		smbcli_unlink(cli->tree, service_filename);
+#ifdef HAVE_SMB2
+	if (u->tree2)
+		return svc_upload_io_send2(u, r);
+#endif
+	if (u->writing) {
+		r->wr.writex.level = RAW_WRITE_WRITEX;
+		r->wr.writex.in.file = u->file;
+		r->wr.writex.in.offset = r->ofs;
+		r->wr.writex.in.wmode = 0;
+		r->wr.writex.in.remaining = 0;
+		r->wr.writex.in.count = r->size;
+		r->wr.writex.in.data = u->data + r->ofs;
+		req = smb_raw_write_send(u->tree, &r->wr);
 	} else {
-		int fd = smbcli_open(cli->tree, service_filename, O_RDONLY, DENY_NONE);
-		if (fd >= 0) {
-			smbcli_close(cli->tree, fd);
-			return status;
+		r->buf = talloc_size(r, r->size);
+		if (!r->buf)
+			return 0;
+		r->rd.readx.level = RAW_READ_READX;
+		r->rd.readx.in.file = u->file;
+		r->rd.readx.in.offset = r->ofs;
+		r->rd.readx.in.mincnt = r->size;
+		r->rd.readx.in.maxcnt = r->size;
+		r->rd.readx.in.remaining = 0;
+		r->rd.readx.in.read_for_execute = false;
+		r->rd.readx.out.data = r->buf;
+		req = smb_raw_read_send(u->tree, &r->rd);
+	}
+	if (!req)
+		return 0;
+	/* Freeing an outstanding svc_upload_req takes it off the wire */
+	talloc_steal(r, req);
+	req->async.fn = svc_upload_io_done;
+	req->async.private_data = r;
+	return 1;
+}
+
+static void svc_upload_pump(struct svc_upload_state *u)
+{
+	struct svc_upload_req *r;
+	unsigned int ofs, size;
+
+	while (NT_STATUS_IS_OK(u->status) && u->pending < UPLOAD_WINDOW) {
+		if (u->writing) {
+			if (u->ofs >= u->end)
+				break;
+			/* The full size tells the next run the copy is complete */
+			if (u->end == u->len && u->end - u->ofs <= u->chunk && u->pending)
+				break;
+			ofs = u->ofs;
+			size = MIN(u->chunk, u->end - u->ofs);
+		} else {
+			/* There is no point in probing past a difference */
+			if (u->probes >= u->nprobes || !u->diff)
+				break;
+			ofs = u->nprobes == 1 ? 0 : (uint64_t)(u->end - u->probe_size)
+			                            * u->probes / (u->nprobes - 1);
+			size = u->probe_size;
+			++u->probes;
+		}
+		r = talloc_zero(u, struct svc_upload_req);
+		if (!r) {
+			u->status = NT_STATUS_NO_MEMORY;
+			return;
 		}
+		r->u = u;
+		r->ofs = ofs;
+		r->size = size;
+		if (!svc_upload_io_send(u, r)) {
+			talloc_free(r);
+			u->status = NT_STATUS_NO_MEMORY;
+			return;
+		}
+		u->ofs = ofs + size;
+		++u->pending;
+	}
+}
+
+static void svc_upload_pass(struct svc_upload_state *u, unsigned int start, unsigned int end, int writing)
+{
+	u->ofs = start;
+	u->end = end;
+	u->writing = writing;
+	u->status = NT_STATUS_OK;
+	svc_upload_pump(u);
+	if (!u->pending)
+		svc_upload_pass_done(u);
+}
+
+/* Compares the complete part of the remote copy, [0, u->diff), by probes */
+static void svc_upload_probe(struct svc_upload_state *u)
+{
+	u->probe_size = MIN(MIN(UPLOAD_PROBE_SIZE, u->chunk), u->diff);
+	u->nprobes = u->probe_size ? MIN(UPLOAD_PROBES, (u->diff + u->probe_size - 1) / u->probe_size) : 0;
+	u->probes = 0;
+	svc_upload_pass(u, 0, u->diff, 0);
+}
+
+static void svc_upload_opened(struct tevent_req *subreq);
+static void svc_upload_created(struct tevent_req *subreq);
+static void svc_upload_closed(struct tevent_req *subreq);
+
+static void svc_upload_close(struct svc_upload_state *u, int next)
+{
+	struct tevent_req *subreq;
+
+	u->next = next;
+	subreq = svc_close_send(u, u->ev_ctx, u->tree, u->tree2, u->file);
+	if (!subreq) {
+		svc_finish(u->req, u->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
 	}
-	io = talloc_zero(cli->tree, struct smb_composite_savefile);
-	io->in.fname = service_filename;
-	if (flags & SVC_OSCHOOSE)
-		status = smbcli_chkpath(cli->tree, "SysWoW64");
+	tevent_req_set_callback(subreq, svc_upload_closed, u->req);
+}
+
+static void svc_upload_select(struct svc_upload_state *u, int wow64)
+{
+	struct tevent_req *subreq;
 
-	if (((flags & SVC_OSCHOOSE) && NT_STATUS_IS_OK(status)) || (flags & SVC_OS64BIT)) {
-		DEBUG(1, ("svc_UploadService: Installing 64bit %s\n", service_filename));
-		io->in.data = svc64_exe;
-		io->in.size = svc64_exe_len;
+	u->stats.os64bit = wow64 || (u->flags & SVC_OS64BIT);
+	if (u->stats.os64bit) {
+		DEBUG(1, ("svc_UploadService: Installing 64bit %s\n", u->fname));
+		u->data = u->svc64_exe;
+		u->len = u->svc64_exe_len;
 	} else {
-		DEBUG(1, ("svc_UploadService: Installing 32bit %s\n", service_filename));
-		io->in.data = svc32_exe;
-		io->in.size = svc32_exe_len;
+		DEBUG(1, ("svc_UploadService: Installing 32bit %s\n", u->fname));
+		u->data = u->svc32_exe;
+		u->len = u->svc32_exe_len;
 	}
-	status = smb_composite_savefile(cli->tree, io);
-	NT_ERR(status, 0, "Failed to save ADMIN$/%s", io->in.fname);
-	talloc_free(io);
-	smbcli_tdis(cli);
-	return status;
+	u->diff = u->len;
+	subreq = svc_open_send(u, u->ev_ctx, u->tree, u->tree2, u->fname,
+	                       SEC_RIGHTS_FILE_READ | SEC_RIGHTS_FILE_WRITE,
+	                       NTCREATEX_DISP_OPEN, NTCREATEX_OPTIONS_NON_DIRECTORY_FILE);
+	if (!subreq) {
+		svc_finish(u->req, u->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
+	}
+	tevent_req_set_callback(subreq, svc_upload_opened, u->req);
 }
 
-/* Start, Creates, Install service if necessary */
-NTSTATUS svc_install(struct tevent_context *ev_ctx, 
-                     const char *hostname,
-                     const char *service_name, const char *service_filename,
-                     unsigned char *svc32_exe, unsigned int svc32_exe_len,
-                     unsigned char *svc64_exe, unsigned int svc64_exe_len,
-                     struct cli_credentials *credentials,
-                     struct loadparm_context *ldprm_ctx,
-                     int flags)
+static void svc_upload_create(struct svc_upload_state *u)
 {
+	struct tevent_req *subreq;
+
+	u->diff = 0;
+	subreq = svc_open_send(u, u->ev_ctx, u->tree, u->tree2, u->fname,
+	                       SEC_RIGHTS_FILE_READ | SEC_RIGHTS_FILE_WRITE,
+	                       NTCREATEX_DISP_OVERWRITE_IF, NTCREATEX_OPTIONS_NON_DIRECTORY_FILE);
+	if (!subreq) {
+		svc_finish(u->req, u->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
+	}
+	tevent_req_set_callback(subreq, svc_upload_created, u->req);
+}
+
+static void svc_upload_chkpath_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_upload_state *u = tevent_req_data(req, struct svc_upload_state);
 	NTSTATUS status;
-	struct dcerpc_binding_handle *binding_handle;
+
+	status = svc_open_recv(subreq, &u->file, &u->size);
+	TALLOC_FREE(subreq);
+	if (NT_STATUS_IS_OK(status))
+		svc_upload_close(u, UPLOAD_NEXT_SELECT64);
+	else
+		svc_upload_select(u, 0);
+}
+
+static void svc_upload_connected(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_upload_state *u = tevent_req_data(req, struct svc_upload_state);
+	NTSTATUS status;
+
+	status = svc_share_connect_recv(subreq, u, &u->tree, &u->tree2);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, u->ev_ctx, status, 0, "Failed to open ADMIN$ share");
+
+	u->chunk = svc_io_max(u->tree, u->tree2);
+
+	if (!(u->flags & SVC_OSCHOOSE)) {
+		svc_upload_select(u, 0);
+		return;
+	}
+	subreq = svc_open_send(u, u->ev_ctx, u->tree, u->tree2, "SysWoW64",
+	                       SEC_FILE_READ_ATTRIBUTE, NTCREATEX_DISP_OPEN,
+	                       NTCREATEX_OPTIONS_DIRECTORY);
+	if (!subreq) {
+		svc_finish(req, u->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
+	}
+	tevent_req_set_callback(subreq, svc_upload_chkpath_done, req);
+}
+
+static void svc_upload_opened(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_upload_state *u = tevent_req_data(req, struct svc_upload_state);
+	NTSTATUS status;
+
+	status = svc_open_recv(subreq, &u->file, &u->size);
+	TALLOC_FREE(subreq);
+	if (!NT_STATUS_IS_OK(status)) {
+		svc_upload_create(u);
+		return;
+	}
+	if (u->size > u->len) {
+		svc_upload_close(u, UPLOAD_NEXT_CREATE);
+		return;
+	}
+	if (u->size == u->len)
+		u->diff = u->len;
+	else if (u->size > UPLOAD_WINDOW * UPLOAD_CHUNK_MAX)
+		u->diff = u->size - UPLOAD_WINDOW * UPLOAD_CHUNK_MAX;
+	else
+		u->diff = 0;
+	svc_upload_probe(u);
+}
+
+static void svc_upload_created(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_upload_state *u = tevent_req_data(req, struct svc_upload_state);
+	NTSTATUS status;
+
+	status = svc_open_recv(subreq, &u->file, &u->size);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, u->ev_ctx, status, 0, "Failed to create %s", u->fname);
+	DEBUG(1, ("svc_UploadService: Writing %u bytes of %s\n", u->len, u->fname));
+	svc_upload_pass(u, 0, u->len, 1);
+}
+
+static void svc_upload_pass_done(struct svc_upload_state *u)
+{
+	if (u->writing) {
+		svc_upload_close(u, UPLOAD_NEXT_DONE);
+		return;
+	}
+	if (!NT_STATUS_IS_OK(u->status)) {
+		svc_upload_close(u, UPLOAD_NEXT_CREATE);
+	} else if (u->diff == u->len) {
+		DEBUG(1, ("svc_UploadService: %s is up to date\n", u->fname));
+		svc_upload_close(u, UPLOAD_NEXT_DONE);
+	} else {
+		DEBUG(1, ("svc_UploadService: Writing %u of %u bytes of %s\n", u->len - u->diff, u->len, u->fname));
+		svc_upload_pass(u, u->diff, u->len, 1);
+	}
+}
+
+static void svc_upload_closed(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_upload_state *u = tevent_req_data(req, struct svc_upload_state);
+
+	svc_close_recv(subreq);
+	TALLOC_FREE(subreq);
+	switch (u->next) {
+	case UPLOAD_NEXT_SELECT64:
+		svc_upload_select(u, 1);
+		break;
+	case UPLOAD_NEXT_CREATE:
+		svc_upload_create(u);
+		break;
+	default:
+		REQ_ERR(req, u->ev_ctx, u->status, 0, "Failed to save ADMIN$/%s", u->fname);
+		svc_finish(req, u->ev_ctx, NT_STATUS_OK);
+	}
+}
+
+static struct tevent_req *svc_upload_send(TALLOC_CTX *mem_ctx,
+                                          struct tevent_context *ev_ctx,
+                                          const char *hostname,
+                                          struct smbcli_tree *tree,
+                                          struct smb2_tree *tree2,
+                                          const char *service_filename,
+                                          unsigned char *svc32_exe, unsigned int svc32_exe_len,
+                                          unsigned char *svc64_exe, unsigned int svc64_exe_len,
+                                          int flags)
+{
+	struct tevent_req *req, *subreq;
+	struct svc_upload_state *u;
+
+	req = tevent_req_create(mem_ctx, &u, struct svc_upload_state);
+	if (!req)
+		return NULL;
+	u->ev_ctx = ev_ctx;
+	u->req = req;
+	u->fname = service_filename;
+	u->svc32_exe = svc32_exe;
+	u->svc32_exe_len = svc32_exe_len;
+	u->svc64_exe = svc64_exe;
+	u->svc64_exe_len = svc64_exe_len;
+	u->flags = flags;
+	u->stats.os64bit = -1;
+	subreq = svc_share_connect_send(u, ev_ctx, hostname, "ADMIN$", tree, tree2);
+	if (tevent_req_nomem(subreq, req))
+		return tevent_req_post(req, ev_ctx);
+	tevent_req_set_callback(subreq, svc_upload_connected, req);
+	return req;
+}
+
+static NTSTATUS svc_upload_recv(struct tevent_req *req, struct svc_install_stats *stats)
+{
+	struct svc_upload_state *u = tevent_req_data(req, struct svc_upload_state);
+
+	stats->upload_compared += u->stats.upload_compared;
+	stats->upload_written += u->stats.upload_written;
+	if (u->stats.os64bit >= 0)
+		stats->os64bit = u->stats.os64bit;
+	return tevent_req_simple_recv_ntstatus(req);
+}
+
+/* Start, Creates, Install service if necessary */
+struct svc_install_state {
+	struct tevent_context *ev_ctx;
+	const char *hostname;
+	const char *service_name;
+	const char *service_filename;
+	unsigned char *svc32_exe;
+	unsigned int svc32_exe_len;
+	unsigned char *svc64_exe;
+	unsigned int svc64_exe_len;
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	int flags;
 	struct dcerpc_pipe *svc_pipe;
+	struct dcerpc_binding_handle *binding_handle;
 	struct policy_handle scm_handle;
 	struct policy_handle svc_handle;
 	struct SERVICE_STATUS s;
-	int need_start = 0;
-	int need_conf = 0;
+	union svc_rpc r;
+	int need_start;
+	int need_conf;
+	struct timeval mark;
+	struct svc_install_stats stats;
+};
+
+static void svc_install_scm_opened(struct tevent_req *subreq);
+static void svc_install_svc_opened(struct tevent_req *subreq);
+static void svc_install_created(struct tevent_req *subreq);
+static void svc_install_queried(struct tevent_req *subreq);
+static void svc_install_stop_sent(struct tevent_req *subreq);
+static void svc_install_stopped(struct tevent_req *subreq);
+static void svc_install_configured(struct tevent_req *subreq);
+static void svc_install_uploaded(struct tevent_req *subreq);
+static void svc_install_start_sent(struct tevent_req *subreq);
+static void svc_install_started(struct tevent_req *subreq);
+
+/* Chains the next step, a failed send completes req */
+#define SVC_STEP(subreq, req, state, fn) \
+	if (!(subreq)) { svc_finish(req, (state)->ev_ctx, NT_STATUS_NO_MEMORY); return; } \
+	tevent_req_set_callback(subreq, fn, req)
+
+/* Adds the time since *mark to *usec and restarts the clock */
+static void svc_lap(struct timeval *mark, int64_t *usec)
+{
+	struct timeval now = timeval_current();
+
+	*usec += usec_time_diff(&now, mark);
+	*mark = now;
+}
+
+static uint32_t svc_install_type(struct svc_install_state *state)
+{
+	return SERVICE_WIN32_OWN_PROCESS |
+	       ((state->flags & SVC_INTERACTIVE) ? SERVICE_INTERACTIVE_PROCESS : 0);
+}
+
+static void svc_install_connected(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = svc_pipe_open_recv(subreq, state, &state->svc_pipe);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, state->ev_ctx, status, 0, "Cannot connect to svcctl pipe");
+	state->binding_handle = state->svc_pipe->binding_handle;
+
+	subreq = svc_OpenSCManager_send(state, state->ev_ctx, state->binding_handle,
+	                                state->hostname, &state->scm_handle, &state->r.open_scm);
+	SVC_STEP(subreq, req, state, svc_install_scm_opened);
+}
+
+static void svc_install_scm_opened(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
 
-	status = svc_pipe_connect(ev_ctx, &svc_pipe, hostname, credentials, ldprm_ctx);
-	NT_ERR(status, 0, "Cannot connect to svcctl pipe");
-	binding_handle = svc_pipe->binding_handle;
+	status = dcerpc_svcctl_OpenSCManagerW_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.open_scm.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 0, "OpenSCManager failed");
 
-	status = svc_OpenSCManager(binding_handle, hostname, &scm_handle);
-	NT_ERR(status, 0, "OpenSCManager failed");
+	subreq = svc_OpenService_send(state, state->ev_ctx, state->binding_handle,
+	                              &state->scm_handle, state->service_name,
+	                              &state->svc_handle, &state->r.open_svc);
+	SVC_STEP(subreq, req, state, svc_install_svc_opened);
+}
+
+static void svc_install_query(struct tevent_req *req)
+{
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	struct tevent_req *subreq;
 
-	status = svc_OpenService(binding_handle, &scm_handle, service_name, &svc_handle);
+	subreq = svc_QueryServiceStatus_send(state, state->ev_ctx, state->binding_handle,
+	                                     &state->svc_handle, &state->s, &state->r.query);
+	SVC_STEP(subreq, req, state, svc_install_queried);
+}
+
+static void svc_install_svc_opened(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_OpenServiceW_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.open_svc.out.result);
 	if (NT_STATUS_EQUAL(status, NT_STATUS_SERVICE_DOES_NOT_EXIST)) {
-		status = svc_CreateService(binding_handle, &scm_handle, service_name,
-		                           SERVICE_WIN32_OWN_PROCESS | 
-		                           ((flags & SVC_INTERACTIVE) ? SERVICE_INTERACTIVE_PROCESS : 0),
-		                           service_filename, &svc_handle);
-		NT_ERR(status, 0, "CreateService failed");
-		need_start = 1;
-	} else {
-		NT_ERR(status, 0, "OpenService failed");
-	}
-
-	status = svc_QueryServiceStatus(binding_handle, &svc_handle, &s);
-	NT_ERR(status, 0, "QueryServiceStatus failed");
-
-	if (!(flags & SVC_IGNORE_INTERACTIVE))
-		need_conf = !(s.type & SERVICE_INTERACTIVE_PROCESS) ^ !(flags & SVC_INTERACTIVE);
-
-	if (s.state == SVCCTL_STOPPED) {
-		need_start = 1;
-	} else if (need_conf) {
-		status = svc_ControlService(binding_handle, &svc_handle,
-		                            SERVICE_CONTROL_STOP, &s);
-		NT_ERR(status, 0, "StopService failed");
-		do {
-			smb_msleep(100);
-			status = svc_QueryServiceStatus(binding_handle, &svc_handle, &s);
-			NT_ERR(status, 0, "QueryServiceStatus failed");
-		} while (s.state == SVCCTL_STOP_PENDING);
-		need_start = 1;
-	}
-
-	if (need_conf) {
-		status = svc_ChangeServiceConfig(binding_handle, &svc_handle,
-		                                 SERVICE_WIN32_OWN_PROCESS |
-		                                 ((flags & SVC_INTERACTIVE) ? SERVICE_INTERACTIVE_PROCESS : 0),
-		                                 NULL);
-		NT_ERR(status, 0, "ChangeServiceConfig failed");
-	}
-
-	if (need_start) {
-		status = svc_UploadService(ev_ctx, hostname, service_filename,
-		                           svc32_exe, svc32_exe_len,
-		                           svc64_exe, svc64_exe_len,
-		                           credentials, ldprm_ctx, flags);
-		NT_ERR(status, 0, "UploadService failed");
-
-		status = svc_StartService(binding_handle, &svc_handle);
-		NT_ERR(status, 0, "StartService failed");
-		do {
-			smb_msleep(100);
-			status = svc_QueryServiceStatus(binding_handle, &svc_handle, &s);
-			NT_ERR(status, 0, "QueryServiceStatus failed");
-		} while (s.state == SVCCTL_START_PENDING);
-		if (s.state != SVCCTL_RUNNING) {
-			DEBUG(0, ("Service cannot start, status=0x%08X\n", s.state));
-			return NT_STATUS_UNSUCCESSFUL;
-		}
+		subreq = svc_CreateService_send(state, state->ev_ctx, state->binding_handle,
+		                                &state->scm_handle, state->service_name,
+		                                svc_install_type(state), state->service_filename,
+		                                &state->svc_handle, &state->r.create);
+		SVC_STEP(subreq, req, state, svc_install_created);
+		return;
 	}
+	REQ_ERR(req, state->ev_ctx, status, 0, "OpenService failed");
+	svc_install_query(req);
+}
 
-	svc_CloseServiceHandle(binding_handle, &svc_handle);
-	svc_CloseServiceHandle(binding_handle, &scm_handle);
-	talloc_free(svc_pipe);
-	return status;
+static void svc_install_created(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_CreateServiceW_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.create.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 0, "CreateService failed");
+	state->need_start = 1;
+	svc_install_query(req);
+}
+
+static void svc_install_configure(struct tevent_req *req)
+{
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	struct tevent_req *subreq;
+
+	if (state->need_conf) {
+		subreq = svc_ChangeServiceConfig_send(state, state->ev_ctx, state->binding_handle,
+		                                      &state->svc_handle, svc_install_type(state),
+		                                      NULL, &state->r.config);
+		SVC_STEP(subreq, req, state, svc_install_configured);
+		return;
+	}
+	svc_lap(&state->mark, &state->stats.scm_usec);
+	if (!state->need_start) {
+		svc_finish(req, state->ev_ctx, NT_STATUS_OK);
+		return;
+	}
+	subreq = svc_upload_send(state, state->ev_ctx, state->hostname,
+	                         state->tree, state->tree2, state->service_filename,
+	                         state->svc32_exe, state->svc32_exe_len,
+	                         state->svc64_exe, state->svc64_exe_len, state->flags);
+	SVC_STEP(subreq, req, state, svc_install_uploaded);
 }
 
-NTSTATUS svc_uninstall(struct tevent_context *ev_ctx,
-                       const char *hostname,
-                       const char *service_name, const char *service_filename,
-                       struct cli_credentials *credentials,
-                       struct loadparm_context *ldprm_ctx)
+static void svc_install_queried(struct tevent_req *subreq)
 {
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
 	NTSTATUS status;
-	struct dcerpc_binding_handle *binding_handle;
+
+	status = dcerpc_svcctl_QueryServiceStatus_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.query.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 0, "QueryServiceStatus failed");
+
+	if (!(state->flags & SVC_IGNORE_INTERACTIVE))
+		state->need_conf = !(state->s.type & SERVICE_INTERACTIVE_PROCESS) ^ !(state->flags & SVC_INTERACTIVE);
+
+	if (state->s.state == SVCCTL_STOPPED) {
+		state->need_start = 1;
+	} else if (state->need_conf) {
+		subreq = svc_ControlService_send(state, state->ev_ctx, state->binding_handle,
+		                                 &state->svc_handle, SERVICE_CONTROL_STOP,
+		                                 &state->s, &state->r.control);
+		SVC_STEP(subreq, req, state, svc_install_stop_sent);
+		return;
+	}
+	svc_install_configure(req);
+}
+
+static void svc_install_stop_sent(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_ControlService_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.control.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 0, "StopService failed");
+
+	subreq = svc_wait_send(state, state->ev_ctx, state->binding_handle,
+	                       &state->svc_handle, SVCCTL_STOP_PENDING);
+	SVC_STEP(subreq, req, state, svc_install_stopped);
+}
+
+static void svc_install_stopped(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = svc_wait_recv(subreq, &state->s);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, state->ev_ctx, status, 0, "QueryServiceStatus failed");
+	state->need_start = 1;
+	svc_install_configure(req);
+}
+
+static void svc_install_configured(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_ChangeServiceConfigW_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.config.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 0, "ChangeServiceConfig failed");
+	state->need_conf = 0;
+	svc_install_configure(req);
+}
+
+static void svc_install_uploaded(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = svc_upload_recv(subreq, &state->stats);
+	TALLOC_FREE(subreq);
+	svc_lap(&state->mark, &state->stats.upload_usec);
+	REQ_ERR(req, state->ev_ctx, status, 0, "UploadService failed");
+
+	subreq = svc_StartService_send(state, state->ev_ctx, state->binding_handle,
+	                               &state->svc_handle, &state->r.start);
+	SVC_STEP(subreq, req, state, svc_install_start_sent);
+}
+
+static void svc_install_start_sent(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_StartServiceW_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.start.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 0, "StartService failed");
+
+	subreq = svc_wait_send(state, state->ev_ctx, state->binding_handle,
+	                       &state->svc_handle, SVCCTL_START_PENDING);
+	SVC_STEP(subreq, req, state, svc_install_started);
+}
+
+static void svc_install_started(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+	NTSTATUS status;
+
+	status = svc_wait_recv(subreq, &state->s);
+	TALLOC_FREE(subreq);
+	svc_lap(&state->mark, &state->stats.start_usec);
+	REQ_ERR(req, state->ev_ctx, status, 0, "QueryServiceStatus failed");
+	if (state->s.state != SVCCTL_RUNNING) {
+		DEBUG(0, ("Service cannot start, status=0x%08X\n", state->s.state));
+		svc_finish(req, state->ev_ctx, NT_STATUS_UNSUCCESSFUL);
+		return;
+	}
+	/* The service and SCM handles go away with the pipe */
+	svc_finish(req, state->ev_ctx, NT_STATUS_OK);
+}
+
+struct tevent_req *svc_install_send(TALLOC_CTX *mem_ctx,
+                                    struct tevent_context *ev_ctx,
+                                    struct smbcli_tree *tree,
+                                    struct smb2_tree *tree2,
+                                    const char *hostname,
+                                    const char *service_name, const char *service_filename,
+                                    unsigned char *svc32_exe, unsigned int svc32_exe_len,
+                                    unsigned char *svc64_exe, unsigned int svc64_exe_len,
+                                    int flags)
+{
+	struct tevent_req *req, *subreq;
+	struct svc_install_state *state;
+
+	req = tevent_req_create(mem_ctx, &state, struct svc_install_state);
+	if (!req)
+		return NULL;
+	state->ev_ctx = ev_ctx;
+	state->hostname = hostname;
+	state->service_name = service_name;
+	state->service_filename = service_filename;
+	state->svc32_exe = svc32_exe;
+	state->svc32_exe_len = svc32_exe_len;
+	state->svc64_exe = svc64_exe;
+	state->svc64_exe_len = svc64_exe_len;
+	state->tree = tree;
+	state->tree2 = tree2;
+	state->flags = flags;
+	state->mark = timeval_current();
+	state->stats.os64bit = -1;
+
+	subreq = svc_pipe_open_send(state, ev_ctx, tree, tree2);
+	if (tevent_req_nomem(subreq, req))
+		return tevent_req_post(req, ev_ctx);
+	tevent_req_set_callback(subreq, svc_install_connected, req);
+	return req;
+}
+
+NTSTATUS svc_install_recv(struct tevent_req *req, struct svc_install_stats *stats)
+{
+	struct svc_install_state *state = tevent_req_data(req, struct svc_install_state);
+
+	if (stats) {
+		stats->scm_usec += state->stats.scm_usec;
+		stats->upload_usec += state->stats.upload_usec;
+		stats->start_usec += state->stats.start_usec;
+		stats->upload_compared += state->stats.upload_compared;
+		stats->upload_written += state->stats.upload_written;
+		if (state->stats.os64bit >= 0)
+			stats->os64bit = state->stats.os64bit;
+	}
+	return tevent_req_simple_recv_ntstatus(req);
+}
+
+/* Stops and deletes the service, then removes its binary */
+struct svc_uninstall_state {
+	struct tevent_context *ev_ctx;
+	const char *hostname;
+	const char *service_name;
+	const char *service_filename;
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	int flags;
 	struct dcerpc_pipe *svc_pipe;
+	struct dcerpc_binding_handle *binding_handle;
 	struct policy_handle scm_handle;
 	struct policy_handle svc_handle;
-	struct SERVICE_STATUS svc_status;
-	struct smbcli_options options;
-	struct smbcli_session_options session_options;
-
-	lpcfg_smbcli_options(ldprm_ctx, &options);
-	lpcfg_smbcli_session_options(ldprm_ctx, &session_options);
-
-	status = svc_pipe_connect(ev_ctx, &svc_pipe, hostname, credentials, ldprm_ctx);
-	NT_ERR(status, 1, "Cannot connect to svcctl pipe");
-	binding_handle = svc_pipe->binding_handle;
-	status = svc_OpenSCManager(binding_handle, hostname, &scm_handle);
-	NT_ERR(status, 1, "OpenSCManager failed");
-	status = svc_OpenService(binding_handle, &scm_handle, service_name,
-	                         &svc_handle);
-	NT_ERR(status, 1, "OpenService failed");
+	struct SERVICE_STATUS s;
+	union svc_rpc r;
+	struct smbcli_tree *admin;
+	struct smb2_tree *admin2;
+	union smb_handle file;
+	uint32_t delay;
+	struct timeval start;
+};
+
+static void svc_uninstall_scm_opened(struct tevent_req *subreq);
+static void svc_uninstall_svc_opened(struct tevent_req *subreq);
+static void svc_uninstall_stop_sent(struct tevent_req *subreq);
+static void svc_uninstall_stopped(struct tevent_req *subreq);
+static void svc_uninstall_deleted(struct tevent_req *subreq);
+static void svc_uninstall_svc_closed(struct tevent_req *subreq);
+static void svc_uninstall_share_connected(struct tevent_req *subreq);
+static void svc_uninstall_unlink_opened(struct tevent_req *subreq);
+static void svc_uninstall_unlinked(struct tevent_req *subreq);
+
+static void svc_uninstall_connected(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = svc_pipe_open_recv(subreq, state, &state->svc_pipe);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, state->ev_ctx, status, 1, "Cannot connect to svcctl pipe");
+	state->binding_handle = state->svc_pipe->binding_handle;
+
+	subreq = svc_OpenSCManager_send(state, state->ev_ctx, state->binding_handle,
+	                                state->hostname, &state->scm_handle, &state->r.open_scm);
+	SVC_STEP(subreq, req, state, svc_uninstall_scm_opened);
+}
+
+static void svc_uninstall_scm_opened(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_OpenSCManagerW_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.open_scm.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 1, "OpenSCManager failed");
+
+	subreq = svc_OpenService_send(state, state->ev_ctx, state->binding_handle,
+	                              &state->scm_handle, state->service_name,
+	                              &state->svc_handle, &state->r.open_svc);
+	SVC_STEP(subreq, req, state, svc_uninstall_svc_opened);
+}
+
+static void svc_uninstall_svc_opened(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_OpenServiceW_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.open_svc.out.result);
+	REQ_ERR(req, state->ev_ctx, status, 1, "OpenService failed");
 	DEBUG(1, ("OpenService - %s\n", nt_errstr(status)));
-	if (NT_STATUS_IS_OK(status)) {
-		status = svc_ControlService(binding_handle, &svc_handle,
-		                            SERVICE_CONTROL_STOP, &svc_status);
-		{
-			struct SERVICE_STATUS s;
-			do {
-				smb_msleep(100);
-				status = svc_QueryServiceStatus(binding_handle, &svc_handle, &s);
-				NT_ERR(status, 1, "QueryServiceStatus failed");
-			} while (s.state == SVCCTL_STOP_PENDING);
-			if (s.state != SVCCTL_STOPPED) {
-				DEBUG(0, ("Service cannot stop, status=0x%08X\n", s.state));
-				return NT_STATUS_UNSUCCESSFUL;
-			}
-		}
-		DEBUG(1, ("StopService - %s\n", nt_errstr(status)));
-		status = svc_DeleteService(binding_handle, &svc_handle);
-		DEBUG(1, ("DeleteService - %s\n", nt_errstr(status)));
-		status = svc_CloseServiceHandle(binding_handle, &svc_handle);
-		DEBUG(1, ("CloseServiceHandle - %s\n", nt_errstr(status)));
-	}
-	svc_CloseServiceHandle(binding_handle, &scm_handle);
-	DEBUG(1, ("CloseSCMHandle - %s\n", nt_errstr(status)));
-
-	struct smbcli_state *cli;
-	status = smbcli_full_connection(NULL, &cli, hostname, lpcfg_smb_ports(ldprm_ctx),
-	                                "ADMIN$", NULL,
-	                                lpcfg_socket_options(ldprm_ctx), credentials,
-	                                lpcfg_resolve_context(ldprm_ctx), ev_ctx,
-	                                &options, &session_options,
-	                                lpcfg_gensec_settings(NULL, ldprm_ctx));
-	NT_ERR(status, 1, "Failed to open ADMIN$ share");
-	/* Give svc some time to exit */
-	smb_msleep(300);
-	status = smbcli_unlink(cli->tree, service_filename);
-	DEBUG(1, ("Delete %s - %s\n", service_filename, nt_errstr(status)));
-	status = smbcli_tdis(cli);
-	DEBUG(1, ("Closing ADMIN$ - %s\n", nt_errstr(status)));
-	talloc_free(svc_pipe);
-	return status;
+
+	subreq = svc_ControlService_send(state, state->ev_ctx, state->binding_handle,
+	                                 &state->svc_handle, SERVICE_CONTROL_STOP,
+	                                 &state->s, &state->r.control);
+	SVC_STEP(subreq, req, state, svc_uninstall_stop_sent);
+}
+
+static void svc_uninstall_stop_sent(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	/* A service which is not running refuses the stop, that is fine */
+	status = dcerpc_svcctl_ControlService_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.control.out.result);
+	DEBUG(1, ("StopService - %s\n", nt_errstr(status)));
+
+	subreq = svc_wait_send(state, state->ev_ctx, state->binding_handle,
+	                       &state->svc_handle, SVCCTL_STOP_PENDING);
+	SVC_STEP(subreq, req, state, svc_uninstall_stopped);
+}
+
+static void svc_uninstall_stopped(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = svc_wait_recv(subreq, &state->s);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, state->ev_ctx, status, 1, "QueryServiceStatus failed");
+	if (state->s.state != SVCCTL_STOPPED) {
+		DEBUG(0, ("Service cannot stop, status=0x%08X\n", state->s.state));
+		svc_finish(req, state->ev_ctx, NT_STATUS_UNSUCCESSFUL);
+		return;
+	}
+
+	subreq = svc_DeleteService_send(state, state->ev_ctx, state->binding_handle,
+	                                &state->svc_handle, &state->r.delete);
+	SVC_STEP(subreq, req, state, svc_uninstall_deleted);
+}
+
+static void svc_uninstall_deleted(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_DeleteService_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.delete.out.result);
+	DEBUG(1, ("DeleteService - %s\n", nt_errstr(status)));
+
+	/* The SCM only drops a deleted service once its last handle is closed */
+	subreq = svc_CloseServiceHandle_send(state, state->ev_ctx, state->binding_handle,
+	                                     &state->svc_handle, &state->r.close);
+	SVC_STEP(subreq, req, state, svc_uninstall_svc_closed);
+}
+
+static void svc_uninstall_svc_closed(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = dcerpc_svcctl_CloseServiceHandle_r_recv(subreq, state);
+	TALLOC_FREE(subreq);
+	status = NT_RES(status, state->r.close.out.result);
+	DEBUG(1, ("CloseServiceHandle - %s\n", nt_errstr(status)));
+
+	subreq = svc_share_connect_send(state, state->ev_ctx, state->hostname, "ADMIN$",
+	                                state->tree, state->tree2);
+	SVC_STEP(subreq, req, state, svc_uninstall_share_connected);
+}
+
+static void svc_uninstall_unlink(struct tevent_req *req)
+{
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	struct tevent_req *subreq;
+
+	subreq = svc_open_send(state, state->ev_ctx, state->admin, state->admin2,
+	                       state->service_filename, SEC_STD_DELETE, NTCREATEX_DISP_OPEN,
+	                       NTCREATEX_OPTIONS_NON_DIRECTORY_FILE | NTCREATEX_OPTIONS_DELETE_ON_CLOSE);
+	SVC_STEP(subreq, req, state, svc_uninstall_unlink_opened);
+}
+
+static void svc_uninstall_unlink_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+{
+	svc_uninstall_unlink(talloc_get_type(private_data, struct tevent_req));
+}
+
+static void svc_uninstall_share_connected(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = svc_share_connect_recv(subreq, state, &state->admin, &state->admin2);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, state->ev_ctx, status, 1, "Failed to open ADMIN$ share");
+	state->delay = SVC_POLL_MIN;
+	state->start = timeval_current();
+	svc_uninstall_unlink(req);
+}
+
+static void svc_uninstall_unlink_opened(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	uint64_t size;
+	NTSTATUS status;
+
+	status = svc_open_recv(subreq, &state->file, &size);
+	TALLOC_FREE(subreq);
+	/* The binary stays locked until the stopped service process exits */
+	if (NT_STATUS_EQUAL(status, NT_STATUS_SHARING_VIOLATION) ||
+	    NT_STATUS_EQUAL(status, NT_STATUS_CANNOT_DELETE)) {
+		DEBUG(2, ("Delete %s - %s, retrying in %u ms\n", state->service_filename, nt_errstr(status), state->delay));
+		status = svc_backoff(state->ev_ctx, state, &state->start, &state->delay,
+		                     svc_uninstall_unlink_handler, req);
+		if (NT_STATUS_IS_OK(status))
+			return;
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(1, ("Delete %s - %s\n", state->service_filename, nt_errstr(status)));
+		svc_finish(req, state->ev_ctx, status);
+		return;
+	}
+	subreq = svc_close_send(state, state->ev_ctx, state->admin, state->admin2, state->file);
+	SVC_STEP(subreq, req, state, svc_uninstall_unlinked);
+}
+
+static void svc_uninstall_unlinked(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct svc_uninstall_state *state = tevent_req_data(req, struct svc_uninstall_state);
+	NTSTATUS status;
+
+	status = svc_close_recv(subreq);
+	TALLOC_FREE(subreq);
+	DEBUG(1, ("Delete %s - %s\n", state->service_filename, nt_errstr(status)));
+	svc_finish(req, state->ev_ctx, status);
+}
+
+struct tevent_req *svc_uninstall_send(TALLOC_CTX *mem_ctx,
+                                      struct tevent_context *ev_ctx,
+                                      struct smbcli_tree *tree,
+                                      struct smb2_tree *tree2,
+                                      const char *hostname,
+                                      const char *service_name, const char *service_filename,
+                                      int flags)
+{
+	struct tevent_req *req, *subreq;
+	struct svc_uninstall_state *state;
+
+	req = tevent_req_create(mem_ctx, &state, struct svc_uninstall_state);
+	if (!req)
+		return NULL;
+	state->ev_ctx = ev_ctx;
+	state->hostname = hostname;
+	state->service_name = service_name;
+	state->service_filename = service_filename;
+	state->tree = tree;
+	state->tree2 = tree2;
+	state->flags = flags;
+
+	subreq = svc_pipe_open_send(state, ev_ctx, tree, tree2);
+	if (tevent_req_nomem(subreq, req))
+		return tevent_req_post(req, ev_ctx);
+	tevent_req_set_callback(subreq, svc_uninstall_connected, req);
+	return req;
+}
+
+NTSTATUS svc_uninstall_recv(struct tevent_req *req)
+{
+	return tevent_req_simple_recv_ntstatus(req);
 }
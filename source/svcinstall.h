@@ -4,6 +4,9 @@
   License: GNU General Public License version 3
 */
 
+struct smbcli_tree;
+struct smb2_tree;
+
 #define SVC_INTERACTIVE 1
 #define SVC_IGNORE_INTERACTIVE 2
 #define SVC_INTERACTIVE_MASK 3
@@ -14,20 +17,79 @@
 #define SVC_SYSTEM 64
 #define SVC_PROFILE 128
 #define SVC_CONVERT 256
+#define SVC_SMB2 512
+
+/*
+  Time spent in the steps of svc_install_send() and bytes of the service
+  binary compared with the remote copy and written, svc_install_recv() adds
+  them to the caller's counters. Without SVC_OSCHOOSE no SysWoW64 probe is
+  made, callers remembering os64bit pass SVC_OS64BIT or neither instead.
+*/
+struct svc_install_stats {
+	int64_t scm_usec;	/* svcctl pipe, open or create, stop, reconfigure */
+	int64_t upload_usec;
+	int64_t start_usec;	/* StartService until the service runs */
+	uint64_t upload_compared;
+	uint64_t upload_written;
+	/* Set to 1 or 0 once the 64 or 32-bit binary was chosen, -1 before */
+	int os64bit;
+};
+
+/*
+  Both run on the caller's IPC$ tree, SMB1 tree or SMB2 tree2, whose
+  session carries the svcctl pipe and the ADMIN$ tree as well.
+*/
+struct tevent_req *svc_install_send(TALLOC_CTX *mem_ctx,
+                                    struct tevent_context *ev_ctx,
+                                    struct smbcli_tree *tree,
+                                    struct smb2_tree *tree2,
+                                    const char *hostname,
+                                    const char *service_name, const char *service_filename,
+                                    unsigned char *svc32_exe, unsigned int svc32_exe_len,
+                                    unsigned char *svc64_exe, unsigned int svc64_exe_len,
+                                    int flags);
+NTSTATUS svc_install_recv(struct tevent_req *req, struct svc_install_stats *stats);
+struct tevent_req *svc_uninstall_send(TALLOC_CTX *mem_ctx,
+                                      struct tevent_context *ev_ctx,
+                                      struct smbcli_tree *tree,
+                                      struct smb2_tree *tree2,
+                                      const char *hostname,
+                                      const char *service_name, const char *service_filename,
+                                      int flags);
+NTSTATUS svc_uninstall_recv(struct tevent_req *req);
+
+/*
+  Building blocks shared with transfer.c. svc_finish() completes req from a
+  zero timer, for requests owning a tree they must not free under its reply.
+*/
+void svc_finish(struct tevent_req *req, struct tevent_context *ev_ctx, NTSTATUS status);
+
+/* Logs a failed step and completes req with its status */
+#define REQ_ERR(req, ev, status, lvl, args...) if (!NT_STATUS_IS_OK(status)) { DEBUG(lvl,("ERROR: " args)); DEBUG(lvl,(". %s.\n", nt_errstr(status))); svc_finish(req, ev, status); return; }
 
-NTSTATUS svc_install(struct tevent_context *ev_ctx, 
-                     const char *hostname,
-                     const char *service_name, const char *service_filename,
-                     unsigned char *svc32_exe, unsigned int svc32_exe_len,
-                     unsigned char *svc64_exe, unsigned int svc64_exe_len,
-                     struct cli_credentials *credentials,
-                     struct loadparm_context *cllp_ctx,
-                     int flags);
-NTSTATUS svc_uninstall(struct tevent_context *ev_ctx,
-                       const char *hostname,
-                       const char *service_name, const char *service_filename,
-                       struct cli_credentials * credentials,
-                       struct loadparm_context *cllp_ctx);
+struct tevent_req *svc_share_connect_send(TALLOC_CTX *mem_ctx,
+                                          struct tevent_context *ev_ctx,
+                                          const char *hostname, const char *share,
+                                          struct smbcli_tree *tree,
+                                          struct smb2_tree *tree2);
+NTSTATUS svc_share_connect_recv(struct tevent_req *req, TALLOC_CTX *mem_ctx,
+                                struct smbcli_tree **tree, struct smb2_tree **tree2);
+struct tevent_req *svc_open_send(TALLOC_CTX *mem_ctx,
+                                 struct tevent_context *ev_ctx,
+                                 struct smbcli_tree *tree,
+                                 struct smb2_tree *tree2,
+                                 const char *fname,
+                                 uint32_t access_mask,
+                                 uint32_t disposition,
+                                 uint32_t create_options);
+NTSTATUS svc_open_recv(struct tevent_req *req, union smb_handle *file, uint64_t *size);
+struct tevent_req *svc_close_send(TALLOC_CTX *mem_ctx,
+                                  struct tevent_context *ev_ctx,
+                                  struct smbcli_tree *tree,
+                                  struct smb2_tree *tree2,
+                                  union smb_handle file);
+NTSTATUS svc_close_recv(struct tevent_req *req);
+unsigned int svc_io_max(struct smbcli_tree *tree, struct smb2_tree *tree2);
 
 const char **lpcfg_smb_ports(struct loadparm_context *);
 const char *lpcfg_socket_options(struct loadparm_context *);
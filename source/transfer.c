@@ -0,0 +1,531 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <core/ntstatus.h>
+
+#include <tevent.h>
+#include <util/time.h>
+#include <util/data_blob.h>
+#include <util/tevent_ntstatus.h>
+#include <smb_cliraw.h>
+#include <util/debug.h>
+#ifdef HAVE_SMB2
+#include <libcli/smb2/smb2.h>
+#include <libcli/smb2/smb2_calls.h>
+#endif
+
+#include "svcinstall.h"
+#include "transfer.h"
+
+/*
+  Files are moved with XFER_WINDOW READX/WRITEX (or SMB2 read/write)
+  requests in flight, the local side is read and written at the offset of
+  each request so replies may complete in any order.
+*/
+#define XFER_WINDOW 8
+
+/*
+  "LOCAL:SHARE/PATH" for a put, "SHARE/PATH:LOCAL" for a get; remote names
+  hold no colon, so the split is at the colon nearest the remote part.
+*/
+struct xfer_item *xfer_item_parse(TALLOC_CTX *mem_ctx, const char *spec, int get)
+{
+	struct xfer_item *x;
+	const char *colon, *remote, *slash;
+	char *path, *p;
+
+	colon = get ? strchr(spec, ':') : strrchr(spec, ':');
+	if (!colon)
+		return NULL;
+	remote = get ? spec : colon + 1;
+	slash = strpbrk(remote, "/\\");
+	if (!slash || slash == remote || slash[1] == 0 || slash[1] == ':')
+		return NULL;
+
+	x = talloc_zero(mem_ctx, struct xfer_item);
+	if (!x)
+		return NULL;
+	x->get = get;
+	x->share = talloc_strndup(x, remote, slash - remote);
+	if (get) {
+		x->local = talloc_strdup(x, colon + 1);
+		path = talloc_strndup(x, slash + 1, colon - slash - 1);
+	} else {
+		x->local = talloc_strndup(x, spec, colon - spec);
+		path = talloc_strdup(x, slash + 1);
+	}
+	if (!x->share || !x->local || !path || !*x->local) {
+		talloc_free(x);
+		return NULL;
+	}
+	for (p = path; *p; ++p)
+		if (*p == '/')
+			*p = '\\';
+	x->path = path;
+	return x;
+}
+
+static mode_t xfer_umask(void)
+{
+	mode_t mask = umask(0);
+
+	umask(mask);
+	return mask;
+}
+
+static NTSTATUS xfer_errno_status(int err)
+{
+	switch (err) {
+	case ENOENT: return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	case EACCES: return NT_STATUS_ACCESS_DENIED;
+	case ENOSPC: return NT_STATUS_DISK_FULL;
+	case ENOMEM: return NT_STATUS_NO_MEMORY;
+	default: return NT_STATUS_UNSUCCESSFUL;
+	}
+}
+
+struct xfer_state {
+	struct tevent_context *ev_ctx;
+	struct tevent_req *req;
+	const char *hostname;
+	/* The session the shares are connected on */
+	struct smbcli_tree *ipc_tree;
+	struct smb2_tree *ipc_tree2;
+	int get;
+	const struct xfer_item *item;
+	/* Tree of item->share, kept while the next items use the same share */
+	const char *share;
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	unsigned int chunk;
+	char *local;
+	/* A get is written here and renamed to local once complete */
+	char *tmp;
+	int fd;
+	union smb_handle file;
+	/* Bytes to move, lowered when a get finds the remote file shorter */
+	uint64_t size;
+	/* Next offset to request */
+	uint64_t ofs;
+	int pending;
+	NTSTATUS status;
+	struct timeval start;
+	struct xfer_stats stats;
+};
+
+struct xfer_io {
+	struct xfer_state *x;
+	uint64_t ofs;
+	unsigned int size;
+	union smb_read rd;
+	union smb_write wr;
+	uint8_t *buf;
+};
+
+static void xfer_item_start(struct xfer_state *x);
+static void xfer_pump(struct xfer_state *x);
+static void xfer_closed(struct tevent_req *subreq);
+
+static int xfer_state_destructor(struct xfer_state *x)
+{
+	if (x->fd >= 0)
+		close(x->fd);
+	if (x->tmp)
+		unlink(x->tmp);
+	return 0;
+}
+
+/* Every outstanding request completed, close the remote file */
+static void xfer_pass_done(struct xfer_state *x)
+{
+	struct tevent_req *subreq;
+
+	subreq = svc_close_send(x, x->ev_ctx, x->tree, x->tree2, x->file);
+	if (!subreq) {
+		svc_finish(x->req, x->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
+	}
+	tevent_req_set_callback(subreq, xfer_closed, x->req);
+}
+
+static void xfer_io_done(struct xfer_io *r, NTSTATUS status, const uint8_t *data, unsigned int n)
+{
+	struct xfer_state *x = r->x;
+
+	--x->pending;
+	if (NT_STATUS_IS_OK(status) && x->get && n) {
+		if (pwrite(x->fd, data, n, r->ofs) != n)
+			status = xfer_errno_status(errno);
+	} else if (NT_STATUS_IS_OK(status) && !x->get && n != r->size) {
+		status = NT_STATUS_DISK_FULL;
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		if (NT_STATUS_IS_OK(x->status))
+			x->status = status;
+	} else {
+		x->stats.bytes += n;
+		/* The remote file is shorter than it was at open time */
+		if (x->get && n < r->size && r->ofs + n < x->size)
+			x->size = r->ofs + n;
+	}
+	talloc_free(r);
+	xfer_pump(x);
+	if (!x->pending)
+		xfer_pass_done(x);
+}
+
+static void xfer_io_recv(struct smbcli_request *req)
+{
+	struct xfer_io *r = req->async.private_data;
+	NTSTATUS status;
+
+	if (r->x->get) {
+		status = smb_raw_read_recv(req, &r->rd);
+		xfer_io_done(r, status, r->buf, r->rd.readx.out.nread);
+	} else {
+		status = smb_raw_write_recv(req, &r->wr);
+		xfer_io_done(r, status, NULL, r->wr.writex.out.nwritten);
+	}
+}
+
+#ifdef HAVE_SMB2
+static void xfer_io_recv2(struct smb2_request *req)
+{
+	struct xfer_io *r = req->async.private_data;
+	NTSTATUS status;
+
+	if (r->x->get) {
+		status = smb2_read_recv(req, r, &r->rd.smb2);
+		xfer_io_done(r, status, r->rd.smb2.out.data.data, r->rd.smb2.out.data.length);
+	} else {
+		status = smb2_write_recv(req, &r->wr.smb2);
+		xfer_io_done(r, status, NULL, r->wr.smb2.out.nwritten);
+	}
+}
+
+static int xfer_io_send2(struct xfer_state *x, struct xfer_io *r)
+{
+	struct smb2_request *req;
+
+	if (x->get) {
+		r->rd.smb2.level = RAW_READ_SMB2;
+		r->rd.smb2.in.file = x->file;
+		r->rd.smb2.in.offset = r->ofs;
+		r->rd.smb2.in.length = r->size;
+		r->rd.smb2.in.min_count = 0;
+		req = smb2_read_send(x->tree2, &r->rd.smb2);
+	} else {
+		r->wr.smb2.level = RAW_WRITE_SMB2;
+		r->wr.smb2.in.file = x->file;
+		r->wr.smb2.in.offset = r->ofs;
+		r->wr.smb2.in.data = data_blob_const(r->buf, r->size);
+		req = smb2_write_send(x->tree2, &r->wr.smb2);
+	}
+	if (!req)
+		return 0;
+	talloc_steal(r, req);
+	req->async.fn = xfer_io_recv2;
+	req->async.private_data = r;
+	return 1;
+}
+#endif
+
+/* Returns 0 with x->status set on failure and with it unchanged at end of file */
+static int xfer_io_send(struct xfer_state *x, struct xfer_io *r)
+{
+	struct smbcli_request *req;
+
+	r->buf = talloc_size(r, r->size);
+	if (!r->buf) {
+		x->status = NT_STATUS_NO_MEMORY;
+		return 0;
+	}
+	if (!x->get) {
+		ssize_t n = pread(x->fd, r->buf, r->size, r->ofs);
+		if (n < 0) {
+			x->status = xfer_errno_status(errno);
+			return 0;
+		}
+		/* The local file shrank, send what is there */
+		r->size = n;
+		if (!n)
+			return 0;
+	}
+#ifdef HAVE_SMB2
+	if (x->tree2) {
+		if (xfer_io_send2(x, r))
+			return 1;
+		x->status = NT_STATUS_NO_MEMORY;
+		return 0;
+	}
+#endif
+	if (x->get) {
+		r->rd.readx.level = RAW_READ_READX;
+		r->rd.readx.in.file = x->file;
+		r->rd.readx.in.offset = r->ofs;
+		r->rd.readx.in.mincnt = 0;
+		r->rd.readx.in.maxcnt = r->size;
+		r->rd.readx.in.remaining = 0;
+		r->rd.readx.in.read_for_execute = false;
+		r->rd.readx.out.data = r->buf;
+		req = smb_raw_read_send(x->tree, &r->rd);
+	} else {
+		r->wr.writex.level = RAW_WRITE_WRITEX;
+		r->wr.writex.in.file = x->file;
+		r->wr.writex.in.offset = r->ofs;
+		r->wr.writex.in.wmode = 0;
+		r->wr.writex.in.remaining = 0;
+		r->wr.writex.in.count = r->size;
+		r->wr.writex.in.data = r->buf;
+		req = smb_raw_write_send(x->tree, &r->wr);
+	}
+	if (!req) {
+		x->status = NT_STATUS_NO_MEMORY;
+		return 0;
+	}
+	/* Freeing an outstanding xfer_io takes it off the wire */
+	talloc_steal(r, req);
+	req->async.fn = xfer_io_recv;
+	req->async.private_data = r;
+	return 1;
+}
+
+static void xfer_pump(struct xfer_state *x)
+{
+	struct xfer_io *r;
+
+	while (NT_STATUS_IS_OK(x->status) && x->pending < XFER_WINDOW && x->ofs < x->size) {
+		r = talloc_zero(x, struct xfer_io);
+		if (!r) {
+			x->status = NT_STATUS_NO_MEMORY;
+			return;
+		}
+		r->x = x;
+		r->ofs = x->ofs;
+		r->size = MIN(x->chunk, x->size - x->ofs);
+		if (!xfer_io_send(x, r)) {
+			talloc_free(r);
+			if (NT_STATUS_IS_OK(x->status))
+				x->size = x->ofs;
+			return;
+		}
+		x->ofs += r->size;
+		++x->pending;
+	}
+}
+
+static void xfer_opened(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct xfer_state *x = tevent_req_data(req, struct xfer_state);
+	const struct xfer_item *it = x->item;
+	NTSTATUS status;
+	uint64_t size;
+
+	status = svc_open_recv(subreq, &x->file, &size);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, x->ev_ctx, status, 0, "%s: Cannot open %s/%s", x->hostname, it->share, it->path);
+
+	if (x->get) {
+		/* Only now that the remote file is there, and next to local
+		   so the rename stays on one file system */
+		x->tmp = talloc_asprintf(x, "%s.XXXXXX", x->local);
+		if (!x->tmp) {
+			x->status = NT_STATUS_NO_MEMORY;
+			xfer_pass_done(x);
+			return;
+		}
+		x->fd = mkstemp(x->tmp);
+		if (x->fd < 0) {
+			DEBUG(0, ("ERROR: %s: Cannot create %s - %s\n", x->hostname, x->tmp, strerror(errno)));
+			x->status = xfer_errno_status(errno);
+			TALLOC_FREE(x->tmp);
+			xfer_pass_done(x);
+			return;
+		}
+		x->size = size;
+	} else {
+		struct stat st;
+		if (fstat(x->fd, &st)) {
+			x->status = xfer_errno_status(errno);
+			xfer_pass_done(x);
+			return;
+		}
+		x->size = st.st_size;
+	}
+	DEBUG(1, ("%s: %s %llu bytes %s %s/%s\n", x->hostname, x->get ? "Getting" : "Putting",
+	          (unsigned long long)x->size, x->get ? "from" : "to", it->share, it->path));
+	x->ofs = 0;
+	x->status = NT_STATUS_OK;
+	xfer_pump(x);
+	if (!x->pending)
+		xfer_pass_done(x);
+}
+
+static void xfer_open(struct xfer_state *x)
+{
+	const struct xfer_item *it = x->item;
+	struct tevent_req *subreq;
+	const char *p;
+	char *local;
+
+	/* Gets from many hosts need a local name per host */
+	local = talloc_strdup(x, "");
+	for (p = it->local; local && *p; ++p) {
+		if (p[0] == '%' && p[1] == 'h') {
+			local = talloc_strdup_append(local, x->hostname);
+			++p;
+		} else {
+			local = talloc_asprintf_append(local, "%c", *p);
+		}
+	}
+	if (!local) {
+		svc_finish(x->req, x->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
+	}
+	talloc_free(x->local);
+	x->local = local;
+
+	/* A get creates its file once the remote one is open */
+	if (!x->get) {
+		x->fd = open(local, O_RDONLY);
+		if (x->fd < 0) {
+			DEBUG(0, ("ERROR: %s: Cannot open %s - %s\n", x->hostname, local, strerror(errno)));
+			svc_finish(x->req, x->ev_ctx, xfer_errno_status(errno));
+			return;
+		}
+	}
+
+	subreq = svc_open_send(x, x->ev_ctx, x->tree, x->tree2, it->path,
+	                       x->get ? SEC_RIGHTS_FILE_READ : SEC_RIGHTS_FILE_WRITE,
+	                       x->get ? NTCREATEX_DISP_OPEN : NTCREATEX_DISP_OVERWRITE_IF,
+	                       NTCREATEX_OPTIONS_NON_DIRECTORY_FILE);
+	if (!subreq) {
+		svc_finish(x->req, x->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
+	}
+	tevent_req_set_callback(subreq, xfer_opened, x->req);
+}
+
+static void xfer_connected(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct xfer_state *x = tevent_req_data(req, struct xfer_state);
+	NTSTATUS status;
+
+	status = svc_share_connect_recv(subreq, x, &x->tree, &x->tree2);
+	TALLOC_FREE(subreq);
+	REQ_ERR(req, x->ev_ctx, status, 0, "%s: Failed to open %s share", x->hostname, x->item->share);
+	x->share = x->item->share;
+	x->chunk = svc_io_max(x->tree, x->tree2);
+	xfer_open(x);
+}
+
+static void xfer_closed(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct xfer_state *x = tevent_req_data(req, struct xfer_state);
+	NTSTATUS status;
+
+	status = svc_close_recv(subreq);
+	TALLOC_FREE(subreq);
+	if (NT_STATUS_IS_OK(x->status) && !x->get)
+		x->status = status;
+	if (NT_STATUS_IS_OK(x->status) && x->get && ftruncate(x->fd, x->size))
+		x->status = xfer_errno_status(errno);
+	/* mkstemp() leaves out the group and other bits open() would give */
+	if (NT_STATUS_IS_OK(x->status) && x->get && fchmod(x->fd, 0666 & ~xfer_umask()))
+		x->status = xfer_errno_status(errno);
+	if (x->fd >= 0 && close(x->fd) && NT_STATUS_IS_OK(x->status))
+		x->status = xfer_errno_status(errno);
+	x->fd = -1;
+	if (x->tmp) {
+		if (NT_STATUS_IS_OK(x->status) && rename(x->tmp, x->local))
+			x->status = xfer_errno_status(errno);
+		if (!NT_STATUS_IS_OK(x->status))
+			unlink(x->tmp);
+		TALLOC_FREE(x->tmp);
+	}
+	REQ_ERR(req, x->ev_ctx, x->status, 0, "%s: Failed to %s %s/%s", x->hostname,
+	        x->get ? "get" : "put", x->item->share, x->item->path);
+	x->stats.files++;
+
+	for (x->item = x->item->next; x->item; x->item = x->item->next)
+		if (x->item->get == x->get)
+			break;
+	xfer_item_start(x);
+}
+
+static void xfer_item_start(struct xfer_state *x)
+{
+	struct tevent_req *subreq;
+
+	if (!x->item) {
+		struct timeval now = timeval_current();
+		x->stats.usec = usec_time_diff(&now, &x->start);
+		svc_finish(x->req, x->ev_ctx, NT_STATUS_OK);
+		return;
+	}
+	if (x->share && strcasecmp(x->share, x->item->share) == 0) {
+		xfer_open(x);
+		return;
+	}
+	x->share = NULL;
+	TALLOC_FREE(x->tree);
+	TALLOC_FREE(x->tree2);
+	subreq = svc_share_connect_send(x, x->ev_ctx, x->hostname, x->item->share,
+	                                x->ipc_tree, x->ipc_tree2);
+	if (!subreq) {
+		svc_finish(x->req, x->ev_ctx, NT_STATUS_NO_MEMORY);
+		return;
+	}
+	tevent_req_set_callback(subreq, xfer_connected, x->req);
+}
+
+struct tevent_req *xfer_send(TALLOC_CTX *mem_ctx,
+                             struct tevent_context *ev_ctx,
+                             struct smbcli_tree *tree,
+                             struct smb2_tree *tree2,
+                             const char *hostname,
+                             const struct xfer_item *items, int get)
+{
+	struct tevent_req *req;
+	struct xfer_state *x;
+
+	req = tevent_req_create(mem_ctx, &x, struct xfer_state);
+	if (!req)
+		return NULL;
+	x->ev_ctx = ev_ctx;
+	x->req = req;
+	x->hostname = hostname;
+	x->ipc_tree = tree;
+	x->ipc_tree2 = tree2;
+	x->get = get;
+	x->fd = -1;
+	x->start = timeval_current();
+	talloc_set_destructor(x, xfer_state_destructor);
+	for (x->item = items; x->item; x->item = x->item->next)
+		if (x->item->get == get)
+			break;
+	xfer_item_start(x);
+	return req;
+}
+
+NTSTATUS xfer_recv(struct tevent_req *req, struct xfer_stats *stats)
+{
+	struct xfer_state *x = tevent_req_data(req, struct xfer_state);
+
+	stats->files += x->stats.files;
+	stats->bytes += x->stats.bytes;
+	stats->usec += x->stats.usec;
+	return tevent_req_simple_recv_ntstatus(req);
+}
@@ -0,0 +1,38 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+
+struct smbcli_tree;
+struct smb2_tree;
+
+/* One --put or --get, parsed by xfer_item_parse() */
+struct xfer_item {
+	struct xfer_item *next;
+	int get;		/* 0 - local to remote, 1 - remote to local */
+	const char *local;	/* "%h" is replaced with the host name */
+	const char *share;
+	const char *path;	/* on share, backslash separated */
+};
+
+/* Files and bytes moved in one direction and the time it took */
+struct xfer_stats {
+	unsigned int files;
+	uint64_t bytes;
+	int64_t usec;
+};
+
+struct xfer_item *xfer_item_parse(TALLOC_CTX *mem_ctx, const char *spec, int get);
+
+/*
+  Copies the items of direction get in list order, each share connected
+  as another tree of the session of tree or tree2.
+*/
+struct tevent_req *xfer_send(TALLOC_CTX *mem_ctx,
+                             struct tevent_context *ev_ctx,
+                             struct smbcli_tree *tree,
+                             struct smb2_tree *tree2,
+                             const char *hostname,
+                             const struct xfer_item *items, int get);
+NTSTATUS xfer_recv(struct tevent_req *req, struct xfer_stats *stats);
@@ -4,10 +4,8 @@
   License: GNU General Public License version 3
 */
 
-#include <sys/epoll.h>
 #include <sys/fcntl.h>
 #include <sys/unistd.h>
-#include <sys/termios.h>
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
@@ -22,48 +20,71 @@
 #include <dcerpc.h>
 #include <iconv.h>
 #include <errno.h>
+#include <ctype.h>
 #include <credentials.h>
 
 #define TEVENT_CONTEXT_INIT tevent_context_init
 
 #include "async.h"
 #include "svcinstall.h"
+#include "hostcache.h"
+#include "transfer.h"
 #include "winexesvc.h"
+#include "winexe.h"
 
-#define SERVICE_FILENAME SERVICE_NAME ".exe"
+/* Default number of hosts processed at the same time in --hosts mode */
+#define DEFAULT_PARALLEL 32
 
-static const char version_message_fmt[] = "winexe version %d.%d\nThis program may be freely redistributed under the terms of the GNU GPLv3\n";
+/* Default number of seconds an idle host connection is kept by --daemon */
+#define DEFAULT_IDLE_TIMEOUT 300
 
-static struct loadparm_context *ldprm_ctx;
-static struct tevent_context *ev_ctx;
+/* Default number of reads and writes kept in flight per std pipe */
+#define DEFAULT_WINDOW 4
 
-static struct termios termios_orig;
-static int termios_orig_is_valid = 0;
+/* popt values of the repeatable options */
+enum {
+	OPT_PUT = 1,
+	OPT_GET
+};
+
+static const char version_message_fmt[] = "winexe version %d.%d\nThis program may be freely redistributed under the terms of the GNU GPLv3\n";
+
+struct loadparm_context *ldprm_ctx;
+struct tevent_context *ev_ctx;
 
 static int abort_requested = 0;
 
-/* winexesvc32.exe binary blob */
-extern unsigned int winexesvc32_exe_len;
-extern unsigned char winexesvc32_exe[];
-
-/* winexesvc64.exe binary blob */
-extern unsigned int winexesvc64_exe_len;
-extern unsigned char winexesvc64_exe[];
-
-struct program_options {
-	char *hostname;
-	char *cmd;
-	struct cli_credentials *credentials;
-	char *runas;
-	char *runas_file;
-	int flags;
-};
+static char *runas_from_file(const char *fn)
+{
+	struct cli_credentials *cred;
+	const char *user, *pass;
+	char buffer[1024];
+
+	if (fn == NULL)
+		return NULL;
+	cred = cli_credentials_init(talloc_autofree_context());
+	cli_credentials_parse_file(cred, fn, CRED_SPECIFIED);
+	user = cli_credentials_get_username(cred);
+	pass = cli_credentials_get_password(cred);
+	if (!user || !pass)
+		return NULL;
+
+	const char *dom = cli_credentials_get_domain(cred);
+	if (dom) {
+		snprintf(buffer, sizeof(buffer), "%s\\%s%%%s", dom, user, pass);
+	} else {
+		snprintf(buffer, sizeof(buffer), "%s%%%s", user, pass);
+	}
+	buffer[sizeof(buffer)-1] = '\0';
+	return strdup(buffer);
+}
 
 static void parse_args(int argc, char *argv[], struct program_options *options)
 {
 	poptContext pc;
 	int opt, i;
 	struct cli_credentials *cred;
+	struct xfer_item **pxfer = &options->xfers;
 
 	int argc_new;
 	char **argv_new;
@@ -77,6 +98,7 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 	int flag_version = 0;
 	int flag_profile = 0;
 	int flag_convert = 0;
+	int flag_smb2 = 0;
 	int flag_nopass = 0;
 	char *opt_user = NULL;
 	char *opt_kerberos = NULL;
@@ -84,6 +106,10 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 	char *opt_debuglevel = NULL;
 	
 	memset(options, 0, sizeof(struct program_options));
+	options->parallel = DEFAULT_PARALLEL;
+	options->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	options->window = DEFAULT_WINDOW;
+	options->cache_ttl = HOST_CACHE_DEFAULT_TTL;
 
 	struct poptOption long_options[] = {
 		{ "help", 'h', POPT_ARG_NONE, &flag_help, 0,
@@ -110,6 +136,8 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 			"Load user profile", NULL},
 		{ "convert", 0, POPT_ARG_NONE, &flag_convert, 0,
 			"Try to convert characters between local and remote code-pages", NULL},
+		{ "smb2", 0, POPT_ARG_NONE, &flag_smb2, 0,
+			"Talk SMB2 to the host, for hosts with SMB1 disabled", NULL},
 		{ "runas", 0, POPT_ARG_STRING, &options->runas, 0,
 			"Run as the given user (BEWARE: this password is sent in cleartext over the network!)" , "[DOMAIN\\]USERNAME%PASSWORD"},
 		{ "runas-file", 0, POPT_ARG_STRING, &options->runas_file, 0,
@@ -118,14 +146,50 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 			"Desktop interaction: 0 - disallow, 1 - allow. If allow, also use the --system switch (Windows requirement). Vista does not support this option.", "0|1"},
 		{ "ostype", 0, POPT_ARG_INT, &flag_ostype, 0,
 			"OS type: 0 - 32-bit, 1 - 64-bit, 2 - winexe will decide. Determines which version (32-bit or 64-bit) of service will be installed.", "0|1|2"},
+		{ "hosts", 0, POPT_ARG_STRING, &options->hosts_file, 0,
+			"Run COMMAND on every host listed in FILE, one per line (- reads the list from stdin)", "FILE"},
+		{ "parallel", 0, POPT_ARG_INT, &options->parallel, 0,
+			"Maximum number of hosts processed concurrently with --hosts (default 32)", "N"},
+		{ "summary", 0, POPT_ARG_STRING, &options->summary_file, 0,
+			"Write a tab separated HOST, RETURN CODE, STATUS line per host to FILE (- for stdout)", "FILE"},
+		{ "report", 0, POPT_ARG_STRING, &options->report_file, 0,
+			"Write per host phase timings and pipe counters as JSON to FILE (- for stdout)", "FILE"},
+		{ "cache", 0, POPT_ARG_STRING, &options->cache_file, 0,
+			"Remember service version and architecture of hosts in tdb FILE to skip install probes", "FILE"},
+		{ "cache-ttl", 0, POPT_ARG_INT, &options->cache_ttl, 0,
+			"Trust --cache entries for SECONDS (default 3600)", "SECONDS"},
+		{ "daemon", 0, POPT_ARG_STRING, &options->daemon_socket, 0,
+			"Keep host connections open and serve commands submitted on unix socket SOCKET", "SOCKET"},
+		{ "idle-timeout", 0, POPT_ARG_INT, &options->idle_timeout, 0,
+			"Close daemon host connections unused for SECONDS (default 300)", "SECONDS"},
+		{ "socket", 0, POPT_ARG_STRING, &options->client_socket, 0,
+			"Submit COMMAND to the winexe daemon listening on SOCKET", "SOCKET"},
+		{ "window", 0, POPT_ARG_INT, &options->window, 0,
+			"Number of reads and writes kept in flight on each stdin/stdout/stderr pipe, 1-16 (default 4)", "N"},
+		{ "put", 0, POPT_ARG_STRING, NULL, OPT_PUT,
+			"Copy LOCAL to SHARE/PATH on the host before running COMMAND, may be repeated", "LOCAL:SHARE/PATH"},
+		{ "get", 0, POPT_ARG_STRING, NULL, OPT_GET,
+			"Copy SHARE/PATH on the host to LOCAL after COMMAND, %h in LOCAL is the host name, may be repeated", "SHARE/PATH:LOCAL"},
+		{ "compress", 0, POPT_ARG_INT, &options->compress, 0,
+			"Have the service compress stdout and stderr at zlib LEVEL, 1-9 (default 0 - off)", "LEVEL"},
 		POPT_TABLEEND
 	};
 
 	pc = poptGetContext(argv[0], argc, (const char **) argv, long_options, 0);
 
-	poptSetOtherOptionHelp(pc, "[OPTION]... //HOST COMMAND\nOptions:");
+	poptSetOtherOptionHelp(pc, "[OPTION]... //HOST COMMAND\n  or:  winexe [OPTION]... --hosts=FILE COMMAND\n  or:  winexe [OPTION]... --daemon=SOCKET\nOptions:");
+
+	while ((opt = poptGetNextOpt(pc)) == OPT_PUT || opt == OPT_GET) {
+		const char *spec = poptGetOptArg(pc);
+		*pxfer = xfer_item_parse(talloc_autofree_context(), spec, opt == OPT_GET);
+		if (!*pxfer) {
+			DEBUG(0, ("ERROR: Invalid --%s %s\n", opt == OPT_GET ? "get" : "put", spec));
+			exit(1);
+		}
+		pxfer = &(*pxfer)->next;
+	}
 
-	if (((opt = poptGetNextOpt(pc)) != -1) || flag_help || flag_version) {
+	if (opt != -1 || flag_help || flag_version) {
 		DEBUG(0, (version_message_fmt, VERSION_MAJOR, VERSION_MINOR));
 		if (flag_version)
 			exit(0);
@@ -135,6 +199,13 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 		exit(1);
 	}
 
+#ifndef HAVE_SMB2
+	if (flag_smb2) {
+		DEBUG(0, ("ERROR: This winexe was built without SMB2 support\n"));
+		exit(1);
+	}
+#endif
+
 	argv_new = discard_const_p(char *, poptGetArgs(pc));
 
 	argc_new = argc;
@@ -145,7 +216,36 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 		}
 	}
 
-	if (argc_new != 2 || argv_new[0][0] != '/' || argv_new[0][1] != '/') {
+	if (options->window < 1 || options->window > ASYNC_WINDOW_MAX || options->cache_ttl < 0
+	    || options->compress < 0 || options->compress > 9) {
+		DEBUG(0, (version_message_fmt, VERSION_MAJOR, VERSION_MINOR));
+		poptPrintHelp(pc, stdout, 0);
+		exit(1);
+	} else if (options->daemon_socket) {
+		if (argc_new != 0 || options->hosts_file || options->client_socket || options->idle_timeout < 1
+		    || options->xfers) {
+			DEBUG(0, (version_message_fmt, VERSION_MAJOR, VERSION_MINOR));
+			poptPrintHelp(pc, stdout, 0);
+			exit(1);
+		}
+	} else if (options->hosts_file) {
+		const struct xfer_item *x;
+
+		if (argc_new != 1 || options->parallel < 1 || options->client_socket) {
+			DEBUG(0, (version_message_fmt, VERSION_MAJOR, VERSION_MINOR));
+			poptPrintHelp(pc, stdout, 0);
+			exit(1);
+		}
+		/* Every host would write the same local file */
+		for (x = options->xfers; x; x = x->next) {
+			if (x->get && !strstr(x->local, "%h")) {
+				DEBUG(0, ("ERROR: --get %s/%s:%s needs %%h in the local name with --hosts\n",
+				          x->share, x->path, x->local));
+				exit(1);
+			}
+		}
+	} else if (argc_new != 2 || argv_new[0][0] != '/' || argv_new[0][1] != '/'
+	           || (options->client_socket && options->xfers)) {
 		DEBUG(0, (version_message_fmt, VERSION_MAJOR, VERSION_MINOR));
 		poptPrintHelp(pc, stdout, 0);
 		exit(1);
@@ -154,6 +254,15 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 	if (opt_debuglevel)
 		lpcfg_set_cmdline(ldprm_ctx, "log level", opt_debuglevel);
 
+	if (options->client_socket) {
+		/* The daemon authenticates, the front-end only needs the command */
+		options->hostname = argv_new[0] + 2;
+		options->cmd = argv_new[1];
+		options->runas = options->runas ? options->runas : runas_from_file(options->runas_file);
+		options->flags = (flag_system ? SVC_SYSTEM : 0) | (flag_profile ? SVC_PROFILE : 0);
+		return;
+	}
+
 	cred = cli_credentials_init(talloc_autofree_context());
 
 	if (opt_user)
@@ -173,28 +282,17 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 		                                   ? CRED_MUST_USE_KERBEROS
 		                                   : CRED_DONT_USE_KERBEROS);
 
-	if (options->runas == NULL && options->runas_file != NULL) {
-		struct cli_credentials* cred = cli_credentials_init(talloc_autofree_context());
-		cli_credentials_parse_file(cred, options->runas_file, CRED_SPECIFIED);
-		const char *user = cli_credentials_get_username(cred);
-		const char *pass = cli_credentials_get_password(cred);
-		if (user && pass) {
-			char buffer[1024];
-			const char *dom = cli_credentials_get_domain(cred);
-			if (dom) {
-				snprintf(buffer, sizeof(buffer), "%s\\%s%%%s", dom, user, pass);
-			} else {
-				snprintf(buffer, sizeof(buffer), "%s%%%s", user, pass);
-			}
-			buffer[sizeof(buffer)-1] = '\0';
-			options->runas = strdup(buffer);
-		}
-	}
+	if (options->runas == NULL)
+		options->runas = runas_from_file(options->runas_file);
 
 	options->credentials = cred;
 
-	options->hostname = argv_new[0] + 2;
-	options->cmd = argv_new[1];
+	if (options->hosts_file) {
+		options->cmd = argv_new[0];
+	} else if (!options->daemon_socket) {
+		options->hostname = argv_new[0] + 2;
+		options->cmd = argv_new[1];
+	}
 	
 	options->flags = flag_interactive;
 	if (flag_reinstall)
@@ -211,443 +309,277 @@ static void parse_args(int argc, char *argv[], struct program_options *options)
 		options->flags |= SVC_PROFILE;
 	if (flag_convert)
 		options->flags |= SVC_CONVERT;
+	if (flag_smb2)
+		options->flags |= SVC_SMB2;
 }
 
-enum {
-	STATE_OPENING,
-	STATE_GETTING_VERSION,
-	STATE_RUNNING,
-	STATE_CLOSING,
-	STATE_CLOSING_FOR_REINSTALL,
-	STATE_INSTALLING
-};
 
-enum {
-	RET_CODE_CTRL_PIPE_ERROR = 0xf0,
-	RET_CODE_INSTALL_ERROR = 0xf1,
-	RET_CODE_UNKNOWN_ERROR = 0xf2
+/* Outcome of one host, kept for the --summary and --report reports */
+struct host_result {
+	struct fanout_context *fanout;
+	const char *hostname;
+	int return_code;
+	const char *status;
+	struct winexe_stats stats;
+	/* While the host runs */
+	struct winexe_context *c;
 };
 
-struct winexe_context {
-	int state;
-	iconv_t iconv_enc;
-	iconv_t iconv_dec;
+/* Drives all hosts of one winexe invocation on the single ev_ctx loop */
+struct fanout_context {
 	struct program_options *args;
-	struct smbcli_tree *tree;
-	struct async_context *ac_ctrl;
-	struct async_context *ac_in;
-	struct async_context *ac_out;
-	struct async_context *ac_err;
-	struct tevent_timer *ev_timeout;
-	struct tevent_fd *ev_stdin;
-	int return_code;
+	const char **hosts;
+	int num_hosts;
+	int next_host;
+	int running;
+	int finished;
+	int prefix_output;
+	struct host_result *results;
 };
 
-static void on_in_pipe_open(struct winexe_context *c);
-static void on_in_pipe_write(struct winexe_context *c);
-
-static void on_out_pipe_read(struct winexe_context *c, const char *data, int len);
-static void on_err_pipe_read(struct winexe_context *c, const char *data, int len);
+static void fanout_start_next(struct fanout_context *f);
 
-static void on_in_pipe_error(struct winexe_context *c, int func, NTSTATUS status);
-static void on_out_pipe_error(struct winexe_context *c, int func, NTSTATUS status);
-static void on_err_pipe_error(struct winexe_context *c, int func, NTSTATUS status);
-
-static const char *cmd_check(const char *data, const char *cmd, int len)
+static void on_fanout_host_finish(struct host_result *r, struct winexe_context *c)
 {
-	int lcmd = strlen(cmd);
-	if (lcmd >= len)
-		return 0;
-	if (
-		!strncmp(data, cmd, lcmd)
-		&& (data[lcmd] == ' ' || data[lcmd] == '\n')
-	) {
-		return data + lcmd + 1;
-	}
-	return 0;
+	struct fanout_context *f = r->fanout;
+
+	r->return_code = c->return_code;
+	r->status = c->status;
+	r->stats = c->stats;
+	r->c = NULL;
+	--f->running;
+	++f->finished;
+	fanout_start_next(f);
 }
 
-static void catch_alarm(int sig)
+static void host_start(struct fanout_context *f, int index)
 {
-	if (++abort_requested > 1) {
-		if (termios_orig_is_valid)
-			tcsetattr(0, TCSANOW, &termios_orig);
-		exit(1);
+	struct host_result *r = &f->results[index];
+	struct winexe_context *c;
+
+	r->fanout = f;
+	r->hostname = f->hosts[index];
+	c = winexe_context_init(f, ev_ctx, ldprm_ctx, f->args, r->hostname);
+	if (c == NULL) {
+		r->return_code = 1;
+		r->status = "unknown-error";
+		++f->finished;
+		return;
 	}
+
+	++f->running;
+	c->cb_ctx = r;
+	c->cb_finish = (winexe_cb_finish) on_fanout_host_finish;
+	c->prefix_output = f->prefix_output;
+	/* stdin is not shared between hosts */
+	c->stdin_mode = f->prefix_output ? STDIN_NONE : STDIN_LOCAL;
+	r->c = c;
+	winexe_context_start(c, NULL, NULL);
 }
 
-static void timer_handler(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time, void *private_data)
+/*
+  The first SIGINT or SIGTERM aborts every running host, hosts not started
+  yet are skipped; the second one exits at once.
+*/
+static void catch_alarm(int sig)
 {
-	struct winexe_context *c = talloc_get_type(private_data, struct winexe_context);
-	if (abort_requested) {
-		fprintf(stderr, "Aborting...\n");
-		async_write(c->ac_ctrl, "abort\n", 6);
-	} else {
-		c->ev_timeout = tevent_add_timer(c->tree->session->transport->ev, c, timeval_current_ofs(0, 10000), (tevent_timer_handler_t)timer_handler, c);
+	if (++abort_requested > 1) {
+		winexe_restore_terminal();
+		_exit(1);
 	}
 }
 
-static void on_ctrl_pipe_open(struct winexe_context *c)
+static void on_abort_signal(struct tevent_context *ev, struct tevent_signal *se,
+                            int signum, int count, void *siginfo, void *private_data)
 {
-	char *str = (c->args->flags & SVC_CONVERT) ? "get codepage\nget version\n" : "get version\n";
+	struct fanout_context *f = talloc_get_type(private_data, struct fanout_context);
+	int i;
 
-	DEBUG(1, ("CTRL: Sending command: %s", str));
-	c->state = STATE_GETTING_VERSION;
-	async_write(c->ac_ctrl, str, strlen(str));
+	if (abort_requested)
+		return;
+	abort_requested = 1;
+	fprintf(stderr, "Aborting...\n");
+	for (i = 0; i < f->num_hosts; ++i)
+		if (f->results[i].c)
+			winexe_context_abort(f->results[i].c);
+	/* From now on a second signal must work without the event loop */
 	signal(SIGINT, catch_alarm);
 	signal(SIGTERM, catch_alarm);
-	c->ev_timeout = tevent_add_timer(c->tree->session->transport->ev, c, timeval_current_ofs(0, 10000), (tevent_timer_handler_t)timer_handler, c);
-}
-
-static void on_ctrl_pipe_close(struct winexe_context *c)
-{
-	TALLOC_FREE(c->ev_stdin);
-	TALLOC_FREE(c->ev_timeout);
 }
 
-static void on_ctrl_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
+static void fanout_start_next(struct fanout_context *f)
 {
-	DEBUG(1, ("ERROR: on_ctrl_pipe_error - %s\n", nt_errstr(status)));
-	if (func == ASYNC_OPEN_RECV) {
-		if (c->state == STATE_OPENING) {
-			DEBUG(1, ("ERROR: Cannot open control pipe - %s, installing service\n", nt_errstr(status)));
-			c->state = STATE_INSTALLING;
-			return;
+	while (f->running < f->args->parallel && f->next_host < f->num_hosts) {
+		int index = f->next_host++;
+		if (abort_requested) {
+			f->results[index].return_code = RET_CODE_UNKNOWN_ERROR;
+			f->results[index].status = "aborted";
+			++f->finished;
+			continue;
 		}
-		DEBUG(1, ("ERROR: Control pipe - %s, closing\n", nt_errstr(status)));
-		c->state = STATE_CLOSING;
-		c->return_code = RET_CODE_CTRL_PIPE_ERROR;
-	}
-
-	TALLOC_FREE(c->ev_stdin);
-	TALLOC_FREE(c->ev_timeout);
-}
-
-const char *codepage_to_string(int cp)
-{
-	switch (cp) {
-	  case 850: return "CP850";
-	  case 852: return "CP852";
-	  default: return "CP850";
+		host_start(f, index);
 	}
 }
 
-static void on_ctrl_pipe_read(struct winexe_context *c, const char *data, int len)
+/* Reads host names, one per line; empty lines and # comments are skipped */
+static const char **read_host_list(TALLOC_CTX *mem_ctx, const char *fn, int *count)
 {
-	const char *p;
-	DEBUG(1, ("CTRL: Received: %.*s", len, data));
-	if ((p = cmd_check(data, CMD_STD_IO_ERR, len))) {
-		unsigned int npipe = strtoul(p, 0, 16);
-		char *fn;
-		/* Open in */
-		c->ac_in = talloc_zero(c, struct async_context);
-		c->ac_in->tree = c->tree;
-		c->ac_in->cb_ctx = c;
-		c->ac_in->cb_open = (async_cb_open) on_in_pipe_open;
-		c->ac_in->cb_write = (async_cb_write) on_in_pipe_write;
-		c->ac_in->cb_error = (async_cb_error) on_in_pipe_error;
-		fn = talloc_asprintf(c->ac_in, "\\" PIPE_NAME_IN, npipe);
-		async_open(c->ac_in, fn, OPENX_MODE_ACCESS_RDWR);
-		/* Open out */
-		c->ac_out = talloc_zero(c, struct async_context);
-		c->ac_out->tree = c->tree;
-		c->ac_out->cb_ctx = c;
-		c->ac_out->cb_read = (async_cb_read) on_out_pipe_read;
-		c->ac_out->cb_error = (async_cb_error) on_out_pipe_error;
-		fn = talloc_asprintf(c->ac_out, "\\" PIPE_NAME_OUT, npipe);
-		async_open(c->ac_out, fn, OPENX_MODE_ACCESS_RDWR);
-		/* Open err */
-		c->ac_err = talloc_zero(c, struct async_context);
-		c->ac_err->tree = c->tree;
-		c->ac_err->cb_ctx = c;
-		c->ac_err->cb_read = (async_cb_read) on_err_pipe_read;
-		c->ac_err->cb_error = (async_cb_error) on_err_pipe_error;
-		fn = talloc_asprintf(c->ac_err, "\\" PIPE_NAME_ERR, npipe);
-		async_open(c->ac_err, fn, OPENX_MODE_ACCESS_RDWR);
-	} else if ((p = cmd_check(data, CMD_RETURN_CODE, len))) {
-		c->return_code = strtoul(p, 0, 16);
-	} else if ((p = cmd_check(data, "version", len))) {
-		int ver = strtoul(p, 0, 0);
-		if (ver/10 != VERSION/10) {
-			DEBUG(1, ("CTRL: Bad version of service (is %d.%d, expected %d.%d), reinstalling.\n", ver/100, ver%100, VERSION/100, VERSION%100));
-			async_close(c->ac_ctrl);
-			c->state = STATE_CLOSING_FOR_REINSTALL;
-		} else {
-			char *str = "";
-			if (c->args->flags & SVC_PROFILE)
-				str = "set profile 1\n";
-			if (c->args->runas)
-				str = talloc_asprintf(c, "%sset runas %s\nrun %s\n", str, c->args->runas, c->args->cmd);
-			else
-				str = talloc_asprintf(c, "%s%srun %s\n", str, (c->args->flags & SVC_SYSTEM) ? "set system 1\n" : "" , c->args->cmd);
-			DEBUG(1, ("CTRL: Sending command: %s", str));
-			async_write(c->ac_ctrl, str, strlen(str));
-			talloc_free(str);
-			c->state = STATE_RUNNING;
-		}
-	} else if ((p = cmd_check(data, "codepage", len))) {
-		int cp = strtoul(p, 0, 0);
-		const char *cp_str = codepage_to_string(cp);
-		DEBUG(1,("Creating iconv for %s\n", cp_str));
-		c->iconv_enc = iconv_open(cp_str, "UTF-8");
-		c->iconv_dec = iconv_open("UTF-8//TRANSLIT", cp_str);
-	} else if ((p = cmd_check(data, "error", len))) {
-		DEBUG(0, ("Error: %.*s", len, data));
-		if (c->state == STATE_GETTING_VERSION) {
-			DEBUG(0, ("CTRL: Probably old version of service, reinstalling.\n"));
-			async_close(c->ac_ctrl);
-			c->state = STATE_CLOSING_FOR_REINSTALL;
-		}
-	} else {
-		DEBUG(0, ("CTRL: Unknown command: %.*s", len, data));
+	const char **hosts = NULL;
+	char line[1024];
+	FILE *f;
+
+	*count = 0;
+	f = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+	if (!f) {
+		DEBUG(0, ("ERROR: Cannot open host list %s - %s\n", fn, strerror(errno)));
+		return NULL;
 	}
-}
 
-static void on_stdin_read_event(struct tevent_context *ev,
-                                struct tevent_fd *fde,
-                                uint16_t flags,
-                                struct winexe_context *c)
-{
-	char data[256];
-	int len;
-	if ((len = read(0, &data, sizeof(data))) > 0) {
-		if (c->iconv_enc == (iconv_t)(-1)) {
-			async_write(c->ac_in, data, len);
-			return;
-		}
-
-		char *pdata = data;
-		size_t l = len;
-		while (l > 0) {
-			char buf[4096];
-			char *p = buf;
-			size_t left = sizeof(buf);
-
-			size_t nchars = iconv(c->iconv_enc, (char **)&pdata, &l, &p, &left);
-
-			if (p - buf > 0)
-				async_write(c->ac_in, buf, p - buf);
-			if (nchars == -1) {
-				DEBUG(9, ("Could not convert: \"%.*s\", errno=%d\n", (int)l, pdata, errno));
-				async_write(c->ac_in, pdata, l);
-				return;
-			}
-
-		}
-	} else {
-		usleep(10);
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line;
+		char *e;
+
+		while (isspace((unsigned char)*p))
+			++p;
+		if (p[0] == '/' && p[1] == '/')
+			p += 2;
+		for (e = p; *e && !isspace((unsigned char)*e); ++e)
+			;
+		*e = 0;
+		if (!*p || *p == '#')
+			continue;
+		hosts = talloc_realloc(mem_ctx, hosts, const char *, *count + 1);
+		if (!hosts)
+			break;
+		hosts[(*count)++] = talloc_strdup(hosts, p);
 	}
-}
-
-static bool is_fd_pollable(int fd)
-{
-	struct epoll_event ev = {};
-
-	/* dirty check, probably not portable */
-	epoll_ctl(fd, EPOLL_CTL_ADD, fd, &ev);
 
-	return errno != EPERM;
+	if (f != stdin)
+		fclose(f);
+	return hosts;
 }
 
-static void on_in_pipe_open(struct winexe_context *c)
+static void write_summary(struct fanout_context *f, const char *fn)
 {
-	if (is_fd_pollable(0))
-	    c->ev_stdin = tevent_add_fd(c->tree->session->transport->ev,
-	                            c->tree, 0, TEVENT_FD_READ,
-	                            (tevent_fd_handler_t) on_stdin_read_event, c);
-	else
-	    on_stdin_read_event(NULL, NULL, 0, c);
-
-	struct termios termios_tmp;
-	tcgetattr(0, &termios_orig);
-	termios_orig_is_valid = 1;
-	termios_tmp = termios_orig;
-	termios_tmp.c_lflag &= ~ICANON;
-	tcsetattr(0, TCSANOW, &termios_tmp);
-	setbuf(stdin, NULL);
-}
+	FILE *fp;
+	int i;
 
-static void on_in_pipe_write(struct winexe_context *c)
-{
-	if (c->ev_stdin)
+	fp = strcmp(fn, "-") ? fopen(fn, "w") : stdout;
+	if (!fp) {
+		DEBUG(0, ("ERROR: Cannot write summary %s - %s\n", fn, strerror(errno)));
 		return;
-
-	on_stdin_read_event(NULL, NULL, 0, c);
+	}
+	for (i = 0; i < f->num_hosts; ++i)
+		fprintf(fp, "%s\t%d\t%s\n", f->hosts[i], f->results[i].return_code, f->results[i].status);
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
 }
 
-static void write_checking_retval(int fd, const char *data, int len)
+/* {"elapsed_usec": N, "hosts": [...]} with one winexe_stats_json() per host */
+static void write_report(struct fanout_context *f, const char *fn, struct timeval *start)
 {
-	ssize_t r = write(fd, data, len);
-	if (r < len)
-		DEBUG(0, ("ERROR: Failed trying to write %d bytes; value returned was %d\n",
-		      len, (int)r));
-	return;
-}
+	struct timeval now = timeval_current();
+	FILE *fp;
+	int i;
 
-static void write_conv_buf(int fd, struct winexe_context *c, const char *data, int len)
-{
-	if (c->iconv_dec == (iconv_t)(-1)) {
-		write_checking_retval(fd, data, len);
+	fp = strcmp(fn, "-") ? fopen(fn, "w") : stdout;
+	if (!fp) {
+		DEBUG(0, ("ERROR: Cannot write report %s - %s\n", fn, strerror(errno)));
 		return;
 	}
-
-	size_t l = len;
-	while (l > 0) {
-		char buf[4096];
-		char *p = buf;
-		size_t left = sizeof(buf);
-
-		size_t nchars = iconv(c->iconv_dec, (char **)&data, &l, &p, &left);
-
-		write_checking_retval(fd, buf, p - buf);
-		if (nchars == -1) {
-			DEBUG(9, ("Could not convert: \"%.*s\", errno=%d\n", (int)l, data, errno));
-			write_checking_retval(1, data, l);
-			return;
-		}
-
+	fprintf(fp, "{\"elapsed_usec\": %lld, \"hosts\": [", (long long)usec_time_diff(&now, start));
+	for (i = 0; i < f->num_hosts; ++i) {
+		struct host_result *r = &f->results[i];
+		char *js = winexe_stats_json(f, f->hosts[i], r->return_code, r->status, &r->stats);
+		fprintf(fp, "%s\n  %s", i ? "," : "", js ? js : "{}");
+		talloc_free(js);
 	}
-}
-
-static void on_out_pipe_read(struct winexe_context *c, const char *data, int len)
-{
-	write_conv_buf(1, c, data, len);
-}
-
-static void on_in_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
-{
-	async_close(c->ac_in);
-}
-
-static void on_out_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
-{
-	async_close(c->ac_out);
-}
-
-static void on_err_pipe_read(struct winexe_context *c, const char *data, int len)
-{
-	write_conv_buf(2, c, data, len);
-}
-
-static void on_err_pipe_error(struct winexe_context *c, int func, NTSTATUS status)
-{
-	async_close(c->ac_err);
-}
-
-static int exit_program(struct winexe_context *c)
-{
-	if (c->args->flags & SVC_UNINSTALL) {
-		svc_uninstall(ev_ctx, c->args->hostname,
-		              SERVICE_NAME, SERVICE_FILENAME,
-		              c->args->credentials, ldprm_ctx);
-	}
-	if (termios_orig_is_valid)
-		tcsetattr(0, TCSANOW, &termios_orig);
-	return c->return_code;
+	fprintf(fp, "\n]}\n");
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
 }
 
 int main(int argc, char *argv[])
 {
-	NTSTATUS status;
-	struct smbcli_tree *cli_tree;
+	struct timeval start = timeval_current();
 	struct program_options options;
+	struct fanout_context *f;
+	int i, ret;
 
 	dcerpc_init();
 	ldprm_ctx = loadparm_init_global(false);
 	parse_args(argc, argv, &options);
 	DEBUG(1, (version_message_fmt, VERSION_MAJOR, VERSION_MINOR));
-	ev_ctx = TEVENT_CONTEXT_INIT(talloc_autofree_context());
 
-	if (options.flags & SVC_FORCE_UPLOAD) {
-		svc_uninstall(ev_ctx, options.hostname,
-		              SERVICE_NAME, SERVICE_FILENAME,
-		              options.credentials,
-		              ldprm_ctx);
-	}
+	if (options.client_socket)
+		return daemon_client_main(&options);
+
+	ev_ctx = TEVENT_CONTEXT_INIT(talloc_autofree_context());
 
-	if ((options.flags & SVC_FORCE_UPLOAD) || !(options.flags & SVC_IGNORE_INTERACTIVE)) {
-		status = svc_install(ev_ctx, options.hostname,
-		                     SERVICE_NAME, SERVICE_FILENAME,
-		                     winexesvc32_exe, winexesvc32_exe_len,
-		                     winexesvc64_exe, winexesvc64_exe_len,
-		                     options.credentials, ldprm_ctx, options.flags);
-		if (!NT_STATUS_IS_OK(status))
+	if (options.cache_file) {
+		options.cache = host_cache_open(talloc_autofree_context(), options.cache_file, options.cache_ttl);
+		if (!options.cache)
 			return 1;
 	}
 
-	struct smbcli_options smb_options;
-	struct smbcli_session_options session_options;
-
-	lpcfg_smbcli_options(ldprm_ctx, &smb_options);
-	lpcfg_smbcli_session_options(ldprm_ctx, &session_options);
-
-	struct smbcli_state *cli_state;
-	status = smbcli_full_connection(NULL, &cli_state, options.hostname, lpcfg_smb_ports(ldprm_ctx),
-	                                "IPC$", NULL, lpcfg_socket_options(ldprm_ctx), options.credentials,
-	                                lpcfg_resolve_context(ldprm_ctx), ev_ctx,
-	                                &smb_options, &session_options,
-	                                lpcfg_gensec_settings(NULL, ldprm_ctx));
-	if (!NT_STATUS_IS_OK(status)) {
-		if (NT_STATUS_EQUAL(status, NT_STATUS_NO_MEMORY))
-			status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
-		DEBUG(0,
-			("ERROR: Failed to open connection - %s\n",
-			nt_errstr(status)));
+	if (options.daemon_socket)
+		return daemon_main(&options);
+
+	f = talloc_zero(talloc_autofree_context(), struct fanout_context);
+	if (f == NULL) {
+		DEBUG(0, ("ERROR: Failed to allocate struct fanout_context\n"));
 		return 1;
 	}
+	f->args = &options;
+	if (options.hosts_file) {
+		f->hosts = read_host_list(f, options.hosts_file, &f->num_hosts);
+		if (!f->num_hosts) {
+			DEBUG(0, ("ERROR: No hosts to run on\n"));
+			return 1;
+		}
+		f->prefix_output = 1;
+	} else {
+		f->hosts = talloc_array(f, const char *, 1);
+		if (f->hosts == NULL)
+			return 1;
+		f->hosts[0] = options.hostname;
+		f->num_hosts = 1;
+	}
+	f->results = talloc_zero_array(f, struct host_result, f->num_hosts);
+	if (f->results == NULL)
+		return 1;
 
-	cli_tree = cli_state->tree;
-
-	struct winexe_context *c =
-		talloc_zero(NULL, struct winexe_context);
-	if (c == NULL) {
-		DEBUG(0, ("ERROR: Failed to allocate struct winexe_context\n"));
+	if (!tevent_add_signal(ev_ctx, f, SIGINT, 0, on_abort_signal, f)
+	    || !tevent_add_signal(ev_ctx, f, SIGTERM, 0, on_abort_signal, f)) {
+		DEBUG(0, ("ERROR: Cannot catch signals\n"));
 		return 1;
 	}
 
-	c->tree = cli_tree;
-	c->ac_ctrl = talloc_zero(NULL, struct async_context);
-	c->ac_ctrl->tree = cli_tree;
-	c->ac_ctrl->cb_ctx = c;
-	c->ac_ctrl->cb_open = (async_cb_open) on_ctrl_pipe_open;
-	c->ac_ctrl->cb_close = (async_cb_open) on_ctrl_pipe_close;
-	c->ac_ctrl->cb_read = (async_cb_read) on_ctrl_pipe_read;
-	c->ac_ctrl->cb_error = (async_cb_error) on_ctrl_pipe_error;
-	c->args = &options;
-	c->return_code = RET_CODE_UNKNOWN_ERROR;
-	c->iconv_dec = (iconv_t)-1;
-	c->iconv_enc = (iconv_t)-1;
-	c->state = STATE_OPENING;
-	do {
-		async_open(c->ac_ctrl, "\\" PIPE_NAME, OPENX_MODE_ACCESS_RDWR);
-
-		tevent_loop_wait(cli_tree->session->transport->ev);
-
-		if (c->state == STATE_CLOSING_FOR_REINSTALL) {
-			DEBUG(1,("Uninstalling service\n"));
-			svc_uninstall(ev_ctx, c->args->hostname,
-			              SERVICE_NAME, SERVICE_FILENAME,
-			              c->args->credentials,
-			              ldprm_ctx);
-			c->state = STATE_INSTALLING;
+	fanout_start_next(f);
+	while (f->finished < f->num_hosts) {
+		if (tevent_loop_once(ev_ctx) != 0) {
+			DEBUG(0, ("ERROR: Event loop failed - %s\n", strerror(errno)));
+			break;
 		}
+	}
 
-		if (c->state != STATE_INSTALLING)
-			break;
+	winexe_restore_terminal();
 
-		DEBUG(1,("Installing service\n"));
-		status = svc_install(ev_ctx, c->args->hostname,
-		                     SERVICE_NAME, SERVICE_FILENAME,
-		                     winexesvc32_exe, winexesvc32_exe_len,
-		                     winexesvc64_exe, winexesvc64_exe_len,
-		                     c->args->credentials, ldprm_ctx,
-		                     c->args->flags);
-		if (!NT_STATUS_IS_OK(status)) {
-			c->return_code = RET_CODE_INSTALL_ERROR;
-			break;
-		}
-	} while (1);
+	if (options.summary_file)
+		write_summary(f, options.summary_file);
 
-	return exit_program(c);
-}
+	if (options.report_file)
+		write_report(f, options.report_file, &start);
 
+	if (!options.hosts_file)
+		return f->results[0].return_code;
+
+	for (i = 0, ret = 0; i < f->num_hosts; ++i)
+		if (f->results[i].return_code)
+			ret = 1;
+	return ret;
+}
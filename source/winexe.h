@@ -0,0 +1,207 @@
+/*
+  Copyright (C) Andrzej Hajda 2009-2013
+  Contact: andrzej.hajda@wp.pl
+  License: GNU General Public License version 3
+*/
+
+struct program_options {
+	char *hostname;
+	char *cmd;
+	struct cli_credentials *credentials;
+	char *runas;
+	char *runas_file;
+	char *hosts_file;
+	char *summary_file;
+	char *daemon_socket;
+	char *client_socket;
+	char *report_file;
+	char *cache_file;
+	int cache_ttl;
+	/* Opened from cache_file, NULL for none */
+	struct host_cache *cache;
+	int parallel;
+	int idle_timeout;
+	int window;
+	/* zlib level asked of the service for stdout/stderr, 0 - off */
+	int compress;
+	/* --put and --get in command line order */
+	struct xfer_item *xfers;
+	int flags;
+};
+
+enum {
+	STATE_OPENING,
+	STATE_GETTING_VERSION,
+	STATE_READY,
+	STATE_RUNNING,
+	STATE_CLOSING,
+	STATE_CLOSING_FOR_REINSTALL,
+	STATE_INSTALLING
+};
+
+enum {
+	RET_CODE_CTRL_PIPE_ERROR = 0xf0,
+	RET_CODE_INSTALL_ERROR = 0xf1,
+	RET_CODE_UNKNOWN_ERROR = 0xf2,
+	RET_CODE_TRANSFER_ERROR = 0xf3
+};
+
+/* Where the remote command's stdin comes from */
+enum {
+	STDIN_LOCAL,	/* local fd 0 */
+	STDIN_NONE,	/* closed as soon as the pipe is open */
+	STDIN_EXTERNAL	/* fed by winexe_context_input() */
+};
+
+/* Phases of a host in the order they are normally gone through */
+enum {
+	PHASE_CONNECT,		/* name resolution, negotiate, session setup, IPC$ */
+	PHASE_INSTALL,		/* split further in winexe_stats.install */
+	PHASE_CTRL_OPEN,
+	PHASE_VERSION,		/* the get version (and codepage) exchange */
+	PHASE_READY,		/* parked until winexe_context_run() or the puts are done */
+	PHASE_LAUNCH,		/* run sent, until the std pipes are announced */
+	PHASE_RUN,		/* until the return code */
+	PHASE_DRAIN,		/* until stdout and stderr are closed */
+	PHASE_UNINSTALL,	/* --uninstall, after the command */
+	PHASE_MAX
+};
+
+enum {
+	STATS_PIPE_CTRL,
+	STATS_PIPE_IN,
+	STATS_PIPE_OUT,
+	STATS_PIPE_ERR,
+	STATS_PIPE_MAX
+};
+
+/* Per host timings and counters, phases entered more than once add up */
+struct winexe_stats {
+	int64_t usec[PHASE_MAX];
+	int64_t total_usec;
+	int cache_hit;
+	struct svc_install_stats install;
+	struct async_stats pipes[STATS_PIPE_MAX];
+	/* Bytes out of the decompressor, 0 if the output was not compressed */
+	uint64_t inflated[STATS_PIPE_MAX];
+	/* --put and --get, the puts overlap the phases up to ready */
+	struct xfer_stats put;
+	struct xfer_stats get;
+/* Private */
+	int phase;
+	struct timeval start;
+	struct timeval mark;
+};
+
+struct winexe_context;
+
+/* Longest multibyte sequence held back between two reads with --convert */
+#define CONV_CARRY_MAX 8
+
+typedef void (*winexe_cb_output) (void *ctx, int fd, const char *data, int len);
+typedef void (*winexe_cb_ready) (void *ctx, struct winexe_context *c);
+typedef void (*winexe_cb_finish) (void *ctx, struct winexe_context *c);
+typedef void (*winexe_cb_input) (void *ctx, struct winexe_context *c);
+
+struct winexe_context {
+/* Public - set by the owner between winexe_context_init() and _start() */
+	struct program_options *args;
+	const char *hostname;
+	void *cb_ctx;
+	/* NULL writes to the local fd */
+	winexe_cb_output cb_output;
+	/* If set the context parks in STATE_READY until winexe_context_run() */
+	winexe_cb_ready cb_ready;
+	/* Called once, just before the context is freed; must not free it */
+	winexe_cb_finish cb_finish;
+	/* STDIN_EXTERNAL: input was written and winexe_context_input_full()
+	   may have turned false */
+	winexe_cb_input cb_input;
+	int stdin_mode;
+	int prefix_output;
+/* Result - valid in cb_finish */
+	int return_code;
+	const char *status;
+	struct winexe_stats stats;
+/* Private */
+	struct tevent_context *ev;
+	struct loadparm_context *lp_ctx;
+	int state;
+	iconv_t iconv_enc;
+	iconv_t iconv_dec;
+	struct smb_composite_connect *io_connect;
+	struct smbcli_tree *tree;
+	struct smb2_tree *tree2;
+	struct async_context *ac_ctrl;
+	struct async_context *ac_in;
+	struct async_context *ac_out;
+	struct async_context *ac_err;
+	struct tevent_fd *ev_stdin;
+	char *input;
+	int input_len;
+	int input_eof;
+	int in_open;
+	int output_paused;
+	int open_pipes;
+	int ctrl_finished;
+	int install_attempts;
+	int finished;
+	/* The --put or --get in flight and whether run waits for the puts */
+	struct tevent_req *xfer_req;
+	int xfer_get;
+	int run_waiting;
+	/* Partial lines held back with --hosts, not nul terminated */
+	char *out_line;
+	char *err_line;
+	int out_line_len;
+	int err_line_len;
+	/* Incomplete multibyte sequence at the end of the last stdout/stderr read */
+	char conv_carry[2][CONV_CARRY_MAX];
+	int conv_carry_len[2];
+	char *ctrl_line;
+	int ctrl_line_len;
+	/* Set if the service compresses stdout/stderr of this run */
+	struct z_stream_s *z_out;
+	struct z_stream_s *z_err;
+	int service_version;
+	const char *codepage;
+	struct host_cache_entry cached;
+	int cache_hit;
+	/* Jobs share the control pipe of their owner */
+	struct winexe_context *owner;
+	struct winexe_context *jobs;
+	struct winexe_context *next_job;
+	unsigned int job_id;
+	unsigned int next_job_id;
+};
+
+/* libwinexe.c */
+struct winexe_context *winexe_context_init(TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+                                           struct loadparm_context *lp_ctx,
+                                           struct program_options *args, const char *hostname);
+void winexe_context_start(struct winexe_context *c, struct smbcli_tree *tree, struct smb2_tree *tree2);
+struct winexe_context *winexe_job_init(TALLOC_CTX *mem_ctx, struct winexe_context *owner, struct program_options *args);
+void winexe_context_run(struct winexe_context *c);
+void winexe_context_input(struct winexe_context *c, const char *data, int len);
+int winexe_context_input_full(struct winexe_context *c);
+void winexe_context_pause_output(struct winexe_context *c, int pause);
+void winexe_context_abort(struct winexe_context *c);
+void winexe_restore_terminal(void);
+char *winexe_stats_json(TALLOC_CTX *mem_ctx, const char *hostname, int return_code,
+                        const char *status, const struct winexe_stats *stats);
+
+struct tevent_req *winexe_run_send(TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+                                   struct loadparm_context *lp_ctx,
+                                   struct program_options *args, const char *hostname,
+                                   winexe_cb_output cb_output, void *cb_ctx);
+void winexe_run_input(struct tevent_req *req, const char *data, int len);
+void winexe_run_abort(struct tevent_req *req);
+NTSTATUS winexe_run_recv(struct tevent_req *req, int *return_code, const char **status,
+                         struct winexe_stats *stats);
+
+/* winexe.c and daemon.c - the winexe program */
+extern struct loadparm_context *ldprm_ctx;
+extern struct tevent_context *ev_ctx;
+
+int daemon_main(struct program_options *options);
+int daemon_client_main(struct program_options *options);
@@ -9,10 +9,17 @@
  */
 
 #define VERSION_MAJOR 1
-#define VERSION_MINOR 1
+#define VERSION_MINOR 3
 
 #define VERSION ((VERSION_MAJOR * 100) + VERSION_MINOR)
 
+/* First service version accepting "job <id> run|abort" */
+#define JOBS_MIN_VERSION 102
+
+/* First service version accepting "set compress <level>", which makes
+   stdout and stderr of the following runs zlib streams */
+#define COMPRESS_MIN_VERSION 103
+
 #define SERVICE_NAME "winexesvc"
 
 #define PIPE_NAME "ahexec"
@@ -13,10 +13,19 @@
 #include <stdarg.h>
 #include <stdlib.h>
 
+#include <zlib.h>
+
 #include "winexesvc.h"
 
 #define BUFSIZE 256
 
+/* Std pipes carry bulk output, a 256 byte buffer would cap every client read */
+#define STD_BUFSIZE 0x10000
+
+/* How long the output of an exited process may take to be compressed and
+   written before the return code is sent anyway */
+#define RELAY_DRAIN_MSEC 5000
+
 #if 0
 #define dbg(arg...) \
 ({\
@@ -102,8 +111,25 @@ static int CreatePipesSA()
 typedef struct {
 	HANDLE h;
 	OVERLAPPED o;
+	/* Writes come from the connection and its job threads */
+	OVERLAPPED ow;
+	CRITICAL_SECTION lock;
+	LONG refs;
 } OV_HANDLE;
 
+static void pipe_release(OV_HANDLE *pipe)
+{
+	if (InterlockedDecrement(&pipe->refs))
+		return;
+	FlushFileBuffers(pipe->h);
+	DisconnectNamedPipe(pipe->h);
+	CloseHandle(pipe->h);
+	CloseHandle(pipe->o.hEvent);
+	CloseHandle(pipe->ow.hEvent);
+	DeleteCriticalSection(&pipe->lock);
+	free(pipe);
+}
+
 static int hgets(char *str, int n, OV_HANDLE *pipe)
 {
 	DWORD res;
@@ -126,30 +152,57 @@ finish:
 
 static int hprintf(OV_HANDLE *pipe, const char *fmt, ...)
 {
-	int res;
+	int res = 0;
 	char buf[1024];
 	va_list ap;
 	va_start(ap, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
-	if (!WriteFile(pipe->h, buf, strlen(buf), NULL, &pipe->o) && GetLastError() == ERROR_IO_PENDING)
-		GetOverlappedResult(pipe->h, &pipe->o, (LPDWORD)&res, TRUE);
+	EnterCriticalSection(&pipe->lock);
+	if (!WriteFile(pipe->h, buf, strlen(buf), NULL, &pipe->ow) && GetLastError() == ERROR_IO_PENDING)
+		GetOverlappedResult(pipe->h, &pipe->ow, (LPDWORD)&res, TRUE);
 	FlushFileBuffers(pipe->h);
+	LeaveCriticalSection(&pipe->lock);
 	return res;
 }
 
+/* Concurrent jobs on one control connection */
+#define MAX_JOBS 32
+
+struct connection_context;
+
+/* One process started by "run" or "job <id> run" */
 typedef struct {
 	OV_HANDLE *pipe;
-	const char *cmd;
+	struct connection_context *conn;
+	unsigned int id;
+	/* "job <id> " for jobs, empty for the plain run */
+	char prefix[24];
+	char *cmdline;
 	HANDLE pin;
 	HANDLE pout;
 	HANDLE perr;
 	HANDLE token;
+	/* NULL - the plain run is aborted by any control pipe input */
+	HANDLE abort_event;
+	int implevel;
+	int system;
+	int profile;
+	/* zlib level of stdout/stderr, 0 - the child writes the pipes itself */
+	int compress;
+	char *runas;
+} job_context;
+
+typedef struct connection_context {
+	OV_HANDLE *pipe;
+	const char *cmd;
 	int implevel;
 	int system;
 	int profile;
+	int compress;
 	char *runas;
-	int conn_number;
+	/* Guarded by pipe->lock, a job clears its slot when it ends */
+	job_context *jobs[MAX_JOBS];
 } connection_context;
 
 typedef int CMD_FUNC(connection_context *);
@@ -165,6 +218,7 @@ static int cmd_set(connection_context *c)
 	static const char* var_implevel = "implevel";
 	static const char* var_runas = "runas";
 	static const char* var_profile = "profile";
+	static const char* var_compress = "compress";
 	char *cmdline;
 	int res = 0;
 
@@ -180,8 +234,14 @@ static int cmd_set(connection_context *c)
 		c->implevel = atoi(cmdline + l + 1);
 	} else if ((strstr(cmdline, var_profile) == cmdline) && (cmdline[l = strlen(var_profile)] == ' ')) {
 		c->profile = atoi(cmdline + l + 1);
+	} else if ((strstr(cmdline, var_compress) == cmdline) && (cmdline[l = strlen(var_compress)] == ' ')) {
+		c->compress = atoi(cmdline + l + 1);
+		if (c->compress < 0 || c->compress > Z_BEST_COMPRESSION)
+			c->compress = Z_DEFAULT_COMPRESSION;
 	} else if ((strstr(cmdline, var_runas) == cmdline) && (cmdline[l = strlen(var_runas)] == ' ')) {
-		c->runas = strdup(cmdline + l + 1);
+		/* An empty value clears runas set for a previous job */
+		free(c->runas);
+		c->runas = cmdline[l + 1] ? strdup(cmdline + l + 1) : NULL;
 	} else {
 		hprintf(c->pipe, "error Unknown commad (%s)\n", c->cmd);
 		goto finish;
@@ -245,52 +305,52 @@ static int prepare_credentials(char *str, credentials *crd)
 	return 1;
 }
 
-static int get_token(connection_context *c)
+static int get_token(job_context *j)
 {
 	int res = 0;
 	int wres;
 	HANDLE token;
 
-	if (c->runas) {
+	if (j->runas) {
 		credentials crd;
-		if (!prepare_credentials(c->runas, &crd)) {
-			hprintf(c->pipe, "error Incorrect runas credentials\n");
+		if (!prepare_credentials(j->runas, &crd)) {
+			hprintf(j->pipe, "%serror Incorrect runas credentials\n", j->prefix);
 			goto finish;
 		}
-		wres = LogonUser(crd.user, crd.domain, crd.password, LOGON32_LOGON_INTERACTIVE, LOGON32_PROVIDER_DEFAULT, &c->token);
+		wres = LogonUser(crd.user, crd.domain, crd.password, LOGON32_LOGON_INTERACTIVE, LOGON32_PROVIDER_DEFAULT, &j->token);
 		if (!wres) {
-			hprintf(c->pipe, "error Cannot LogonUser(%s,%s,%s) %d\n",
-			        crd.user, crd.domain, crd.password, GetLastError());
+			hprintf(j->pipe, "%serror Cannot LogonUser(%s,%s,%s) %d\n",
+			        j->prefix, crd.user, crd.domain, crd.password, GetLastError());
 			goto finish;
 		}
 		res = 1;
 		goto finish;
-	} else if (c->system) {
+	} else if (j->system) {
 		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ALL_ACCESS, &token)) {
-			hprintf(c->pipe, "error Cannot OpenProcessToken %d\n", GetLastError());
+			hprintf(j->pipe, "%serror Cannot OpenProcessToken %d\n", j->prefix, GetLastError());
 			goto finish;
 		}
 	} else {
-		if (!ImpersonateNamedPipeClient(c->pipe->h)) {
-			hprintf(c->pipe, "error Cannot ImpersonateNamedPipeClient %d\n", GetLastError());
+		if (!ImpersonateNamedPipeClient(j->pipe->h)) {
+			hprintf(j->pipe, "%serror Cannot ImpersonateNamedPipeClient %d\n", j->prefix, GetLastError());
 			goto finish;
 		}
 		if (!OpenThreadToken(GetCurrentThread(), TOKEN_ALL_ACCESS, FALSE, &token)) {
-			hprintf(c->pipe, "error Cannot OpenThreadToken %d\n", GetLastError());
+			hprintf(j->pipe, "%serror Cannot OpenThreadToken %d\n", j->prefix, GetLastError());
 			goto finishRevertToSelf;
 		}
 	}
-	if (!DuplicateTokenEx(token, MAXIMUM_ALLOWED, 0, c->implevel, TokenPrimary, &c->token)) {
-		hprintf(c->pipe, "error Cannot Duplicate Token %d\n", GetLastError());
+	if (!DuplicateTokenEx(token, MAXIMUM_ALLOWED, 0, j->implevel, TokenPrimary, &j->token)) {
+		hprintf(j->pipe, "%serror Cannot Duplicate Token %d\n", j->prefix, GetLastError());
 		goto finishCloseToken;
 	}
 	res = 1;
 finishCloseToken:
 	CloseHandle(token);
 finishRevertToSelf:
-	if (!c->system) {
+	if (!j->system) {
 		if (!RevertToSelf()) {
-			hprintf(c->pipe, "error Cannot RevertToSelf %d\n", GetLastError());
+			hprintf(j->pipe, "%serror Cannot RevertToSelf %d\n", j->prefix, GetLastError());
 			res = 0;
 		}
 	}
@@ -298,7 +358,7 @@ finish:
 	return res;
 }
 
-static int load_user_profile(connection_context *c)
+static int load_user_profile(job_context *j)
 {
 	PROFILEINFO pi = { .dwSize = sizeof(PROFILEINFO) };
 	DWORD ulen = 256;
@@ -307,73 +367,164 @@ static int load_user_profile(connection_context *c)
 	GetUserName(username, &ulen);
 	pi.lpUserName = username;
 
-	return LoadUserProfile(c->token, &pi);
+	return LoadUserProfile(j->token, &pi);
 }
 
-static int cmd_run(connection_context *c)
+/*
+  With "set compress" the child writes stdout/stderr to anonymous pipes and
+  a relay thread per stream sends them on as one zlib stream, flushed after
+  every read so output is not held back, and finished at end of file.
+  The relay owns its handles and frees itself; once run_job() disconnects
+  the std pipe its writes fail, so a grandchild keeping the anonymous pipe
+  open cannot make it outlive the job for long.
+*/
+typedef struct {
+	HANDLE src;
+	HANDLE dst;
+	int level;
+} RELAY;
+
+static int relay_write(RELAY *r, z_stream *z, int flush)
 {
-	char buf[256];
-	int res = 0;
-	char *cmdline;
-	DWORD pipe_nr;
+	unsigned char out[STD_BUFSIZE];
+	DWORD n;
+	int res;
 
-	cmdline = strchr(c->cmd, ' ');
-	if (!cmdline) {
+	do {
+		z->next_out = out;
+		z->avail_out = sizeof(out);
+		res = deflate(z, flush);
+		if (res == Z_STREAM_ERROR)
+			return 0;
+		if (z->avail_out < sizeof(out)
+		    && !WriteFile(r->dst, out, sizeof(out) - z->avail_out, &n, NULL))
+			return 0;
+	} while (z->avail_out == 0);
+	return 1;
+}
+
+static DWORD WINAPI relay_thread(LPVOID lpParameter)
+{
+	RELAY *r = (RELAY *) lpParameter;
+	unsigned char in[STD_BUFSIZE];
+	z_stream z;
+	DWORD n;
+
+	ZeroMemory(&z, sizeof(z));
+	if (deflateInit(&z, r->level) != Z_OK) {
+		dbg("deflateInit failed\n");
 		goto finish;
 	}
-	++cmdline;
+	while (ReadFile(r->src, in, sizeof(in), &n, NULL) && n) {
+		z.next_in = in;
+		z.avail_in = n;
+		if (!relay_write(r, &z, Z_SYNC_FLUSH))
+			goto finishEnd;
+	}
+	relay_write(r, &z, Z_FINISH);
+finishEnd:
+	deflateEnd(&z);
+finish:
+	CloseHandle(r->src);
+	CloseHandle(r->dst);
+	free(r);
+	return 0;
+}
 
-	if (!get_token(c))
-		return 0;
+/*
+  Creates the pipe the child writes to through *child and starts a relay
+  from it to dst; returns the relay thread, NULL on failure.
+*/
+static HANDLE relay_start(HANDLE dst, int level, HANDLE *child)
+{
+	RELAY *r;
+	HANDLE th;
+
+	r = calloc(1, sizeof(RELAY));
+	if (!r)
+		return NULL;
+	r->level = level;
+	if (!CreatePipe(&r->src, child, NULL, STD_BUFSIZE))
+		goto failFree;
+	if (!DuplicateHandle(GetCurrentProcess(), dst, GetCurrentProcess(), &r->dst,
+	                     0, FALSE, DUPLICATE_SAME_ACCESS))
+		goto failClosePipe;
+	th = CreateThread(NULL, 0, relay_thread, (LPVOID) r, 0, NULL);
+	if (th)
+		return th;
+	CloseHandle(r->dst);
+failClosePipe:
+	CloseHandle(*child);
+	CloseHandle(r->src);
+failFree:
+	free(r);
+	return NULL;
+}
+
+/* Std pipe names must be unique among all jobs of all connections */
+static LONG std_pipe_number = 0;
+
+/*
+  Processes are created with handle inheritance on, so the std handles of
+  a job are inheritable only while holding this, or the processes of
+  concurrent jobs would inherit them too and keep the pipes open
+*/
+static CRITICAL_SECTION spawn_lock;
 
-	pipe_nr = (GetCurrentProcessId() << 16) + (DWORD) c->conn_number;
+/* Runs the job's process to completion, consumes j->token */
+static void run_job(job_context *j)
+{
+	char buf[256];
+	DWORD pipe_nr;
+
+	pipe_nr = (GetCurrentProcessId() << 16) + (DWORD) (InterlockedIncrement(&std_pipe_number) & 0xFFFF);
 
 	sprintf(buf, "\\\\.\\pipe\\" PIPE_NAME_IN, (unsigned int) pipe_nr);
-	c->pin = CreateNamedPipe(buf,
+	j->pin = CreateNamedPipe(buf,
 	                         PIPE_ACCESS_DUPLEX,
 	                         PIPE_WAIT,
 	                         1,
-	                         BUFSIZE,
-	                         BUFSIZE,
+	                         STD_BUFSIZE,
+	                         STD_BUFSIZE,
 	                         NMPWAIT_USE_DEFAULT_WAIT,
 	                         &sa);
-	if (c->pin == INVALID_HANDLE_VALUE) {
-		hprintf(c->pipe, "error Cannot create in pipe(%s), error 0x%08X\n", buf, GetLastError());
+	if (j->pin == INVALID_HANDLE_VALUE) {
+		hprintf(j->pipe, "%serror Cannot create in pipe(%s), error 0x%08X\n", j->prefix, buf, GetLastError());
 		goto finishCloseToken;
 	}
 
 	sprintf(buf, "\\\\.\\pipe\\" PIPE_NAME_OUT, (unsigned int) pipe_nr);
-	c->pout = CreateNamedPipe(buf,
+	j->pout = CreateNamedPipe(buf,
 	                          PIPE_ACCESS_DUPLEX,
 	                          PIPE_WAIT,
 	                          1,
-	                          BUFSIZE,
-	                          BUFSIZE,
+	                          STD_BUFSIZE,
+	                          STD_BUFSIZE,
 	                          NMPWAIT_USE_DEFAULT_WAIT,
 	                          &sa);
-	if (c->pout == INVALID_HANDLE_VALUE) {
-		hprintf(c->pipe, "error Cannot create out pipe(%s), error 0x%08X\n", buf, GetLastError());
+	if (j->pout == INVALID_HANDLE_VALUE) {
+		hprintf(j->pipe, "%serror Cannot create out pipe(%s), error 0x%08X\n", j->prefix, buf, GetLastError());
 		goto finishClosePin;
 	}
 
 	sprintf(buf, "\\\\.\\pipe\\" PIPE_NAME_ERR, (unsigned int) pipe_nr);
-	c->perr = CreateNamedPipe(buf,
+	j->perr = CreateNamedPipe(buf,
 	                          PIPE_ACCESS_DUPLEX,
 	                          PIPE_WAIT,
 	                          1,
-	                          BUFSIZE,
-	                          BUFSIZE,
+	                          STD_BUFSIZE,
+	                          STD_BUFSIZE,
 	                          NMPWAIT_USE_DEFAULT_WAIT,
 	                          &sa);
-	if (c->perr == INVALID_HANDLE_VALUE) {
-		hprintf(c->pipe, "error Cannot create err pipe(%s), error 0x%08x\n", buf, GetLastError());
+	if (j->perr == INVALID_HANDLE_VALUE) {
+		hprintf(j->pipe, "%serror Cannot create err pipe(%s), error 0x%08x\n", j->prefix, buf, GetLastError());
 		goto finishClosePout;
 	}
 
 	/* Send handle to client (it will use it to connect pipes) */
-	hprintf(c->pipe, CMD_STD_IO_ERR " %08X\n", pipe_nr);
+	hprintf(j->pipe, "%s" CMD_STD_IO_ERR " %08X\n", j->prefix, pipe_nr);
 
-	HANDLE ph[] = { c->pin, c->pout, c->perr };
+	HANDLE ph[] = { j->pin, j->pout, j->perr };
 	int i;
 
 	for (i = 0; i < 3; ++i) {
@@ -381,19 +532,33 @@ static int cmd_run(connection_context *c)
 			continue;
 		int err = GetLastError();
 		if (err != ERROR_PIPE_CONNECTED) {
-			hprintf(c->pipe, "error ConnectNamedPipe(pin) %d\n", err);
+			hprintf(j->pipe, "%serror ConnectNamedPipe(pin) %d\n", j->prefix, err);
 			while (--i >= 0)
 				DisconnectNamedPipe(ph[i]);
 			goto finishClosePerr;
 		}
 	}
 
-	SetHandleInformation(c->pin, HANDLE_FLAG_INHERIT, 1);
-	SetHandleInformation(c->pout, HANDLE_FLAG_INHERIT, 1);
-	SetHandleInformation(c->perr, HANDLE_FLAG_INHERIT, 1);
+	HANDLE relay[2] = { NULL, NULL };
+	HANDLE cout = j->pout, cerr = j->perr;
+
+	if (j->compress) {
+		relay[0] = relay_start(j->pout, j->compress, &cout);
+		if (relay[0])
+			relay[1] = relay_start(j->perr, j->compress, &cerr);
+		if (!relay[1]) {
+			hprintf(j->pipe, "%serror Cannot start output relay %d\n", j->prefix, GetLastError());
+			if (relay[0]) {
+				CloseHandle(cout);
+				WaitForSingleObject(relay[0], INFINITE);
+				CloseHandle(relay[0]);
+			}
+			goto finishDisconnect;
+		}
+	}
 
-	if (c->profile)
-		load_user_profile(c);
+	if (j->profile)
+		load_user_profile(j);
 
 	PROCESS_INFORMATION pi;
 	ZeroMemory(&pi, sizeof(PROCESS_INFORMATION));
@@ -401,15 +566,19 @@ static int cmd_run(connection_context *c)
 	STARTUPINFO si;
 	ZeroMemory(&si, sizeof(STARTUPINFO));
 	si.cb = sizeof(STARTUPINFO);
-	si.hStdInput = c->pin;
-	si.hStdOutput = c->pout;
-	si.hStdError = c->perr;
+	si.hStdInput = j->pin;
+	si.hStdOutput = cout;
+	si.hStdError = cerr;
 	si.dwFlags |= STARTF_USESTDHANDLES;
 
-	if (CreateProcessAsUser(
-		c->token,
+	EnterCriticalSection(&spawn_lock);
+	SetHandleInformation(j->pin, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	SetHandleInformation(cout, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	SetHandleInformation(cerr, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	BOOL created = CreateProcessAsUser(
+		j->token,
 		NULL, 
-		cmdline,	/* command line */
+		j->cmdline,	/* command line */
 		NULL,	/* process security attributes */
 		NULL,	/* primary thread security attributes */
 		TRUE,	/* handles are inherited */
@@ -417,77 +586,262 @@ static int cmd_run(connection_context *c)
 		NULL,	/* use parent's environment */
 		NULL,	/* use parent's current directory */
 		&si,	/* STARTUPINFO pointer */
-		&pi) 	/* receives PROCESS_INFORMATION */
-	) {
-		HANDLE hlist[2] = {c->pipe->o.hEvent, pi.hProcess};
+		&pi); 	/* receives PROCESS_INFORMATION */
+	DWORD create_error = GetLastError();
+	SetHandleInformation(j->pin, HANDLE_FLAG_INHERIT, 0);
+	SetHandleInformation(cout, HANDLE_FLAG_INHERIT, 0);
+	SetHandleInformation(cerr, HANDLE_FLAG_INHERIT, 0);
+	LeaveCriticalSection(&spawn_lock);
+
+	if (created) {
+		HANDLE hlist[2] = {j->abort_event, pi.hProcess};
 		DWORD ec;
 		char str[1];
-		
-		if (!ResetEvent(c->pipe->o.hEvent))
-			dbg("ResetEvent error - %lu\n", GetLastError());
-		if (!ReadFile(c->pipe->h, str, 1, NULL, &c->pipe->o) && GetLastError() != ERROR_IO_PENDING)
-			dbg("ReadFile(control_pipe) error - %lu\n", GetLastError());
+
+		/* Only the child may keep the relays' pipes open */
+		if (relay[0]) {
+			CloseHandle(cout);
+			CloseHandle(cerr);
+		}
+
+		if (!j->abort_event) {
+			hlist[0] = j->pipe->o.hEvent;
+			if (!ResetEvent(j->pipe->o.hEvent))
+				dbg("ResetEvent error - %lu\n", GetLastError());
+			if (!ReadFile(j->pipe->h, str, 1, NULL, &j->pipe->o) && GetLastError() != ERROR_IO_PENDING)
+				dbg("ReadFile(control_pipe) error - %lu\n", GetLastError());
+		}
 		ec = WaitForMultipleObjects(2, hlist, FALSE, INFINITE);
 		dbg("WaitForMultipleObjects=%lu\n", ec - WAIT_OBJECT_0);
 		if (ec != WAIT_OBJECT_0)
 			GetExitCodeProcess(pi.hProcess, &ec);
 		else
 			TerminateProcess(pi.hProcess, ec = 0x1234);
-		FlushFileBuffers(c->pout);
-		FlushFileBuffers(c->perr);
+		if (relay[0])
+			WaitForMultipleObjects(2, relay, TRUE, RELAY_DRAIN_MSEC);
+		FlushFileBuffers(j->pout);
+		FlushFileBuffers(j->perr);
 		CloseHandle(pi.hProcess);
 		CloseHandle(pi.hThread);
-		hprintf(c->pipe, CMD_RETURN_CODE " %08X\n", ec);
+		hprintf(j->pipe, "%s" CMD_RETURN_CODE " %08X\n", j->prefix, ec);
 	} else {
-		hprintf(c->pipe, "error Creating process(%s) %d\n", cmdline, GetLastError());
+		hprintf(j->pipe, "%serror Creating process(%s) %d\n", j->prefix, j->cmdline, (int) create_error);
+		if (relay[0]) {
+			CloseHandle(cout);
+			CloseHandle(cerr);
+		}
+	}
+	if (relay[0]) {
+		CloseHandle(relay[0]);
+		CloseHandle(relay[1]);
 	}
 
-	DisconnectNamedPipe(c->perr);
-	DisconnectNamedPipe(c->pout);
-	DisconnectNamedPipe(c->pin);
+finishDisconnect:
+	DisconnectNamedPipe(j->perr);
+	DisconnectNamedPipe(j->pout);
+	DisconnectNamedPipe(j->pin);
 finishClosePerr:
-	CloseHandle(c->perr);
+	CloseHandle(j->perr);
 finishClosePout:
-	CloseHandle(c->pout);
+	CloseHandle(j->pout);
 finishClosePin:
-	CloseHandle(c->pin);
+	CloseHandle(j->pin);
 finishCloseToken:
-	CloseHandle(c->token);
-finish:
-	return res;
+	CloseHandle(j->token);
+}
+
+static void job_settings(job_context *j, connection_context *c)
+{
+	j->pipe = c->pipe;
+	j->implevel = c->implevel;
+	j->system = c->system;
+	j->profile = c->profile;
+	j->compress = c->compress;
+	/* prepare_credentials() modifies the string */
+	j->runas = c->runas ? strdup(c->runas) : NULL;
+}
+
+static void free_job(job_context *j)
+{
+	if (j->abort_event)
+		CloseHandle(j->abort_event);
+	free(j->runas);
+	free(j->cmdline);
+	free(j);
+}
+
+static int cmd_run(connection_context *c)
+{
+	job_context _j, *j = &_j;
+	char *cmdline;
+
+	cmdline = strchr(c->cmd, ' ');
+	if (!cmdline)
+		return 0;
+	ZeroMemory(j, sizeof(job_context));
+	job_settings(j, c);
+	j->cmdline = cmdline + 1;
+	if (get_token(j))
+		run_job(j);
+	free(j->runas);
+	return 0;
+}
+
+static DWORD WINAPI job_thread(LPVOID lpParameter)
+{
+	job_context *j = (job_context *) lpParameter;
+	OV_HANDLE *pipe = j->pipe;
+
+	run_job(j);
+
+	EnterCriticalSection(&pipe->lock);
+	if (j->conn) {
+		int i;
+		for (i = 0; i < MAX_JOBS; ++i)
+			if (j->conn->jobs[i] == j)
+				j->conn->jobs[i] = NULL;
+	}
+	LeaveCriticalSection(&pipe->lock);
+	free_job(j);
+	pipe_release(pipe);
+	return 0;
+}
+
+/* Call with pipe->lock held */
+static job_context *find_job(connection_context *c, unsigned int id, int *free_slot)
+{
+	job_context *found = NULL;
+	int i;
+
+	if (free_slot)
+		*free_slot = -1;
+	for (i = 0; i < MAX_JOBS; ++i) {
+		if (!c->jobs[i]) {
+			if (free_slot && *free_slot < 0)
+				*free_slot = i;
+		} else if (c->jobs[i]->id == id) {
+			found = c->jobs[i];
+		}
+	}
+	return found;
+}
+
+/*
+  "job <id> run <cmd>" starts cmd in its own thread and returns at once, so
+  one connection can run many processes; their messages are prefixed with
+  "job <id> " and end with either return_code or error.
+  "job <id> abort" terminates the job's process.
+*/
+static int cmd_job(connection_context *c)
+{
+	job_context *j;
+	char *verb;
+	unsigned int id;
+	int slot;
+
+	verb = strchr(c->cmd, ' ');
+	if (!verb) {
+		hprintf(c->pipe, "error Missing job id (%s)\n", c->cmd);
+		return 1;
+	}
+	id = strtoul(verb + 1, &verb, 10);
+	if (*verb != ' ') {
+		hprintf(c->pipe, "error Missing job command (%s)\n", c->cmd);
+		return 1;
+	}
+	++verb;
+
+	EnterCriticalSection(&c->pipe->lock);
+	j = find_job(c, id, &slot);
+	if (!strcmp(verb, "abort")) {
+		if (j)
+			SetEvent(j->abort_event);
+		LeaveCriticalSection(&c->pipe->lock);
+		return 1;
+	}
+	LeaveCriticalSection(&c->pipe->lock);
+
+	if (strstr(verb, "run ") != verb) {
+		hprintf(c->pipe, "job %u error Unknown job command (%s)\n", id, verb);
+		return 1;
+	}
+	if (j) {
+		hprintf(c->pipe, "job %u error Job id in use\n", id);
+		return 1;
+	}
+	if (slot < 0) {
+		hprintf(c->pipe, "job %u error Too many jobs\n", id);
+		return 1;
+	}
+
+	j = calloc(1, sizeof(job_context));
+	if (!j) {
+		hprintf(c->pipe, "job %u error Out of memory\n", id);
+		return 1;
+	}
+	job_settings(j, c);
+	j->id = id;
+	sprintf(j->prefix, "job %u ", id);
+	j->cmdline = strdup(verb + 4);
+	j->abort_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!j->cmdline || !j->abort_event) {
+		hprintf(c->pipe, "job %u error Out of memory\n", id);
+		free_job(j);
+		return 1;
+	}
+	/* The token is taken here, impersonation needs the connection's pipe */
+	if (!get_token(j)) {
+		free_job(j);
+		return 1;
+	}
+
+	j->conn = c;
+	InterlockedIncrement(&c->pipe->refs);
+	EnterCriticalSection(&c->pipe->lock);
+	c->jobs[slot] = j;
+	LeaveCriticalSection(&c->pipe->lock);
+	HANDLE th = CreateThread(NULL, 0, job_thread, (LPVOID) j, 0, NULL);
+	if (!th) {
+		EnterCriticalSection(&c->pipe->lock);
+		c->jobs[slot] = NULL;
+		LeaveCriticalSection(&c->pipe->lock);
+		hprintf(c->pipe, "job %u error Cannot create thread %d\n", id, GetLastError());
+		CloseHandle(j->token);
+		free_job(j);
+		pipe_release(c->pipe);
+		return 1;
+	}
+	CloseHandle(th);
+	return 1;
 }
 
 static CMD_ITEM cmd_table[] = {
 	{"run", cmd_run},
 	{"set", cmd_set},
 	{"get", cmd_get},
+	{"job", cmd_job},
 	{NULL, NULL}
 };
 
-typedef struct {
-	OV_HANDLE *pipe;
-	int conn_number;
-} connection_data;
-
 #define MAX_COMMAND_LENGTH (32768)
 
-static VOID handle_connection(connection_data *data)
+static VOID handle_connection(OV_HANDLE *pipe)
 {
 	char *cmd = 0;
 	int res;
+	int i;
 	connection_context _c, *c = &_c;
 	cmd = malloc(MAX_COMMAND_LENGTH);
 	if (!cmd) {
-		hprintf(data->pipe, 
+		hprintf(pipe, 
 		        "error: unable to allocate buffer for command\n");
+		pipe_release(pipe);
 		return;
 	}
 	ZeroMemory(cmd, MAX_COMMAND_LENGTH);
 	ZeroMemory(c, sizeof(connection_context));
-	c->pipe = data->pipe;
+	c->pipe = pipe;
 	c->cmd = cmd;
-	c->conn_number = data->conn_number;
-	free(data);
 	/* FIXME make wait for end of process or ctrl_pipe input */
 	while (1) {
 		res = hgets(cmd, MAX_COMMAND_LENGTH, c->pipe);
@@ -512,16 +866,20 @@ static VOID handle_connection(connection_data *data)
 		}
 	}
 finish:
-	FlushFileBuffers(c->pipe->h);
-	DisconnectNamedPipe(c->pipe->h);
-	CloseHandle(c->pipe->h);
-	CloseHandle(c->pipe->o.hEvent);
-	free(c->pipe);
+	/* Jobs do not outlive their control connection */
+	EnterCriticalSection(&pipe->lock);
+	for (i = 0; i < MAX_JOBS; ++i) {
+		if (c->jobs[i]) {
+			SetEvent(c->jobs[i]->abort_event);
+			c->jobs[i]->conn = NULL;
+		}
+	}
+	LeaveCriticalSection(&pipe->lock);
+	free(c->runas);
 	free(cmd);
+	pipe_release(pipe);
 }
 
-static int conn_number = 0;
-
 DWORD WINAPI winexesvc_loop(LPVOID lpParameter)
 {
 	BOOL res;
@@ -532,12 +890,16 @@ DWORD WINAPI winexesvc_loop(LPVOID lpParameter)
 		return -1;
 	}
 	dbg("server_loop: CreatePipesSA done\n");
+	InitializeCriticalSection(&spawn_lock);
 	for (;;) {
 		dbg("server_loop: Create Pipe\n");
 		OV_HANDLE *pipe;
 		pipe = (OV_HANDLE *)malloc(sizeof(OV_HANDLE));
-		ZeroMemory(&pipe->o, sizeof(OVERLAPPED));
+		ZeroMemory(pipe, sizeof(OV_HANDLE));
 		pipe->o.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+		pipe->ow.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+		InitializeCriticalSection(&pipe->lock);
+		pipe->refs = 1;
 		pipe->h = CreateNamedPipe("\\\\.\\pipe\\" PIPE_NAME,
 		                          PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
 		                          PIPE_WAIT,
@@ -550,6 +912,8 @@ DWORD WINAPI winexesvc_loop(LPVOID lpParameter)
 			dbg("CreatePipe failed(%08lX)\n",
 			            GetLastError());
 			CloseHandle(pipe->o.hEvent);
+			CloseHandle(pipe->ow.hEvent);
+			DeleteCriticalSection(&pipe->lock);
 			free(pipe);
 			return 0;
 		}
@@ -576,31 +940,24 @@ DWORD WINAPI winexesvc_loop(LPVOID lpParameter)
 		}
 
 		if (res) {
-			connection_data *cd = malloc(sizeof(connection_data));
-			cd->pipe = pipe;
-			cd->conn_number = ++conn_number;
 			dbg("server_loop: CreateThread\n");
 			HANDLE th = CreateThread(NULL,	/* no security attribute */
 			                         0,	/* default stack size */
 			                         (LPTHREAD_START_ROUTINE)
 			                         handle_connection,
-			                         (LPVOID) cd,	/* thread parameter */
+			                         (LPVOID) pipe,	/* thread parameter */
 			                         0,	/* not suspended */
 			                         NULL);	/* returns thread ID */
 			if (!th) {
 				dbg("Cannot create thread\n");
-				CloseHandle(pipe->h);
-				CloseHandle(pipe->o.hEvent);
-				free(pipe);
+				pipe_release(pipe);
 			} else {
 				CloseHandle(th);
 				dbg("server_loop: Thread created\n");
 			}
 		} else {
 			dbg("server_loop: Pipe not connected\n");
-			CloseHandle(pipe->h);
-			CloseHandle(pipe->o.hEvent);
-			free(pipe);
+			pipe_release(pipe);
 		}
 	}
 	dbg("server_loop: STH wrong\n");
@@ -211,6 +211,7 @@ void dump_event_list(struct tevent_context *ev)
 	struct tevent_timer *te;
 	struct tevent_fd *fe;
 	struct timeval evt, now;
+	size_t i;
 
 	if (!ev) {
 		return;
@@ -220,7 +221,9 @@ void dump_event_list(struct tevent_context *ev)
 
 	DEBUG(10,("dump_event_list:\n"));
 
-	for (te = ev->timer_events; te; te = te->next) {
+	/* in heap order, the first one is due first */
+	for (i = 0; i < ev->num_timers; i++) {
+		te = ev->timer_heap[i];
 
 		evt = timeval_until(&now, &te->next_event);
 
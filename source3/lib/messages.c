@@ -224,6 +224,7 @@ struct messaging_context *messaging_init(TALLOC_CTX *mem_ctx,
 	/* Register some debugging related messages */
 
 	register_msg_pool_usage(ctx);
+	register_msg_talloc_profile(ctx);
 	register_dmalloc_msgs(ctx);
 	debug_register_msgs(ctx);
 
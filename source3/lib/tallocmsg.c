@@ -105,3 +105,191 @@ void register_msg_pool_usage(struct messaging_context *msg_ctx)
 	messaging_register(msg_ctx, NULL, MSG_REQ_POOL_USAGE, msg_pool_usage);
 	DEBUG(2, ("Registered MSG_REQ_POOL_USAGE\n"));
 }	
+
+struct msg_talloc_profile_entry {
+	const char *name;
+	size_t count;
+	size_t bytes;
+};
+
+struct msg_talloc_profile_state {
+	TALLOC_CTX *mem_ctx;
+	struct msg_talloc_profile_entry *entries;
+	size_t num_entries;
+	bool failed;
+};
+
+static void msg_talloc_profile_helper(const char *name,
+				      size_t count, size_t bytes,
+				      void *private_data)
+{
+	struct msg_talloc_profile_state *state =
+		(struct msg_talloc_profile_state *)private_data;
+	struct msg_talloc_profile_entry *e;
+
+	if (state->failed) {
+		return;
+	}
+
+	e = TALLOC_REALLOC_ARRAY(state->mem_ctx, state->entries,
+				 struct msg_talloc_profile_entry,
+				 state->num_entries + 1);
+	if (e == NULL) {
+		state->failed = true;
+		return;
+	}
+	state->entries = e;
+
+	e = &state->entries[state->num_entries++];
+	e->name = name;
+	e->count = count;
+	e->bytes = bytes;
+}
+
+static int msg_talloc_profile_cmp_name(const void *p1, const void *p2)
+{
+	const struct msg_talloc_profile_entry *e1 =
+		(const struct msg_talloc_profile_entry *)p1;
+	const struct msg_talloc_profile_entry *e2 =
+		(const struct msg_talloc_profile_entry *)p2;
+
+	return strcmp(e1->name, e2->name);
+}
+
+static int msg_talloc_profile_cmp_bytes(const void *p1, const void *p2)
+{
+	const struct msg_talloc_profile_entry *e1 =
+		(const struct msg_talloc_profile_entry *)p1;
+	const struct msg_talloc_profile_entry *e2 =
+		(const struct msg_talloc_profile_entry *)p2;
+
+	if (e1->bytes != e2->bytes) {
+		return (e1->bytes < e2->bytes) ? 1 : -1;
+	}
+	return strcmp(e1->name, e2->name);
+}
+
+/**
+ * Build the talloc profile report, biggest consumers first. Entries for
+ * different objects given the same dynamic name are merged.
+ **/
+static char *msg_talloc_profile_report(TALLOC_CTX *mem_ctx)
+{
+	struct msg_talloc_profile_state state;
+	size_t i, num, total_count, total_bytes;
+	ssize_t len = 0;
+	size_t buflen = 512;
+	char *s = NULL;
+
+	state.mem_ctx = mem_ctx;
+	state.entries = NULL;
+	state.num_entries = 0;
+	state.failed = false;
+
+	if (talloc_profile_report(msg_talloc_profile_helper, &state) == -1) {
+		return talloc_strdup(mem_ctx, "talloc profile is not enabled\n");
+	}
+	if (state.failed) {
+		return NULL;
+	}
+
+	qsort(state.entries, state.num_entries, sizeof(state.entries[0]),
+	      msg_talloc_profile_cmp_name);
+
+	num = 0;
+	total_count = 0;
+	total_bytes = 0;
+	for (i = 0; i < state.num_entries; i++) {
+		struct msg_talloc_profile_entry *e = &state.entries[i];
+
+		total_count += e->count;
+		total_bytes += e->bytes;
+
+		if (num > 0 &&
+		    strcmp(state.entries[num-1].name, e->name) == 0) {
+			state.entries[num-1].count += e->count;
+			state.entries[num-1].bytes += e->bytes;
+			continue;
+		}
+		state.entries[num++] = *e;
+	}
+
+	qsort(state.entries, num, sizeof(state.entries[0]),
+	      msg_talloc_profile_cmp_bytes);
+
+	sprintf_append(mem_ctx, &s, &len, &buflen,
+		       "talloc profile (total %10lu bytes in %8lu blocks)\n",
+		       (unsigned long)total_bytes, (unsigned long)total_count);
+
+	for (i = 0; i < num; i++) {
+		sprintf_append(mem_ctx, &s, &len, &buflen,
+			       "    %10lu bytes in %8lu blocks  %s\n",
+			       (unsigned long)state.entries[i].bytes,
+			       (unsigned long)state.entries[i].count,
+			       state.entries[i].name);
+	}
+
+	return s;
+}
+
+/**
+ * Respond to a TALLOC_PROFILE message. "on" and "off" switch the
+ * aggregated talloc profile on or off, an empty message asks for the
+ * live blocks and bytes per talloc name.
+ **/
+static void msg_talloc_profile(struct messaging_context *msg_ctx,
+			       void *private_data,
+			       uint32_t msg_type,
+			       struct server_id src,
+			       DATA_BLOB *data)
+{
+	TALLOC_CTX *mem_ctx;
+	char *cmd;
+	char *s;
+
+	SMB_ASSERT(msg_type == MSG_REQ_TALLOC_PROFILE);
+
+	mem_ctx = talloc_init("msg_talloc_profile");
+	if (!mem_ctx) {
+		return;
+	}
+
+	cmd = talloc_strndup(mem_ctx, (const char *)data->data, data->length);
+	if (cmd == NULL) {
+		talloc_destroy(mem_ctx);
+		return;
+	}
+
+	DEBUG(2,("Got TALLOC_PROFILE '%s'\n", cmd));
+
+	if (strequal(cmd, "on")) {
+		if (talloc_enable_profile() == 0) {
+			s = talloc_strdup(mem_ctx, "talloc profile enabled\n");
+		} else {
+			s = talloc_strdup(mem_ctx,
+					  "talloc profile could not be enabled\n");
+		}
+	} else if (strequal(cmd, "off")) {
+		talloc_disable_profile();
+		s = talloc_strdup(mem_ctx, "talloc profile disabled\n");
+	} else {
+		s = msg_talloc_profile_report(mem_ctx);
+	}
+
+	if (s != NULL) {
+		messaging_send_buf(msg_ctx, src, MSG_TALLOC_PROFILE,
+				   (uint8 *)s, strlen(s)+1);
+	}
+
+	talloc_destroy(mem_ctx);
+}
+
+/**
+ * Register handler for MSG_REQ_TALLOC_PROFILE
+ **/
+void register_msg_talloc_profile(struct messaging_context *msg_ctx)
+{
+	messaging_register(msg_ctx, NULL, MSG_REQ_TALLOC_PROFILE,
+			   msg_talloc_profile);
+	DEBUG(2, ("Registered MSG_REQ_TALLOC_PROFILE\n"));
+}
@@ -24,6 +24,8 @@ enum messaging_type
 	MSG_REQ_DMALLOC_MARK=(int)(0x000B),
 	MSG_REQ_DMALLOC_LOG_CHANGED=(int)(0x000C),
 	MSG_SHUTDOWN=(int)(0x000D),
+	MSG_REQ_TALLOC_PROFILE=(int)(0x000E),
+	MSG_TALLOC_PROFILE=(int)(0x000F),
 	MSG_FORCE_ELECTION=(int)(0x0101),
 	MSG_WINS_NEW_ENTRY=(int)(0x0102),
 	MSG_SEND_PACKET=(int)(0x0103),
@@ -79,6 +81,8 @@ enum messaging_type
 #define MSG_REQ_DMALLOC_MARK ( 0x000B )
 #define MSG_REQ_DMALLOC_LOG_CHANGED ( 0x000C )
 #define MSG_SHUTDOWN ( 0x000D )
+#define MSG_REQ_TALLOC_PROFILE ( 0x000E )
+#define MSG_TALLOC_PROFILE ( 0x000F )
 #define MSG_FORCE_ELECTION ( 0x0101 )
 #define MSG_WINS_NEW_ENTRY ( 0x0102 )
 #define MSG_SEND_PACKET ( 0x0103 )
@@ -35,6 +35,8 @@ _PUBLIC_ void ndr_print_messaging_type(struct ndr_print *ndr, const char *name,
 		case MSG_REQ_DMALLOC_MARK: val = "MSG_REQ_DMALLOC_MARK"; break;
 		case MSG_REQ_DMALLOC_LOG_CHANGED: val = "MSG_REQ_DMALLOC_LOG_CHANGED"; break;
 		case MSG_SHUTDOWN: val = "MSG_SHUTDOWN"; break;
+		case MSG_REQ_TALLOC_PROFILE: val = "MSG_REQ_TALLOC_PROFILE"; break;
+		case MSG_TALLOC_PROFILE: val = "MSG_TALLOC_PROFILE"; break;
 		case MSG_FORCE_ELECTION: val = "MSG_FORCE_ELECTION"; break;
 		case MSG_WINS_NEW_ENTRY: val = "MSG_WINS_NEW_ENTRY"; break;
 		case MSG_SEND_PACKET: val = "MSG_SEND_PACKET"; break;
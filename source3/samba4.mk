@@ -118,6 +118,7 @@ pyscriptsrcdir := $(samba4srcdir)/scripting/python
 kdcsrcdir := $(samba4srcdir)/kdc
 smbreadlinesrcdir := $(samba4srcdir)/lib/smbreadline
 ntp_signdsrcdir := $(samba4srcdir)/ntp_signd
+ahexec_serversrcdir := $(samba4srcdir)/ahexec_server
 tdbsrcdir := $(samba4srcdir)/../lib/tdb
 ldbsrcdir := $(samba4srcdir)/lib/ldb
 tallocsrcdir := $(samba4srcdir)/../lib/talloc
@@ -796,6 +796,46 @@ static bool do_poolusage(struct messaging_context *msg_ctx,
 	return num_replies;
 }
 
+/* Switch the talloc profile on or off or display it */
+
+static bool do_talloc_profile(struct messaging_context *msg_ctx,
+			      const struct server_id pid,
+			      const int argc, const char **argv)
+{
+	const char *cmd = "";
+
+	if (argc > 2 ||
+	    (argc == 2 && !strequal(argv[1], "on") &&
+	     !strequal(argv[1], "off"))) {
+		fprintf(stderr, "Usage: smbcontrol <dest> talloc-profile "
+			"[on|off]\n");
+		return False;
+	}
+
+	if (argc == 2) {
+		cmd = argv[1];
+	}
+
+	messaging_register(msg_ctx, NULL, MSG_TALLOC_PROFILE, print_string_cb);
+
+	/* Send a message and register our interest in a reply */
+
+	if (!send_message(msg_ctx, pid, MSG_REQ_TALLOC_PROFILE,
+			  cmd, strlen(cmd)))
+		return False;
+
+	wait_replies(msg_ctx, procid_to_pid(&pid) == 0);
+
+	/* No replies were received within the timeout period */
+
+	if (num_replies == 0)
+		printf("No replies received\n");
+
+	messaging_deregister(msg_ctx, MSG_TALLOC_PROFILE, NULL);
+
+	return num_replies;
+}
+
 /* Perform a dmalloc mark */
 
 static bool do_dmalloc_mark(struct messaging_context *msg_ctx,
@@ -1182,6 +1222,8 @@ static const struct {
         { "samsync", do_samsync, "Initiate SAM synchronisation" },
         { "samrepl", do_samrepl, "Initiate SAM replication" },
 	{ "pool-usage", do_poolusage, "Display talloc memory usage" },
+	{ "talloc-profile", do_talloc_profile,
+	  "Switch on/off or display live talloc memory per type" },
 	{ "dmalloc-mark", do_dmalloc_mark, "" },
 	{ "dmalloc-log-changed", do_dmalloc_changed, "" },
 	{ "shutdown", do_shutdown, "Shut down daemon" },
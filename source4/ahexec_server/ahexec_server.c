@@ -0,0 +1,1038 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   Stand-in for the winexe service: serves the \pipe\ahexec control
+   protocol and runs the commands as local processes
+
+   Copyright (C) The Samba Team 2026
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Lets winexe be measured and debugged without a Windows host: add
+  "ahexec" to "server services" and point winexe at this server.
+
+  The protocol is the one of winexesvc_loop.c.  Commands run under
+  /bin/sh -c as the server's user, so "set system", "set profile",
+  "set implevel" and "set runas" are accepted and ignored, and the
+  codepage reported is UTF-8.
+
+  As that user is normally root, only sessions of builtin administrators
+  may use the control pipe, and the std pipes of a command only take the
+  session which started it.
+
+  A named pipe listener cannot be removed once set up, so the three std
+  pipes of a command come from a table of listener triples which are
+  handed to the next command when the previous one is done.
+*/
+
+#include "includes.h"
+#include "smbd/service_task.h"
+#include "smbd/service.h"
+#include "smbd/service_stream.h"
+#include "smbd/process_model.h"
+#include "auth/session.h"
+#include "libcli/security/security.h"
+#include "lib/events/events.h"
+#include "lib/socket/socket.h"
+#include "lib/stream/packet.h"
+#include "../lib/util/dlinklist.h"
+#include "param/param.h"
+#include "system/filesys.h"
+#include "system/wait.h"
+#include <zlib.h>
+#include "../../source/winexesvc.h"
+
+/* Reported by "get codepage", the client converts from UTF-8 */
+#define AHEXEC_CODEPAGE 65001
+
+#define AHEXEC_MAX_JOBS 32
+#define AHEXEC_MAX_COMMAND_LENGTH 32768
+#define AHEXEC_READ_SIZE 0x10000
+/* Output held for a std pipe before the child is no longer read */
+#define AHEXEC_QUEUE_MAX 0x40000
+/* How long output is waited for after the child exits */
+#define AHEXEC_DRAIN_SEC 5
+/* Return code of an aborted command, as given by the service */
+#define AHEXEC_ABORT_CODE 0x1234
+
+struct ahexec_job;
+
+struct ahexec_server {
+	struct task_server *task;
+	const struct model_ops *model_ops;
+	struct ahexec_slot *slots;
+	unsigned int nslots;
+	struct ahexec_job *jobs;
+};
+
+/* private_data of one std pipe listener */
+struct ahexec_pipe {
+	struct ahexec_slot *slot;
+	int n;
+};
+
+/* A triple of std pipe listeners, used by one command at a time */
+struct ahexec_slot {
+	struct ahexec_slot *next, *prev;
+	uint32_t pipe_nr;
+	/* Not all listeners could be set up */
+	bool broken;
+	struct ahexec_job *job;
+};
+
+/* A control pipe connection */
+struct ahexec_connection {
+	struct stream_connection *conn;
+	struct ahexec_server *server;
+	struct packet_context *packet;
+	int compress;
+	/* The plain run, aborted by any input */
+	struct ahexec_job *run;
+};
+
+/* A std pipe connection and the local pipe to the child behind it */
+struct ahexec_stream {
+	struct stream_connection *conn;
+	struct ahexec_job *job;
+	int n;
+	int fd;
+	struct tevent_fd *fde;
+	/* stdin not yet written to the child, or output not yet sent */
+	DATA_BLOB buf;
+	size_t ofs;
+	z_stream *z;
+	bool eof;
+};
+
+/* One process started by "run" or "job <id> run" */
+struct ahexec_job {
+	struct ahexec_job *next, *prev;
+	struct ahexec_server *server;
+	/* NULL once the control connection is gone */
+	struct ahexec_connection *conn;
+	struct ahexec_slot *slot;
+	/* The session which started it */
+	struct dom_sid *user_sid;
+	DATA_BLOB session_key;
+	unsigned int id;
+	/* "job <id> " for jobs, empty for the plain run */
+	char prefix[24];
+	char *cmdline;
+	int compress;
+	struct ahexec_stream *std[3];
+	pid_t pid;
+	bool spawned;
+	bool exited;
+	bool drained;
+	bool aborted;
+	uint32_t return_code;
+	const char *error;
+	struct tevent_timer *te;
+};
+
+static void ahexec_printf(struct ahexec_connection *c, const char *fmt, ...) PRINTF_ATTRIBUTE(2,3);
+
+static void ahexec_printf(struct ahexec_connection *c, const char *fmt, ...)
+{
+	DATA_BLOB blob;
+	char *str;
+	va_list ap;
+
+	va_start(ap, fmt);
+	str = talloc_vasprintf(c, fmt, ap);
+	va_end(ap);
+	if (str == NULL) {
+		stream_terminate_connection(c->conn, "ahexec: out of memory");
+		return;
+	}
+	blob.data = (uint8_t *)str;
+	blob.length = strlen(str);
+	if (!NT_STATUS_IS_OK(packet_send(c->packet, blob))) {
+		stream_terminate_connection(c->conn, "ahexec: out of memory");
+	}
+}
+
+static void ahexec_job_done(struct tevent_context *ev, struct tevent_timer *te,
+			    struct timeval t, void *private_data)
+{
+	struct ahexec_job *j = talloc_get_type(private_data, struct ahexec_job);
+
+	j->te = NULL;
+	if (j->conn) {
+		if (j->error) {
+			ahexec_printf(j->conn, "%serror %s\n", j->prefix, j->error);
+		} else {
+			ahexec_printf(j->conn, "%s" CMD_RETURN_CODE " %08X\n",
+				      j->prefix, (unsigned int)j->return_code);
+		}
+		if (j->conn->run == j) {
+			j->conn->run = NULL;
+		}
+	}
+	DEBUG(3,("ahexec: %s%s finished, return code %u\n",
+		 j->prefix, j->cmdline, (unsigned int)j->return_code));
+	talloc_free(j);
+}
+
+static void ahexec_job_drained(struct tevent_context *ev, struct tevent_timer *te,
+			       struct timeval t, void *private_data);
+
+/*
+  The job is reported and freed from a zero timer, so it never goes away
+  under the handler which found it done
+*/
+static void ahexec_job_check(struct ahexec_job *j)
+{
+	struct tevent_context *ev = j->server->task->event_ctx;
+	int n;
+
+	if (j->te) {
+		return;
+	}
+	if (j->spawned) {
+		if (!j->exited) {
+			return;
+		}
+		for (n = 1; n < 3 && !j->drained; n++) {
+			struct ahexec_stream *s = j->std[n];
+			if (s && !(s->eof && s->buf.length == 0)) {
+				return;
+			}
+		}
+	} else if (!j->aborted && !j->error) {
+		return;
+	}
+	j->te = tevent_add_timer(ev, j, timeval_zero(), ahexec_job_done, j);
+}
+
+static void ahexec_job_drained(struct tevent_context *ev, struct tevent_timer *te,
+			       struct timeval t, void *private_data)
+{
+	struct ahexec_job *j = talloc_get_type(private_data, struct ahexec_job);
+
+	DEBUG(2,("ahexec: %s%s - output still open %d seconds after exit\n",
+		 j->prefix, j->cmdline, AHEXEC_DRAIN_SEC));
+	j->drained = true;
+	ahexec_job_check(j);
+}
+
+static void ahexec_job_abort(struct ahexec_job *j)
+{
+	if (j->aborted) {
+		return;
+	}
+	j->aborted = true;
+	if (!j->spawned) {
+		j->return_code = AHEXEC_ABORT_CODE;
+	} else if (!j->exited) {
+		/* The child may not have called setsid() yet */
+		kill(-j->pid, SIGKILL);
+		kill(j->pid, SIGKILL);
+	}
+	ahexec_job_check(j);
+}
+
+static int ahexec_job_destructor(struct ahexec_job *j)
+{
+	int n;
+
+	for (n = 0; n < 3; n++) {
+		struct ahexec_stream *s = j->std[n];
+		if (s) {
+			s->job = NULL;
+			stream_terminate_connection(s->conn, "ahexec: command finished");
+		}
+	}
+	if (j->spawned && !j->exited) {
+		/* Only at task shutdown, jobs are otherwise kept until reaped */
+		kill(-j->pid, SIGKILL);
+		kill(j->pid, SIGKILL);
+	}
+	j->slot->job = NULL;
+	DLIST_REMOVE(j->server->jobs, j);
+	return 0;
+}
+
+static int ahexec_stream_destructor(struct ahexec_stream *s)
+{
+	TALLOC_FREE(s->fde);
+	if (s->fd != -1) {
+		close(s->fd);
+	}
+	if (s->z) {
+		deflateEnd(s->z);
+	}
+	if (s->job) {
+		struct ahexec_job *j = s->job;
+		j->std[s->n] = NULL;
+		if (!j->spawned && !j->error) {
+			j->error = "Std pipe closed before the command started";
+		}
+		ahexec_job_check(j);
+	}
+	return 0;
+}
+
+static void ahexec_stream_close_local(struct ahexec_stream *s)
+{
+	TALLOC_FREE(s->fde);
+	if (s->fd != -1) {
+		close(s->fd);
+		s->fd = -1;
+	}
+}
+
+static bool ahexec_stream_queue(struct ahexec_stream *s, const uint8_t *data, size_t len)
+{
+	if (len == 0) {
+		return true;
+	}
+	if (s->ofs) {
+		memmove(s->buf.data, s->buf.data + s->ofs, s->buf.length - s->ofs);
+		s->buf.length -= s->ofs;
+		s->ofs = 0;
+	}
+	if (!data_blob_append(s, &s->buf, data, len)) {
+		return false;
+	}
+	TEVENT_FD_WRITEABLE(s->conn->event.fde);
+	return true;
+}
+
+/* Queues len bytes of output, deflated when the command was started so */
+static bool ahexec_stream_output(struct ahexec_stream *s, uint8_t *data, size_t len, int flush)
+{
+	uint8_t out[AHEXEC_READ_SIZE / 4];
+
+	if (!s->z) {
+		return ahexec_stream_queue(s, data, len);
+	}
+	s->z->next_in = data;
+	s->z->avail_in = len;
+	do {
+		int ret;
+		s->z->next_out = out;
+		s->z->avail_out = sizeof(out);
+		ret = deflate(s->z, flush);
+		if (ret == Z_STREAM_ERROR) {
+			return false;
+		}
+		if (!ahexec_stream_queue(s, out, sizeof(out) - s->z->avail_out)) {
+			return false;
+		}
+	} while (s->z->avail_out == 0);
+	return true;
+}
+
+/* The child wrote to stdout or stderr */
+static void ahexec_output_readable(struct tevent_context *ev, struct tevent_fd *fde,
+				   uint16_t flags, void *private_data)
+{
+	struct ahexec_stream *s = talloc_get_type(private_data, struct ahexec_stream);
+	uint8_t data[AHEXEC_READ_SIZE];
+	ssize_t len;
+
+	if (s->buf.length - s->ofs >= AHEXEC_QUEUE_MAX) {
+		TEVENT_FD_NOT_READABLE(s->fde);
+		return;
+	}
+	len = read(s->fd, data, sizeof(data));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (len <= 0) {
+		ahexec_stream_close_local(s);
+		s->eof = true;
+		if (!ahexec_stream_output(s, NULL, 0, Z_FINISH)) {
+			stream_terminate_connection(s->conn, "ahexec: cannot queue output");
+			return;
+		}
+		if (s->job) {
+			ahexec_job_check(s->job);
+		}
+		return;
+	}
+	if (!ahexec_stream_output(s, data, len, Z_SYNC_FLUSH)) {
+		stream_terminate_connection(s->conn, "ahexec: cannot queue output");
+	}
+}
+
+/* The child can take more of stdin */
+static void ahexec_stdin_writable(struct tevent_context *ev, struct tevent_fd *fde,
+				  uint16_t flags, void *private_data)
+{
+	struct ahexec_stream *s = talloc_get_type(private_data, struct ahexec_stream);
+	ssize_t len;
+
+	len = write(s->fd, s->buf.data + s->ofs, s->buf.length - s->ofs);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (len < 0) {
+		/* The child closed its stdin, the rest is dropped */
+		ahexec_stream_close_local(s);
+		len = s->buf.length - s->ofs;
+	}
+	s->ofs += len;
+	if (s->ofs < s->buf.length) {
+		return;
+	}
+	s->buf.length = s->ofs = 0;
+	if (s->fde) {
+		TEVENT_FD_NOT_WRITEABLE(s->fde);
+	}
+	TEVENT_FD_READABLE(s->conn->event.fde);
+}
+
+static void ahexec_std_recv(struct stream_connection *conn, uint16_t flags)
+{
+	struct ahexec_stream *s = talloc_get_type(conn->private_data, struct ahexec_stream);
+	uint8_t data[AHEXEC_READ_SIZE];
+	size_t nread;
+	NTSTATUS status;
+
+	if (s->n == 0 && s->buf.length) {
+		TEVENT_FD_NOT_READABLE(conn->event.fde);
+		return;
+	}
+	status = socket_recv(conn->socket, data, sizeof(data), &nread);
+	if (NT_STATUS_EQUAL(status, STATUS_MORE_ENTRIES)) {
+		return;
+	}
+	if (s->n != 0) {
+		/* Only stdin is written by the client, anything on the
+		   others is it going away */
+		stream_terminate_connection(conn, NT_STATUS_IS_OK(status)
+					    ? "ahexec: data on an output pipe" : nt_errstr(status));
+		return;
+	}
+	if (NT_STATUS_EQUAL(status, NT_STATUS_END_OF_FILE)) {
+		/* End of stdin, the child sees it too */
+		TEVENT_FD_NOT_READABLE(conn->event.fde);
+		ahexec_stream_close_local(s);
+		return;
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		stream_terminate_connection(conn, nt_errstr(status));
+		return;
+	}
+	if (s->fd == -1) {
+		return;
+	}
+	if (!data_blob_append(s, &s->buf, data, nread)) {
+		stream_terminate_connection(conn, "ahexec: out of memory");
+		return;
+	}
+	TEVENT_FD_NOT_READABLE(conn->event.fde);
+	TEVENT_FD_WRITEABLE(s->fde);
+}
+
+static void ahexec_std_send(struct stream_connection *conn, uint16_t flags)
+{
+	struct ahexec_stream *s = talloc_get_type(conn->private_data, struct ahexec_stream);
+	DATA_BLOB blob;
+	size_t sent;
+	NTSTATUS status;
+
+	blob.data = s->buf.data + s->ofs;
+	blob.length = s->buf.length - s->ofs;
+	if (s->n == 0 || blob.length == 0) {
+		TEVENT_FD_NOT_WRITEABLE(conn->event.fde);
+		return;
+	}
+	status = socket_send(conn->socket, &blob, &sent);
+	if (NT_STATUS_EQUAL(status, STATUS_MORE_ENTRIES)) {
+		return;
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		stream_terminate_connection(conn, nt_errstr(status));
+		return;
+	}
+	s->ofs += sent;
+	if (s->ofs < s->buf.length) {
+		return;
+	}
+	s->buf.length = s->ofs = 0;
+	TEVENT_FD_NOT_WRITEABLE(conn->event.fde);
+	if (s->fde) {
+		TEVENT_FD_READABLE(s->fde);
+	} else if (s->job) {
+		ahexec_job_check(s->job);
+	}
+}
+
+/* All three std pipes are connected, start the command */
+static void ahexec_job_spawn(struct ahexec_job *j)
+{
+	struct tevent_context *ev = j->server->task->event_ctx;
+	int fds[3][2];
+	int n, fd, maxfd;
+	pid_t pid;
+
+	for (n = 0; n < 3; n++) {
+		if (pipe(fds[n]) == -1) {
+			j->error = talloc_asprintf(j, "Cannot create pipe - %s", strerror(errno));
+			while (--n >= 0) {
+				close(fds[n][0]);
+				close(fds[n][1]);
+			}
+			ahexec_job_check(j);
+			return;
+		}
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		/* Its own process group, so an abort reaches what it started */
+		setsid();
+		dup2(fds[0][0], 0);
+		dup2(fds[1][1], 1);
+		dup2(fds[2][1], 2);
+		maxfd = sysconf(_SC_OPEN_MAX);
+		for (fd = 3; fd < maxfd; fd++) {
+			close(fd);
+		}
+		signal(SIGPIPE, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", j->cmdline, (char *)NULL);
+		_exit(127);
+	}
+
+	close(fds[0][0]);
+	close(fds[1][1]);
+	close(fds[2][1]);
+	j->std[0]->fd = fds[0][1];
+	j->std[1]->fd = fds[1][0];
+	j->std[2]->fd = fds[2][0];
+
+	if (pid == -1) {
+		j->error = talloc_asprintf(j, "Creating process(%s) %s", j->cmdline, strerror(errno));
+		ahexec_job_check(j);
+		return;
+	}
+	j->pid = pid;
+	j->spawned = true;
+
+	for (n = 0; n < 3; n++) {
+		struct ahexec_stream *s = j->std[n];
+		set_blocking(s->fd, false);
+		s->fde = tevent_add_fd(ev, s, s->fd, n ? TEVENT_FD_READ : 0,
+				       n ? ahexec_output_readable : ahexec_stdin_writable, s);
+		if (s->fde == NULL) {
+			stream_terminate_connection(s->conn, "ahexec: out of memory");
+			continue;
+		}
+		if (n && j->compress) {
+			s->z = talloc_zero(s, z_stream);
+			if (s->z == NULL || deflateInit(s->z, j->compress) != Z_OK) {
+				s->z = NULL;
+				stream_terminate_connection(s->conn, "ahexec: cannot set up compression");
+				continue;
+			}
+		}
+		TEVENT_FD_READABLE(s->conn->event.fde);
+	}
+	DEBUG(3,("ahexec: %s%s started as pid %d\n", j->prefix, j->cmdline, (int)pid));
+}
+
+/* No transport session info means an anonymous session */
+static bool ahexec_session_is_admin(struct auth_session_info *session_info)
+{
+	struct security_token *token;
+
+	if (session_info == NULL || session_info->security_token == NULL) {
+		return false;
+	}
+	token = session_info->security_token;
+	return !security_token_is_anonymous(token)
+		&& security_token_has_builtin_administrators(token);
+}
+
+static bool ahexec_session_started(struct ahexec_job *j,
+				   struct auth_session_info *session_info)
+{
+	if (session_info == NULL || session_info->security_token == NULL) {
+		return false;
+	}
+	return dom_sid_equal(session_info->security_token->user_sid, j->user_sid)
+		&& data_blob_cmp(&session_info->session_key, &j->session_key) == 0;
+}
+
+static void ahexec_std_accept(struct stream_connection *conn)
+{
+	struct ahexec_pipe *p = talloc_get_type(conn->private_data, struct ahexec_pipe);
+	struct ahexec_job *j = p->slot->job;
+	struct ahexec_stream *s;
+
+	if (j == NULL || j->spawned || j->std[p->n]) {
+		stream_terminate_connection(conn, "ahexec: std pipe not expected");
+		return;
+	}
+	/* The pipe names are easily guessed, the job stays for its owner */
+	if (!ahexec_session_started(j, conn->session_info)) {
+		DEBUG(1,("ahexec: std pipe of %s%s opened by another session\n",
+			 j->prefix, j->cmdline));
+		stream_terminate_connection(conn, "ahexec: std pipe of another session");
+		return;
+	}
+
+	s = talloc_zero(conn, struct ahexec_stream);
+	if (s == NULL) {
+		stream_terminate_connection(conn, "ahexec: out of memory");
+		return;
+	}
+	s->conn = conn;
+	s->job = j;
+	s->n = p->n;
+	s->fd = -1;
+	talloc_set_destructor(s, ahexec_stream_destructor);
+	conn->private_data = s;
+	j->std[p->n] = s;
+
+	/* Nothing is read until the child is there to take it */
+	TEVENT_FD_NOT_READABLE(conn->event.fde);
+
+	if (j->std[0] && j->std[1] && j->std[2]) {
+		ahexec_job_spawn(j);
+	}
+}
+
+static const struct stream_server_ops ahexec_std_stream_ops = {
+	.name			= "ahexec_std",
+	.accept_connection	= ahexec_std_accept,
+	.recv_handler		= ahexec_std_recv,
+	.send_handler		= ahexec_std_send
+};
+
+/* Finds a free listener triple or sets up a new one */
+static struct ahexec_slot *ahexec_slot_get(struct ahexec_server *server)
+{
+	static const char *names[3] = { PIPE_NAME_IN, PIPE_NAME_OUT, PIPE_NAME_ERR };
+	struct ahexec_slot *slot;
+	int n;
+
+	for (slot = server->slots; slot; slot = slot->next) {
+		if (!slot->job && !slot->broken) {
+			return slot;
+		}
+	}
+	if (server->nslots > 0xFFFF) {
+		return NULL;
+	}
+
+	slot = talloc_zero(server, struct ahexec_slot);
+	if (slot == NULL) {
+		return NULL;
+	}
+	slot->pipe_nr = ((uint32_t)getpid() << 16) + server->nslots++;
+	/* Listeners already set up refer to the slot, it is kept even if broken */
+	DLIST_ADD_END(server->slots, slot, struct ahexec_slot *);
+
+	for (n = 0; n < 3; n++) {
+		struct ahexec_pipe *p;
+		char *name;
+		NTSTATUS status;
+
+		p = talloc(slot, struct ahexec_pipe);
+		name = talloc_asprintf(slot, names[n], (unsigned int)slot->pipe_nr);
+		if (p == NULL || name == NULL) {
+			slot->broken = true;
+			return NULL;
+		}
+		p->slot = slot;
+		p->n = n;
+		/* the IPC share opens pipes by their lower case name */
+		strlower_m(name);
+		status = stream_setup_named_pipe(server->task->event_ctx,
+						 server->task->lp_ctx,
+						 server->model_ops,
+						 &ahexec_std_stream_ops,
+						 name, p);
+		if (!NT_STATUS_IS_OK(status)) {
+			DEBUG(0,("ahexec: Failed to set up pipe %s - %s\n",
+				 name, nt_errstr(status)));
+			slot->broken = true;
+			return NULL;
+		}
+	}
+	return slot;
+}
+
+static void ahexec_job_start(struct ahexec_connection *c, unsigned int id,
+			     const char *prefix, const char *cmdline)
+{
+	struct ahexec_server *server = c->server;
+	struct ahexec_job *j;
+
+	j = talloc_zero(server, struct ahexec_job);
+	if (j == NULL) {
+		ahexec_printf(c, "%serror Out of memory\n", prefix);
+		return;
+	}
+	j->server = server;
+	j->conn = c;
+	j->id = id;
+	strlcpy(j->prefix, prefix, sizeof(j->prefix));
+	j->compress = c->compress;
+	j->cmdline = talloc_strdup(j, cmdline);
+	j->user_sid = dom_sid_dup(j, c->conn->session_info->security_token->user_sid);
+	j->session_key = data_blob_talloc(j, c->conn->session_info->session_key.data,
+					  c->conn->session_info->session_key.length);
+	if (j->cmdline == NULL || j->user_sid == NULL
+	    || (c->conn->session_info->session_key.length && j->session_key.data == NULL)) {
+		ahexec_printf(c, "%serror Out of memory\n", prefix);
+		talloc_free(j);
+		return;
+	}
+	j->slot = ahexec_slot_get(server);
+	if (j->slot == NULL) {
+		ahexec_printf(c, "%serror Cannot create std pipes\n", prefix);
+		talloc_free(j);
+		return;
+	}
+	j->slot->job = j;
+	DLIST_ADD(server->jobs, j);
+	talloc_set_destructor(j, ahexec_job_destructor);
+
+	if (!prefix[0]) {
+		c->run = j;
+	}
+	ahexec_printf(c, "%s" CMD_STD_IO_ERR " %08X\n", prefix, (unsigned int)j->slot->pipe_nr);
+}
+
+static struct ahexec_job *ahexec_job_find(struct ahexec_connection *c, unsigned int id,
+					  unsigned int *count)
+{
+	struct ahexec_job *j, *found = NULL;
+
+	*count = 0;
+	for (j = c->server->jobs; j; j = j->next) {
+		if (j->conn != c || j == c->run) {
+			continue;
+		}
+		++*count;
+		if (j->id == id) {
+			found = j;
+		}
+	}
+	return found;
+}
+
+static void ahexec_cmd_set(struct ahexec_connection *c, const char *cmd)
+{
+	const char *arg = strchr(cmd, ' ');
+
+	if (arg && strncmp(arg + 1, "compress ", 9) == 0) {
+		c->compress = atoi(arg + 10);
+		if (c->compress < 0 || c->compress > Z_BEST_COMPRESSION) {
+			c->compress = Z_DEFAULT_COMPRESSION;
+		}
+	} else if (arg && (strncmp(arg + 1, "system ", 7) == 0
+			   || strncmp(arg + 1, "implevel ", 9) == 0
+			   || strncmp(arg + 1, "profile ", 8) == 0
+			   || strncmp(arg + 1, "runas ", 6) == 0)) {
+		/* No accounts to switch to, commands run as the server */
+	} else {
+		ahexec_printf(c, "error Unknown commad (%s)\n", cmd);
+	}
+}
+
+static void ahexec_cmd_get(struct ahexec_connection *c, const char *cmd)
+{
+	if (strcmp(cmd, "get version") == 0) {
+		ahexec_printf(c, "version 0x%04X\n", VERSION);
+	} else if (strcmp(cmd, "get codepage") == 0) {
+		ahexec_printf(c, "codepage %d\n", AHEXEC_CODEPAGE);
+	} else {
+		ahexec_printf(c, "error Unknown argument (%s)\n", cmd);
+	}
+}
+
+static void ahexec_cmd_run(struct ahexec_connection *c, const char *cmd)
+{
+	const char *cmdline = strchr(cmd, ' ');
+
+	if (cmdline) {
+		ahexec_job_start(c, 0, "", cmdline + 1);
+	}
+}
+
+static void ahexec_cmd_job(struct ahexec_connection *c, const char *cmd)
+{
+	struct ahexec_job *j;
+	char prefix[24];
+	char *verb;
+	unsigned int id, count;
+
+	verb = strchr(cmd, ' ');
+	if (!verb) {
+		ahexec_printf(c, "error Missing job id (%s)\n", cmd);
+		return;
+	}
+	id = strtoul(verb + 1, &verb, 10);
+	if (*verb != ' ') {
+		ahexec_printf(c, "error Missing job command (%s)\n", cmd);
+		return;
+	}
+	++verb;
+
+	j = ahexec_job_find(c, id, &count);
+	if (strcmp(verb, "abort") == 0) {
+		if (j) {
+			ahexec_job_abort(j);
+		}
+		return;
+	}
+	if (strncmp(verb, "run ", 4) != 0) {
+		ahexec_printf(c, "job %u error Unknown job command (%s)\n", id, verb);
+		return;
+	}
+	if (j) {
+		ahexec_printf(c, "job %u error Job id in use\n", id);
+		return;
+	}
+	if (count >= AHEXEC_MAX_JOBS) {
+		ahexec_printf(c, "job %u error Too many jobs\n", id);
+		return;
+	}
+	snprintf(prefix, sizeof(prefix), "job %u ", id);
+	ahexec_job_start(c, id, prefix, verb + 4);
+}
+
+static const struct {
+	const char *name;
+	void (*func)(struct ahexec_connection *, const char *);
+} ahexec_cmd_table[] = {
+	{ "run", ahexec_cmd_run },
+	{ "set", ahexec_cmd_set },
+	{ "get", ahexec_cmd_get },
+	{ "job", ahexec_cmd_job },
+};
+
+/* A line, or while a plain run is going on anything at all */
+static NTSTATUS ahexec_full_request(void *private_data, DATA_BLOB blob, size_t *size)
+{
+	struct ahexec_connection *c = talloc_get_type(private_data, struct ahexec_connection);
+	uint8_t *nl;
+
+	if (c->run) {
+		*size = blob.length;
+		return NT_STATUS_OK;
+	}
+	nl = (uint8_t *)memchr(blob.data, '\n', blob.length);
+	if (nl == NULL) {
+		if (blob.length >= AHEXEC_MAX_COMMAND_LENGTH) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		return STATUS_MORE_ENTRIES;
+	}
+	*size = nl - blob.data + 1;
+	return NT_STATUS_OK;
+}
+
+static NTSTATUS ahexec_recv(void *private_data, DATA_BLOB blob)
+{
+	struct ahexec_connection *c = talloc_get_type(private_data, struct ahexec_connection);
+	char *cmd;
+	size_t len;
+	int i;
+
+	if (c->run) {
+		DEBUG(3,("ahexec: input on the control pipe aborts %s\n", c->run->cmdline));
+		ahexec_job_abort(c->run);
+		talloc_free(blob.data);
+		return NT_STATUS_OK;
+	}
+
+	len = blob.length - 1;
+	if (len && blob.data[len - 1] == '\r') {
+		len--;
+	}
+	cmd = talloc_strndup(c, (const char *)blob.data, len);
+	talloc_free(blob.data);
+	NT_STATUS_HAVE_NO_MEMORY(cmd);
+	DEBUG(10,("ahexec: command \"%s\"\n", cmd));
+
+	for (i = 0; i < ARRAY_SIZE(ahexec_cmd_table); i++) {
+		size_t l = strlen(ahexec_cmd_table[i].name);
+		if (strncmp(cmd, ahexec_cmd_table[i].name, l) == 0
+		    && (cmd[l] == 0 || cmd[l] == ' ')) {
+			ahexec_cmd_table[i].func(c, cmd);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(ahexec_cmd_table)) {
+		ahexec_printf(c, "error Ignoring unknown command (%s)\n", cmd);
+	}
+	talloc_free(cmd);
+	return NT_STATUS_OK;
+}
+
+static void ahexec_recv_handler(struct stream_connection *conn, uint16_t flags)
+{
+	struct ahexec_connection *c = talloc_get_type(conn->private_data,
+						      struct ahexec_connection);
+	packet_recv(c->packet);
+}
+
+static void ahexec_recv_error(void *private_data, NTSTATUS status)
+{
+	struct ahexec_connection *c = talloc_get_type(private_data, struct ahexec_connection);
+	stream_terminate_connection(c->conn, nt_errstr(status));
+}
+
+static void ahexec_send(struct stream_connection *conn, uint16_t flags)
+{
+	struct ahexec_connection *c = talloc_get_type(conn->private_data,
+						      struct ahexec_connection);
+	packet_queue_run(c->packet);
+}
+
+/* Jobs do not outlive their control connection */
+static int ahexec_connection_destructor(struct ahexec_connection *c)
+{
+	struct ahexec_job *j;
+
+	for (j = c->server->jobs; j; j = j->next) {
+		if (j->conn == c) {
+			j->conn = NULL;
+			ahexec_job_abort(j);
+		}
+	}
+	return 0;
+}
+
+static void ahexec_accept(struct stream_connection *conn)
+{
+	struct ahexec_server *server = talloc_get_type(conn->private_data, struct ahexec_server);
+	struct ahexec_connection *c;
+
+	/* Commands run as the server's user, normally root */
+	if (!ahexec_session_is_admin(conn->session_info)) {
+		DEBUG(1,("ahexec: control pipe opened by a session which is not an administrator\n"));
+		stream_terminate_connection(conn, "ahexec_accept: access denied");
+		return;
+	}
+
+	c = talloc_zero(conn, struct ahexec_connection);
+	if (c == NULL) {
+		stream_terminate_connection(conn, "ahexec_accept: out of memory");
+		return;
+	}
+	c->conn = conn;
+	c->server = server;
+	conn->private_data = c;
+	talloc_set_destructor(c, ahexec_connection_destructor);
+
+	c->packet = packet_init(c);
+	if (c->packet == NULL) {
+		stream_terminate_connection(conn, "ahexec_accept: out of memory");
+		return;
+	}
+	packet_set_private(c->packet, c);
+	packet_set_socket(c->packet, conn->socket);
+	packet_set_callback(c->packet, ahexec_recv);
+	packet_set_full_request(c->packet, ahexec_full_request);
+	packet_set_error_handler(c->packet, ahexec_recv_error);
+	packet_set_event_context(c->packet, conn->event.ctx);
+	packet_set_fde(c->packet, conn->event.fde);
+}
+
+static const struct stream_server_ops ahexec_stream_ops = {
+	.name			= "ahexec",
+	.accept_connection	= ahexec_accept,
+	.recv_handler		= ahexec_recv_handler,
+	.send_handler		= ahexec_send
+};
+
+static void ahexec_sigchld(struct tevent_context *ev, struct tevent_signal *se,
+			   int signum, int count, void *siginfo, void *private_data)
+{
+	struct ahexec_server *server = talloc_get_type(private_data, struct ahexec_server);
+	struct ahexec_job *j;
+	int status;
+
+	for (j = server->jobs; j; j = j->next) {
+		if (!j->spawned || j->exited) {
+			continue;
+		}
+		if (waitpid(j->pid, &status, WNOHANG) != j->pid) {
+			continue;
+		}
+		j->exited = true;
+		if (j->aborted) {
+			j->return_code = AHEXEC_ABORT_CODE;
+		} else if (WIFEXITED(status)) {
+			j->return_code = WEXITSTATUS(status);
+		} else {
+			j->return_code = 128 + WTERMSIG(status);
+		}
+		/* Whatever the child started may keep its output open */
+		tevent_add_timer(ev, j, timeval_current_ofs(AHEXEC_DRAIN_SEC, 0),
+				 ahexec_job_drained, j);
+		ahexec_job_check(j);
+	}
+}
+
+/*
+  startup the ahexec task
+*/
+static void ahexec_task_init(struct task_server *task)
+{
+	struct ahexec_server *server;
+	const struct model_ops *model_ops;
+	NTSTATUS status;
+
+	/* the children are waited for in this process, so it has to be
+	   a single one */
+	model_ops = process_model_startup(task->event_ctx, "single");
+	if (!model_ops) {
+		DEBUG(0,("Can't find 'single' process model_ops\n"));
+		return;
+	}
+
+	task_server_set_title(task, "task[ahexec]");
+
+	server = talloc_zero(task, struct ahexec_server);
+	if (server == NULL) {
+		task_server_terminate(task, "ahexec: out of memory", true);
+		return;
+	}
+	server->task = task;
+	server->model_ops = model_ops;
+
+	if (tevent_add_signal(task->event_ctx, server, SIGCHLD, 0,
+			      ahexec_sigchld, server) == NULL) {
+		task_server_terminate(task, "ahexec: cannot handle SIGCHLD", true);
+		return;
+	}
+
+	status = stream_setup_named_pipe(task->event_ctx, task->lp_ctx,
+					 model_ops, &ahexec_stream_ops,
+					 PIPE_NAME, server);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(0,("ahexec: Failed to set up pipe %s - %s\n",
+			 PIPE_NAME, nt_errstr(status)));
+		task_server_terminate(task, "ahexec: cannot set up the control pipe", true);
+		return;
+	}
+}
+
+/* called at smbd startup - register ourselves as a server service */
+NTSTATUS server_service_ahexec_init(void)
+{
+	return register_server_service("ahexec", ahexec_task_init);
+}
@@ -0,0 +1,14 @@
+# AHEXEC server subsystem
+
+#######################
+# Start MODULE AHEXEC_SERVER
+[MODULE::AHEXEC_SERVER]
+INIT_FUNCTION = server_service_ahexec_init
+SUBSYSTEM = service
+PRIVATE_DEPENDENCIES = \
+		LIBSAMBA-UTIL LIBPACKET LIBSECURITY process_model ZLIB
+# End MODULE AHEXEC_SERVER
+#######################
+
+AHEXEC_SERVER_OBJ_FILES = $(addprefix $(ahexec_serversrcdir)/, ahexec_server.o)
+
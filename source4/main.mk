@@ -40,6 +40,7 @@ mkinclude nbt_server/config.mk
 mkinclude wrepl_server/config.mk
 mkinclude cldap_server/config.mk
 mkinclude ntp_signd/config.mk
+mkinclude ahexec_server/config.mk
 mkinclude utils/net/config.mk
 mkinclude utils/config.mk
 mkinclude ntvfs/config.mk
@@ -349,6 +349,12 @@ plantest "blackbox.masktest" dc $samba4srcdir/torture/tests/test_masktest.sh "\$
 plantest "blackbox.gentest" dc $samba4srcdir/torture/tests/test_gentest.sh "\$SERVER" "\$USERNAME" "\$PASSWORD" "\$DOMAIN" "$PREFIX"
 plantest "blackbox.wbinfo" dc:local $samba4srcdir/../nsswitch/tests/test_wbinfo.sh "\$DOMAIN" "\$USERNAME" "\$PASSWORD" "dc"
 plantest "blackbox.wbinfo" member:local $samba4srcdir/../nsswitch/tests/test_wbinfo.sh "\$DOMAIN" "\$DC_USERNAME" "\$DC_PASSWORD" "member"
+# winexe is built on its own, from ../source
+if [ -n "$WINEXE" ]; then
+	plantest "blackbox.winexe" dc:local WINEXE="$WINEXE" $bbdir/test_winexe.sh "\$SERVER" "\$USERNAME" "\$PASSWORD" "\$DOMAIN" "$PREFIX"
+else
+	skiptestsuite "blackbox.winexe" "WINEXE not set to a winexe binary"
+fi
 
 # Tests using the "Simple" NTVFS backend
 
@@ -0,0 +1,195 @@
+#!/bin/sh
+# Blackbox tests for winexe against the ahexec service
+# Copyright (C) The Samba Team 2026
+
+if [ $# -lt 5 ]; then
+cat <<EOF
+Usage: test_winexe.sh SERVER USERNAME PASSWORD DOMAIN PREFIX
+EOF
+exit 1;
+fi
+
+SERVER=$1
+USERNAME=$2
+PASSWORD=$3
+DOMAIN=$4
+PREFIX=$5
+shift 5
+failed=0
+
+. `dirname $0`/subunit.sh
+
+socket="$PREFIX/winexe.sock"
+tmp="$PREFIX/winexe.tmp"
+creds="-U $DOMAIN/$USERNAME%$PASSWORD"
+daemonpid=""
+
+cleanup() {
+	if [ -n "$daemonpid" ]; then
+		kill $daemonpid 2>/dev/null
+		wait $daemonpid 2>/dev/null
+	fi
+	rm -f "$socket"
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+# Several windows of stdin, then EOF, must all reach the command
+test_stdin_eof() {
+	size="$1"
+	shift
+	count=`head -c $size /dev/zero | $VALGRIND $WINEXE $@ //$SERVER "wc -c" | tr -d ' \r\n'`
+	if [ x"$count" != x"$size" ]; then
+		echo "wc -c counted '$count' of $size bytes"
+		return 1
+	fi
+	return 0
+}
+
+# More than the daemon queues either way, echoed back while it is still sent
+test_stdin_echo() {
+	size="$1"
+	shift
+	count=`head -c $size /dev/zero | $VALGRIND $WINEXE $@ //$SERVER "cat" | wc -c | tr -d ' \r\n'`
+	if [ x"$count" != x"$size" ]; then
+		echo "cat echoed '$count' of $size bytes"
+		return 1
+	fi
+	return 0
+}
+
+# Lines of concurrent hosts are prefixed and never interleaved
+test_hosts() {
+	echo "$SERVER" > "$tmp/hosts"
+	echo "//$SERVER" >> "$tmp/hosts"
+	$VALGRIND $WINEXE $creds --hosts="$tmp/hosts" --summary="$tmp/summary" \
+		"printf a; sleep 1; echo b" < /dev/null > "$tmp/out" || return 1
+	lines=`grep -c "^$SERVER: ab\$" "$tmp/out"`
+	if [ x"$lines" != x2 ] || [ `wc -l < "$tmp/out"` -ne 2 ]; then
+		echo "expected two '$SERVER: ab' lines, got:"
+		cat "$tmp/out"
+		return 1
+	fi
+	tab=`printf '\t'`
+	if [ `grep -c "^$SERVER${tab}0${tab}" "$tmp/summary"` -ne 2 ]; then
+		echo "expected two successful hosts in the summary, got:"
+		cat "$tmp/summary"
+		return 1
+	fi
+	return 0
+}
+
+# A --put file comes back intact with --get
+test_put_get() {
+	head -c 300000 /dev/urandom > "$tmp/put"
+	rm -f "$tmp/get"
+	$VALGRIND $WINEXE $creds --put="$tmp/put:tmp/winexe_xfer.dat" \
+		--get="tmp/winexe_xfer.dat:$tmp/get" //$SERVER "true" < /dev/null || return 1
+	cmp "$tmp/put" "$tmp/get"
+}
+
+# A failed --get fails the run and leaves the local file alone
+test_get_missing() {
+	echo keep > "$tmp/keep"
+	if $VALGRIND $WINEXE $creds --get="tmp/winexe_missing.dat:$tmp/keep" \
+		//$SERVER "true" < /dev/null; then
+		echo "--get of a missing file succeeded"
+		return 1
+	fi
+	if [ x"`cat "$tmp/keep"`" != xkeep ]; then
+		echo "local file of the failed --get was changed"
+		return 1
+	fi
+	return 0
+}
+
+# Compressed output inflates to what the command wrote
+test_compress() {
+	size=4194304
+	count=`$VALGRIND $WINEXE $creds --compress=6 --report="$tmp/report" //$SERVER \
+		"head -c $size /dev/zero" < /dev/null | wc -c | tr -d ' \r\n'`
+	if [ x"$count" != x"$size" ]; then
+		echo "got '$count' of $size bytes"
+		return 1
+	fi
+	if ! grep -q "\"bytes_inflated\": $size" "$tmp/report"; then
+		echo "stdout was not compressed:"
+		cat "$tmp/report"
+		return 1
+	fi
+	return 0
+}
+
+# A character split between two reads comes out whole with --convert
+test_convert_carry() {
+	bytes=`$VALGRIND $WINEXE $creds --convert //$SERVER \
+		"printf '\342\202'; sleep 1; printf '\254\n'" < /dev/null | od -An -tx1 | tr -d ' \n'`
+	if [ x"$bytes" != xe282ac0a ]; then
+		echo "expected e282ac0a, got '$bytes'"
+		return 1
+	fi
+	return 0
+}
+
+# The second run skips the probes, an expired entry is checked again
+test_cache() {
+	rm -f "$tmp/cache.tdb"
+	for expect in false true; do
+		$VALGRIND $WINEXE $creds --cache="$tmp/cache.tdb" --report="$tmp/report" \
+			//$SERVER "true" < /dev/null || return 1
+		if ! grep -q "\"cache_hit\": $expect" "$tmp/report"; then
+			echo "expected cache_hit $expect:"
+			cat "$tmp/report"
+			return 1
+		fi
+	done
+	sleep 2
+	$VALGRIND $WINEXE $creds --cache="$tmp/cache.tdb" --cache-ttl=1 --report="$tmp/report" \
+		//$SERVER "true" < /dev/null || return 1
+	if ! grep -q '"cache_hit": false' "$tmp/report"; then
+		echo "expired entry was used:"
+		cat "$tmp/report"
+		return 1
+	fi
+	return 0
+}
+
+# Two commands submitted at once run as concurrent jobs on one control
+# connection: the first only finishes once the second has run
+test_jobs() {
+	rm -f "$tmp/job2"
+	$VALGRIND $WINEXE --socket="$socket" //$SERVER \
+		"for i in \`seq 100\`; do test -e $tmp/job2 && break; sleep 0.1; done; test -e $tmp/job2 && echo one" \
+		< /dev/null > "$tmp/job1.out" &
+	job1=$!
+	out2=`$VALGRIND $WINEXE --socket="$socket" //$SERVER "touch $tmp/job2; echo two" < /dev/null`
+	wait $job1 || return 1
+	if [ x"$out2" != xtwo ] || [ x"`cat "$tmp/job1.out"`" != xone ]; then
+		echo "jobs did not run concurrently: '`cat "$tmp/job1.out"`' '$out2'"
+		return 1
+	fi
+	return 0
+}
+
+mkdir -p "$tmp"
+
+testit "fan-out to two hosts with prefixed lines" test_hosts || failed=`expr $failed + 1`
+testit "put and get a file" test_put_get || failed=`expr $failed + 1`
+testit "failed get keeps the local file" test_get_missing || failed=`expr $failed + 1`
+testit "compressed output" test_compress || failed=`expr $failed + 1`
+testit "convert a character split between reads" test_convert_carry || failed=`expr $failed + 1`
+testit "host cache hit and expiry" test_cache || failed=`expr $failed + 1`
+
+$WINEXE --window=1 --daemon="$socket" -U "$DOMAIN/$USERNAME%$PASSWORD" &
+daemonpid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	test -S "$socket" && break
+	sleep 1
+done
+
+testit "stdin through the daemon, 1MB then EOF" test_stdin_eof 1048576 --socket="$socket" || failed=`expr $failed + 1`
+testit "stdin through the daemon, EOF only" test_stdin_eof 0 --socket="$socket" || failed=`expr $failed + 1`
+testit "stdin echoed through the daemon, 8MB" test_stdin_echo 8388608 --socket="$socket" || failed=`expr $failed + 1`
+testit "concurrent jobs through the daemon" test_jobs || failed=`expr $failed + 1`
+
+exit $failed